@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "AcquireFenceMonitor.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <limits>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+bool AcquireFenceMonitor::isEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.fence_stats.enable", true);
+}
+
+void AcquireFenceMonitor::watch(int64_t display, int64_t layer, ::android::base::unique_fd fence,
+                                nsecs_t expectedPresentTime) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const LayerKey key{display, layer};
+    auto unpresented = mUnpresented.find(key);
+    if (unpresented != mUnpresented.end()) {
+        mEntries.erase(unpresented->second);
+        mUnpresented.erase(unpresented);
+        mSuperseded++;
+    }
+
+    const uint64_t id = mNextId++;
+    if (!mWatcher->watch(std::move(fence),
+                         [this, id](nsecs_t signalTime) { onSignaled(id, signalTime); })) {
+        return;
+    }
+    Entry& entry = mEntries[id];
+    entry.layer = key;
+    entry.expectedPresentTime = expectedPresentTime;
+    mUnpresented[key] = id;
+    mWatched++;
+}
+
+void AcquireFenceMonitor::onSignaled(uint64_t id, nsecs_t signalTime) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.find(id);
+    if (it == mEntries.end()) {
+        // replaced or removed meanwhile
+        return;
+    }
+    it->second.signalTime = signalTime;
+    if (it->second.presentTime > 0) {
+        record(it->second);
+        mEntries.erase(it);
+    }
+}
+
+void AcquireFenceMonitor::onPresent(int64_t display, nsecs_t presentTime, nsecs_t vsyncPeriod) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mUnpresented.lower_bound({display, std::numeric_limits<int64_t>::min()});
+    while (it != mUnpresented.end() && it->first.first == display) {
+        auto entry = mEntries.find(it->second);
+        if (entry != mEntries.end()) {
+            entry->second.presentTime = presentTime;
+            entry->second.vsyncPeriod = vsyncPeriod;
+            if (entry->second.signalTime >= 0) {
+                record(entry->second);
+                mEntries.erase(entry);
+            }
+        }
+        it = mUnpresented.erase(it);
+    }
+}
+
+void AcquireFenceMonitor::removeLayer(int64_t display, int64_t layer) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const LayerKey key{display, layer};
+    std::erase_if(mEntries, [&key](const auto& item) { return item.second.layer == key; });
+    mUnpresented.erase(key);
+    mStats.erase(key);
+}
+
+void AcquireFenceMonitor::removeDisplay(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::erase_if(mEntries,
+                  [display](const auto& item) { return item.second.layer.first == display; });
+    std::erase_if(mUnpresented, [display](const auto& item) { return item.first.first == display; });
+    std::erase_if(mStats, [display](const auto& item) { return item.first.first == display; });
+}
+
+void AcquireFenceMonitor::record(const Entry& entry) {
+    LayerStats& stats = mStats[entry.layer];
+    stats.frames++;
+    // without an expected present time the buffer is due at the present
+    const nsecs_t deadline =
+            entry.expectedPresentTime > 0 ? entry.expectedPresentTime : entry.presentTime;
+    const nsecs_t margin = deadline - entry.signalTime;
+    if (margin < 0) {
+        stats.late++;
+        stats.lateTotal -= margin;
+        stats.lateMax = std::max(stats.lateMax, -margin);
+        if (entry.vsyncPeriod > 0) {
+            stats.missedVsyncs += (-margin + entry.vsyncPeriod - 1) / entry.vsyncPeriod;
+        }
+    }
+    if (entry.signalTime > entry.presentTime) {
+        stats.blockedPresents++;
+    }
+    stats.margins[stats.next] = margin;
+    stats.next = (stats.next + 1) % LayerStats::kWindow;
+    stats.count = std::min(stats.count + 1, LayerStats::kWindow);
+}
+
+void AcquireFenceMonitor::dump(std::string* output) {
+    using ::android::base::StringAppendF;
+    static constexpr double kNsPerMs = 1000000.0;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    StringAppendF(output,
+                  "\nhwc3 acquire fences: watched=%" PRIu64 " pending=%zu replaced before"
+                  " present=%" PRIu64 "\n",
+                  mWatched, mEntries.size(), mSuperseded);
+
+    // the layers most often late first
+    std::vector<std::pair<LayerKey, const LayerStats*>> layers;
+    for (const auto& [key, stats] : mStats) {
+        layers.emplace_back(key, &stats);
+    }
+    std::stable_sort(layers.begin(), layers.end(), [](const auto& a, const auto& b) {
+        return a.second->late > b.second->late;
+    });
+    for (const auto& [key, stats] : layers) {
+        std::vector<nsecs_t> margins(stats->margins.begin(),
+                                     stats->margins.begin() + stats->count);
+        std::sort(margins.begin(), margins.end());
+        StringAppendF(output,
+                      "  display %" PRId64 " layer %" PRId64 ": frames=%" PRIu64 " late=%" PRIu64
+                      " (%.1f%%) late avg/max=%.3f/%.3fms missed vsyncs=%" PRIu64
+                      " blocked presents=%" PRIu64,
+                      key.first, key.second, stats->frames, stats->late,
+                      stats->frames ? stats->late * 100.0 / stats->frames : 0.0,
+                      stats->late ? stats->lateTotal / kNsPerMs / stats->late : 0.0,
+                      stats->lateMax / kNsPerMs, stats->missedVsyncs, stats->blockedPresents);
+        if (!margins.empty()) {
+            // margin to the expected present time, negative is late
+            StringAppendF(output, " margin p50/p10/min=%.3f/%.3f/%.3fms",
+                          margins[margins.size() / 2] / kNsPerMs,
+                          margins[margins.size() / 10] / kNsPerMs, margins.front() / kNsPerMs);
+        }
+        output->append("\n");
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "FenceWatcher.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Records when the acquire fence of each layer buffer signals, and how that
+// compares to the time the frame was meant to be shown and the time it was
+// presented. A buffer whose fence signals after its expected present time
+// missed its frame, which points at the producer rather than composition.
+//
+// The fences are waited for by a FenceWatcher, the command thread only hands
+// over a dup of each fence.
+class AcquireFenceMonitor {
+  public:
+    // vendor.hwc3.fence_stats.enable
+    static bool isEnabled();
+
+    // watcher must outlive the monitor, or stop calling back before it goes
+    explicit AcquireFenceMonitor(FenceWatcher* watcher) : mWatcher(watcher) {}
+
+    AcquireFenceMonitor(const AcquireFenceMonitor&) = delete;
+    AcquireFenceMonitor& operator=(const AcquireFenceMonitor&) = delete;
+
+    // fence is owned by the callee, expectedPresentTime is 0 if the client
+    // did not give one
+    void watch(int64_t display, int64_t layer, ::android::base::unique_fd fence,
+               nsecs_t expectedPresentTime);
+    // the buffers watched since the last present of the display are presented
+    void onPresent(int64_t display, nsecs_t presentTime, nsecs_t vsyncPeriod);
+    void removeLayer(int64_t display, int64_t layer);
+    void removeDisplay(int64_t display);
+
+    void dump(std::string* output);
+
+  private:
+    using LayerKey = std::pair<int64_t, int64_t>;
+
+    struct Entry {
+        LayerKey layer;
+        nsecs_t expectedPresentTime = 0;
+        // 0 until the buffer is presented
+        nsecs_t presentTime = 0;
+        nsecs_t vsyncPeriod = 0;
+        // -1 until the fence signals
+        nsecs_t signalTime = -1;
+    };
+
+    struct LayerStats {
+        static constexpr size_t kWindow = 64;
+
+        uint64_t frames = 0;
+        // signaled after the expected present time
+        uint64_t late = 0;
+        nsecs_t lateTotal = 0;
+        nsecs_t lateMax = 0;
+        // whole vsyncs the late ones missed
+        uint64_t missedVsyncs = 0;
+        // signaled after presentDisplay, so hwc2 had to wait for it
+        uint64_t blockedPresents = 0;
+        // expected present time minus signal time of the last frames, negative is late
+        std::array<nsecs_t, kWindow> margins = {};
+        size_t next = 0;
+        size_t count = 0;
+    };
+
+    void onSignaled(uint64_t id, nsecs_t signalTime);
+    void record(const Entry& entry) REQUIRES(mMutex);
+
+    FenceWatcher* const mWatcher;
+
+    std::mutex mMutex;
+    uint64_t mNextId GUARDED_BY(mMutex) = 1;
+    std::unordered_map<uint64_t, Entry> mEntries GUARDED_BY(mMutex);
+    // the entry of each layer waiting for the present of its display
+    std::map<LayerKey, uint64_t> mUnpresented GUARDED_BY(mMutex);
+    std::map<LayerKey, LayerStats> mStats GUARDED_BY(mMutex);
+    uint64_t mWatched GUARDED_BY(mMutex) = 0;
+    // replaced before a present
+    uint64_t mSuperseded GUARDED_BY(mMutex) = 0;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
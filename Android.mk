@@ -44,6 +44,7 @@ LOCAL_SHARED_LIBRARIES := android.hardware.graphics.composer3-V2-ndk \
 	libhardware_legacy \
 	liblog \
 	libsync \
+	libui \
 	libutils
 
 LOCAL_STATIC_LIBRARIES := libaidlcommonsupport
@@ -58,11 +59,32 @@ LOCAL_C_INCLUDES := \
 	$(TOP)/hardware/rockchip/hwcomposer/hwc3/include
 
 LOCAL_SRC_FILES := \
+	AcquireFenceMonitor.cpp \
+	CallStats.cpp \
 	Composer.cpp \
 	ComposerClient.cpp \
 	ComposerCommandEngine.cpp \
+	FenceWatcher.cpp \
+	FlightRecorder.cpp \
+	LayerCadence.cpp \
+	PresentFenceTracker.cpp \
+	PresentPipeline.cpp \
+	Startup.cpp \
+	SyncTimeline.cpp \
+	impl/BrightnessCoalescer.cpp \
+	impl/BufferMapper.cpp \
+	impl/DispatchFn.cpp \
+	impl/DisplaySnapshot.cpp \
 	impl/HalImpl.cpp \
+	impl/LayerSquasher.cpp \
+	impl/LayerStack.cpp \
+	impl/PlaneDump.cpp \
+	impl/RefreshRateController.cpp \
 	impl/ResourceManager.cpp \
+	impl/SoftwareCompositor.cpp \
+	impl/SoftwareReadback.cpp \
+	impl/SoftwareVirtualDisplay.cpp \
+	impl/WorkerPool.cpp \
 	service.cpp
 
 ifeq ($(BOARD_USES_HWC_SERVICES),true)
@@ -70,6 +92,11 @@ LOCAL_CFLAGS += -DUSES_HWC_SERVICES
 LOCAL_HEADER_LIBRARIES += libbinder_headers
 endif
 
+# times every hwc2 call, see impl/DispatchFn.h
+ifeq ($(strip $(BOARD_HWC3_DISPATCH_STATS)),true)
+LOCAL_CFLAGS += -DHWC3_DISPATCH_STATS
+endif
+
 ifeq ($(strip $(BOARD_USES_HWC_PROXY_SERVICE)),true)
 LOCAL_CFLAGS += \
 	-DUSE_HWC_PROXY_SERVICE=1
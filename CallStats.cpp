@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CallStats.h"
+
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <bit>
+#include <cinttypes>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+std::atomic<CallStats*> CallStats::sHead = nullptr;
+std::atomic<bool> CallStats::sEnabled =
+        ::android::base::GetBoolProperty("vendor.hwc3.call_stats.enable", false);
+
+// upper bound of bucket, in microseconds
+static uint64_t getBucketLimit(size_t bucket) {
+    return uint64_t(1) << bucket;
+}
+
+CallStats::CallStats(const char* name) : mName(name) {
+    mNext = sHead.load(std::memory_order_relaxed);
+    while (!sHead.compare_exchange_weak(mNext, this, std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+    }
+}
+
+void CallStats::record(nsecs_t duration) {
+    const uint64_t us = static_cast<uint64_t>(std::max<nsecs_t>(duration, 0)) / 1000;
+    const size_t bucket = std::min<size_t>(std::bit_width(us), kBuckets - 1);
+    mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    mCalls.fetch_add(1, std::memory_order_relaxed);
+    mTotal.fetch_add(duration, std::memory_order_relaxed);
+    nsecs_t max = mMax.load(std::memory_order_relaxed);
+    while (duration > max &&
+           !mMax.compare_exchange_weak(max, duration, std::memory_order_relaxed)) {
+    }
+}
+
+void CallStats::reset() {
+    mCalls.store(0, std::memory_order_relaxed);
+    mTotal.store(0, std::memory_order_relaxed);
+    mMax.store(0, std::memory_order_relaxed);
+    for (auto& bucket : mBuckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+void CallStats::dump(std::string* output) const {
+    using ::android::base::StringAppendF;
+
+    std::array<uint64_t, kBuckets> buckets;
+    uint64_t calls = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+        buckets[i] = mBuckets[i].load(std::memory_order_relaxed);
+        calls += buckets[i];
+    }
+    if (!calls) {
+        return;
+    }
+    // bucket that holds the given fraction of the calls
+    auto percentile = [&](double fraction) {
+        uint64_t rank = static_cast<uint64_t>(calls * fraction);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return i;
+            }
+        }
+        return kBuckets - 1;
+    };
+    auto appendLimit = [output](size_t bucket) {
+        if (bucket == kBuckets - 1) {
+            StringAppendF(output, ">=%" PRIu64 "us", getBucketLimit(bucket - 1));
+        } else {
+            StringAppendF(output, "<%" PRIu64 "us", getBucketLimit(bucket));
+        }
+    };
+
+    StringAppendF(output, "  %s: calls=%" PRIu64 " avg=%.3fms max=%.3fms p50", mName, calls,
+                  mTotal.load(std::memory_order_relaxed) / 1e6 / calls,
+                  mMax.load(std::memory_order_relaxed) / 1e6);
+    appendLimit(percentile(0.5));
+    output->append(" p99");
+    appendLimit(percentile(0.99));
+    output->append("\n   ");
+    for (size_t i = 0; i < kBuckets; ++i) {
+        if (buckets[i]) {
+            output->append(" ");
+            appendLimit(i);
+            StringAppendF(output, ":%" PRIu64, buckets[i]);
+        }
+    }
+    output->append("\n");
+}
+
+void CallStats::setEnabled(bool enabled) {
+    sEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+void CallStats::resetAll() {
+    for (CallStats* stats = sHead.load(std::memory_order_acquire); stats; stats = stats->mNext) {
+        stats->reset();
+    }
+}
+
+void CallStats::dumpAll(std::string* output) {
+    std::vector<const CallStats*> all;
+    for (CallStats* stats = sHead.load(std::memory_order_acquire); stats; stats = stats->mNext) {
+        if (stats->mCalls.load(std::memory_order_relaxed)) {
+            all.push_back(stats);
+        }
+    }
+    // where the time goes first
+    std::sort(all.begin(), all.end(), [](const CallStats* a, const CallStats* b) {
+        return a->mTotal.load(std::memory_order_relaxed) >
+                b->mTotal.load(std::memory_order_relaxed);
+    });
+
+    ::android::base::StringAppendF(output, "\nhwc3 calls (%s):\n",
+                                   isEnabled() ? "enabled" : "disabled");
+    for (const CallStats* stats : all) {
+        stats->dump(output);
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <array>
+#include <atomic>
+#include <string>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Call count and latency histogram of one entry point. Instances are static
+// locals of the functions they time, see DEBUG_FUNC, and register themselves
+// on first use. A call costs two clock reads and a few relaxed atomic adds,
+// nothing at all while disabled.
+class CallStats {
+  public:
+    // powers of two in microseconds, the last bucket is open ended
+    static constexpr size_t kBuckets = 16;
+
+    explicit CallStats(const char* name);
+
+    CallStats(const CallStats&) = delete;
+    CallStats& operator=(const CallStats&) = delete;
+
+    void record(nsecs_t duration);
+
+    // vendor.hwc3.call_stats.enable, off by default, dumpsys --enable stats turns it on
+    static bool isEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+    static void setEnabled(bool enabled);
+    static void resetAll();
+    static void dumpAll(std::string* output);
+
+  private:
+    void reset();
+    void dump(std::string* output) const;
+
+    const char* const mName;
+    std::atomic<uint64_t> mCalls = 0;
+    std::atomic<nsecs_t> mTotal = 0;
+    std::atomic<nsecs_t> mMax = 0;
+    std::array<std::atomic<uint64_t>, kBuckets> mBuckets = {};
+    // list of every instance, they live until exit
+    CallStats* mNext = nullptr;
+
+    static std::atomic<CallStats*> sHead;
+    static std::atomic<bool> sEnabled;
+};
+
+// Times its scope into stats.
+class ScopedCallTimer {
+  public:
+    explicit ScopedCallTimer(CallStats& stats)
+          : mStats(stats), mStart(CallStats::isEnabled() ? systemTime(SYSTEM_TIME_MONOTONIC) : 0) {}
+    ~ScopedCallTimer() {
+        if (mStart) {
+            mStats.record(systemTime(SYSTEM_TIME_MONOTONIC) - mStart);
+        }
+    }
+
+  private:
+    CallStats& mStats;
+    const nsecs_t mStart;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -19,15 +19,68 @@
 #include "Composer.h"
 
 #include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android/binder_ibinder_platform.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "Util.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
 
+Composer::~Composer() {
+    // in handover mode a destroyed client retires on a thread of its own,
+    // which still uses mHal
+    std::shared_future<void> retired;
+    {
+        std::lock_guard<std::mutex> lock(mClientMutex);
+        if (mClientAlive) {
+            LOG(ERROR) << "composer destroyed with a client alive";
+            return;
+        }
+        retired = mClientRetired;
+    }
+    if (retired.valid()) {
+        retired.wait();
+    }
+}
+
 ndk::ScopedAStatus Composer::createClient(std::shared_ptr<IComposerClient>* outClient) {
     DEBUG_FUNC();
+    // The owner of the previous client may be gone with its destruction on
+    // the way, there is no point in waiting for it then. It no longer counts
+    // as alive, and retires on its own once destroyed. Ours may be the last
+    // reference to it, so it is looked at without mClientMutex, which its
+    // destructor takes.
+    std::weak_ptr<ComposerClient> previous;
+    bool abandoned = false;
+    if (ComposerClient::isHandoverEnabled()) {
+        {
+            std::lock_guard<std::mutex> lock(mClientMutex);
+            if (mClientAlive) {
+                previous = mClient;
+            }
+        }
+        if (auto client = previous.lock(); client && client->isAbandoned()) {
+            // not destroyed while we hold it, so it has not called it yet
+            client->setOnClientDestroyed(nullptr);
+            abandoned = true;
+        }
+    }
+
     std::unique_lock<std::mutex> lock(mClientMutex);
+    // unless another call took over from it meanwhile
+    if (abandoned && !previous.owner_before(mClient) && !mClient.owner_before(previous)) {
+        LOG(INFO) << "taking over from an abandoned client";
+        mClientAlive = false;
+    }
     if (!waitForClientDestroyedLocked(lock)) {
         *outClient = nullptr;
         return TO_BINDER_STATUS(EX_NO_RESOURCES);
@@ -41,17 +94,155 @@ ndk::ScopedAStatus Composer::createClient(std::shared_ptr<IComposerClient>* outC
 
     auto clientDestroyed = [this]() { onClientDestroyed(); };
     client->setOnClientDestroyed(clientDestroyed);
+    // its first frame waits for the layers of the previous client to go
+    client->setPreviousRetired(mClientRetired);
+    mClientRetired = client->getRetired();
 
     mClientAlive = true;
+    mClient = client;
     *outClient = client;
 
     return ndk::ScopedAStatus::ok();
 }
 
-binder_status_t Composer::dump(int fd, const char** /*args*/, uint32_t /*numArgs*/) {
+static constexpr const char* kDumpUsage =
+        "usage: dumpsys android.hardware.graphics.composer3.IComposer/default [option]...\n"
+        "  (none)             everything below but --frames\n"
+        "  --hal              hwc2 and HAL state\n"
+        "  --stats            call counters, latency histograms and present statistics\n"
+        "  --resources        buffer cache occupancy\n"
+        "  --frames           flight recorder of the recent frames\n"
+        "  --reset            starts the statistics over\n"
+        "  --enable <name>    turns instrumentation on, name is stats or recorder\n"
+        "  --disable <name>   turns instrumentation off\n"
+        "  --help             this\n";
+
+// writes all of output in chunks, binder hands us a pipe to dumpsys
+static void writeFully(int fd, std::string_view output) {
+    static constexpr size_t kChunk = 64 * 1024;
+    while (!output.empty()) {
+        ssize_t written =
+                TEMP_FAILURE_RETRY(write(fd, output.data(), std::min(output.size(), kChunk)));
+        if (written <= 0) {
+            LOG(WARNING) << __FUNCTION__ << ": dump aborted: " << strerror(errno);
+            return;
+        }
+        output.remove_prefix(written);
+    }
+}
+
+void Composer::dumpHal(int fd) {
+    // a dump stuck in hwc2 must not pile up threads
+    if (mHalDumpRunning.exchange(true)) {
+        writeFully(fd, "\nhwc2 dump of a previous dumpsys still running, skipped\n");
+        return;
+    }
+
+    struct Result {
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool done GUARDED_BY(mutex) = false;
+        std::string output GUARDED_BY(mutex);
+    };
+    auto result = std::make_shared<Result>();
+    // hwc2 may wait for the display pipeline, or be stuck in it. The thread
+    // outlives the dump then, the service keeps this Composer until exit.
+    std::thread([this, result]() {
+        std::string output;
+        mHal->dumpDebugInfo(&output);
+        mHalDumpRunning = false;
+        std::lock_guard<std::mutex> lock(result->mutex);
+        result->output = std::move(output);
+        result->done = true;
+        result->condition.notify_one();
+    }).detach();
+
+    const auto timeout = std::chrono::milliseconds(
+            ::android::base::GetIntProperty("vendor.hwc3.dump.timeout_ms", 3000));
+    std::unique_lock<std::mutex> lock(result->mutex);
+    if (!result->condition.wait_for(lock, timeout, [&result]() { return result->done; })) {
+        writeFully(fd, ::android::base::StringPrintf("\nhwc2 dump timed out after %lldms\n",
+                                                    static_cast<long long>(timeout.count())));
+        return;
+    }
+    writeFully(fd, result->output);
+}
+
+binder_status_t Composer::dump(int fd, const char** args, uint32_t numArgs) {
+    bool all = numArgs == 0;
+    bool hal = false;
+    bool stats = false;
+    bool resources = false;
+    bool frames = false;
+    bool reset = false;
+    std::vector<std::pair<std::string_view, bool>> toggles;
+    for (uint32_t i = 0; i < numArgs; ++i) {
+        std::string_view arg = args[i];
+        if (arg == "--hal") {
+            hal = true;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--resources") {
+            resources = true;
+        } else if (arg == "--frames") {
+            frames = true;
+        } else if (arg == "--reset") {
+            reset = true;
+        } else if ((arg == "--enable" || arg == "--disable") && i + 1 < numArgs) {
+            toggles.emplace_back(args[++i], arg == "--enable");
+        } else {
+            writeFully(fd, kDumpUsage);
+            return arg == "--help" || arg == "-h" ? STATUS_OK : STATUS_BAD_VALUE;
+        }
+    }
+
+    std::shared_ptr<ComposerClient> client;
+    {
+        std::lock_guard<std::mutex> lock(mClientMutex);
+        client = mClient.lock();
+    }
+
     std::string output;
-    mHal->dumpDebugInfo(&output);
-    write(fd, output.c_str(), output.size());
+    for (const auto& [name, enable] : toggles) {
+        if (name == "stats") {
+            CallStats::setEnabled(enable);
+        } else if (name == "recorder" && client) {
+            client->setRecording(enable);
+        } else {
+            writeFully(fd, kDumpUsage);
+            return STATUS_BAD_VALUE;
+        }
+        ::android::base::StringAppendF(&output, "%s %s\n", enable ? "enabled" : "disabled",
+                                       std::string(name).c_str());
+    }
+    if (reset) {
+        CallStats::resetAll();
+        mHal->resetDebugStats();
+        if (client) {
+            client->resetStats();
+        }
+        output.append("statistics reset\n");
+    }
+    writeFully(fd, output);
+
+    // each part goes out as soon as it is ready
+    if (all || hal) {
+        dumpHal(fd);
+    }
+    output.clear();
+    if (all || stats) {
+        CallStats::dumpAll(&output);
+        if (client) {
+            client->dump(&output);
+        }
+    }
+    if (client && (all || resources)) {
+        client->dumpResources(&output);
+    }
+    if (client && frames) {
+        client->dumpFrames(&output);
+    }
+    writeFully(fd, output);
     return STATUS_OK;
 }
 
@@ -19,6 +19,9 @@
 #include <aidl/android/hardware/graphics/composer3/BnComposer.h>
 #include <utils/Mutex.h>
 
+#include <atomic>
+#include <future>
+
 #include "include/IComposerHal.h"
 #include "ComposerClient.h"
 
@@ -27,6 +30,7 @@ namespace aidl::android::hardware::graphics::composer3::impl {
 class Composer : public BnComposer {
 public:
     Composer(std::unique_ptr<IComposerHal> hal) : mHal(std::move(hal)) {}
+    ~Composer();
 
     binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
 
@@ -39,12 +43,18 @@ protected:
 
 private:
     bool waitForClientDestroyedLocked(std::unique_lock<std::mutex>& lock);
+    // the HAL dump, given up on after vendor.hwc3.dump.timeout_ms
+    void dumpHal(int fd);
     void onClientDestroyed();
 
     const std::unique_ptr<IComposerHal> mHal;
     std::mutex mClientMutex;
     bool mClientAlive GUARDED_BY(mClientMutex) = false;
+    std::weak_ptr<ComposerClient> mClient GUARDED_BY(mClientMutex);
+    // ready once the layers of the last client are gone
+    std::shared_future<void> mClientRetired GUARDED_BY(mClientMutex);
     std::condition_variable mClientDestroyedCondition;
+    std::atomic<bool> mHalDumpRunning = false;
 };
 
 }  // namespace aidl::android::hardware::graphics::composer3::impl
@@ -19,14 +19,29 @@
 #include "ComposerClient.h"
 
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <android/binder_ibinder_platform.h>
+#include <utils/Timers.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #include "Util.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
 
+// how long the first commands wait for the previous client to retire, its
+// owner may be gone without the client being destroyed yet
+static constexpr auto kRetireTimeout = std::chrono::seconds(1);
+
+bool ComposerClient::isHandoverEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.client.handover", false);
+}
+
 bool ComposerClient::init() {
     DEBUG_FUNC();
+    mRetiredFuture = mRetired.get_future().share();
     mResources = IResourceManager::create();
     if (!mResources) {
         LOG(ERROR) << "failed to create composer resources";
@@ -54,8 +69,34 @@ ComposerClient::~ComposerClient() {
 
     LOG(DEBUG) << "destroying composer client";
 
-    mHal->unregisterEventCallback();
-    destroyResources();
+    mHal->waitForDevice();
+    // retirements go in order, as the clients came
+    waitForPreviousClient();
+    std::unique_ptr<HalEventCallback> callback;
+    {
+        std::lock_guard<std::mutex> lock(mCallbackMutex);
+        callback = std::move(mHalEventCallback);
+    }
+    mHal->unregisterEventCallback(callback.get());
+
+    if (isHandoverEnabled()) {
+        // The engine and the callback go along, the presents in flight use
+        // them. Composer waits for the retirement before the HAL goes, so
+        // nothing may touch the HAL after it.
+        std::thread([hal = mHal, engine = std::move(mCommandEngine),
+                     resources = std::move(mResources), callback = std::move(callback),
+                     retired = std::move(mRetired)]() mutable {
+            engine->waitForPendingPresents();
+            destroyResources(hal, std::move(resources), /*finalPresent*/ false);
+            engine.reset();
+            callback.reset();
+            retired.set_value();
+        }).detach();
+    } else {
+        mCommandEngine->waitForPendingPresents();
+        destroyResources(mHal, std::move(mResources), /*finalPresent*/ true);
+        mRetired.set_value();
+    }
 
     if (mOnClientDestroyed) {
         mOnClientDestroyed();
@@ -68,6 +109,9 @@ ComposerClient::~ComposerClient() {
 ndk::ScopedAStatus ComposerClient::createLayer(int64_t display, int32_t bufferSlotCount,
                                                int64_t* layer) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->waitForPendingPresent(display);
     auto err = mHal->createLayer(display, layer);
     if (!err) {
         err = mResources->addLayer(display, *layer, bufferSlotCount);
@@ -83,6 +127,8 @@ ndk::ScopedAStatus ComposerClient::createVirtualDisplay(int32_t width, int32_t h
                                                         int32_t outputBufferSlotCount,
                                                         VirtualDisplay* display) {
     DEBUG_FUNC();
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->createVirtualDisplay(width, height, formatHint, display);
     if (!err) {
         err = mResources->addVirtualDisplay(display->display, outputBufferSlotCount);
@@ -92,8 +138,12 @@ ndk::ScopedAStatus ComposerClient::createVirtualDisplay(int32_t width, int32_t h
 
 ndk::ScopedAStatus ComposerClient::destroyLayer(int64_t display, int64_t layer) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->waitForPendingPresent(display);
     auto err = mHal->destroyLayer(display, layer);
     if (!err) {
+        mCommandEngine->onLayerDestroyed(display, layer);
         err = mResources->removeLayer(display, layer);
     }
     return TO_BINDER_STATUS(err);
@@ -101,6 +151,9 @@ ndk::ScopedAStatus ComposerClient::destroyLayer(int64_t display, int64_t layer)
 
 ndk::ScopedAStatus ComposerClient::destroyVirtualDisplay(int64_t display) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->onDisplayRemoved(display);
     auto err = mHal->destroyVirtualDisplay(display);
     if (!err) {
         err = mResources->removeDisplay(display);
@@ -112,6 +165,8 @@ ndk::ScopedAStatus ComposerClient::executeCommands(const std::vector<DisplayComm
                                                    std::vector<CommandResultPayload>* results) {
     int64_t display = commands.empty() ? -1 : commands[0].display;
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mCommandEngine->execute(commands, results);
     return TO_BINDER_STATUS(err);
 }
@@ -125,6 +180,7 @@ ndk::ScopedAStatus ComposerClient::getActiveConfig(int64_t display, int32_t* con
 ndk::ScopedAStatus ComposerClient::getColorModes(int64_t display,
                                                  std::vector<ColorMode>* colorModes) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getColorModes(display, colorModes);
     return TO_BINDER_STATUS(err);
 }
@@ -132,6 +188,7 @@ ndk::ScopedAStatus ComposerClient::getColorModes(int64_t display,
 ndk::ScopedAStatus ComposerClient::getDataspaceSaturationMatrix(common::Dataspace dataspace,
                                                                 std::vector<float>* matrix) {
     DEBUG_FUNC();
+    mHal->waitForDevice();
     if (dataspace != common::Dataspace::SRGB_LINEAR) {
         return TO_BINDER_STATUS(EX_BAD_PARAMETER);
     }
@@ -213,6 +270,7 @@ ndk::ScopedAStatus ComposerClient::getDisplayedContentSample(int64_t display, in
                                                              int64_t timestamp,
                                                              DisplayContentSample* samples) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getDisplayedContentSample(display, maxFrames, timestamp, samples);
     return TO_BINDER_STATUS(err);
 }
@@ -220,6 +278,7 @@ ndk::ScopedAStatus ComposerClient::getDisplayedContentSample(int64_t display, in
 ndk::ScopedAStatus ComposerClient::getDisplayedContentSamplingAttributes(
         int64_t display, DisplayContentSamplingAttributes* attrs) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getDisplayedContentSamplingAttributes(display, attrs);
     return TO_BINDER_STATUS(err);
 }
@@ -227,24 +286,28 @@ ndk::ScopedAStatus ComposerClient::getDisplayedContentSamplingAttributes(
 ndk::ScopedAStatus ComposerClient::getDisplayPhysicalOrientation(int64_t display,
                                                                  common::Transform* orientation) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getDisplayPhysicalOrientation(display, orientation);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getHdrCapabilities(int64_t display, HdrCapabilities* caps) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getHdrCapabilities(display, caps);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getOverlaySupport(OverlayProperties* caps) {
     DEBUG_FUNC();
+    mHal->waitForDevice();
     auto err = mHal->getOverlaySupport(caps);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getMaxVirtualDisplayCount(int32_t* count) {
     DEBUG_FUNC();
+    mHal->waitForDevice();
     auto err = mHal->getMaxVirtualDisplayCount(count);
     return TO_BINDER_STATUS(err);
 }
@@ -252,6 +315,7 @@ ndk::ScopedAStatus ComposerClient::getMaxVirtualDisplayCount(int32_t* count) {
 ndk::ScopedAStatus ComposerClient::getPerFrameMetadataKeys(int64_t display,
                                                            std::vector<PerFrameMetadataKey>* keys) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getPerFrameMetadataKeys(display, keys);
     return TO_BINDER_STATUS(err);
 }
@@ -259,6 +323,7 @@ ndk::ScopedAStatus ComposerClient::getPerFrameMetadataKeys(int64_t display,
 ndk::ScopedAStatus ComposerClient::getReadbackBufferAttributes(int64_t display,
                                                                ReadbackBufferAttributes* attrs) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getReadbackBufferAttributes(display, attrs);
     return TO_BINDER_STATUS(err);
 }
@@ -266,6 +331,9 @@ ndk::ScopedAStatus ComposerClient::getReadbackBufferAttributes(int64_t display,
 ndk::ScopedAStatus ComposerClient::getReadbackBufferFence(int64_t display,
                                                           ndk::ScopedFileDescriptor* acquireFence) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    // the readback belongs to the present that may still be in flight
+    mCommandEngine->waitForPendingPresent(display);
     auto err = mHal->getReadbackBufferFence(display, acquireFence);
     return TO_BINDER_STATUS(err);
 }
@@ -273,6 +341,7 @@ ndk::ScopedAStatus ComposerClient::getReadbackBufferFence(int64_t display,
 ndk::ScopedAStatus ComposerClient::getRenderIntents(int64_t display, ColorMode mode,
                                                     std::vector<RenderIntent>* intents) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getRenderIntents(display, mode, intents);
     return TO_BINDER_STATUS(err);
 }
@@ -280,6 +349,7 @@ ndk::ScopedAStatus ComposerClient::getRenderIntents(int64_t display, ColorMode m
 ndk::ScopedAStatus ComposerClient::getSupportedContentTypes(int64_t display,
                                                             std::vector<ContentType>* types) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getSupportedContentTypes(display, types);
     return TO_BINDER_STATUS(err);
 }
@@ -287,6 +357,7 @@ ndk::ScopedAStatus ComposerClient::getSupportedContentTypes(int64_t display,
 ndk::ScopedAStatus ComposerClient::getDisplayDecorationSupport(
         int64_t display, std::optional<common::DisplayDecorationSupport>* supportStruct) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     bool support = false;
     auto err = mHal->getRCDLayerSupport(display, support);
     if (err != ::android::OK) {
@@ -306,7 +377,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayDecorationSupport(
 ndk::ScopedAStatus ComposerClient::registerCallback(
         const std::shared_ptr<IComposerCallback>& callback) {
     DEBUG_FUNC();
-    // no locking as we require this function to be called only once
+    // called only once, the lock is for isAbandoned
+    std::lock_guard<std::mutex> lock(mCallbackMutex);
     mHalEventCallback = std::make_unique<HalEventCallback>(mHal, mResources.get(), callback);
     mHal->registerEventCallback(mHalEventCallback.get());
     return ndk::ScopedAStatus::ok();
@@ -314,6 +386,9 @@ ndk::ScopedAStatus ComposerClient::registerCallback(
 
 ndk::ScopedAStatus ComposerClient::setActiveConfig(int64_t display, int32_t config) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->waitForPendingPresent(display);
     auto err = mHal->setActiveConfig(display, config);
     return TO_BINDER_STATUS(err);
 }
@@ -322,24 +397,32 @@ ndk::ScopedAStatus ComposerClient::setActiveConfigWithConstraints(
         int64_t display, int32_t config, const VsyncPeriodChangeConstraints& constraints,
         VsyncPeriodChangeTimeline* timeline) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->waitForPendingPresent(display);
     auto err = mHal->setActiveConfigWithConstraints(display, config, constraints, timeline);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setBootDisplayConfig(int64_t display, int32_t config) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setBootDisplayConfig(display, config);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::clearBootDisplayConfig(int64_t display) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->clearBootDisplayConfig(display);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getPreferredBootDisplayConfig(int64_t display, int32_t* config) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
     auto err = mHal->getPreferredBootDisplayConfig(display, config);
     return TO_BINDER_STATUS(err);
 }
@@ -347,6 +430,7 @@ ndk::ScopedAStatus ComposerClient::getPreferredBootDisplayConfig(int64_t display
 ndk::ScopedAStatus ComposerClient::getHdrConversionCapabilities(
         std::vector<common::HdrConversionCapability>* hdrConversionCapabilities) {
     DEBUG_FUNC();
+    mHal->waitForDevice();
     auto err = mHal->getHdrConversionCapabilities(hdrConversionCapabilities);
     return TO_BINDER_STATUS(err);
 }
@@ -355,12 +439,16 @@ ndk::ScopedAStatus ComposerClient::setHdrConversionStrategy(
         const common::HdrConversionStrategy& hdrConversionStrategy,
         common::Hdr* preferredHdrOutputType) {
     DEBUG_FUNC();
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setHdrConversionStrategy(hdrConversionStrategy, preferredHdrOutputType);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setAutoLowLatencyMode(int64_t display, bool on) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setAutoLowLatencyMode(display, on);
     return TO_BINDER_STATUS(err);
 }
@@ -374,12 +462,17 @@ ndk::ScopedAStatus ComposerClient::setClientTargetSlotCount(int64_t display, int
 ndk::ScopedAStatus ComposerClient::setColorMode(int64_t display, ColorMode mode,
                                                 RenderIntent intent) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->waitForPendingPresent(display);
     auto err = mHal->setColorMode(display, mode, intent);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setContentType(int64_t display, ContentType type) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setContentType(display, type);
     return TO_BINDER_STATUS(err);
 }
@@ -387,12 +480,17 @@ ndk::ScopedAStatus ComposerClient::setContentType(int64_t display, ContentType t
 ndk::ScopedAStatus ComposerClient::setDisplayedContentSamplingEnabled(
         int64_t display, bool enable, FormatColorComponent componentMask, int64_t maxFrames) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setDisplayedContentSamplingEnabled(display, enable, componentMask, maxFrames);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setPowerMode(int64_t display, PowerMode mode) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->waitForPendingPresent(display);
     auto err = mHal->setPowerMode(display, mode);
     return TO_BINDER_STATUS(err);
 }
@@ -401,6 +499,9 @@ ndk::ScopedAStatus ComposerClient::setReadbackBuffer(
         int64_t display, const AidlNativeHandle& aidlBuffer,
         const ndk::ScopedFileDescriptor& releaseFence) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
+    mCommandEngine->waitForPendingPresent(display);
     buffer_handle_t readbackBuffer;
     // Note ownership of the buffer is not passed to resource manager.
     buffer_handle_t buffer = ::android::makeFromAidl(aidlBuffer);
@@ -418,12 +519,16 @@ ndk::ScopedAStatus ComposerClient::setReadbackBuffer(
 
 ndk::ScopedAStatus ComposerClient::setVsyncEnabled(int64_t display, bool enabled) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setVsyncEnabled(display, enabled);
     return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setIdleTimerEnabled(int64_t display, int32_t timeout) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setIdleTimerEnabled(display, timeout);
     return TO_BINDER_STATUS(err);
 }
@@ -431,10 +536,55 @@ ndk::ScopedAStatus ComposerClient::setIdleTimerEnabled(int64_t display, int32_t
 ndk::ScopedAStatus ComposerClient::setRefreshRateChangedCallbackDebugEnabled(int64_t display,
                                                                              bool enabled) {
     DEBUG_DISPLAY_FUNC(display);
+    mHal->waitForDevice();
+    waitForPreviousClient();
     auto err = mHal->setRefreshRateChangedCallbackDebugEnabled(display, enabled);
     return TO_BINDER_STATUS(err);
 }
 
+void ComposerClient::dump(std::string* output) {
+    mCommandEngine->dump(output);
+}
+
+void ComposerClient::dumpFrames(std::string* output) {
+    mCommandEngine->dumpFrames(output);
+}
+
+void ComposerClient::dumpResources(std::string* output) {
+    mResources->dump(output);
+}
+
+void ComposerClient::resetStats() {
+    mCommandEngine->resetStats();
+    mResources->resetStats();
+}
+
+void ComposerClient::setRecording(bool recording) {
+    mCommandEngine->setRecording(recording);
+}
+
+bool ComposerClient::isAbandoned() {
+    std::lock_guard<std::mutex> lock(mCallbackMutex);
+    return mHalEventCallback && !mHalEventCallback->isCallbackAlive();
+}
+
+void ComposerClient::waitForPreviousClient() {
+    if (mPreviousWaited.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mPreviousMutex);
+    // its layers would be composed along with ours
+    if (mPreviousRetired.valid() &&
+        mPreviousRetired.wait_for(kRetireTimeout) == std::future_status::timeout) {
+        LOG(ERROR) << "previous client did not retire in time, its layers may still show";
+    }
+    mPreviousWaited = true;
+}
+
+bool ComposerClient::HalEventCallback::isCallbackAlive() {
+    return AIBinder_isAlive(mCallback->asBinder().get());
+}
+
 void ComposerClient::HalEventCallback::onHotplug(int64_t display, bool connected) {
     DEBUG_FUNC();
     if (connected) {
@@ -554,7 +704,9 @@ void ComposerClient::HalEventCallback::cleanDisplayResources(int64_t display) {
     }
 }
 
-void ComposerClient::destroyResources() {
+void ComposerClient::destroyResources(IComposerHal* hal,
+                                      std::unique_ptr<IResourceManager> resources,
+                                      bool finalPresent) {
     DEBUG_FUNC();
     // We want to call hwc2_close here (and move hwc2_open to the
     // constructor), with the assumption that hwc2_close would
@@ -568,16 +720,33 @@ void ComposerClient::destroyResources() {
     // because we might also have VTS or VR as clients that can come and go.
     //
     // Below we manually clean all resources (layers and virtual
-    // displays), and perform a presentDisplay afterwards.
-    mResources->clear([this](int64_t display, bool isVirtual, const std::vector<int64_t> layers) {
+    // displays), and perform a presentDisplay afterwards unless the next
+    // client takes over the displays as they are. Each display is torn down
+    // on a thread of its own, but hwc2 is not known to take calls for
+    // several displays at once, so every call holds hwc2Mutex and only what
+    // happens between them overlaps. The buffers stay in the caches until
+    // all of them are done, a final present uses the client target.
+    const nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    const auto displays = resources->getDisplayResources();
+    size_t layerCount = 0;
+    for (const auto& target : displays) {
+        layerCount += target.layers.size();
+    }
+
+    std::mutex hwc2Mutex;
+    auto destroyDisplay = [hal, finalPresent,
+                           &hwc2Mutex](const IResourceManager::DisplayResources& target) {
+        const int64_t display = target.display;
         LOG(WARNING) << "destroying client resources for display " << display;
-        for (auto layer : layers) {
-            mHal->destroyLayer(display, layer);
+        {
+            std::lock_guard<std::mutex> lock(hwc2Mutex);
+            hal->destroyLayers(display, target.layers);
         }
 
-        if (isVirtual) {
-            mHal->destroyVirtualDisplay(display);
-        } else {
+        if (target.isVirtual) {
+            std::lock_guard<std::mutex> lock(hwc2Mutex);
+            hal->destroyVirtualDisplay(display);
+        } else if (finalPresent) {
             LOG(WARNING) << "performing a final presentDisplay";
             std::vector<int64_t> changedLayers;
             std::vector<Composition> compositionTypes;
@@ -586,18 +755,43 @@ void ComposerClient::destroyResources() {
             std::vector<int32_t> requestMasks;
             ClientTargetProperty clientTargetProperty;
             DimmingStage dimmingStage;
-            mHal->validateDisplay(display, &changedLayers, &compositionTypes, &displayRequestMask,
-                                  &requestedLayers, &requestMasks, &clientTargetProperty,
-                                  &dimmingStage);
-            mHal->acceptDisplayChanges(display);
+            {
+                std::lock_guard<std::mutex> lock(hwc2Mutex);
+                hal->validateDisplay(display, &changedLayers, &compositionTypes,
+                                     &displayRequestMask, &requestedLayers, &requestMasks,
+                                     &clientTargetProperty, &dimmingStage);
+            }
+            {
+                std::lock_guard<std::mutex> lock(hwc2Mutex);
+                hal->acceptDisplayChanges(display);
+            }
 
             ndk::ScopedFileDescriptor presentFence;
             std::vector<int64_t> releasedLayers;
             std::vector<ndk::ScopedFileDescriptor> releaseFences;
-            mHal->presentDisplay(display, presentFence, &releasedLayers, &releaseFences);
+            {
+                std::lock_guard<std::mutex> lock(hwc2Mutex);
+                hal->presentDisplay(display, presentFence, &releasedLayers, &releaseFences);
+            }
         }
-    });
-    mResources.reset();
+    };
+    // this thread takes the first display
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < displays.size(); ++i) {
+        workers.emplace_back(destroyDisplay, std::cref(displays[i]));
+    }
+    if (!displays.empty()) {
+        destroyDisplay(displays[0]);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    resources->clear([](int64_t, bool, const std::vector<int64_t>&) {});
+    resources.reset();
+
+    LOG(INFO) << "destroyed client resources of " << displays.size() << " displays and "
+              << layerCount << " layers in " << ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - start)
+              << "ms";
 }
 
 ::ndk::SpAIBinder ComposerClient::createBinder() {
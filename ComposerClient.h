@@ -20,7 +20,10 @@
 #include <aidl/android/hardware/graphics/composer3/BnComposerClient.h>
 #include <utils/Mutex.h>
 
+#include <atomic>
+#include <future>
 #include <memory>
+#include <mutex>
 
 #include "ComposerCommandEngine.h"
 #include "include/IComposerHal.h"
@@ -36,6 +39,26 @@ public:
     void setOnClientDestroyed(std::function<void()> onClientDestroyed) {
         mOnClientDestroyed = onClientDestroyed;
     }
+    // vendor.hwc3.client.handover: a client going away retires its layers on
+    // a thread of its own and leaves the last frame on the displays, the next
+    // client starts right away and only its first commands wait for that
+    static bool isHandoverEnabled();
+    // ready once the layers of this client are gone from hwc2, the HAL is not
+    // used by it after that
+    std::shared_future<void> getRetired() const { return mRetiredFuture; }
+    // the first commands of this client wait for the previous one to retire
+    void setPreviousRetired(std::shared_future<void> retired) {
+        std::lock_guard<std::mutex> lock(mPreviousMutex);
+        mPreviousRetired = std::move(retired);
+    }
+    // the process which registered the callback is gone, the client is
+    // about to be destroyed
+    bool isAbandoned();
+    void dump(std::string* output);
+    void dumpFrames(std::string* output);
+    void dumpResources(std::string* output);
+    void resetStats();
+    void setRecording(bool recording);
 
     class HalEventCallback : public IComposerHal::EventCallback {
       public:
@@ -50,6 +73,8 @@ public:
           void onVsyncIdle(int64_t display) override;
           void onSeamlessPossible(int64_t display) override;
 
+          bool isCallbackAlive();
+
       private:
         void cleanDisplayResources(int64_t display);
 
@@ -138,13 +163,28 @@ protected:
     ::ndk::SpAIBinder createBinder() override;
 
 private:
-    void destroyResources();
+    // destroys the layers and virtual displays of the client, a final present
+    // blanks the displays
+    static void destroyResources(IComposerHal* hal, std::unique_ptr<IResourceManager> resources,
+                                 bool finalPresent);
+    // Until the previous client retired its presents may still be in flight
+    // and its layers are being destroyed, anything that changes a display
+    // waits for that first. Queries don't.
+    void waitForPreviousClient();
 
+    // calls wait for hwc2 first, except for the display queries a snapshot answers
     IComposerHal* mHal;
     std::unique_ptr<IResourceManager> mResources;
     std::unique_ptr<ComposerCommandEngine> mCommandEngine;
     std::function<void()> mOnClientDestroyed;
-    std::unique_ptr<HalEventCallback> mHalEventCallback;
+    std::promise<void> mRetired;
+    std::shared_future<void> mRetiredFuture;
+    std::mutex mPreviousMutex;
+    std::shared_future<void> mPreviousRetired GUARDED_BY(mPreviousMutex);
+    std::atomic<bool> mPreviousWaited = false;
+    // isAbandoned is called from other binder threads
+    std::mutex mCallbackMutex;
+    std::unique_ptr<HalEventCallback> mHalEventCallback GUARDED_BY(mCallbackMutex);
 };
 
 } // namespace aidl::android::hardware::graphics::composer3::impl
@@ -14,9 +14,17 @@
  * limitations under the License.
  */
 
-#include <set>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <sync/sync.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string_view>
 
 #include "ComposerCommandEngine.h"
+#include "Startup.h"
+#include "SyncTimeline.h"
 #include "Util.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
@@ -55,26 +63,356 @@ namespace aidl::android::hardware::graphics::composer3::impl {
         }                                                                         \
     } while (0)
 
+static void accumulate(nsecs_t value, nsecs_t* total, nsecs_t* max) {
+    *total += value;
+    *max = std::max(*max, value);
+}
+
+static nsecs_t threadCpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<nsecs_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static bool hasSignaled(int fence) {
+    return sync_wait(fence, 0) == 0;
+}
+
+static bool isCursorOnlyCommand(const LayerCommand& command) {
+    return command.cursorPosition && !command.buffer && !command.damage && !command.blendMode &&
+            !command.color && !command.composition && !command.dataspace &&
+            !command.displayFrame && !command.planeAlpha && !command.sidebandStream &&
+            !command.sourceCrop && !command.transform && !command.visibleRegion && !command.z &&
+            !command.colorTransform && !command.brightness && !command.perFrameMetadata &&
+            !command.perFrameMetadataBlob && !command.blockingRegion;
+}
+
 bool ComposerCommandEngine::init() {
     mWriter = std::make_unique<ComposerServiceWriter>();
-    return (mWriter != nullptr);
+    if (mWriter == nullptr) {
+        return false;
+    }
+
+    if (AcquireFenceMonitor::isEnabled() || PresentFenceTracker::isEnabled()) {
+        mFenceWatcher = FenceWatcher::create();
+    }
+    if (mFenceWatcher && AcquireFenceMonitor::isEnabled()) {
+        mAcquireFences = std::make_unique<AcquireFenceMonitor>(mFenceWatcher.get());
+    }
+    if (mFenceWatcher && PresentFenceTracker::isEnabled()) {
+        mPresentFences = std::make_unique<PresentFenceTracker>(mFenceWatcher.get());
+    }
+    mRecorder = std::make_unique<FlightRecorder>();
+    mRecording = ::android::base::GetBoolProperty("vendor.hwc3.recorder.enable", true);
+    mSlowPresent =
+            ms2ns(::android::base::GetIntProperty("vendor.hwc3.recorder.slow_present_ms", 50));
+    mFilterReleaseFences =
+            ::android::base::GetBoolProperty("vendor.hwc3.release_fence.filter", true);
+    mMergeReleaseFences =
+            ::android::base::GetBoolProperty("vendor.hwc3.release_fence.merge", false);
+    mAsyncCursor = ::android::base::GetBoolProperty("vendor.hwc3.cursor.async", false);
+    if (PresentPipeline::isEnabled()) {
+        auto onCommitted = [this](int64_t display, nsecs_t latency) {
+            std::lock_guard<std::mutex> lock(mStatsMutex);
+            auto& stats = mPresentStats[display];
+            accumulate(latency, &stats.latencyTotal, &stats.latencyMax);
+        };
+        mPresentPipeline = std::make_unique<PresentPipeline>(mHal, mResources, onCommitted);
+        LOG(INFO) << "asynchronous present enabled";
+    }
+    return true;
+}
+
+void ComposerCommandEngine::waitForPendingPresent(int64_t display) {
+    if (!mPresentPipeline) {
+        return;
+    }
+    auto stall = mPresentPipeline->waitIdle(display);
+    if (stall > 0) {
+        std::lock_guard<std::mutex> lock(mStatsMutex);
+        auto& stats = mPresentStats[display];
+        accumulate(stall, &stats.stallTotal, &stats.stallMax);
+    }
+}
+
+void ComposerCommandEngine::waitForPendingPresents() {
+    if (mPresentPipeline) {
+        mPresentPipeline->waitIdleAll();
+    }
+}
+
+void ComposerCommandEngine::onDisplayRemoved(int64_t display) {
+    if (mPresentPipeline) {
+        mPresentPipeline->removeDisplay(display);
+    }
+    queueStateUpdate([this, display]() { mDisplayStates.erase(display); });
+    {
+        std::lock_guard<std::mutex> lock(mCadenceMutex);
+        mCadences.erase(display);
+    }
+    if (mAcquireFences) {
+        mAcquireFences->removeDisplay(display);
+    }
+    if (mPresentFences) {
+        mPresentFences->removeDisplay(display);
+    }
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    mPresentStats.erase(display);
+    mCursorStats.erase(display);
+}
+
+void ComposerCommandEngine::onLayerDestroyed(int64_t display, int64_t layer) {
+    queueStateUpdate([this, display, layer]() {
+        auto it = mDisplayStates.find(display);
+        if (it != mDisplayStates.end()) {
+            it->second.bufferUpdatedLayers.erase(layer);
+            it->second.layers.erase(layer);
+        }
+    });
+    if (mAcquireFences) {
+        mAcquireFences->removeLayer(display, layer);
+    }
+    std::lock_guard<std::mutex> lock(mCadenceMutex);
+    auto cadences = mCadences.find(display);
+    if (cadences != mCadences.end()) {
+        cadences->second.erase(layer);
+    }
+}
+
+void ComposerCommandEngine::queueStateUpdate(std::function<void()> update) {
+    std::lock_guard<std::mutex> lock(mStateUpdateMutex);
+    mStateUpdates.push_back(std::move(update));
+}
+
+void ComposerCommandEngine::applyStateUpdates() {
+    std::vector<std::function<void()>> updates;
+    {
+        std::lock_guard<std::mutex> lock(mStateUpdateMutex);
+        updates.swap(mStateUpdates);
+    }
+    for (const auto& update : updates) {
+        update();
+    }
+}
+
+DisplayCadence ComposerCommandEngine::getDisplayCadence(int64_t display) {
+    DisplayCadence cadence;
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::lock_guard<std::mutex> lock(mCadenceMutex);
+    auto it = mCadences.find(display);
+    if (it == mCadences.end()) {
+        return cadence;
+    }
+    for (const auto& [layer, layerCadence] : it->second) {
+        float fps = 0.f;
+        auto type = layerCadence.classify(now, &fps);
+        cadence.add(type, fps);
+    }
+    return cadence;
+}
+
+std::vector<float> ComposerCommandEngine::getRefreshRates(int64_t display) {
+    auto getAttribute = [&](int32_t config, DisplayAttribute attribute) {
+        int32_t value = -1;
+        return mHal->getDisplayAttribute(display, config, attribute, &value) ? -1 : value;
+    };
+
+    std::vector<float> rates;
+    int32_t active = 0;
+    std::vector<int32_t> configs;
+    if (mHal->getActiveConfig(display, &active) || mHal->getDisplayConfigs(display, &configs)) {
+        return rates;
+    }
+    const int32_t group = getAttribute(active, DisplayAttribute::CONFIG_GROUP);
+    const int32_t width = getAttribute(active, DisplayAttribute::WIDTH);
+    const int32_t height = getAttribute(active, DisplayAttribute::HEIGHT);
+    for (int32_t config : configs) {
+        int32_t vsyncPeriod = getAttribute(config, DisplayAttribute::VSYNC_PERIOD);
+        if (vsyncPeriod <= 0 || getAttribute(config, DisplayAttribute::CONFIG_GROUP) != group ||
+            getAttribute(config, DisplayAttribute::WIDTH) != width ||
+            getAttribute(config, DisplayAttribute::HEIGHT) != height) {
+            continue;
+        }
+        float rate = 1e9f / vsyncPeriod;
+        if (std::find(rates.begin(), rates.end(), rate) == rates.end()) {
+            rates.push_back(rate);
+        }
+    }
+    return rates;
+}
+
+float ComposerCommandEngine::getRecommendedRefreshRate(int64_t display) {
+    return recommendRefreshRate(getDisplayCadence(display), getRefreshRates(display));
+}
+
+void ComposerCommandEngine::dump(std::string* output) {
+    using ::android::base::StringAppendF;
+    static constexpr double kNsPerMs = 1000000.0;
+
+    std::vector<int64_t> displays;
+    {
+        std::lock_guard<std::mutex> lock(mCadenceMutex);
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        for (const auto& [display, layers] : mCadences) {
+            displays.push_back(display);
+            StringAppendF(output, "\nhwc3 layer cadence, display %" PRId64 ":\n", display);
+            for (const auto& [layer, cadence] : layers) {
+                float fps = 0.f;
+                auto type = cadence.classify(now, &fps);
+                StringAppendF(output, "  layer %" PRId64 ": %s %.2ffps\n", layer,
+                              LayerCadence::toString(type), fps);
+            }
+        }
+    }
+    for (int64_t display : displays) {
+        StringAppendF(output, "  display %" PRId64 " recommended refresh rate: %.2fHz\n",
+                      display, getRecommendedRefreshRate(display));
+    }
+
+    if (mAcquireFences) {
+        mAcquireFences->dump(output);
+    }
+    if (mPresentFences) {
+        mPresentFences->dump(output);
+    }
+
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    StringAppendF(output, "\nhwc3 present (%s):\n", mPresentPipeline ? "async" : "sync");
+    for (const auto& [display, stats] : mPresentStats) {
+        if (!stats.frames) {
+            continue;
+        }
+        StringAppendF(output,
+                      "  display %" PRId64 ": frames=%" PRIu64 " async=%" PRIu64
+                      " blocked avg/max=%.3f/%.3fms stall avg/max=%.3f/%.3fms"
+                      " latency avg/max=%.3f/%.3fms\n",
+                      display, stats.frames, stats.asyncFrames,
+                      stats.blockedTotal / kNsPerMs / stats.frames, stats.blockedMax / kNsPerMs,
+                      stats.stallTotal / kNsPerMs / stats.frames, stats.stallMax / kNsPerMs,
+                      stats.latencyTotal / kNsPerMs / stats.frames, stats.latencyMax / kNsPerMs);
+        if (stats.releaseFencesReported) {
+            StringAppendF(output,
+                          "    release fences: reported=%" PRIu64 " sent=%" PRIu64
+                          " (%.1f/frame) merged=%" PRIu64 "\n",
+                          stats.releaseFencesReported, stats.releaseFencesSent,
+                          static_cast<double>(stats.releaseFencesSent) / stats.frames,
+                          stats.releaseFencesMerged);
+        }
+    }
+
+    for (auto& [display, stats] : mCursorStats) {
+        if (stats.pendingFence.ok()) {
+            // pick up the last update if it reached the screen in the meantime
+            nsecs_t signalTime = getFenceSignalTime(stats.pendingFence.get());
+            if (signalTime >= 0) {
+                accumulate(signalTime - stats.pendingStart, &stats.latencyTotal,
+                           &stats.latencyMax);
+                stats.latencySamples++;
+                stats.pendingFence.reset();
+            }
+        }
+        if (!stats.updates) {
+            continue;
+        }
+        StringAppendF(output,
+                      "  display %" PRId64 " cursor: updates=%" PRIu64 " async=%" PRIu64
+                      " fallbacks=%" PRIu64
+                      " cpu avg/max=%.3f/%.3fms latency avg/max=%.3f/%.3fms\n",
+                      display, stats.updates, stats.asyncUpdates, stats.fallbacks,
+                      stats.cpuTotal / kNsPerMs / stats.updates, stats.cpuMax / kNsPerMs,
+                      stats.latencySamples ? stats.latencyTotal / kNsPerMs / stats.latencySamples
+                                           : 0.0,
+                      stats.latencyMax / kNsPerMs);
+    }
+}
+
+bool ComposerCommandEngine::isCursorOnlyUpdate(const DisplayCommand& command) {
+    if (!command.presentOrValidateDisplay || command.layers.empty() || command.validateDisplay ||
+        command.acceptDisplayChanges || command.presentDisplay || command.brightness ||
+        command.colorTransformMatrix || command.clientTarget ||
+        command.virtualDisplayOutputBuffer) {
+        return false;
+    }
+
+    auto it = mDisplayStates.find(command.display);
+    if (it == mDisplayStates.end()) {
+        return false;
+    }
+    const auto& layers = it->second.layers;
+    for (const auto& layerCmd : command.layers) {
+        auto layer = layers.find(layerCmd.layer);
+        if (!isCursorOnlyCommand(layerCmd) || layer == layers.end() ||
+            layer->second.composition != Composition::CURSOR ||
+            layer->second.validatedComposition != Composition::CURSOR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ComposerCommandEngine::executeCursorUpdate(const DisplayCommand& command) {
+    // nothing is validated nor presented, the last validate has to hold
+    if (!mAsyncCursor || !mHal->hasCapability(Capability::SKIP_VALIDATE) ||
+        mResources->mustValidateDisplay(command.display)) {
+        return false;
+    }
+
+    ATRACE_NAME("cursorUpdate");
+    mFrame.fields |= FlightRecorder::CURSOR_UPDATE;
+    const int64_t display = command.display;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t cpuStart = threadCpuTime();
+
+    for (const auto& layerCmd : command.layers) {
+        executeSetLayerCursorPosition(display, layerCmd.layer, *layerCmd.cursorPosition);
+    }
+    // hwc2 moves the cursor plane by itself, the frame on screen stays valid
+    mWriter->setPresentOrValidateResult(display, PresentOrValidate::Result::Presented);
+    recordCursorUpdate(display, start, cpuStart, CursorPath::ASYNC, {});
+    return true;
+}
+
+void ComposerCommandEngine::recordCursorUpdate(int64_t display, nsecs_t start, nsecs_t cpuStart,
+                                               CursorPath path,
+                                               ::android::base::unique_fd presentFence) {
+    nsecs_t cpuTime = threadCpuTime() - cpuStart;
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    auto& stats = mCursorStats[display];
+    stats.updates++;
+    accumulate(cpuTime, &stats.cpuTotal, &stats.cpuMax);
+    if (stats.pendingFence.ok()) {
+        nsecs_t signalTime = getFenceSignalTime(stats.pendingFence.get());
+        if (signalTime >= 0) {
+            accumulate(signalTime - stats.pendingStart, &stats.latencyTotal, &stats.latencyMax);
+            stats.latencySamples++;
+            stats.pendingFence.reset();
+        }
+    }
+    switch (path) {
+        case CursorPath::ASYNC:
+            stats.asyncUpdates++;
+            break;
+        case CursorPath::PRESENTED:
+            stats.pendingFence = std::move(presentFence);
+            stats.pendingStart = start;
+            break;
+        case CursorPath::VALIDATED:
+            stats.fallbacks++;
+            break;
+    }
 }
 
 int32_t ComposerCommandEngine::execute(const std::vector<DisplayCommand>& commands,
                                        std::vector<CommandResultPayload>* result) {
-    std::set<int64_t> displaysPendingBrightenssChange;
     mCommandIndex = 0;
+    applyStateUpdates();
+    // a brightness change is held by the HAL until the next present of its
+    // display, or its deadline if no present comes, see BrightnessCoalescer
     for (const auto& command : commands) {
+        beginFrame(command);
         dispatchDisplayCommand(command);
+        endFrame();
         ++mCommandIndex;
-        // The input commands could have 2+ commands for the same display.
-        // If the first has pending brightness change, the second presentDisplay will apply it.
-        if (command.validateDisplay || command.presentDisplay ||
-            command.presentOrValidateDisplay) {
-            displaysPendingBrightenssChange.erase(command.display);
-        } else if (command.brightness) {
-            displaysPendingBrightenssChange.insert(command.display);
-        }
     }
 
     *result = mWriter->getPendingCommandResults();
@@ -83,10 +421,126 @@ int32_t ComposerCommandEngine::execute(const std::vector<DisplayCommand>& comman
     return ::android::NO_ERROR;
 }
 
+static uint32_t getLayerFields(const LayerCommand& command) {
+    using F = FlightRecorder;
+    return (command.cursorPosition ? F::CURSOR_POSITION : 0) | (command.buffer ? F::BUFFER : 0) |
+            (command.damage ? F::DAMAGE : 0) | (command.blendMode ? F::BLEND_MODE : 0) |
+            (command.color ? F::COLOR : 0) | (command.composition ? F::COMPOSITION : 0) |
+            (command.dataspace ? F::DATASPACE : 0) |
+            (command.displayFrame ? F::DISPLAY_FRAME : 0) |
+            (command.planeAlpha ? F::PLANE_ALPHA : 0) |
+            (command.sidebandStream ? F::SIDEBAND_STREAM : 0) |
+            (command.sourceCrop ? F::SOURCE_CROP : 0) | (command.transform ? F::TRANSFORM : 0) |
+            (command.visibleRegion ? F::VISIBLE_REGION : 0) | (command.z ? F::Z : 0) |
+            (command.colorTransform ? F::COLOR_TRANSFORM : 0) |
+            (command.brightness ? F::BRIGHTNESS : 0) |
+            (command.perFrameMetadata ? F::PER_FRAME_METADATA : 0) |
+            (command.perFrameMetadataBlob ? F::PER_FRAME_METADATA_BLOB : 0) |
+            (command.blockingRegion ? F::BLOCKING_REGION : 0);
+}
+
+void ComposerCommandEngine::beginFrame(const DisplayCommand& command) {
+    mFrameStarted = mRecording;
+    if (!mFrameStarted) {
+        return;
+    }
+    using F = FlightRecorder;
+    mFrame = {};
+    mFrame.display = command.display;
+    mFrame.start = systemTime(SYSTEM_TIME_MONOTONIC);
+    mFrame.fields = (command.brightness ? F::DISPLAY_BRIGHTNESS : 0) |
+            (command.colorTransformMatrix ? F::COLOR_TRANSFORM_MATRIX : 0) |
+            (command.clientTarget ? F::CLIENT_TARGET : 0) |
+            (command.virtualDisplayOutputBuffer ? F::OUTPUT_BUFFER : 0) |
+            (command.validateDisplay ? F::VALIDATE : 0) |
+            (command.acceptDisplayChanges ? F::ACCEPT_CHANGES : 0) |
+            (command.presentDisplay ? F::PRESENT : 0) |
+            (command.presentOrValidateDisplay ? F::PRESENT_OR_VALIDATE : 0) |
+            (command.expectedPresentTime ? F::EXPECTED_PRESENT_TIME : 0);
+    mFrame.layerCount = static_cast<uint32_t>(command.layers.size());
+    const size_t recorded = std::min(command.layers.size(), F::kLayers);
+    for (size_t i = 0; i < recorded; ++i) {
+        mFrame.layers[i].id = command.layers[i].layer;
+        mFrame.layers[i].fields = getLayerFields(command.layers[i]);
+    }
+}
+
+void ComposerCommandEngine::endFrame() {
+    if (!mFrameStarted) {
+        return;
+    }
+    auto state = mDisplayStates.find(mFrame.display);
+    const size_t recorded = std::min<size_t>(mFrame.layerCount, FlightRecorder::kLayers);
+    for (size_t i = 0; i < recorded; ++i) {
+        FlightRecorder::Layer& layer = mFrame.layers[i];
+        layer.composition = -1;
+        if (state != mDisplayStates.end()) {
+            auto layerState = state->second.layers.find(layer.id);
+            if (layerState != state->second.layers.end() && layerState->second.composition) {
+                layer.composition = static_cast<int32_t>(*layerState->second.composition);
+            }
+        }
+    }
+    const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    mFrame.duration = now - mFrame.start;
+    mRecorder->record(mFrame);
+
+    // what led up to a stall, at most every few seconds
+    static constexpr nsecs_t kSlowDumpInterval = 10'000'000'000;
+    if (mSlowPresent > 0 && mFrame.presentDuration > mSlowPresent &&
+        now - mLastSlowDump > kSlowDumpInterval) {
+        mLastSlowDump = now;
+        std::string frames;
+        FlightRecorder::decode(mRecorder->getFrames(), &frames);
+        LOG(WARNING) << "present of display " << mFrame.display << " took "
+                     << mFrame.presentDuration / 1000000.0 << "ms, recent frames:";
+        for (size_t start = 0; start < frames.size();) {
+            size_t end = frames.find('\n', start);
+            if (end == std::string::npos) {
+                end = frames.size();
+            }
+            LOG(WARNING) << std::string_view(frames).substr(start, end - start);
+            start = end + 1;
+        }
+    }
+}
+
+void ComposerCommandEngine::dumpFrames(std::string* output) {
+    output->append(mRecording ? "\nhwc3 recent frames:\n" : "\nhwc3 recent frames (paused):\n");
+    FlightRecorder::decode(mRecorder->getFrames(), output);
+}
+
+void ComposerCommandEngine::resetStats() {
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    for (auto& [display, stats] : mPresentStats) {
+        stats = {};
+    }
+    for (auto& [display, stats] : mCursorStats) {
+        stats = {};
+    }
+}
+
 void ComposerCommandEngine::dispatchDisplayCommand(const DisplayCommand& command) {
+    waitForPendingPresent(command.display);
+    // the client took the last frame as presented, it hears of it now
+    if (mPresentPipeline) {
+        if (auto err = mPresentPipeline->takeCommitError(command.display)) {
+            LOG(ERROR) << __func__ << ": last async present failed: " << err;
+            setCommandError(err);
+        }
+    }
+
+    mCursorUpdate = isCursorOnlyUpdate(command);
+    if (mCursorUpdate && executeCursorUpdate(command)) {
+        return;
+    }
+
     //  place SetDisplayBrightness before SetLayerWhitePointNits since current
     //  display brightness is used to validate the layer white point nits.
     DISPATCH_DISPLAY_COMMAND(command, brightness, SetDisplayBrightness);
+    mExpectedPresentTime =
+            command.expectedPresentTime ? command.expectedPresentTime->timestampNanos : 0;
+    mBufferTime = mExpectedPresentTime ? mExpectedPresentTime : systemTime(SYSTEM_TIME_MONOTONIC);
     for (const auto& layerCmd : command.layers) {
         dispatchLayerCommand(command.display, layerCmd);
     }
@@ -133,19 +587,31 @@ int32_t ComposerCommandEngine::executeValidateDisplayInternal(int64_t display) {
     ClientTargetProperty clientTargetProperty{common::PixelFormat::RGBA_8888,
                                               common::Dataspace::UNKNOWN};
     DimmingStage dimmingStage;
+    const nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
     auto err =
             mHal->validateDisplay(display, &changedLayers, &compositionTypes, &displayRequestMask,
                                   &requestedLayers, &requestMasks, &clientTargetProperty,
                                   &dimmingStage);
+    mFrame.validateDuration = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    mFrame.validateError = err;
+    mFrame.changedTypes = static_cast<uint32_t>(changedLayers.size());
     mResources->setDisplayMustValidateState(display, false);
     if (!err) {
+        // SurfaceFlinger always accepts the changes
+        auto& layers = mDisplayStates[display].layers;
+        for (size_t i = 0; i < changedLayers.size() && i < compositionTypes.size(); ++i) {
+            layers[changedLayers[i]].composition = compositionTypes[i];
+        }
+        for (auto& [_, layer] : layers) {
+            layer.validatedComposition = layer.composition;
+        }
         mWriter->setChangedCompositionTypes(display, changedLayers, compositionTypes);
         mWriter->setDisplayRequests(display, displayRequestMask, requestedLayers, requestMasks);
         static constexpr float kBrightness = 1.f;
         mWriter->setClientTargetProperty(display, clientTargetProperty, kBrightness, dimmingStage);
     } else {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
     return err;
 }
@@ -155,7 +621,7 @@ void ComposerCommandEngine::executeSetColorTransform(int64_t display,
     auto err = mHal->setColorTransform(display, matrix);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -173,11 +639,11 @@ void ComposerCommandEngine::executeSetClientTarget(int64_t display, const Client
                                     command.dataspace, command.damage);
         if (err) {
             LOG(ERROR) << __func__ << " setClientTarget: err " << err;
-            mWriter->setError(mCommandIndex, err);
+            setCommandError(err);
         }
     } else {
         LOG(ERROR) << __func__ << " getDisplayClientTarget : err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
     //handle from android::makeFromAidl should be deleted with native_handle_delete.
     if(handle)
@@ -197,11 +663,11 @@ void ComposerCommandEngine::executeSetOutputBuffer(uint64_t display, const Buffe
         err = mHal->setOutputBuffer(display, outputBuffer, buffer.fence);
         if (err) {
             LOG(ERROR) << __func__ << " setOutputBuffer: err " << err;
-            mWriter->setError(mCommandIndex, err);
+            setCommandError(err);
         }
     } else {
         LOG(ERROR) << __func__ << " getDisplayOutputBuffer: err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
     //handle from android::makeFromAidl should be deleted with native_handle_delete.
     if(handle)
@@ -224,21 +690,31 @@ void ComposerCommandEngine::executeSetDisplayBrightness(uint64_t display,
     auto err = mHal->setDisplayBrightness(display, command.brightness);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
 void ComposerCommandEngine::executePresentOrValidateDisplay(
         int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime) {
+    const nsecs_t start = mCursorUpdate ? systemTime(SYSTEM_TIME_MONOTONIC) : 0;
+    const nsecs_t cpuStart = mCursorUpdate ? threadCpuTime() : 0;
     executeSetExpectedPresentTimeInternal(display, expectedPresentTime);
 
     int err;
-    // First try to Present as is.
+    // First try to Present as is. Always synchronous, even with the present
+    // pipeline: hwc2 tells here whether the frame needs a validate after all,
+    // and the client has to hear which one it was.
     if (mHal->hasCapability(Capability::SKIP_VALIDATE)) {
-        err = mResources->mustValidateDisplay(display) ? IComposerClient::EX_NOT_VALIDATED
-                                                       : executePresentDisplay(display);
+        ::android::base::unique_fd presentFence;
+        err = mResources->mustValidateDisplay(display)
+                ? IComposerClient::EX_NOT_VALIDATED
+                : executePresentDisplayInternal(display, mCursorUpdate ? &presentFence : nullptr);
         if (!err) {
             mWriter->setPresentOrValidateResult(display, PresentOrValidate::Result::Presented);
+            if (mCursorUpdate) {
+                recordCursorUpdate(display, start, cpuStart, CursorPath::PRESENTED,
+                                   std::move(presentFence));
+            }
             return;
         }
     }
@@ -248,35 +724,193 @@ void ComposerCommandEngine::executePresentOrValidateDisplay(
     if (!err) {
         mWriter->setPresentOrValidateResult(display, PresentOrValidate::Result::Validated);
     }
+    if (mCursorUpdate) {
+        recordCursorUpdate(display, start, cpuStart, CursorPath::VALIDATED, {});
+    }
 }
 
 void ComposerCommandEngine::executeAcceptDisplayChanges(int64_t display) {
     auto err = mHal->acceptDisplayChanges(display);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
-int ComposerCommandEngine::executePresentDisplay(int64_t display) {
+void ComposerCommandEngine::executePresentDisplay(int64_t display) {
+    if (!executePresentDisplayAsync(display, nullptr)) {
+        executePresentDisplayInternal(display);
+    }
+}
+
+bool ComposerCommandEngine::executePresentDisplayAsync(
+        int64_t display, ::android::base::unique_fd* outPresentFence) {
+    if (!mPresentPipeline) {
+        return false;
+    }
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    auto& state = mDisplayStates[display];
+    std::vector<int64_t> layers(state.bufferUpdatedLayers.begin(),
+                                state.bufferUpdatedLayers.end());
+    ndk::ScopedFileDescriptor presentFence;
+    std::vector<ndk::ScopedFileDescriptor> fences;
+    if (!mPresentPipeline->queuePresent(display, layers, &presentFence, &fences)) {
+        return false;
+    }
+
+    // the same rules as a synchronous present, earlier frames may have left
+    // fences pending on these layers
+    const size_t reported = fences.size();
+    filterReleaseFences(display, &layers, &fences);
+    state.bufferUpdatedLayers.clear();
+    trackPresent(display, start, presentFence.get());
+    if (outPresentFence) {
+        outPresentFence->reset(dup(presentFence.get()));
+    }
+    mWriter->setPresentFence(display, std::move(presentFence));
+    mWriter->setReleaseFences(display, layers, std::move(fences));
+
+    const nsecs_t duration = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    mFrame.fields |= FlightRecorder::PRESENTED | FlightRecorder::ASYNC_PRESENT;
+    logFirstPresent();
+    mFrame.presentDuration = duration;
+
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    auto& stats = mPresentStats[display];
+    stats.frames++;
+    stats.asyncFrames++;
+    stats.releaseFencesReported += reported;
+    stats.releaseFencesSent += layers.size();
+    accumulate(duration, &stats.blockedTotal, &stats.blockedMax);
+    return true;
+}
+
+int32_t ComposerCommandEngine::executePresentDisplayInternal(
+        int64_t display, ::android::base::unique_fd* outPresentFence) {
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
     ndk::ScopedFileDescriptor presentFence;
     std::vector<int64_t> layers;
     std::vector<ndk::ScopedFileDescriptor> fences;
     auto err = mHal->presentDisplay(display, presentFence, &layers, &fences);
+    mFrame.presentDuration = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    mFrame.presentError = err;
     if (!err) {
+        mFrame.fields |= FlightRecorder::PRESENTED;
+        logFirstPresent();
+        const size_t reported = fences.size();
+        filterReleaseFences(display, &layers, &fences);
+        mDisplayStates[display].bufferUpdatedLayers.clear();
+        trackPresent(display, start, presentFence.get());
+        if (outPresentFence) {
+            outPresentFence->reset(dup(presentFence.get()));
+        }
         mWriter->setPresentFence(display, std::move(presentFence));
         mWriter->setReleaseFences(display, layers, std::move(fences));
+
+        nsecs_t duration = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        std::lock_guard<std::mutex> lock(mStatsMutex);
+        auto& stats = mPresentStats[display];
+        stats.frames++;
+        stats.releaseFencesReported += reported;
+        stats.releaseFencesSent += layers.size();
+        accumulate(duration, &stats.blockedTotal, &stats.blockedMax);
+        accumulate(duration, &stats.latencyTotal, &stats.latencyMax);
     }
 
     return err;
 }
 
+void ComposerCommandEngine::trackPresent(int64_t display, nsecs_t presentTime,
+                                         int presentFence) {
+    if (!mAcquireFences && !mPresentFences) {
+        return;
+    }
+    int32_t vsyncPeriod = 0;
+    if (mHal->getDisplayVsyncPeriod(display, &vsyncPeriod)) {
+        vsyncPeriod = 0;
+    }
+    if (mAcquireFences) {
+        mAcquireFences->onPresent(display, presentTime, vsyncPeriod);
+    }
+    if (mPresentFences) {
+        mPresentFences->onPresent(
+                display,
+                ::android::base::unique_fd(presentFence >= 0 ? dup(presentFence) : -1),
+                presentTime, mExpectedPresentTime, vsyncPeriod);
+    }
+}
+
+void ComposerCommandEngine::filterReleaseFences(int64_t display, std::vector<int64_t>* layers,
+                                                std::vector<ndk::ScopedFileDescriptor>* fences) {
+    if (!mMergeReleaseFences) {
+        if (!mFilterReleaseFences) {
+            return;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < layers->size(); ++i) {
+            if ((*fences)[i].get() >= 0) {
+                (*layers)[kept] = (*layers)[i];
+                (*fences)[kept] = std::move((*fences)[i]);
+                kept++;
+            }
+        }
+        layers->resize(kept);
+        fences->resize(kept);
+        return;
+    }
+
+    auto& state = mDisplayStates[display];
+    uint64_t merged = 0;
+    // the client only waits for the buffers it replaced, the fence of a layer
+    // that kept its buffer waits until that buffer is replaced
+    for (size_t i = 0; i < layers->size(); ++i) {
+        ::android::base::unique_fd fence((*fences)[i].release());
+        if (!fence.ok()) {
+            continue;
+        }
+        auto& pending = state.layers[(*layers)[i]].pendingRelease;
+        if (!pending.ok() || hasSignaled(pending.get())) {
+            pending = std::move(fence);
+            continue;
+        }
+        if (hasSignaled(fence.get())) {
+            continue;
+        }
+        // whether both are on one timeline is not known here, the kernel
+        // keeps only the later point of fences which are
+        ::android::base::unique_fd both(sync_merge("hwc3-release", pending.get(), fence.get()));
+        if (both.ok()) {
+            pending = std::move(both);
+            merged++;
+        } else {
+            LOG(ERROR) << __func__ << ": failed to merge release fences of layer " << (*layers)[i];
+            pending = std::move(fence);
+        }
+    }
+
+    layers->clear();
+    fences->clear();
+    for (int64_t layer : state.bufferUpdatedLayers) {
+        auto it = state.layers.find(layer);
+        if (it != state.layers.end() && it->second.pendingRelease.ok()) {
+            layers->push_back(layer);
+            fences->emplace_back(it->second.pendingRelease.release());
+        }
+    }
+
+    if (merged) {
+        std::lock_guard<std::mutex> lock(mStatsMutex);
+        mPresentStats[display].releaseFencesMerged += merged;
+    }
+}
+
 void ComposerCommandEngine::executeSetLayerCursorPosition(int64_t display, int64_t layer,
                                        const common::Point& cursorPosition) {
     auto err = mHal->setLayerCursorPosition(display, layer, cursorPosition.x, cursorPosition.y);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -311,11 +945,28 @@ void ComposerCommandEngine::executeSetLayerBuffer(int64_t display, int64_t layer
         err = mHal->setLayerBuffer(display, layer, hwcBuffer, buffer.fence);
         if (err) {
             LOG(ERROR) << __func__ << ": setLayerBuffer err " << err;
-            mWriter->setError(mCommandIndex, err);
+            setCommandError(err);
+        } else {
+            auto& state = mDisplayStates[display];
+            auto& layerState = state.layers[layer];
+            state.bufferUpdatedLayers.insert(layer);
+
+            if (mAcquireFences && buffer.fence.get() >= 0) {
+                mAcquireFences->watch(display, layer,
+                                      ::android::base::unique_fd(dup(buffer.fence.get())),
+                                      mExpectedPresentTime);
+            }
+
+            std::lock_guard<std::mutex> lock(mCadenceMutex);
+            auto& cadence = mCadences[display][layer];
+            cadence.setVideo(layerState.sideband ||
+                             LayerCadence::isVideoDataspace(
+                                     static_cast<int32_t>(layerState.dataspace)));
+            cadence.onBuffer(mBufferTime);
         }
     } else {
         LOG(ERROR) << __func__ << ": getLayerBuffer err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
     //handle from android::makeFromAidl should be deleted with native_handle_delete.
     if(handle)
@@ -327,7 +978,7 @@ void ComposerCommandEngine::executeSetLayerSurfaceDamage(int64_t display, int64_
     auto err = mHal->setLayerSurfaceDamage(display, layer, damage);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -336,7 +987,7 @@ void ComposerCommandEngine::executeSetLayerBlendMode(int64_t display, int64_t la
     auto err = mHal->setLayerBlendMode(display, layer, blendMode.blendMode);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -345,7 +996,7 @@ void ComposerCommandEngine::executeSetLayerColor(int64_t display, int64_t layer,
     auto err = mHal->setLayerColor(display, layer, color);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -354,7 +1005,9 @@ void ComposerCommandEngine::executeSetLayerComposition(int64_t display, int64_t
     auto err = mHal->setLayerCompositionType(display, layer, composition.composition);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
+    } else {
+        mDisplayStates[display].layers[layer].composition = composition.composition;
     }
 }
 
@@ -363,7 +1016,9 @@ void ComposerCommandEngine::executeSetLayerDataspace(int64_t display, int64_t la
     auto err = mHal->setLayerDataspace(display, layer, dataspace.dataspace);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
+    } else {
+        mDisplayStates[display].layers[layer].dataspace = dataspace.dataspace;
     }
 }
 
@@ -372,7 +1027,7 @@ void ComposerCommandEngine::executeSetLayerDisplayFrame(int64_t display, int64_t
     auto err = mHal->setLayerDisplayFrame(display, layer, rect);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -381,7 +1036,7 @@ void ComposerCommandEngine::executeSetLayerPlaneAlpha(int64_t display, int64_t l
     auto err = mHal->setLayerPlaneAlpha(display, layer, planeAlpha.alpha);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -397,10 +1052,13 @@ void ComposerCommandEngine::executeSetLayerSidebandStream(int64_t display, int64
     if (err == 0) {
     //----------------------------------------
         err = mHal->setLayerSidebandStream(display, layer, stream);
+        if (err == 0) {
+            mDisplayStates[display].layers[layer].sideband = true;
+        }
     }
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
     //handle from android::makeFromAidl should be deleted with native_handle_delete.
     if(handle)
@@ -412,7 +1070,7 @@ void ComposerCommandEngine::executeSetLayerSourceCrop(int64_t display, int64_t l
     auto err = mHal->setLayerSourceCrop(display, layer, sourceCrop);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -421,7 +1079,7 @@ void ComposerCommandEngine::executeSetLayerTransform(int64_t display, int64_t la
     auto err = mHal->setLayerTransform(display, layer, transform.transform);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -430,7 +1088,7 @@ void ComposerCommandEngine::executeSetLayerVisibleRegion(int64_t display, int64_
     auto err = mHal->setLayerVisibleRegion(display, layer, visibleRegion);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -439,7 +1097,7 @@ void ComposerCommandEngine::executeSetLayerZOrder(int64_t display, int64_t layer
     auto err = mHal->setLayerZOrder(display, layer, zOrder.z);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -448,7 +1106,7 @@ void ComposerCommandEngine::executeSetLayerPerFrameMetadata(int64_t display, int
     auto err = mHal->setLayerPerFrameMetadata(display, layer, perFrameMetadata);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -457,7 +1115,7 @@ void ComposerCommandEngine::executeSetLayerColorTransform(int64_t display, int64
     auto err = mHal->setLayerColorTransform(display, layer, matrix);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -466,7 +1124,7 @@ void ComposerCommandEngine::executeSetLayerBrightness(int64_t display, int64_t l
     auto err = mHal->setLayerBrightness(display, layer, brightness.brightness);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
@@ -475,7 +1133,7 @@ void ComposerCommandEngine::executeSetLayerPerFrameMetadataBlobs(int64_t display
     auto err = mHal->setLayerPerFrameMetadataBlobs(display, layer, metadata);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
-        mWriter->setError(mCommandIndex, err);
+        setCommandError(err);
     }
 }
 
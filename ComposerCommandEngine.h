@@ -18,9 +18,21 @@
 
 #include <android/hardware/graphics/composer3/ComposerServiceWriter.h>
 #include <utils/Mutex.h>
+#include <utils/Timers.h>
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "AcquireFenceMonitor.h"
+#include "FlightRecorder.h"
+#include "LayerCadence.h"
+#include "PresentFenceTracker.h"
+#include "PresentPipeline.h"
 #include "include/IComposerHal.h"
 #include "include/IResourceManager.h"
 
@@ -43,6 +55,28 @@ class ComposerCommandEngine {
           mWriter->reset();
       }
 
+      // decodes the flight recorder
+      void dumpFrames(std::string* output);
+      // pauses or resumes the flight recorder
+      void setRecording(bool recording) { mRecording = recording; }
+      // starts the present and cursor statistics over
+      void resetStats();
+
+      // Wait for the asynchronous present of the display, if any, to be committed.
+      // Needed before any hwc2 call that changes the display state.
+      void waitForPendingPresent(int64_t display);
+      void waitForPendingPresents();
+      // called from other binder threads than execute()
+      void onDisplayRemoved(int64_t display);
+      void onLayerDestroyed(int64_t display, int64_t layer);
+
+      // what the layers of the display update at, measured from their buffers
+      DisplayCadence getDisplayCadence(int64_t display);
+      // refresh rate in the active config group which suits that best, 0 if unknown
+      float getRecommendedRefreshRate(int64_t display);
+
+      void dump(std::string* output);
+
   private:
       void dispatchDisplayCommand(const DisplayCommand& displayCommand);
       void dispatchLayerCommand(int64_t display, const LayerCommand& displayCommand);
@@ -56,7 +90,13 @@ class ComposerCommandEngine {
       void executePresentOrValidateDisplay(
               int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime);
       void executeAcceptDisplayChanges(int64_t display);
-      int executePresentDisplay(int64_t display);
+      void executePresentDisplay(int64_t display);
+      // whether the command only moves layers the last validate left on a cursor plane
+      bool isCursorOnlyUpdate(const DisplayCommand& command);
+      // Moves the cursor plane without a validate nor a present, if hwc2 does
+      // that outside a frame commit. Returns false if the command needs the
+      // regular path.
+      bool executeCursorUpdate(const DisplayCommand& command);
 
       void executeSetLayerCursorPosition(int64_t display, int64_t layer,
                                          const common::Point& cursorPosition);
@@ -92,14 +132,137 @@ class ComposerCommandEngine {
       void executeSetLayerBrightness(int64_t display, int64_t layer,
                                      const LayerBrightness& brightness);
 
+      // flight recorder entry of each display command
+      void beginFrame(const DisplayCommand& command);
+      void endFrame();
+      // fails the current command
+      void setCommandError(int32_t err) {
+          mFrame.errors++;
+          if (!mFrame.firstError) {
+              mFrame.firstError = err;
+          }
+          mWriter->setError(mCommandIndex, err);
+      }
+
       int32_t executeValidateDisplayInternal(int64_t display);
+      void queueStateUpdate(std::function<void()> update);
+      void applyStateUpdates();
+      int32_t executePresentDisplayInternal(int64_t display,
+                                            ::android::base::unique_fd* outPresentFence = nullptr);
+      // presentDisplay through mPresentPipeline, false if it has to be synchronous.
+      // presentOrValidateDisplay never takes it.
+      bool executePresentDisplayAsync(int64_t display,
+                                      ::android::base::unique_fd* outPresentFence);
+      // starts timing the frame, presentFence is not taken
+      void trackPresent(int64_t display, nsecs_t presentTime, int presentFence);
+      // drops -1 release fences, and with mMergeReleaseFences holds back the
+      // ones of layers which kept their buffer
+      void filterReleaseFences(int64_t display, std::vector<int64_t>* layers,
+                               std::vector<ndk::ScopedFileDescriptor>* fences);
+      enum class CursorPath { ASYNC, PRESENTED, VALIDATED };
+      // accounts a cursor-only command, presentFence signals when it is on screen
+      void recordCursorUpdate(int64_t display, nsecs_t start, nsecs_t cpuStart,
+                              CursorPath path, ::android::base::unique_fd presentFence);
       void executeSetExpectedPresentTimeInternal(
               int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime);
+      // refresh rates of the configs sharing the group and size of the active one
+      std::vector<float> getRefreshRates(int64_t display);
 
       IComposerHal* mHal;
       IResourceManager* mResources;
       std::unique_ptr<ComposerServiceWriter> mWriter;
       int32_t mCommandIndex;
+
+      struct LayerState {
+          // composition type after the last validate
+          std::optional<Composition> composition;
+          // what hwc2 left it at in the last validate, CURSOR means the
+          // display put it on a cursor plane
+          std::optional<Composition> validatedComposition;
+          common::Dataspace dataspace = common::Dataspace::UNKNOWN;
+          bool sideband = false;
+          // release fences of frames the layer kept its buffer in, sent with its next one
+          ::android::base::unique_fd pendingRelease;
+      };
+      struct DisplayState {
+          // layers which got a new buffer since the last present
+          std::unordered_set<int64_t> bufferUpdatedLayers;
+          std::unordered_map<int64_t, LayerState> layers;
+      };
+      // only touched by execute(), others queue their changes for it
+      std::unordered_map<int64_t, DisplayState> mDisplayStates;
+      std::mutex mStateUpdateMutex;
+      std::vector<std::function<void()>> mStateUpdates GUARDED_BY(mStateUpdateMutex);
+      std::unique_ptr<PresentPipeline> mPresentPipeline;
+      // vendor.hwc3.release_fence.filter: -1 release fences are never sent
+      bool mFilterReleaseFences = true;
+      // vendor.hwc3.release_fence.merge: only layers which got a new buffer get
+      // a release fence, the ones of frames the layer kept its buffer in are
+      // merged into it
+      bool mMergeReleaseFences = false;
+      // vendor.hwc3.cursor.async: hwc2 moves the cursor plane on setCursorPosition
+      // without waiting for presentDisplay, as hwc2 allows it to
+      bool mAsyncCursor = false;
+      // the current command only moves the cursor, see isCursorOnlyUpdate
+      bool mCursorUpdate = false;
+
+      // when the buffers of the current display command are meant to be shown
+      nsecs_t mBufferTime = 0;
+      // the same if the client gave one, otherwise 0
+      nsecs_t mExpectedPresentTime = 0;
+      std::unique_ptr<AcquireFenceMonitor> mAcquireFences;
+      std::unique_ptr<PresentFenceTracker> mPresentFences;
+      // mFrame is the entry of the current command, recorded if mFrameStarted
+      std::unique_ptr<FlightRecorder> mRecorder;
+      FlightRecorder::Frame mFrame = {};
+      bool mFrameStarted = false;
+      // vendor.hwc3.recorder.enable, can be changed with dumpsys
+      std::atomic<bool> mRecording = false;
+      // vendor.hwc3.recorder.slow_present_ms, a present this slow logs the recorder
+      nsecs_t mSlowPresent = 0;
+      nsecs_t mLastSlowDump = 0;
+      // waits for the fences of both, goes first as its callbacks use them
+      std::unique_ptr<FenceWatcher> mFenceWatcher;
+      std::mutex mCadenceMutex;
+      std::unordered_map<int64_t, std::unordered_map<int64_t, LayerCadence>> mCadences
+              GUARDED_BY(mCadenceMutex);
+
+      struct PresentStats {
+          uint64_t frames = 0;
+          uint64_t asyncFrames = 0;
+          // binder thread time spent in presentDisplay
+          nsecs_t blockedTotal = 0;
+          nsecs_t blockedMax = 0;
+          // binder thread time spent waiting for the previous asynchronous commit
+          nsecs_t stallTotal = 0;
+          nsecs_t stallMax = 0;
+          // presentDisplay command to the end of the hwc2 commit
+          nsecs_t latencyTotal = 0;
+          nsecs_t latencyMax = 0;
+          // release fences from hwc2 and the ones sent to the client
+          uint64_t releaseFencesReported = 0;
+          uint64_t releaseFencesSent = 0;
+          uint64_t releaseFencesMerged = 0;
+      };
+      std::mutex mStatsMutex;
+      std::unordered_map<int64_t, PresentStats> mPresentStats GUARDED_BY(mStatsMutex);
+
+      struct CursorStats {
+          uint64_t updates = 0;
+          // moved by hwc2 without a present, these have no latency sample
+          uint64_t asyncUpdates = 0;
+          // updates which needed a validate after all
+          uint64_t fallbacks = 0;
+          nsecs_t cpuTotal = 0;
+          nsecs_t cpuMax = 0;
+          // command to present fence signal, sampled once the fence has signaled
+          uint64_t latencySamples = 0;
+          nsecs_t latencyTotal = 0;
+          nsecs_t latencyMax = 0;
+          ::android::base::unique_fd pendingFence;
+          nsecs_t pendingStart = 0;
+      };
+      std::unordered_map<int64_t, CursorStats> mCursorStats GUARDED_BY(mStatsMutex);
 };
 
 template <typename InputType, typename Functor>
@@ -110,7 +273,7 @@ void ComposerCommandEngine::dispatchLayerCommand(int64_t display, int64_t layer,
         auto err = (mHal->*func)(display, layer, *input);
         if (err) {
             LOG(ERROR) << funcName << ": err " << err;
-            mWriter->setError(mCommandIndex, err);
+            setCommandError(err);
         }
     }
 };
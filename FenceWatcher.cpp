@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FenceWatcher.h"
+
+#include <android-base/logging.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "SyncTimeline.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// epoll data of mWake, fences start at 1
+static constexpr uint64_t kWakeId = 0;
+
+std::unique_ptr<FenceWatcher> FenceWatcher::create() {
+    ::android::base::unique_fd epoll(epoll_create1(EPOLL_CLOEXEC));
+    ::android::base::unique_fd wake(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (!epoll.ok() || !wake.ok()) {
+        LOG(ERROR) << "failed to create fence epoll: " << strerror(errno);
+        return nullptr;
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = kWakeId;
+    if (epoll_ctl(epoll.get(), EPOLL_CTL_ADD, wake.get(), &event) != 0) {
+        LOG(ERROR) << "failed to watch fence wake fd: " << strerror(errno);
+        return nullptr;
+    }
+    return std::unique_ptr<FenceWatcher>(new FenceWatcher(std::move(epoll), std::move(wake)));
+}
+
+FenceWatcher::FenceWatcher(::android::base::unique_fd epoll, ::android::base::unique_fd wake)
+      : mEpoll(std::move(epoll)), mWake(std::move(wake)) {
+    mThread = std::thread(&FenceWatcher::watchLoop, this);
+}
+
+FenceWatcher::~FenceWatcher() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    uint64_t one = 1;
+    if (write(mWake.get(), &one, sizeof(one)) != sizeof(one)) {
+        LOG(ERROR) << "failed to stop fence thread: " << strerror(errno);
+    }
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+bool FenceWatcher::watch(::android::base::unique_fd fence, Callback callback) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const uint64_t id = mNextId++;
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = id;
+    if (epoll_ctl(mEpoll.get(), EPOLL_CTL_ADD, fence.get(), &event) != 0) {
+        LOG(ERROR) << __func__ << ": failed to watch fence: " << strerror(errno);
+        return false;
+    }
+    mWatches.emplace(id, Watch{std::move(fence), std::move(callback)});
+    return true;
+}
+
+void FenceWatcher::watchLoop() {
+    struct epoll_event events[16];
+    std::vector<std::pair<Callback, nsecs_t>> signaled;
+    for (;;) {
+        int count = epoll_wait(mEpoll.get(), events, std::size(events), -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(ERROR) << __func__ << ": epoll_wait failed: " << strerror(errno);
+            return;
+        }
+
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mStopping) {
+                return;
+            }
+            for (int i = 0; i < count; ++i) {
+                auto it = mWatches.find(events[i].data.u64);
+                if (it == mWatches.end()) {
+                    continue;
+                }
+                nsecs_t signalTime = getFenceSignalTime(it->second.fence.get());
+                epoll_ctl(mEpoll.get(), EPOLL_CTL_DEL, it->second.fence.get(), nullptr);
+                signaled.emplace_back(std::move(it->second.callback),
+                                      signalTime >= 0 ? signalTime : now);
+                mWatches.erase(it);
+            }
+        }
+        // callbacks may take their own locks and watch more fences
+        for (auto& [callback, signalTime] : signaled) {
+            callback(signalTime);
+        }
+        signaled.clear();
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Calls back once sync fences signal. One thread waits for all of them with
+// epoll, so watching a fence costs the caller an epoll_ctl and no wait.
+class FenceWatcher {
+  public:
+    // signalTime is the CLOCK_MONOTONIC signal time of the fence, or the time
+    // it was seen in an error state
+    using Callback = std::function<void(nsecs_t signalTime)>;
+
+    // nullptr if epoll is not available
+    static std::unique_ptr<FenceWatcher> create();
+    // callbacks of fences still pending are dropped
+    ~FenceWatcher();
+
+    FenceWatcher(const FenceWatcher&) = delete;
+    FenceWatcher& operator=(const FenceWatcher&) = delete;
+
+    // callback runs on the watcher thread without any lock held, returns false
+    // if the fence can't be watched
+    bool watch(::android::base::unique_fd fence, Callback callback);
+
+  private:
+    struct Watch {
+        ::android::base::unique_fd fence;
+        Callback callback;
+    };
+
+    FenceWatcher(::android::base::unique_fd epoll, ::android::base::unique_fd wake);
+    void watchLoop();
+
+    const ::android::base::unique_fd mEpoll;
+    // wakes the thread up to stop
+    const ::android::base::unique_fd mWake;
+
+    std::mutex mMutex;
+    uint64_t mNextId GUARDED_BY(mMutex) = 1;
+    std::unordered_map<uint64_t, Watch> mWatches GUARDED_BY(mMutex);
+    bool mStopping GUARDED_BY(mMutex) = false;
+
+    std::thread mThread;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FlightRecorder.h"
+
+#include <aidl/android/hardware/graphics/composer3/Composition.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <string.h>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+static constexpr const char* kLayerFieldNames[] = {
+        "cursor", "buffer", "damage", "blend", "color", "composition", "dataspace",
+        "frame", "alpha", "sideband", "crop", "transform", "visible", "z",
+        "colorTransform", "brightness", "metadata", "metadataBlob", "blocking",
+};
+
+static constexpr const char* kDisplayFieldNames[] = {
+        "brightness", "colorTransform", "clientTarget", "outputBuffer", "validate", "accept",
+        "present", "presentOrValidate", "expectedPresentTime", "cursor", "presented", "async",
+};
+
+static void appendFields(uint32_t fields, const char* const* names, size_t count,
+                         std::string* output) {
+    bool first = true;
+    for (size_t i = 0; i < count; ++i) {
+        if (fields & (1u << i)) {
+            output->append(first ? "" : ",");
+            output->append(names[i]);
+            first = false;
+        }
+    }
+}
+
+void FlightRecorder::record(const Frame& frame) {
+    const uint64_t index = mNext.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = mSlots[index % kFrames];
+    const uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&slot.frame, &frame, sizeof(frame));
+    slot.frame.index = index;
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+std::vector<FlightRecorder::Frame> FlightRecorder::getFrames() const {
+    std::vector<Frame> frames;
+    frames.reserve(kFrames);
+    for (const Slot& slot : mSlots) {
+        const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == 0 || (sequence & 1)) {
+            continue;
+        }
+        Frame frame;
+        memcpy(&frame, &slot.frame, sizeof(frame));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+            frames.push_back(frame);
+        }
+    }
+    std::sort(frames.begin(), frames.end(),
+              [](const Frame& a, const Frame& b) { return a.index < b.index; });
+    return frames;
+}
+
+void FlightRecorder::decode(const std::vector<Frame>& frames, std::string* output) {
+    using ::android::base::StringAppendF;
+    static constexpr double kNsPerMs = 1000000.0;
+
+    if (frames.empty()) {
+        output->append("  no frames recorded\n");
+        return;
+    }
+    // times are relative to the end of the newest frame
+    const nsecs_t end = frames.back().start + frames.back().duration;
+    for (const Frame& frame : frames) {
+        StringAppendF(output, "  #%" PRIu64 " %.3fms display %" PRId64 " %.3fms [", frame.index,
+                      (frame.start - end) / kNsPerMs, frame.display, frame.duration / kNsPerMs);
+        appendFields(frame.fields, kDisplayFieldNames, std::size(kDisplayFieldNames), output);
+        StringAppendF(output, "] %u layers", frame.layerCount);
+        if (frame.validateDuration > 0) {
+            StringAppendF(output, ", validate %.3fms err %d changed %u",
+                          frame.validateDuration / kNsPerMs, frame.validateError,
+                          frame.changedTypes);
+        }
+        if (frame.presentDuration > 0) {
+            StringAppendF(output, ", present %.3fms err %d", frame.presentDuration / kNsPerMs,
+                          frame.presentError);
+        }
+        if (frame.errors) {
+            StringAppendF(output, ", %u errors first %d", frame.errors, frame.firstError);
+        }
+        output->append("\n");
+
+        const size_t recorded = std::min<size_t>(frame.layerCount, kLayers);
+        for (size_t i = 0; i < recorded; ++i) {
+            const Layer& layer = frame.layers[i];
+            StringAppendF(output, "    layer %" PRId64 " {", layer.id);
+            appendFields(layer.fields, kLayerFieldNames, std::size(kLayerFieldNames), output);
+            output->append("}");
+            if (layer.composition >= 0) {
+                output->append(" ");
+                output->append(toString(static_cast<Composition>(layer.composition)));
+            }
+            output->append("\n");
+        }
+        if (frame.layerCount > recorded) {
+            StringAppendF(output, "    %zu more layers\n", frame.layerCount - recorded);
+        }
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
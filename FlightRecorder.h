@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Keeps a compact record of the last display commands for post-mortem
+// analysis: which fields of which layers changed, what validate made of them,
+// errors, and how long validate and present took.
+//
+// record() takes no lock and does not allocate. Each slot is guarded by a
+// sequence count that is odd while the slot is written, so a reader copying a
+// slot under a writer notices and skips it.
+class FlightRecorder {
+  public:
+    static constexpr size_t kFrames = 256;
+    // layers recorded per frame, the count of the others is kept
+    static constexpr size_t kLayers = 16;
+
+    // fields of a LayerCommand
+    enum LayerField : uint32_t {
+        CURSOR_POSITION = 1 << 0,
+        BUFFER = 1 << 1,
+        DAMAGE = 1 << 2,
+        BLEND_MODE = 1 << 3,
+        COLOR = 1 << 4,
+        COMPOSITION = 1 << 5,
+        DATASPACE = 1 << 6,
+        DISPLAY_FRAME = 1 << 7,
+        PLANE_ALPHA = 1 << 8,
+        SIDEBAND_STREAM = 1 << 9,
+        SOURCE_CROP = 1 << 10,
+        TRANSFORM = 1 << 11,
+        VISIBLE_REGION = 1 << 12,
+        Z = 1 << 13,
+        COLOR_TRANSFORM = 1 << 14,
+        BRIGHTNESS = 1 << 15,
+        PER_FRAME_METADATA = 1 << 16,
+        PER_FRAME_METADATA_BLOB = 1 << 17,
+        BLOCKING_REGION = 1 << 18,
+    };
+    // fields of a DisplayCommand, and how it was handled
+    enum DisplayField : uint32_t {
+        DISPLAY_BRIGHTNESS = 1 << 0,
+        COLOR_TRANSFORM_MATRIX = 1 << 1,
+        CLIENT_TARGET = 1 << 2,
+        OUTPUT_BUFFER = 1 << 3,
+        VALIDATE = 1 << 4,
+        ACCEPT_CHANGES = 1 << 5,
+        PRESENT = 1 << 6,
+        PRESENT_OR_VALIDATE = 1 << 7,
+        EXPECTED_PRESENT_TIME = 1 << 8,
+        // handled by the cursor fast path
+        CURSOR_UPDATE = 1 << 9,
+        // presentOrValidate presented
+        PRESENTED = 1 << 10,
+        // presented asynchronously
+        ASYNC_PRESENT = 1 << 11,
+    };
+
+    struct Layer {
+        int64_t id;
+        uint32_t fields;
+        // Composition after the last validate, -1 if unknown
+        int32_t composition;
+    };
+
+    struct Frame {
+        // set by record()
+        uint64_t index;
+        int64_t display;
+        nsecs_t start;
+        nsecs_t duration;
+        uint32_t fields;
+        uint32_t layerCount;
+        Layer layers[kLayers];
+        nsecs_t validateDuration;
+        nsecs_t presentDuration;
+        uint32_t changedTypes;
+        // commands of the frame that failed, and the first error
+        uint32_t errors;
+        int32_t firstError;
+        int32_t validateError;
+        int32_t presentError;
+    };
+
+    void record(const Frame& frame);
+    // the recorded frames, oldest first
+    std::vector<Frame> getFrames() const;
+    static void decode(const std::vector<Frame>& frames, std::string* output);
+
+  private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        Frame frame;
+    };
+
+    std::array<Slot, kFrames> mSlots;
+    std::atomic<uint64_t> mNext{0};
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
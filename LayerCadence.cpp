@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LayerCadence.h"
+
+#include <system/graphics.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// a gap this long ends the window, and the layer is static after it
+static constexpr nsecs_t kPause = 250'000'000;
+// buffers needed before the rate is trusted
+static constexpr size_t kMinSamples = 8;
+// how far apart the rates of both halves of the window may be
+static constexpr float kSteadyTolerance = 0.1f;
+// how far from a nominal video rate a measurement may be, 23.976 is 24
+static constexpr float kVideoTolerance = 0.02f;
+// UI at the display rate can't be told from 50 / 60 fps video, only the
+// lower rates are trusted to be video without a video dataspace
+static constexpr float kMaxUiVideoRate = 48.f;
+// a mode may be this far from an exact multiple of a video rate
+static constexpr float kMultipleTolerance = 0.01f;
+
+static constexpr float kVideoRates[] = {24.f, 25.f, 30.f, 50.f, 60.f};
+
+void LayerCadence::onBuffer(nsecs_t time) {
+    if (mCount > 0 && time - at(mCount - 1) > kPause) {
+        mCount = 0;
+    }
+    mTimes[mNext] = time;
+    mNext = (mNext + 1) % kWindow;
+    mCount = std::min(mCount + 1, kWindow);
+}
+
+float LayerCadence::getRate(size_t first, size_t last) const {
+    nsecs_t span = at(last - 1) - at(first);
+    return span > 0 ? (last - first - 1) * 1e9f / span : 0.f;
+}
+
+LayerCadence::Type LayerCadence::classify(nsecs_t now, float* outFps) const {
+    *outFps = 0.f;
+    if (mCount == 0 || now - at(mCount - 1) > kPause) {
+        return Type::STATIC;
+    }
+    if (mCount < kMinSamples) {
+        // just started, assume the worst
+        return Type::ANIMATING;
+    }
+
+    const float rate = getRate(0, mCount);
+    *outFps = rate;
+    // the halves share the middle buffer
+    const float early = getRate(0, mCount / 2 + 1);
+    const float late = getRate(mCount / 2, mCount);
+    if (std::abs(early - late) > rate * kSteadyTolerance) {
+        return Type::ANIMATING;
+    }
+
+    const float* nominal = std::min_element(
+            std::begin(kVideoRates), std::end(kVideoRates),
+            [rate](float a, float b) { return std::abs(a - rate) < std::abs(b - rate); });
+    if (std::abs(*nominal - rate) > *nominal * kVideoTolerance ||
+        (!mVideo && *nominal > kMaxUiVideoRate)) {
+        return Type::ANIMATING;
+    }
+    *outFps = *nominal;
+    return Type::VIDEO;
+}
+
+const char* LayerCadence::toString(Type type) {
+    switch (type) {
+        case Type::STATIC:
+            return "static";
+        case Type::VIDEO:
+            return "video";
+        case Type::ANIMATING:
+            return "animating";
+    }
+    return "unknown";
+}
+
+bool LayerCadence::isVideoDataspace(int32_t dataspace) {
+    int32_t standard = dataspace & HAL_DATASPACE_STANDARD_MASK;
+    return standard == HAL_DATASPACE_STANDARD_BT601_625 ||
+            standard == HAL_DATASPACE_STANDARD_BT601_525 ||
+            standard == HAL_DATASPACE_STANDARD_BT2020 ||
+            (dataspace & HAL_DATASPACE_RANGE_MASK) == HAL_DATASPACE_RANGE_LIMITED;
+}
+
+void DisplayCadence::add(LayerCadence::Type type, float fps) {
+    switch (type) {
+        case LayerCadence::Type::STATIC:
+            staticLayers++;
+            break;
+        case LayerCadence::Type::VIDEO:
+            videoLayers++;
+            if (std::find(videoRates.begin(), videoRates.end(), fps) == videoRates.end()) {
+                videoRates.push_back(fps);
+            }
+            break;
+        case LayerCadence::Type::ANIMATING:
+            // one that just started could be as fast as anything
+            animatingFps = std::max(animatingFps,
+                                    fps > 0.f ? fps : std::numeric_limits<float>::infinity());
+            animatingLayers++;
+            break;
+    }
+}
+
+bool fitsVideoRates(const DisplayCadence& cadence, float rate) {
+    return std::all_of(cadence.videoRates.begin(), cadence.videoRates.end(), [rate](float fps) {
+        float vsyncs = std::round(rate / fps);
+        return vsyncs >= 1.f && std::abs(rate - vsyncs * fps) <= rate * kMultipleTolerance;
+    });
+}
+
+float recommendRefreshRate(const DisplayCadence& cadence, const std::vector<float>& rates) {
+    if (rates.empty()) {
+        return 0.f;
+    }
+    std::vector<float> sorted = rates;
+    std::sort(sorted.begin(), sorted.end());
+    if (cadence.animatingLayers > 0) {
+        return sorted.back();
+    }
+    if (cadence.videoRates.empty()) {
+        return sorted.front();
+    }
+
+    for (float rate : sorted) {
+        if (fitsVideoRates(cadence, rate)) {
+            return rate;
+        }
+    }
+    // nothing fits all of them, judder the least
+    return sorted.back();
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
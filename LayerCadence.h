@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <utils/Timers.h>
+
+#include <array>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Update rate of one layer, estimated from the times its buffers arrive.
+//
+// The client latches buffers on vsync, so 24 fps on a 60 Hz display arrives
+// as alternating 33 / 50 ms intervals. The rate is therefore taken over the
+// whole window rather than from single intervals, and the window restarts
+// after a pause so that a resumed layer is not averaged with its past.
+class LayerCadence {
+  public:
+    enum class Type {
+        // no buffer for a while
+        STATIC,
+        // steady at one of the usual video rates
+        VIDEO,
+        // anything else that updates, including steady UI at the display rate
+        ANIMATING,
+    };
+
+    void onBuffer(nsecs_t time);
+    // the content is decoded video, not rendered
+    void setVideo(bool video) { mVideo = video; }
+
+    // outFps is the measured rate, or the nominal one for VIDEO
+    Type classify(nsecs_t now, float* outFps) const;
+
+    static const char* toString(Type type);
+    // YCbCr content from decoders, UI is sRGB / Display P3 full range
+    static bool isVideoDataspace(int32_t dataspace);
+
+  private:
+    static constexpr size_t kWindow = 32;
+
+    // rate over buffers [first, last) of the window, oldest is 0
+    float getRate(size_t first, size_t last) const;
+    nsecs_t at(size_t index) const { return mTimes[(mNext + kWindow - mCount + index) % kWindow]; }
+
+    std::array<nsecs_t, kWindow> mTimes = {};
+    size_t mNext = 0;
+    size_t mCount = 0;
+    bool mVideo = false;
+};
+
+// What the layers of a display need from its refresh rate.
+struct DisplayCadence {
+    uint32_t staticLayers = 0;
+    uint32_t videoLayers = 0;
+    uint32_t animatingLayers = 0;
+    // distinct nominal rates of the video layers
+    std::vector<float> videoRates;
+    // fastest animation, infinity if one is not measured yet
+    float animatingFps = 0.f;
+
+    void add(LayerCadence::Type type, float fps);
+};
+
+// Whether rate shows every video layer at a whole number of vsyncs per frame.
+bool fitsVideoRates(const DisplayCadence& cadence, float rate);
+
+// Lowest of rates that shows every video layer at a whole number of vsyncs
+// per frame, so 24 fps picks 48 or 72 Hz over 60 Hz. Animations want the
+// highest rate and a display with only static layers the lowest. Returns 0 if
+// rates is empty.
+float recommendRefreshRate(const DisplayCadence& cadence, const std::vector<float>& rates);
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
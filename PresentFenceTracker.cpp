@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PresentFenceTracker.h"
+
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// frames listed in dump
+static constexpr size_t kDumpFrames = 8;
+
+bool PresentFenceTracker::isEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.present_stats.enable", true);
+}
+
+void PresentFenceTracker::onPresent(int64_t display, ::android::base::unique_fd presentFence,
+                                    nsecs_t presentTime, nsecs_t expectedPresentTime,
+                                    nsecs_t vsyncPeriod) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    Display& state = mDisplays[display];
+    if (state.generation == 0) {
+        state.generation = mNextGeneration++;
+    }
+    state.presented++;
+    if (!presentFence.ok()) {
+        return;
+    }
+
+    Frame frame;
+    frame.presentTime = presentTime;
+    frame.expectedPresentTime = expectedPresentTime;
+    frame.vsyncPeriod = vsyncPeriod;
+    mWatcher->watch(std::move(presentFence),
+                    [this, display, generation = state.generation, frame](nsecs_t signalTime) {
+                        Frame signaled = frame;
+                        signaled.signalTime = signalTime;
+                        onSignaled(display, generation, signaled);
+                    });
+}
+
+void PresentFenceTracker::onSignaled(int64_t display, uint64_t generation, Frame frame) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end() || it->second.generation != generation) {
+        return;
+    }
+    Display& state = it->second;
+
+    const nsecs_t period = frame.vsyncPeriod;
+    nsecs_t target = frame.expectedPresentTime;
+    if (target <= 0 && state.lastSignal > 0 && period > 0) {
+        // the first vsync after presentDisplay, on the grid of the last signal
+        const nsecs_t since = frame.presentTime - state.lastSignal;
+        target = state.lastSignal + std::max<nsecs_t>(1, (since + period - 1) / period) * period;
+    }
+    if (target > 0 && period > 0 && frame.signalTime > target) {
+        frame.missedVsyncs = static_cast<uint32_t>(
+                std::llround(static_cast<double>(frame.signalTime - target) / period));
+    }
+    state.lastSignal = std::max(state.lastSignal, frame.signalTime);
+
+    const nsecs_t latency = frame.signalTime - frame.presentTime;
+    state.signaled++;
+    state.latencyTotal += latency;
+    state.latencyMax = std::max(state.latencyMax, latency);
+    if (frame.missedVsyncs > 0) {
+        state.missedFrames++;
+        state.missedVsyncs += frame.missedVsyncs;
+    }
+    state.frames[state.next] = frame;
+    state.next = (state.next + 1) % kFrames;
+    state.count = std::min(state.count + 1, kFrames);
+}
+
+void PresentFenceTracker::removeDisplay(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDisplays.erase(display);
+}
+
+std::vector<PresentFenceTracker::Frame> PresentFenceTracker::getFrames(const Display& state) {
+    std::vector<Frame> frames;
+    frames.reserve(state.count);
+    for (size_t i = 0; i < state.count; ++i) {
+        frames.push_back(state.frames[(state.next + kFrames - state.count + i) % kFrames]);
+    }
+    return frames;
+}
+
+std::vector<PresentFenceTracker::Frame> PresentFenceTracker::getFrames(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    return it != mDisplays.end() ? getFrames(it->second) : std::vector<Frame>();
+}
+
+void PresentFenceTracker::dump(std::string* output) {
+    using ::android::base::StringAppendF;
+    static constexpr double kNsPerMs = 1000000.0;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    StringAppendF(output, "\nhwc3 present fences:\n");
+    for (const auto& [display, state] : mDisplays) {
+        StringAppendF(output,
+                      "  display %" PRId64 ": presented=%" PRIu64 " signaled=%" PRIu64
+                      " latency avg/max=%.3f/%.3fms missed frames=%" PRIu64 " vsyncs=%" PRIu64
+                      "\n",
+                      display, state.presented, state.signaled,
+                      state.signaled ? state.latencyTotal / kNsPerMs / state.signaled : 0.0,
+                      state.latencyMax / kNsPerMs, state.missedFrames, state.missedVsyncs);
+
+        std::vector<Frame> frames = getFrames(state);
+        if (frames.empty()) {
+            continue;
+        }
+        std::vector<nsecs_t> latencies;
+        latencies.reserve(frames.size());
+        for (const Frame& frame : frames) {
+            latencies.push_back(frame.signalTime - frame.presentTime);
+        }
+        std::sort(latencies.begin(), latencies.end());
+        StringAppendF(output, "    last %zu latency p50/p99=%.3f/%.3fms, newest:", frames.size(),
+                      latencies[latencies.size() / 2] / kNsPerMs,
+                      latencies[latencies.size() * 99 / 100] / kNsPerMs);
+        const size_t first = frames.size() > kDumpFrames ? frames.size() - kDumpFrames : 0;
+        for (size_t i = frames.size(); i-- > first;) {
+            const Frame& frame = frames[i];
+            StringAppendF(output, " %.3fms", (frame.signalTime - frame.presentTime) / kNsPerMs);
+            if (frame.missedVsyncs) {
+                StringAppendF(output, "(+%u)", frame.missedVsyncs);
+            }
+        }
+        output->append("\n");
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FenceWatcher.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Times the present fences of each display. The fence signals when the frame
+// starts to scan out, so its signal time is when the frame really reached the
+// screen. That gives the latency from presentDisplay, and against the vsync
+// the frame was meant for, the vsyncs it missed.
+class PresentFenceTracker {
+  public:
+    struct Frame {
+        // presentDisplay was called
+        nsecs_t presentTime = 0;
+        // the client wanted the frame on screen, 0 if it did not say
+        nsecs_t expectedPresentTime = 0;
+        // the present fence signaled
+        nsecs_t signalTime = 0;
+        nsecs_t vsyncPeriod = 0;
+        // vsyncs between the one the frame was meant for and the one it made
+        uint32_t missedVsyncs = 0;
+    };
+    // frames kept per display
+    static constexpr size_t kFrames = 128;
+
+    // vendor.hwc3.present_stats.enable
+    static bool isEnabled();
+
+    // watcher must outlive the tracker, or stop calling back before it goes
+    explicit PresentFenceTracker(FenceWatcher* watcher) : mWatcher(watcher) {}
+
+    PresentFenceTracker(const PresentFenceTracker&) = delete;
+    PresentFenceTracker& operator=(const PresentFenceTracker&) = delete;
+
+    void onPresent(int64_t display, ::android::base::unique_fd presentFence,
+                   nsecs_t presentTime, nsecs_t expectedPresentTime, nsecs_t vsyncPeriod);
+    void removeDisplay(int64_t display);
+
+    // the last frames of the display whose fence signaled, oldest first
+    std::vector<Frame> getFrames(int64_t display);
+    void dump(std::string* output);
+
+  private:
+    struct Display {
+        // tells a late fence of a removed display from one of the next
+        uint64_t generation = 0;
+        std::array<Frame, kFrames> frames = {};
+        size_t next = 0;
+        size_t count = 0;
+        // the last signal, the vsync grid is counted from it
+        nsecs_t lastSignal = 0;
+
+        uint64_t presented = 0;
+        uint64_t signaled = 0;
+        uint64_t missedFrames = 0;
+        uint64_t missedVsyncs = 0;
+        nsecs_t latencyTotal = 0;
+        nsecs_t latencyMax = 0;
+    };
+
+    void onSignaled(int64_t display, uint64_t generation, Frame frame);
+    static std::vector<Frame> getFrames(const Display& state);
+
+    FenceWatcher* const mWatcher;
+
+    std::mutex mMutex;
+    uint64_t mNextGeneration GUARDED_BY(mMutex) = 1;
+    std::map<int64_t, Display> mDisplays GUARDED_BY(mMutex);
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG (ATRACE_TAG_GRAPHICS | ATRACE_TAG_HAL)
+
+#include "PresentPipeline.h"
+
+#include <android-base/properties.h>
+#include <sync/sync.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <utility>
+
+#include "Util.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// A fence wait is split in slices so that a stopping pipeline is not stuck
+// on a display that never flips again.
+static constexpr int kFenceWaitSliceMs = 500;
+
+bool PresentPipeline::isEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.async_present", false);
+}
+
+PresentPipeline::~PresentPipeline() {
+    std::lock_guard<std::mutex> lock(mDisplaysMutex);
+    for (auto& [_, display] : mDisplays) {
+        stopDisplay(display.get());
+    }
+    mDisplays.clear();
+}
+
+nsecs_t PresentPipeline::waitIdle(int64_t display) {
+    Display* d = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mDisplaysMutex);
+        auto it = mDisplays.find(display);
+        if (it == mDisplays.end()) {
+            return 0;
+        }
+        d = it->second.get();
+    }
+
+    std::unique_lock<std::mutex> lock(d->mutex);
+    if (!d->commitPending) {
+        return 0;
+    }
+    ATRACE_NAME("waitForPendingPresent");
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    d->condition.wait(lock, [d]() { return !d->commitPending; });
+    return systemTime(SYSTEM_TIME_MONOTONIC) - start;
+}
+
+void PresentPipeline::waitIdleAll() {
+    std::vector<int64_t> displays;
+    {
+        std::lock_guard<std::mutex> lock(mDisplaysMutex);
+        for (const auto& [id, _] : mDisplays) {
+            displays.push_back(id);
+        }
+    }
+    for (auto display : displays) {
+        waitIdle(display);
+    }
+}
+
+void PresentPipeline::removeDisplay(int64_t display) {
+    std::unique_ptr<Display> d;
+    {
+        std::lock_guard<std::mutex> lock(mDisplaysMutex);
+        auto it = mDisplays.find(display);
+        if (it == mDisplays.end()) {
+            return;
+        }
+        d = std::move(it->second);
+        mDisplays.erase(it);
+    }
+    stopDisplay(d.get());
+}
+
+int32_t PresentPipeline::takeCommitError(int64_t display) {
+    Display* d = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mDisplaysMutex);
+        auto it = mDisplays.find(display);
+        if (it == mDisplays.end()) {
+            return 0;
+        }
+        d = it->second.get();
+    }
+
+    std::lock_guard<std::mutex> lock(d->mutex);
+    return std::exchange(d->commitError, 0);
+}
+
+bool PresentPipeline::queuePresent(int64_t display, const std::vector<int64_t>& releasedLayers,
+                                   ndk::ScopedFileDescriptor* outPresentFence,
+                                   std::vector<ndk::ScopedFileDescriptor>* outReleaseFences) {
+    ATRACE_CALL();
+    Display* d = getOrCreateDisplay(display);
+    if (!d) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(d->mutex);
+    // one frame in flight
+    d->condition.wait(lock, [d]() { return !d->commitPending; });
+
+    uint32_t point = d->queuedPoint + 1;
+    auto presentFence = d->presentTimeline->createFence("hwc3-present", point);
+    auto releaseFence = d->releaseTimeline->createFence("hwc3-release", point);
+    if (!presentFence.ok() || !releaseFence.ok()) {
+        return false;
+    }
+    d->queuedPoint = point;
+
+    outReleaseFences->clear();
+    outReleaseFences->reserve(releasedLayers.size());
+    for (size_t i = 0; i < releasedLayers.size(); ++i) {
+        outReleaseFences->emplace_back(dup(releaseFence.get()));
+    }
+    *outPresentFence = ndk::ScopedFileDescriptor(presentFence.release());
+
+    d->frameQueued = true;
+    d->commitPending = true;
+    d->queueTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    d->condition.notify_all();
+    return true;
+}
+
+PresentPipeline::Display* PresentPipeline::getOrCreateDisplay(int64_t display) {
+    std::lock_guard<std::mutex> lock(mDisplaysMutex);
+    auto it = mDisplays.find(display);
+    if (it != mDisplays.end()) {
+        return it->second.get();
+    }
+    if (mNoTimelines) {
+        return nullptr;
+    }
+
+    auto d = std::make_unique<Display>();
+    d->id = display;
+    d->presentTimeline = SyncTimeline::create();
+    d->releaseTimeline = SyncTimeline::create();
+    if (!d->presentTimeline || !d->releaseTimeline) {
+        // not going to change, don't try again for every frame
+        LOG(ERROR) << "failed to create timelines for display " << display
+                   << ", presenting synchronously from now on";
+        mNoTimelines = true;
+        return nullptr;
+    }
+    d->commitThread = std::thread(&PresentPipeline::commitLoop, this, d.get());
+    d->signalThread = std::thread(&PresentPipeline::signalLoop, this, d.get());
+
+    auto* ret = d.get();
+    mDisplays.emplace(display, std::move(d));
+    return ret;
+}
+
+void PresentPipeline::stopDisplay(Display* display) {
+    {
+        std::lock_guard<std::mutex> lock(display->mutex);
+        display->stopping = true;
+        display->condition.notify_all();
+    }
+    display->commitThread.join();
+    display->signalThread.join();
+    // Timelines are closed by the caller, which signals whatever is still pending.
+}
+
+void PresentPipeline::commitLoop(Display* display) {
+    std::string name = "hwc3Commit" + std::to_string(display->id);
+    pthread_setname_np(pthread_self(), name.c_str());
+    // same as the binder threads which present synchronously
+    struct sched_param param = {0};
+    param.sched_priority = 2;
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) != 0) {
+        LOG(ERROR) << "Couldn't set SCHED_FIFO for " << name << ": " << errno;
+    }
+
+    std::unique_lock<std::mutex> lock(display->mutex);
+    while (true) {
+        display->condition.wait(lock,
+                                [display]() { return display->frameQueued || display->stopping; });
+        if (!display->frameQueued) {
+            break;
+        }
+        display->frameQueued = false;
+        nsecs_t queueTime = display->queueTime;
+        lock.unlock();
+
+        Signal signal;
+        int32_t err;
+        {
+            ATRACE_NAME("asyncPresentDisplay");
+            ndk::ScopedFileDescriptor presentFence;
+            std::vector<int64_t> layers;
+            std::vector<ndk::ScopedFileDescriptor> fences;
+            err = mHal->presentDisplay(display->id, presentFence, &layers, &fences);
+            if (!err) {
+                signal.presentFence.reset(presentFence.release());
+                display->lastPresentFence.reset(
+                        signal.presentFence.ok() ? dup(signal.presentFence.get()) : -1);
+                for (auto& fence : fences) {
+                    ::android::base::unique_fd fd(fence.release());
+                    if (fd.ok()) {
+                        signal.releaseFences.push_back(std::move(fd));
+                    }
+                }
+            } else {
+                // The client already got its fences. The frame on screen is
+                // still the last one presented, its fence stands for this one
+                // too, and the next frame goes through validate again.
+                LOG(ERROR) << "async presentDisplay for display " << display->id
+                           << " failed: " << err;
+                if (display->lastPresentFence.ok()) {
+                    signal.presentFence.reset(dup(display->lastPresentFence.get()));
+                }
+                mResources->setDisplayMustValidateState(display->id, true);
+            }
+        }
+        if (mOnCommitted) {
+            mOnCommitted(display->id, systemTime(SYSTEM_TIME_MONOTONIC) - queueTime);
+        }
+
+        lock.lock();
+        if (err) {
+            display->commitError = err;
+        }
+        display->signals.push_back(std::move(signal));
+        display->commitPending = false;
+        display->condition.notify_all();
+    }
+}
+
+bool PresentPipeline::waitFence(Display* display, const ::android::base::unique_fd& fence) {
+    if (!fence.ok()) {
+        return true;
+    }
+    while (sync_wait(fence.get(), kFenceWaitSliceMs) < 0) {
+        if (errno != ETIME) {
+            // treat a broken fence as signaled rather than stalling the timeline
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(display->mutex);
+        if (display->stopping) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void PresentPipeline::signalLoop(Display* display) {
+    std::string name = "hwc3Signal" + std::to_string(display->id);
+    pthread_setname_np(pthread_self(), name.c_str());
+
+    while (true) {
+        Signal signal;
+        {
+            std::unique_lock<std::mutex> lock(display->mutex);
+            display->condition.wait(lock, [display]() {
+                return !display->signals.empty() || display->stopping;
+            });
+            if (display->signals.empty()) {
+                break;
+            }
+            signal = std::move(display->signals.front());
+            display->signals.pop_front();
+        }
+
+        if (!waitFence(display, signal.presentFence)) {
+            break;
+        }
+        display->presentTimeline->advance();
+        bool stopped = false;
+        for (const auto& fence : signal.releaseFences) {
+            if (!waitFence(display, fence)) {
+                stopped = true;
+                break;
+            }
+        }
+        if (stopped) {
+            break;
+        }
+        display->releaseTimeline->advance();
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <utils/Timers.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "SyncTimeline.h"
+#include "include/IComposerHal.h"
+#include "include/IResourceManager.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Pipelined presentDisplay. The validated frame is handed to a per-display
+// commit thread and the client gets sw_sync fences back right away. Those
+// fences signal once the fences of the real hwc2 commit have signaled.
+// At most one frame per display is in flight. Only presentDisplay commands
+// take it, presentOrValidateDisplay stays synchronous as the client has to
+// learn from hwc2 whether the frame was presented or needs a validate.
+class PresentPipeline {
+  public:
+    // Called on the commit thread with the time from queuePresent to the end
+    // of the hwc2 presentDisplay.
+    using CommitCallback = std::function<void(int64_t display, nsecs_t latency)>;
+
+    PresentPipeline(IComposerHal* hal, IResourceManager* resources, CommitCallback onCommitted)
+          : mHal(hal), mResources(resources), mOnCommitted(std::move(onCommitted)) {}
+    ~PresentPipeline();
+
+    static bool isEnabled();
+
+    // Blocks until no commit is in flight for the display. Returns the time spent waiting.
+    nsecs_t waitIdle(int64_t display);
+    void waitIdleAll();
+    void removeDisplay(int64_t display);
+
+    // The error of a commit that failed since the last call, or 0. The
+    // client got fences and success for the frame long before.
+    int32_t takeCommitError(int64_t display);
+
+    // Returns false if the fences could not be allocated, the caller should
+    // present synchronously in that case.
+    bool queuePresent(int64_t display, const std::vector<int64_t>& releasedLayers,
+                      ndk::ScopedFileDescriptor* outPresentFence,
+                      std::vector<ndk::ScopedFileDescriptor>* outReleaseFences);
+
+  private:
+    struct Signal {
+        ::android::base::unique_fd presentFence;
+        std::vector<::android::base::unique_fd> releaseFences;
+    };
+
+    struct Display {
+        int64_t id;
+        std::unique_ptr<SyncTimeline> presentTimeline;
+        std::unique_ptr<SyncTimeline> releaseTimeline;
+        uint32_t queuedPoint = 0;
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool frameQueued = false;
+        bool commitPending = false;
+        bool stopping = false;
+        nsecs_t queueTime = 0;
+        std::deque<Signal> signals;
+        int32_t commitError = 0;
+        // of the frame on screen, only touched by the commit thread
+        ::android::base::unique_fd lastPresentFence;
+
+        std::thread commitThread;
+        std::thread signalThread;
+    };
+
+    Display* getOrCreateDisplay(int64_t display);
+    void stopDisplay(Display* display);
+    void commitLoop(Display* display);
+    void signalLoop(Display* display);
+    bool waitFence(Display* display, const ::android::base::unique_fd& fence);
+
+    IComposerHal* mHal;
+    IResourceManager* mResources;
+    CommitCallback mOnCommitted;
+
+    std::mutex mDisplaysMutex;
+    std::unordered_map<int64_t, std::unique_ptr<Display>> mDisplays;
+    // no sw_sync, every present is synchronous
+    bool mNoTimelines = false;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
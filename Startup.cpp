@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Startup.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+#include "ComposerCommandEngine.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+static std::atomic<nsecs_t> sStartupTime = 0;
+static std::atomic<bool> sPresented = false;
+
+void setStartupTime(nsecs_t time) {
+    sStartupTime = time;
+}
+
+size_t getPrefaultBudgetProperty() {
+    return static_cast<size_t>(
+                   ::android::base::GetIntProperty("vendor.hwc3.startup.prefault_mb", 32, 0,
+                                                   1024))
+            << 20;
+}
+
+bool getMlockProperty() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.startup.mlock", false);
+}
+
+namespace {
+
+struct Mapping {
+    uintptr_t start;
+    uintptr_t end;
+    // stacks are written to, code only read
+    bool stack;
+    // lower goes first
+    int priority;
+};
+
+// what of /proc/self/maps is worth faulting in, in the order to do it
+std::vector<Mapping> getHotMappings() {
+    std::vector<Mapping> mappings;
+    FILE* maps = fopen("/proc/self/maps", "re");
+    if (!maps) {
+        PLOG(ERROR) << __FUNCTION__ << ": failed to open /proc/self/maps";
+        return mappings;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), maps)) {
+        uintptr_t start, end;
+        char perms[5];
+        int pathOffset = 0;
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s %*s %*s %*s %n", &start, &end, perms,
+                   &pathOffset) < 3) {
+            continue;
+        }
+        std::string path = ::android::base::Trim(line + pathOffset);
+
+        if (perms[0] == 'r' && perms[1] == 'w' &&
+            (path == "[stack]" || ::android::base::StartsWith(path, "[anon:stack_and_tls:"))) {
+            // binder threads first, they run the frames
+            mappings.push_back({start, end, true, 0});
+        } else if (perms[0] == 'r' && perms[2] == 'x' && !path.empty() && path[0] == '/') {
+            // the service and hwc2 before the system libraries
+            const bool vendor = ::android::base::StartsWith(path, "/vendor/");
+            mappings.push_back({start, end, false, vendor ? 1 : 2});
+        }
+    }
+    fclose(maps);
+
+    std::stable_sort(mappings.begin(), mappings.end(),
+                     [](const Mapping& a, const Mapping& b) { return a.priority < b.priority; });
+    return mappings;
+}
+
+bool populate(const Mapping& mapping, size_t size, size_t pageSize) {
+    void* start = reinterpret_cast<void*>(mapping.start);
+    if (madvise(start, size, mapping.stack ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0) {
+        return true;
+    }
+    if (errno != EINVAL || mapping.stack) {
+        // a stack can only be faulted in by its thread before 5.14
+        return false;
+    }
+    // before 5.14, code is readable and reading it faults it in
+    for (size_t offset = 0; offset < size; offset += pageSize) {
+        (void)*reinterpret_cast<volatile const char*>(mapping.start + offset);
+    }
+    return true;
+}
+
+} // namespace
+
+size_t prefaultMemory(size_t budget, bool lock) {
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t faulted = 0;
+    size_t locked = 0;
+    for (const Mapping& mapping : getHotMappings()) {
+        if (faulted >= budget) {
+            break;
+        }
+        const size_t size = std::min(mapping.end - mapping.start, budget - faulted) /
+                pageSize * pageSize;
+        if (size == 0 || !populate(mapping, size, pageSize)) {
+            continue;
+        }
+        faulted += size;
+
+        if (lock) {
+            if (mlock(reinterpret_cast<void*>(mapping.start), size) == 0) {
+                locked += size;
+            } else {
+                PLOG(WARNING) << __FUNCTION__ << ": mlock failed after " << (locked >> 10)
+                              << "KB, see vendor.hwc3.startup.mlock";
+                lock = false;
+            }
+        }
+    }
+    LOG(INFO) << "startup: faulted in " << (faulted >> 10) << "KB, locked " << (locked >> 10)
+              << "KB";
+    return faulted;
+}
+
+void warmUpCommandEngine(IComposerHal* hal) {
+    const nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    auto resources = IResourceManager::create();
+    ComposerCommandEngine engine(hal, resources.get());
+    if (!engine.init()) {
+        LOG(ERROR) << __FUNCTION__ << ": failed to init the command engine";
+        return;
+    }
+
+    // unknown to the resources, every command fails before reaching the HAL
+    static constexpr int64_t kDisplay = -1;
+    static constexpr int kLayers = 8;
+    DisplayCommand command;
+    command.display = kDisplay;
+    for (int64_t layer = 0; layer < kLayers; ++layer) {
+        LayerCommand layerCommand;
+        layerCommand.layer = layer;
+        layerCommand.buffer = Buffer{.slot = 0};
+        command.layers.push_back(std::move(layerCommand));
+    }
+    ClientTarget clientTarget;
+    clientTarget.buffer.slot = 0;
+    command.clientTarget = std::move(clientTarget);
+    command.expectedPresentTime = ClockMonotonicTimestamp{start};
+
+    std::vector<DisplayCommand> commands;
+    commands.push_back(std::move(command));
+    std::vector<CommandResultPayload> results;
+    engine.execute(commands, &results);
+    engine.onDisplayRemoved(kDisplay);
+
+    LOG(INFO) << "startup: warmed up the command engine in "
+              << (systemTime(SYSTEM_TIME_MONOTONIC) - start) / 1000 << "us";
+}
+
+void logFirstPresent() {
+    if (sPresented.load(std::memory_order_relaxed) || sPresented.exchange(true)) {
+        return;
+    }
+    const nsecs_t startup = sStartupTime;
+    if (startup > 0) {
+        LOG(INFO) << "startup: first present "
+                  << ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - startup) << "ms after start";
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
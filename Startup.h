@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <utils/Timers.h>
+
+#include <stddef.h>
+
+#include "include/IComposerHal.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Startup of the service, so the first frames after boot or a restart do
+// not pay for page faults and lazy initialization at realtime priority.
+
+// when main() started, for the time to first present
+void setStartupTime(nsecs_t time);
+
+// vendor.hwc3.startup.prefault_mb, 0 turns prefaulting off
+size_t getPrefaultBudgetProperty();
+// vendor.hwc3.startup.mlock, needs CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK
+bool getMlockProperty();
+
+// Faults in the code of the process and the stacks of its threads, the
+// service's own code and the vendor libraries first, up to budget bytes.
+// Locks them into memory as well if lock is set. Returns the bytes faulted in.
+size_t prefaultMemory(size_t budget, bool lock);
+
+// Runs a synthetic frame through a throwaway command engine. The frame
+// targets a display that does not exist, so neither hwc2 nor the HAL state
+// see it, while the engine, the command writer and the allocator are warm.
+void warmUpCommandEngine(IComposerHal* hal);
+
+// after each present, logs the time from startup to the first one
+void logFirstPresent();
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
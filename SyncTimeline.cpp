@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SyncTimeline.h"
+
+#include <android-base/logging.h>
+#include <fcntl.h>
+#include <linux/types.h>
+#include <string.h>
+#include <sync/sync.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+
+// sw_sync uapi, see drivers/dma-buf/sw_sync.c
+struct sw_sync_create_fence_data {
+    __u32 value;
+    char name[32];
+    __s32 fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, __u32)
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+std::unique_ptr<SyncTimeline> SyncTimeline::create() {
+    static constexpr const char* kSwSyncPaths[] = {
+        "/dev/sw_sync",
+        "/sys/kernel/debug/sync/sw_sync",
+    };
+
+    for (auto path : kSwSyncPaths) {
+        ::android::base::unique_fd fd(open(path, O_RDWR | O_CLOEXEC));
+        if (fd.ok()) {
+            return std::unique_ptr<SyncTimeline>(new SyncTimeline(std::move(fd)));
+        }
+    }
+
+    LOG(ERROR) << "failed to open sw_sync: " << strerror(errno);
+    return nullptr;
+}
+
+::android::base::unique_fd SyncTimeline::createFence(const char* name, uint32_t point) {
+    struct sw_sync_create_fence_data data = {};
+    data.value = point;
+    strlcpy(data.name, name, sizeof(data.name));
+
+    if (ioctl(mFd.get(), SW_SYNC_IOC_CREATE_FENCE, &data) != 0) {
+        LOG(ERROR) << "failed to create sw_sync fence: " << strerror(errno);
+        return ::android::base::unique_fd();
+    }
+    return ::android::base::unique_fd(data.fence);
+}
+
+bool SyncTimeline::advance(uint32_t count) {
+    __u32 arg = count;
+    if (ioctl(mFd.get(), SW_SYNC_IOC_INC, &arg) != 0) {
+        LOG(ERROR) << "failed to advance sw_sync timeline: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+nsecs_t getFenceSignalTime(int fd) {
+    struct sync_file_info* info = sync_file_info(fd);
+    if (!info) {
+        return -1;
+    }
+    nsecs_t signalTime = -1;
+    if (info->status == 1) {
+        auto* fences = sync_get_fence_info(info);
+        for (uint32_t i = 0; i < info->num_fences; ++i) {
+            signalTime = std::max(signalTime, static_cast<nsecs_t>(fences[i].timestamp_ns));
+        }
+    }
+    sync_file_info_free(info);
+    return signalTime;
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <utils/Timers.h>
+
+#include <memory>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Wrapper of a kernel sw_sync timeline. Fences created on the timeline signal
+// once the timeline counter reaches their point. Closing the timeline signals
+// every fence that is still pending.
+class SyncTimeline {
+  public:
+    // Returns nullptr when the kernel has no sw_sync support (CONFIG_SW_SYNC).
+    static std::unique_ptr<SyncTimeline> create();
+    ~SyncTimeline() = default;
+
+    // Returns an invalid fd on failure.
+    ::android::base::unique_fd createFence(const char* name, uint32_t point);
+    bool advance(uint32_t count = 1);
+
+  private:
+    explicit SyncTimeline(::android::base::unique_fd fd) : mFd(std::move(fd)) {}
+
+    ::android::base::unique_fd mFd;
+};
+
+// Returns the CLOCK_MONOTONIC signal time of a sync fence, or -1 if it is still pending.
+nsecs_t getFenceSignalTime(int fd);
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -17,34 +17,44 @@
 #pragma once
 
 #include <android-base/logging.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <atomic>
+#include <optional>
 #include <string_view>
 #include <utils/Trace.h>
 #include <cutils/native_handle.h>
 
+#include "CallStats.h"
+
 // #define LOG_FUNC
 #define TRACE_FUNC
 
+// counts the calls of the function and their latency, see CallStats
+#define COUNT_FUNC(name)                        \
+    static CallStats __kCallStats__{name};      \
+    ScopedCallTimer _callTimer_(__kCallStats__)
+
 #ifdef TRACE_FUNC
 #define DEBUG_FUNC() constexpr static FullMethodName __kFullNameObj__ =                     \
                                            FullMethodName{ __PRETTY_FUNCTION__ };           \
                      constexpr static const char *__kFullName__ =  __kFullNameObj__.get();  \
+                     COUNT_FUNC(__kFullName__);                                             \
                      ATRACE_NAME(__kFullName__)
 
-#define DEBUG_DISPLAY_FUNC(display)                                                     \
-    constexpr static FullMethodName __kFullNameObj__{__PRETTY_FUNCTION__};              \
-    constexpr static const char *__kFullName__ = __kFullNameObj__.get();                \
-    if (CC_UNLIKELY(ATRACE_ENABLED())) {                                                \
-        ::android::String8 _traceName_;                                                 \
-        _traceName_.appendFormat("%s(display=%" PRId64 ",..)", __kFullName__, display); \
-        ATRACE_BEGIN(_traceName_.c_str());                                              \
-    }                                                                                   \
-    ScopedTraceEnder _traceEnder_
+#define DEBUG_DISPLAY_FUNC(display)                                        \
+    constexpr static FullMethodName __kFullNameObj__{__PRETTY_FUNCTION__}; \
+    constexpr static const char *__kFullName__ = __kFullNameObj__.get();   \
+    COUNT_FUNC(__kFullName__);                                             \
+    ScopedDisplayTrace _displayTrace_(__kFullName__, display)
 #else
 
 #ifdef LOG_FUNC
-#define DEBUG_DISPLAY_FUNC(display) DebugFunction _dbgFnObj_(__func__, display)
+#define DEBUG_DISPLAY_FUNC(display) \
+    COUNT_FUNC(__func__);           \
+    DebugFunction _dbgFnObj_(__func__, display)
 #else
-#define DEBUG_DISPLAY_FUNC(display)
+#define DEBUG_DISPLAY_FUNC(display) COUNT_FUNC(__func__)
 #endif
 
 #define DEBUG_FUNC() DEBUG_DISPLAY_FUNC(std::nullopt)
@@ -64,9 +74,70 @@
 
 namespace aidl::android::hardware::graphics::composer3::impl {
 
-class ScopedTraceEnder {
+// Traces a call for a display: a slice on the calling thread, and one on
+// the track of the display so the calls of each display line up. Both are
+// named by the constant function name and nothing is allocated.
+class ScopedDisplayTrace {
 public:
-    ~ScopedTraceEnder() { ATRACE_END(); }
+    ScopedDisplayTrace(const char *name, std::optional<int64_t> display) {
+        if (CC_LIKELY(!atrace_is_tag_enabled(kTag))) {
+            return;
+        }
+        mTraced = true;
+        atrace_begin(kTag, name);
+        if (display) {
+            mTrack = getTrack(*display);
+            mCookie = sCookie.fetch_add(1, std::memory_order_relaxed);
+            atrace_async_for_track_begin(kTag, mTrack, name, mCookie);
+        }
+    }
+
+    ~ScopedDisplayTrace() {
+        if (mTrack) {
+            atrace_async_for_track_end(kTag, mTrack, mCookie);
+        }
+        if (mTraced) {
+            atrace_end(kTag);
+        }
+    }
+
+private:
+    static constexpr uint64_t kTag = ATRACE_TAG_GRAPHICS | ATRACE_TAG_HAL;
+    // displays past the first few share kSharedTrack
+    static constexpr size_t kTracks = 8;
+
+    struct Track {
+        // display + 1 once claimed, 0 while free
+        std::atomic<uint64_t> id = 0;
+        std::atomic<bool> named = false;
+        char name[32];
+    };
+
+    // named the first time the display is traced
+    static const char *getTrack(int64_t display) {
+        static Track tracks[kTracks];
+        const uint64_t id = static_cast<uint64_t>(display) + 1;
+        for (Track &track : tracks) {
+            uint64_t current = track.id.load(std::memory_order_acquire);
+            if (current == 0 && track.id.compare_exchange_strong(current, id)) {
+                snprintf(track.name, sizeof(track.name), "hwc3 display %" PRId64, display);
+                track.named.store(true, std::memory_order_release);
+                return track.name;
+            }
+            if (current == id) {
+                // another thread may still be naming it
+                return track.named.load(std::memory_order_acquire) ? track.name : kSharedTrack;
+            }
+        }
+        return kSharedTrack;
+    }
+
+    static constexpr const char *kSharedTrack = "hwc3 displays";
+    static inline std::atomic<int32_t> sCookie = 0;
+
+    bool mTraced = false;
+    const char *mTrack = nullptr;
+    int32_t mCookie = 0;
 };
 
 class DebugFunction {
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BrightnessCoalescer.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <hardware/hwcomposer2.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <limits>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+nsecs_t BrightnessCoalescer::getDeadlineProperty() {
+    return ms2ns(::android::base::GetIntProperty("vendor.hwc3.brightness.deadline_ms", 20, 0,
+                                                 1000));
+}
+
+BrightnessCoalescer::BrightnessCoalescer(ApplyFn apply, nsecs_t deadline)
+      : mApply(std::move(apply)), mDeadline(deadline) {
+    if (mDeadline > 0) {
+        mThread = std::thread(&BrightnessCoalescer::deadlineLoop, this);
+    }
+}
+
+BrightnessCoalescer::~BrightnessCoalescer() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_one();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+int32_t BrightnessCoalescer::set(int64_t display, float brightness, nsecs_t now) {
+    if (mDeadline <= 0) {
+        std::lock_guard<std::mutex> applyLock(mApplyMutex);
+        return mApply(display, brightness);
+    }
+
+    bool armed = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRequested++;
+        auto [it, inserted] = mPending.try_emplace(display, Pending{brightness, now + mDeadline});
+        // the first deadline stays, a ramp without presents still moves
+        it->second.brightness = brightness;
+        armed = inserted;
+    }
+    if (armed) {
+        mCondition.notify_one();
+    }
+    return HWC2_ERROR_NONE;
+}
+
+void BrightnessCoalescer::flush(int64_t display) {
+    apply(display, true);
+}
+
+void BrightnessCoalescer::apply(int64_t display, bool atPresent) {
+    std::lock_guard<std::mutex> applyLock(mApplyMutex);
+    float brightness;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mPending.find(display);
+        if (it == mPending.end()) {
+            return;
+        }
+        brightness = it->second.brightness;
+        mPending.erase(it);
+    }
+
+    int32_t err = mApply(display, brightness);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (err != HWC2_ERROR_NONE) {
+        LOG(ERROR) << __func__ << ": display " << display << " brightness " << brightness
+                   << " err " << err;
+        mFailed++;
+    } else if (atPresent) {
+        mAppliedAtPresent++;
+    } else {
+        mAppliedAtDeadline++;
+    }
+}
+
+void BrightnessCoalescer::removeDisplay(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPending.erase(display);
+}
+
+void BrightnessCoalescer::deadlineLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mStopping) {
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t next = std::numeric_limits<nsecs_t>::max();
+        std::vector<int64_t> expired;
+        for (const auto& [display, pending] : mPending) {
+            if (pending.deadline <= now) {
+                expired.push_back(display);
+            } else {
+                next = std::min(next, pending.deadline);
+            }
+        }
+
+        if (!expired.empty()) {
+            lock.unlock();
+            for (int64_t display : expired) {
+                apply(display, false);
+            }
+            lock.lock();
+        } else if (next == std::numeric_limits<nsecs_t>::max()) {
+            mCondition.wait(lock);
+        } else {
+            mCondition.wait_for(lock, std::chrono::nanoseconds(next - now));
+        }
+    }
+}
+
+void BrightnessCoalescer::dump(std::string* output) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    const uint64_t applied = mAppliedAtPresent + mAppliedAtDeadline;
+    ::android::base::StringAppendF(output,
+                                   "\nhwc3 display brightness: deadline %.0fms, requested=%" PRIu64
+                                   " applied at present=%" PRIu64 " at deadline=%" PRIu64
+                                   " dropped=%" PRIu64 " failed=%" PRIu64 " pending=%zu\n",
+                                   mDeadline / 1e6, mRequested, mAppliedAtPresent,
+                                   mAppliedAtDeadline,
+                                   mRequested - applied - mFailed - mPending.size(), mFailed,
+                                   mPending.size());
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
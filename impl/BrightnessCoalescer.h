@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Holds display brightness changes until the next present of the display, so
+// the backlight changes along with the frame it belongs to. Several values
+// set within a frame, as a brightness animation does, end up as one write of
+// the last. Without a present the value is applied once the deadline passes.
+class BrightnessCoalescer {
+  public:
+    // Applies brightness to the display, returns an HWC2_ERROR_* code.
+    using ApplyFn = std::function<int32_t(int64_t display, float brightness)>;
+
+    // vendor.hwc3.brightness.deadline_ms, 0 applies every value at once
+    static nsecs_t getDeadlineProperty();
+
+    BrightnessCoalescer(ApplyFn apply, nsecs_t deadline);
+    ~BrightnessCoalescer();
+
+    BrightnessCoalescer(const BrightnessCoalescer&) = delete;
+    BrightnessCoalescer& operator=(const BrightnessCoalescer&) = delete;
+
+    // replaces what is pending for the display
+    int32_t set(int64_t display, float brightness, nsecs_t now);
+    // applies what is pending for the display, right before its present
+    void flush(int64_t display);
+    void removeDisplay(int64_t display);
+
+    void dump(std::string* output);
+
+  private:
+    struct Pending {
+        float brightness;
+        // applied by then without a present
+        nsecs_t deadline;
+    };
+
+    // writes what is pending for the display, if anything
+    void apply(int64_t display, bool atPresent);
+    void deadlineLoop();
+
+    const ApplyFn mApply;
+    const nsecs_t mDeadline;
+
+    // one write at a time and in order, taken before mMutex
+    std::mutex mApplyMutex;
+    std::mutex mMutex;
+    std::map<int64_t, Pending> mPending GUARDED_BY(mMutex);
+    uint64_t mRequested GUARDED_BY(mMutex) = 0;
+    uint64_t mAppliedAtPresent GUARDED_BY(mMutex) = 0;
+    uint64_t mAppliedAtDeadline GUARDED_BY(mMutex) = 0;
+    uint64_t mFailed GUARDED_BY(mMutex) = 0;
+
+    std::condition_variable mCondition;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    std::thread mThread;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
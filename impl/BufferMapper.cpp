@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BufferMapper.h"
+
+#include <android-base/logging.h>
+#include <hardware/gralloc.h>
+#include <ui/GraphicBufferMapper.h>
+#include <unistd.h>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+MappedBuffer::MappedBuffer(buffer_handle_t handle, bool write, int acquireFence)
+      : mHandle(handle) {
+    auto& mapper = ::android::GraphicBufferMapper::get();
+    uint64_t width = 0;
+    uint64_t height = 0;
+    ::android::ui::PixelFormat format;
+    if (!handle || mapper.getWidth(handle, &width) != ::android::OK ||
+        mapper.getHeight(handle, &height) != ::android::OK ||
+        mapper.getPixelFormatRequested(handle, &format) != ::android::OK) {
+        LOG(ERROR) << "failed to query buffer " << handle;
+        if (acquireFence >= 0) {
+            close(acquireFence);
+        }
+        return;
+    }
+
+    uint32_t usage = GRALLOC_USAGE_SW_READ_OFTEN;
+    if (write) {
+        usage |= GRALLOC_USAGE_SW_WRITE_OFTEN;
+    }
+    ::android::Rect bounds(static_cast<int32_t>(width), static_cast<int32_t>(height));
+    mBuffer.width = static_cast<uint32_t>(width);
+    mBuffer.height = static_cast<uint32_t>(height);
+    mBuffer.format = static_cast<int32_t>(format);
+
+    // the lock owns the fence from here on
+    if (SoftwareCompositor::isYuvFormat(mBuffer.format)) {
+        android_ycbcr ycbcr = {};
+        if (mapper.lockAsyncYCbCr(handle, usage, bounds, &ycbcr, acquireFence) !=
+            ::android::OK) {
+            LOG(ERROR) << "failed to lock buffer " << handle;
+            return;
+        }
+        mLocked = true;
+        mBuffer.data = static_cast<uint8_t*>(ycbcr.y);
+        mBuffer.stride = static_cast<uint32_t>(ycbcr.ystride);
+        mBuffer.cb = static_cast<uint8_t*>(ycbcr.cb);
+        mBuffer.cr = static_cast<uint8_t*>(ycbcr.cr);
+        mBuffer.chromaStride = static_cast<uint32_t>(ycbcr.cstride);
+        mBuffer.chromaStep = static_cast<uint32_t>(ycbcr.chroma_step);
+        return;
+    }
+
+    void* data = nullptr;
+    int32_t bytesPerPixel = -1;
+    int32_t bytesPerStride = -1;
+    if (mapper.lockAsync(handle, usage, bounds, &data, acquireFence, &bytesPerPixel,
+                         &bytesPerStride) != ::android::OK) {
+        LOG(ERROR) << "failed to lock buffer " << handle;
+        return;
+    }
+    mLocked = true;
+    if (bytesPerStride <= 0) {
+        LOG(ERROR) << "gralloc did not report the stride of buffer " << handle;
+        return;
+    }
+
+    mBuffer.data = static_cast<uint8_t*>(data);
+    mBuffer.stride = static_cast<uint32_t>(bytesPerStride);
+}
+
+MappedBuffer::~MappedBuffer() {
+    if (mLocked) {
+        ::android::GraphicBufferMapper::get().unlock(mHandle);
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cutils/native_handle.h>
+
+#include "SoftwareCompositor.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Keeps a gralloc buffer locked for CPU access while in scope.
+class MappedBuffer {
+  public:
+    // Takes ownership of acquireFence, the lock waits for it.
+    MappedBuffer(buffer_handle_t handle, bool write, int acquireFence = -1);
+    ~MappedBuffer();
+
+    MappedBuffer(const MappedBuffer&) = delete;
+    MappedBuffer& operator=(const MappedBuffer&) = delete;
+
+    bool isValid() const { return mLocked && mBuffer.data; }
+    const SwBuffer& get() const { return mBuffer; }
+
+  private:
+    buffer_handle_t mHandle;
+    bool mLocked = false;
+    SwBuffer mBuffer;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DispatchFn.h"
+
+#ifdef HWC3_DISPATCH_STATS
+
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+#include <cinttypes>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+const bool DispatchStats::sTracing =
+        ::android::base::GetBoolProperty("vendor.hwc3.dispatch.trace", false);
+
+void DispatchStats::init(hwc2_function_descriptor_t descriptor) {
+    mDescriptor = descriptor;
+    mName = getFunctionDescriptorName(descriptor);
+}
+
+DispatchStats::Slot& DispatchStats::getSlot(uint64_t display) {
+    if (display == kNoDisplay) {
+        return mDevice;
+    }
+    // claimed for good, displays come and go far less than kDisplays
+    const uint64_t id = display + 1;
+    for (Slot& slot : mDisplays) {
+        uint64_t current = slot.id.load(std::memory_order_relaxed);
+        if (current == 0 &&
+            slot.id.compare_exchange_strong(current, id, std::memory_order_relaxed)) {
+            return slot;
+        }
+        // current is whoever has the slot, maybe the display itself
+        if (current == id) {
+            return slot;
+        }
+    }
+    return mDisplays.back();
+}
+
+void DispatchStats::record(uint64_t display, nsecs_t duration) {
+    Slot& slot = getSlot(display);
+    slot.calls.fetch_add(1, std::memory_order_relaxed);
+    slot.total.fetch_add(duration, std::memory_order_relaxed);
+    nsecs_t max = slot.max.load(std::memory_order_relaxed);
+    while (duration > max &&
+           !slot.max.compare_exchange_weak(max, duration, std::memory_order_relaxed)) {
+    }
+}
+
+void DispatchStats::reset() {
+    auto clear = [](Slot& slot) {
+        slot.calls.store(0, std::memory_order_relaxed);
+        slot.total.store(0, std::memory_order_relaxed);
+        slot.max.store(0, std::memory_order_relaxed);
+    };
+    clear(mDevice);
+    for (Slot& slot : mDisplays) {
+        clear(slot);
+    }
+}
+
+void DispatchStats::dump(std::string* output) const {
+    auto dumpSlot = [this, output](const Slot& slot, const char* display) {
+        const uint64_t calls = slot.calls.load(std::memory_order_relaxed);
+        if (!calls) {
+            return;
+        }
+        ::android::base::StringAppendF(output,
+                                       "  %s(%d) %s: calls=%" PRIu64 " avg=%.3fms max=%.3fms\n",
+                                       mName, mDescriptor, display, calls,
+                                       slot.total.load(std::memory_order_relaxed) / 1e6 / calls,
+                                       slot.max.load(std::memory_order_relaxed) / 1e6);
+    };
+    dumpSlot(mDevice, "device");
+    for (size_t i = 0; i < kDisplays; ++i) {
+        const uint64_t id = mDisplays[i].id.load(std::memory_order_relaxed);
+        if (id == 0) {
+            break;
+        }
+        std::string display = ::android::base::StringPrintf("display %" PRIu64 "%s", id - 1,
+                                                            i == kDisplays - 1 ? " and later" : "");
+        dumpSlot(mDisplays[i], display.c_str());
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
+
+#endif // HWC3_DISPATCH_STATS
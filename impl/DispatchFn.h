@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cutils/trace.h>
+#include <hardware/hwcomposer2.h>
+#include <utils/Timers.h>
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+#ifdef HWC3_DISPATCH_STATS
+
+// Calls of one hwc2 function, per display.
+class DispatchStats {
+  public:
+    // displays past the first few share the last slot
+    static constexpr size_t kDisplays = 8;
+
+    void init(hwc2_function_descriptor_t descriptor);
+    void reset();
+    void dump(std::string* output) const;
+
+  protected:
+    static constexpr uint64_t kNoDisplay = ~uint64_t(0);
+
+    // around each call, display is kNoDisplay for device functions
+    nsecs_t begin() const {
+        if (sTracing) {
+            atrace_begin(ATRACE_TAG_GRAPHICS | ATRACE_TAG_HAL, mName);
+        }
+        return systemTime(SYSTEM_TIME_MONOTONIC);
+    }
+    void end(uint64_t display, nsecs_t start) {
+        record(display, systemTime(SYSTEM_TIME_MONOTONIC) - start);
+        if (sTracing) {
+            atrace_end(ATRACE_TAG_GRAPHICS | ATRACE_TAG_HAL);
+        }
+    }
+
+  private:
+    struct Slot {
+        // display + 1, 0 while free
+        std::atomic<uint64_t> id = 0;
+        std::atomic<uint64_t> calls = 0;
+        std::atomic<nsecs_t> total = 0;
+        std::atomic<nsecs_t> max = 0;
+    };
+    Slot& getSlot(uint64_t display);
+    void record(uint64_t display, nsecs_t duration);
+
+    hwc2_function_descriptor_t mDescriptor = HWC2_FUNCTION_INVALID;
+    const char* mName = "";
+    Slot mDevice;
+    std::array<Slot, kDisplays> mDisplays;
+
+    // vendor.hwc3.dispatch.trace, a trace slice per call
+    static const bool sTracing;
+};
+
+template <typename Pfn>
+class DispatchFn;
+
+// Stands in for the hwc2 function pointer and times every call through it.
+// Calls, null checks and assignments look the same as with the pointer.
+template <typename Ret, typename... Args>
+class DispatchFn<Ret (*)(hwc2_device_t*, Args...)> : public DispatchStats {
+  public:
+    using Pfn = Ret (*)(hwc2_device_t*, Args...);
+
+    DispatchFn& operator=(Pfn pfn) {
+        mPfn = pfn;
+        return *this;
+    }
+    explicit operator bool() const { return mPfn != nullptr; }
+
+    Ret operator()(hwc2_device_t* device, Args... args) {
+        Timer timer(this, getDisplay(args...));
+        return mPfn(device, args...);
+    }
+
+  private:
+    class Timer {
+      public:
+        Timer(DispatchFn* fn, uint64_t display) : mFn(fn), mDisplay(display), mStart(fn->begin()) {}
+        ~Timer() { mFn->end(mDisplay, mStart); }
+
+      private:
+        DispatchFn* const mFn;
+        const uint64_t mDisplay;
+        const nsecs_t mStart;
+    };
+
+    // the display functions take it right after the device
+    static uint64_t getDisplay() { return kNoDisplay; }
+    template <typename First, typename... Rest>
+    static uint64_t getDisplay(First first, Rest...) {
+        if constexpr (std::is_same_v<First, hwc2_display_t>) {
+            return first;
+        } else {
+            return kNoDisplay;
+        }
+    }
+
+    Pfn mPfn = nullptr;
+};
+
+#else
+
+// the plain function pointer, nothing to pay
+template <typename Pfn>
+using DispatchFn = Pfn;
+
+#endif
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
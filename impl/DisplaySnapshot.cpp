@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DisplaySnapshot.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <type_traits>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+static constexpr uint32_t kMagic = 0x33637768; // "hwc3"
+// bump with any change to the layout below
+static constexpr uint32_t kVersion = 1;
+// what is in a file is read whole, anything larger is not a snapshot
+static constexpr uint32_t kMaxSize = 1 << 20;
+// changes within this long of each other are written once
+static constexpr nsecs_t kWriteDelay = 200'000'000;
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t checksum;
+};
+
+// FNV-1a
+static uint32_t checksum(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+namespace {
+
+class Writer {
+  public:
+    template <typename T>
+    void put(T value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        mData.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    void put(const std::string& value) {
+        put(static_cast<uint32_t>(value.size()));
+        mData.append(value);
+    }
+    template <typename T>
+    void put(const std::vector<T>& values) {
+        put(static_cast<uint32_t>(values.size()));
+        for (const T& value : values) {
+            put(value);
+        }
+    }
+    std::string& data() { return mData; }
+
+  private:
+    std::string mData;
+};
+
+// any read past the end fails all later ones
+class Reader {
+  public:
+    Reader(const char* data, size_t size) : mPos(data), mEnd(data + size) {}
+
+    template <typename T>
+    bool get(T* value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (!take(sizeof(T))) {
+            return false;
+        }
+        memcpy(value, mPos - sizeof(T), sizeof(T));
+        return true;
+    }
+    bool get(std::string* value) {
+        uint32_t size;
+        if (!get(&size) || !take(size)) {
+            return false;
+        }
+        value->assign(mPos - size, size);
+        return true;
+    }
+    template <typename T>
+    bool get(std::vector<T>* values) {
+        uint32_t count;
+        if (!get(&count) || count > remaining()) {
+            return false;
+        }
+        values->resize(count);
+        for (T& value : *values) {
+            if (!get(&value)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool done() const { return mOk && mPos == mEnd; }
+
+  private:
+    size_t remaining() const { return static_cast<size_t>(mEnd - mPos); }
+    bool take(size_t size) {
+        mOk = mOk && size <= remaining();
+        if (mOk) {
+            mPos += size;
+        }
+        return mOk;
+    }
+
+    const char* mPos;
+    const char* const mEnd;
+    bool mOk = true;
+};
+
+} // namespace
+
+bool DisplaySnapshot::Attribute::operator==(const Attribute& other) const {
+    return error == other.error && value == other.value;
+}
+
+bool DisplaySnapshot::Config::operator==(const Config& other) const {
+    return id == other.id && std::equal(std::begin(attributes), std::end(attributes),
+                                        std::begin(other.attributes));
+}
+
+bool DisplaySnapshot::Display::operator==(const Display& other) const {
+    return id == other.id && name == other.name && activeConfig == other.activeConfig &&
+            vsyncPeriod == other.vsyncPeriod && connectionType == other.connectionType &&
+            identificationError == other.identificationError &&
+            identificationPort == other.identificationPort &&
+            identification == other.identification &&
+            capabilitiesError == other.capabilitiesError && capabilities == other.capabilities &&
+            configs == other.configs;
+}
+
+const DisplaySnapshot::Attribute* DisplaySnapshot::Display::findAttribute(
+        int32_t config, int32_t attribute) const {
+    const int32_t* attr = std::find(std::begin(kAttributes), std::end(kAttributes), attribute);
+    if (attr == std::end(kAttributes)) {
+        return nullptr;
+    }
+    for (const Config& c : configs) {
+        if (c.id == config) {
+            return &c.attributes[attr - std::begin(kAttributes)];
+        }
+    }
+    return nullptr;
+}
+
+bool DisplaySnapshot::isEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.snapshot.enable", true);
+}
+
+std::string DisplaySnapshot::getPathProperty() {
+    return ::android::base::GetProperty("vendor.hwc3.snapshot.path", "/dev/hwc3/displays");
+}
+
+const DisplaySnapshot::Display* DisplaySnapshot::findDisplay(int64_t display) const {
+    for (const Display& d : displays) {
+        if (d.id == display) {
+            return &d;
+        }
+    }
+    return nullptr;
+}
+
+std::string DisplaySnapshot::serialize() const {
+    Writer writer;
+    writer.put(Header{});
+    writer.put(capabilities);
+    writer.put(static_cast<uint32_t>(metadataKeys.size()));
+    for (const MetadataKey& key : metadataKeys) {
+        writer.put(key.name);
+        writer.put(static_cast<uint8_t>(key.mandatory));
+    }
+    writer.put(static_cast<uint32_t>(displays.size()));
+    for (const Display& display : displays) {
+        writer.put(display.id);
+        writer.put(display.name);
+        writer.put(display.activeConfig);
+        writer.put(display.vsyncPeriod);
+        writer.put(display.connectionType);
+        writer.put(display.identificationError);
+        writer.put(display.identificationPort);
+        writer.put(display.identification);
+        writer.put(display.capabilitiesError);
+        writer.put(display.capabilities);
+        writer.put(display.configs);
+    }
+
+    std::string& data = writer.data();
+    Header header = {
+            .magic = kMagic,
+            .version = kVersion,
+            .size = static_cast<uint32_t>(data.size() - sizeof(Header)),
+            .checksum = checksum(data.data() + sizeof(Header), data.size() - sizeof(Header)),
+    };
+    memcpy(data.data(), &header, sizeof(header));
+    return std::move(data);
+}
+
+std::optional<DisplaySnapshot> DisplaySnapshot::parse(const std::string& data) {
+    Header header;
+    if (data.size() < sizeof(header)) {
+        return std::nullopt;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    const char* payload = data.data() + sizeof(header);
+    if (header.magic != kMagic || header.version != kVersion ||
+        header.size != data.size() - sizeof(header) ||
+        header.checksum != checksum(payload, header.size)) {
+        return std::nullopt;
+    }
+
+    DisplaySnapshot snapshot;
+    Reader reader(payload, header.size);
+    uint32_t count;
+    if (!reader.get(&snapshot.capabilities) || !reader.get(&count)) {
+        return std::nullopt;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        MetadataKey key;
+        uint8_t mandatory;
+        if (!reader.get(&key.name) || !reader.get(&mandatory)) {
+            return std::nullopt;
+        }
+        key.mandatory = mandatory != 0;
+        snapshot.metadataKeys.push_back(std::move(key));
+    }
+    if (!reader.get(&count)) {
+        return std::nullopt;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        Display display;
+        if (!reader.get(&display.id) || !reader.get(&display.name) ||
+            !reader.get(&display.activeConfig) || !reader.get(&display.vsyncPeriod) ||
+            !reader.get(&display.connectionType) || !reader.get(&display.identificationError) ||
+            !reader.get(&display.identificationPort) || !reader.get(&display.identification) ||
+            !reader.get(&display.capabilitiesError) || !reader.get(&display.capabilities) ||
+            !reader.get(&display.configs)) {
+            return std::nullopt;
+        }
+        snapshot.displays.push_back(std::move(display));
+    }
+    if (!reader.done()) {
+        return std::nullopt;
+    }
+    return snapshot;
+}
+
+std::optional<DisplaySnapshot> DisplaySnapshot::load(const std::string& path) {
+    std::string data;
+    if (!::android::base::ReadFileToString(path, &data)) {
+        if (errno != ENOENT) {
+            PLOG(WARNING) << __FUNCTION__ << ": failed to read " << path;
+        }
+        return std::nullopt;
+    }
+    auto snapshot = data.size() <= kMaxSize ? parse(data) : std::nullopt;
+    if (!snapshot) {
+        LOG(WARNING) << __FUNCTION__ << ": ignoring the damaged or outdated " << path;
+        remove(path);
+    }
+    return snapshot;
+}
+
+bool DisplaySnapshot::save(const std::string& path, size_t* outSize) const {
+    const std::string data = serialize();
+    *outSize = data.size();
+    const std::string temp = path + ".tmp";
+    if (!::android::base::WriteStringToFile(data, temp)) {
+        PLOG(ERROR) << __FUNCTION__ << ": failed to write " << temp;
+        return false;
+    }
+    if (rename(temp.c_str(), path.c_str())) {
+        PLOG(ERROR) << __FUNCTION__ << ": failed to rename " << temp;
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void DisplaySnapshot::remove(const std::string& path) {
+    if (unlink(path.c_str()) && errno != ENOENT) {
+        PLOG(ERROR) << __FUNCTION__ << ": failed to remove " << path;
+    }
+}
+
+DisplaySnapshotWriter::DisplaySnapshotWriter(std::string path, CaptureFn capture)
+      : mPath(std::move(path)), mCapture(std::move(capture)) {
+    mThread = std::thread(&DisplaySnapshotWriter::writeLoop, this);
+}
+
+DisplaySnapshotWriter::~DisplaySnapshotWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+void DisplaySnapshotWriter::schedule() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mDeadline != 0) {
+            return;
+        }
+        mDeadline = systemTime(SYSTEM_TIME_MONOTONIC) + kWriteDelay;
+    }
+    mCondition.notify_one();
+}
+
+void DisplaySnapshotWriter::writeLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mStopping) {
+        if (mDeadline == 0) {
+            mCondition.wait(lock);
+            continue;
+        }
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (now < mDeadline) {
+            mCondition.wait_for(lock, std::chrono::nanoseconds(mDeadline - now));
+            continue;
+        }
+        // a change from here on is written again
+        mDeadline = 0;
+        lock.unlock();
+
+        // captured through the HAL, which may take a while
+        DisplaySnapshot snapshot;
+        size_t size = 0;
+        const bool captured = mCapture(&snapshot);
+        const bool saved = captured && snapshot.save(mPath, &size);
+
+        lock.lock();
+        if (!captured) {
+            continue;
+        }
+        if (saved) {
+            mWrites++;
+            mLastSize = size;
+            mLastWrite = systemTime(SYSTEM_TIME_MONOTONIC);
+        } else {
+            mFailures++;
+        }
+    }
+}
+
+void DisplaySnapshotWriter::dump(std::string* output) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    ::android::base::StringAppendF(output,
+                                   "  %s: writes=%" PRIu64 " failed=%" PRIu64
+                                   " last=%zu bytes %.1fs ago%s\n",
+                                   mPath.c_str(), mWrites, mFailures, mLastSize,
+                                   mLastWrite ? (systemTime(SYSTEM_TIME_MONOTONIC) - mLastWrite) / 1e9
+                                              : 0.0,
+                                   mDeadline ? ", write pending" : "");
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
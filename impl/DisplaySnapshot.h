@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// What the client asks about the displays right after it connects: the
+// topology, configs, active configs and capabilities. It is kept in a tmpfs
+// file, so it lasts across a restart of the service but not of the device,
+// and answers those questions while hwc2 comes up again.
+//
+// Values are kept as the HWC2_ERROR_* code and value the HAL returned for
+// them, in the integer form of the aidl types.
+struct DisplaySnapshot {
+    struct Attribute {
+        int32_t error;
+        int32_t value;
+        bool operator==(const Attribute& other) const;
+    };
+    // WIDTH, HEIGHT, VSYNC_PERIOD, DPI_X, DPI_Y, CONFIG_GROUP
+    static constexpr int32_t kAttributes[] = {1, 2, 3, 4, 5, 7};
+    static constexpr size_t kAttributeCount = std::size(kAttributes);
+
+    struct Config {
+        int32_t id;
+        Attribute attributes[kAttributeCount];
+        bool operator==(const Config& other) const;
+    };
+
+    struct Display {
+        int64_t id;
+        std::string name;
+        int32_t activeConfig;
+        Attribute vsyncPeriod;
+        Attribute connectionType;
+        int32_t identificationError;
+        uint8_t identificationPort;
+        std::vector<uint8_t> identification;
+        int32_t capabilitiesError;
+        std::vector<int32_t> capabilities;
+        std::vector<Config> configs;
+
+        // null if the attribute is not in kAttributes
+        const Attribute* findAttribute(int32_t config, int32_t attribute) const;
+        bool operator==(const Display& other) const;
+        bool operator!=(const Display& other) const { return !(*this == other); }
+    };
+
+    struct MetadataKey {
+        std::string name;
+        bool mandatory;
+    };
+
+    std::vector<int32_t> capabilities;
+    std::vector<MetadataKey> metadataKeys;
+    std::vector<Display> displays;
+
+    // vendor.hwc3.snapshot.enable
+    static bool isEnabled();
+    // vendor.hwc3.snapshot.path, /dev is tmpfs
+    static std::string getPathProperty();
+
+    // nullopt if there is no file or it is damaged or of another version
+    static std::optional<DisplaySnapshot> load(const std::string& path);
+    // replaces the file at once, a crash never leaves half of it behind
+    bool save(const std::string& path, size_t* outSize) const;
+    static void remove(const std::string& path);
+
+    const Display* findDisplay(int64_t display) const;
+
+    std::string serialize() const;
+    static std::optional<DisplaySnapshot> parse(const std::string& data);
+};
+
+// Keeps the snapshot file up to date. The HAL calls schedule() when something
+// in it may have changed; the snapshot is captured and written on a thread of
+// its own a moment later, so a burst of hotplugs is written once.
+class DisplaySnapshotWriter {
+  public:
+    // false if there is nothing worth saving yet
+    using CaptureFn = std::function<bool(DisplaySnapshot* outSnapshot)>;
+
+    DisplaySnapshotWriter(std::string path, CaptureFn capture);
+    ~DisplaySnapshotWriter();
+
+    DisplaySnapshotWriter(const DisplaySnapshotWriter&) = delete;
+    DisplaySnapshotWriter& operator=(const DisplaySnapshotWriter&) = delete;
+
+    void schedule();
+
+    void dump(std::string* output);
+
+  private:
+    void writeLoop();
+
+    const std::string mPath;
+    const CaptureFn mCapture;
+
+    std::mutex mMutex;
+    // written by then, 0 if nothing is scheduled
+    nsecs_t mDeadline GUARDED_BY(mMutex) = 0;
+    uint64_t mWrites GUARDED_BY(mMutex) = 0;
+    uint64_t mFailures GUARDED_BY(mMutex) = 0;
+    size_t mLastSize GUARDED_BY(mMutex) = 0;
+    nsecs_t mLastWrite GUARDED_BY(mMutex) = 0;
+
+    std::condition_variable mCondition;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    std::thread mThread;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -18,6 +18,12 @@
 
 #include <aidl/android/hardware/graphics/composer3/IComposerCallback.h>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+#include <map>
+#include <set>
+#include <tuple>
 
 #include "TranslateHwcAidl.h"
 #include "Util.h"
@@ -61,6 +67,14 @@ static const hw_module_t* loadModule() {
 }
 
 std::unique_ptr<IComposerHal> IComposerHal::create() {
+    if (DisplaySnapshot::isEnabled()) {
+        if (auto snapshot = DisplaySnapshot::load(DisplaySnapshot::getPathProperty())) {
+            auto hal = std::make_unique<HalImpl>();
+            hal->initWithSnapshot(std::move(*snapshot));
+            return hal;
+        }
+    }
+
     const hw_module_t* module = loadModule();
     if (!module) {
         return nullptr;
@@ -83,6 +97,13 @@ void hotplug(hwc2_callback_data_t callbackData, hwc2_display_t hwcDisplay,
     int64_t display;
 
     h2a::translate(hwcDisplay, display);
+    hal->invalidateClientTargetProperty(display);
+    if (connected != HWC2_CONNECTION_CONNECTED) {
+        hal->onDisplayDisconnected(display);
+    }
+    if (!hal->onDisplayHotplug(display, connected == HWC2_CONNECTION_CONNECTED)) {
+        return;
+    }
     hal->getEventCallback()->onHotplug(display, connected == HWC2_CONNECTION_CONNECTED);
 }
 
@@ -135,11 +156,23 @@ void seamlessPossible(hwc2_callback_data_t callbackData, hwc2_display_t hwcDispl
 
 } // nampesapce hook
 
+HalImpl::~HalImpl() {
+    if (mDeviceThread.joinable()) {
+        mDeviceThread.join();
+    }
+    // captures through this
+    mSnapshotWriter.reset();
+}
+
 bool HalImpl::initWithDevice(hwc2_device_t* device, bool requireReliablePresentFence) {
     // we own the device from this point on
     mDevice = device;
 
-    initCaps();
+    if (!initCaps()) {
+        mDevice->common.close(&mDevice->common);
+        mDevice = nullptr;
+        return false;
+    }
     if (requireReliablePresentFence &&
         hasCapability(Capability::PRESENT_FENCE_IS_NOT_RELIABLE)) {
         ALOGE("present fence must be reliable");
@@ -154,23 +187,379 @@ bool HalImpl::initWithDevice(hwc2_device_t* device, bool requireReliablePresentF
         return false;
     }
 
+    if (!initLayerGenericMetadataKeys()) {
+        mDevice->common.close(&mDevice->common);
+        mDevice = nullptr;
+        return false;
+    }
+    initOverlaySupport();
+    if (!mDispatch.setReadbackBuffer && SoftwareReadback::isEnabled()) {
+        ALOGI("no writeback connector, readback is composed on the CPU");
+        mSoftwareReadback = std::make_unique<SoftwareReadback>();
+    }
+    if (uint32_t frames = LayerSquasher::getStaticFramesProperty()) {
+        ALOGI("layers unchanged for %u frames are squashed into the client target", frames);
+        mLayerSquasher = std::make_unique<LayerSquasher>(frames);
+    }
+    if (mDispatch.setDisplayBrightness) {
+        mBrightnessCoalescer = std::make_unique<BrightnessCoalescer>(
+                [this](int64_t display, float brightness) {
+                    return mDispatch.setDisplayBrightness(mDevice, display, brightness);
+                },
+                BrightnessCoalescer::getDeadlineProperty());
+    }
+    if (RefreshRateController::isEnabled()) {
+        ALOGI("refresh rate follows the content below the client's config");
+        mRefreshRateController = std::make_unique<RefreshRateController>(
+                [this](int64_t display, int32_t config, nsecs_t now) {
+                    return switchRefreshRate(display, config, now);
+                },
+                RefreshRateController::getIdleTimeoutProperty());
+    }
+    if (mDispatch.getMaxVirtualDisplayCount(mDevice) == 0 &&
+        SoftwareVirtualDisplay::isEnabled()) {
+        ALOGI("no hwc2 virtual displays, composing them on the CPU");
+        mSoftwareVirtualDisplay = true;
+        int threads = ::android::base::GetIntProperty("vendor.hwc3.virtual.threads", 2);
+        mVirtualDisplayPool =
+                std::make_unique<WorkerPool>(std::max(threads, 0), "hwc3VirtualDisplay");
+        // the display index has DISPLAYID_MASK_LEN bits
+        mMaxVirtualDisplays = static_cast<uint32_t>(
+                ::android::base::GetIntProperty("vendor.hwc3.virtual.max_count", 16, 1,
+                                                (1 << DISPLAYID_MASK_LEN) - 1));
+    }
+    if (DisplaySnapshot::isEnabled()) {
+        mSnapshotWriter = std::make_unique<DisplaySnapshotWriter>(
+                DisplaySnapshot::getPathProperty(),
+                [this](DisplaySnapshot* snapshot) { return captureSnapshot(snapshot); });
+    }
     return true;
 }
 
-void HalImpl::initCaps() {
+void HalImpl::initWithSnapshot(DisplaySnapshot snapshot) {
+    mSnapshot = std::make_unique<const DisplaySnapshot>(std::move(snapshot));
+    for (int32_t cap : mSnapshot->capabilities) {
+        mCaps.insert(static_cast<Capability>(cap));
+    }
+    for (const auto& key : mSnapshot->metadataKeys) {
+        mLayerGenericMetadataKeys.push_back({key.name, key.mandatory});
+    }
+    mServingSnapshot = true;
+    mDeviceReady = false;
+    mSnapshotServed = systemTime(SYSTEM_TIME_MONOTONIC);
+    ALOGI("serving %zu displays from the snapshot while hwc2 starts",
+          mSnapshot->displays.size());
+    mDeviceThread = std::thread(&HalImpl::initDeviceForSnapshot, this);
+}
+
+void HalImpl::initDeviceForSnapshot() {
+    const hw_module_t* module = loadModule();
+    bool adapted = false;
+    hwc2_device_t* device = module ? openDeviceWithAdapter(module, &adapted) : nullptr;
+    if (!device || !initWithDevice(device, !adapted)) {
+        // the client saw a state this hwc2 can not serve, start over without it
+        DisplaySnapshot::remove(DisplaySnapshot::getPathProperty());
+        LOG(FATAL) << "failed to start hwc2 behind the display snapshot";
+    }
+    // hwc2 answers the queries from here on, the rest waits for its callbacks
+    mServingSnapshot = false;
+
+    std::lock_guard<std::mutex> lock(mDeviceMutex);
+    if (mEventCallback) {
+        registerHwcCallbacks();
+        checkSnapshotDisplays();
+    }
+    mSnapshotDeviceReady = systemTime(SYSTEM_TIME_MONOTONIC);
+    ALOGI("hwc2 up %.1fms after serving the snapshot",
+          (mSnapshotDeviceReady - mSnapshotServed) / 1e6);
+    mDeviceReady = true;
+    mDeviceCondition.notify_all();
+}
+
+void HalImpl::waitForDevice() {
+    if (mDeviceReady.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mDeviceMutex);
+    mDeviceCondition.wait(lock, [this] { return mDeviceReady.load(); });
+}
+
+const DisplaySnapshot::Display* HalImpl::getSnapshotDisplay(int64_t display) {
+    if (!mServingSnapshot.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    if (auto snapshotDisplay = mSnapshot->findDisplay(display)) {
+        return snapshotDisplay;
+    }
+    waitForDevice();
+    return nullptr;
+}
+
+void HalImpl::checkSnapshotDisplays() {
+    std::map<int64_t, bool> announced;
+    {
+        std::lock_guard<std::mutex> lock(mDisplayMutex);
+        announced.swap(mAnnouncedDisplays);
+    }
+    // hwc2 reports the connected displays while the hotplug callback is registered
+    for (const auto& [display, reported] : announced) {
+        if (!reported) {
+            ALOGI("display %" PRId64 " of the snapshot is gone", display);
+            mSnapshotGone++;
+            onDisplayDisconnected(display);
+            mEventCallback->onHotplug(display, false);
+            continue;
+        }
+        DisplaySnapshot::Display current;
+        if (captureDisplay(display, &current) && current == *mSnapshot->findDisplay(display)) {
+            mSnapshotUnchanged++;
+            continue;
+        }
+        // a hotplug of a connected display has the client query it again
+        ALOGI("display %" PRId64 " changed since the snapshot", display);
+        mSnapshotChanged++;
+        mEventCallback->onHotplug(display, true);
+    }
+    scheduleSnapshot();
+}
+
+bool HalImpl::onDisplayHotplug(int64_t display, bool connected) {
+    bool announced = false;
+    {
+        std::lock_guard<std::mutex> lock(mDisplayMutex);
+        if (connected) {
+            mConnectedDisplays.insert(display);
+        } else {
+            mConnectedDisplays.erase(display);
+        }
+        auto it = mAnnouncedDisplays.find(display);
+        if (it != mAnnouncedDisplays.end()) {
+            announced = connected && !it->second;
+            if (announced) {
+                it->second = true;
+            } else {
+                mAnnouncedDisplays.erase(it);
+            }
+        }
+    }
+    scheduleSnapshot();
+    return !announced;
+}
+
+bool HalImpl::captureDisplay(int64_t display, DisplaySnapshot::Display* outDisplay) {
+    std::vector<int32_t> configs;
+    outDisplay->id = display;
+    if (getDisplayName(display, &outDisplay->name) ||
+        getActiveConfig(display, &outDisplay->activeConfig) ||
+        getDisplayConfigs(display, &configs)) {
+        return false;
+    }
+
+    outDisplay->vsyncPeriod = {};
+    outDisplay->vsyncPeriod.error = getDisplayVsyncPeriod(display, &outDisplay->vsyncPeriod.value);
+    DisplayConnectionType type = DisplayConnectionType::INTERNAL;
+    outDisplay->connectionType.error = getDisplayConnectionType(display, &type);
+    outDisplay->connectionType.value = static_cast<int32_t>(type);
+    DisplayIdentification identification;
+    outDisplay->identificationError = getDisplayIdentificationData(display, &identification);
+    outDisplay->identificationPort = static_cast<uint8_t>(identification.port);
+    outDisplay->identification = std::move(identification.data);
+    std::vector<DisplayCapability> caps;
+    outDisplay->capabilitiesError = getDisplayCapabilities(display, &caps);
+    for (DisplayCapability cap : caps) {
+        outDisplay->capabilities.push_back(static_cast<int32_t>(cap));
+    }
+
+    for (int32_t config : configs) {
+        DisplaySnapshot::Config& snapshotConfig = outDisplay->configs.emplace_back();
+        snapshotConfig.id = config;
+        for (size_t i = 0; i < DisplaySnapshot::kAttributeCount; ++i) {
+            auto& attribute = snapshotConfig.attributes[i];
+            attribute.value = -1;
+            attribute.error = getDisplayAttribute(
+                    display, config, static_cast<DisplayAttribute>(DisplaySnapshot::kAttributes[i]),
+                    &attribute.value);
+        }
+    }
+    return true;
+}
+
+bool HalImpl::captureSnapshot(DisplaySnapshot* outSnapshot) {
+    std::set<int64_t> displays;
+    {
+        std::lock_guard<std::mutex> lock(mDisplayMutex);
+        displays = mConnectedDisplays;
+    }
+    for (Capability cap : mCaps) {
+        outSnapshot->capabilities.push_back(static_cast<int32_t>(cap));
+    }
+    for (const auto& key : mLayerGenericMetadataKeys) {
+        outSnapshot->metadataKeys.push_back({key.name, key.mandatory});
+    }
+    for (int64_t display : displays) {
+        DisplaySnapshot::Display& snapshotDisplay = outSnapshot->displays.emplace_back();
+        if (!captureDisplay(display, &snapshotDisplay)) {
+            // on its way out, the hotplug schedules another capture
+            return false;
+        }
+    }
+    return true;
+}
+
+void HalImpl::scheduleSnapshot() {
+    if (mSnapshotWriter) {
+        mSnapshotWriter->schedule();
+    }
+}
+
+bool HalImpl::initCaps() {
     uint32_t count = 0;
     mDevice->getCapabilities(mDevice, &count, nullptr);
 
     std::vector<int32_t> halCaps(count);
     mDevice->getCapabilities(mDevice, &count, halCaps.data());
 
+    std::unordered_set<Capability> caps;
     for (auto hwcCap : halCaps) {
         Capability cap;
         h2a::translate(hwcCap, cap);
-        mCaps.insert(cap);
+        caps.insert(cap);
+    }
+
+    //caps.insert(Capability::BOOT_DISPLAY_CONFIG);
+
+    // the client has those of the snapshot
+    if (mSnapshot) {
+        if (caps != mCaps) {
+            ALOGE("hwc2 capabilities differ from the snapshot");
+            return false;
+        }
+        return true;
+    }
+    mCaps = std::move(caps);
+    return true;
+}
+
+bool HalImpl::initLayerGenericMetadataKeys() {
+    std::vector<LayerGenericMetadataKey> keys;
+    if (!mDispatch.getLayerGenericMetadataKey) {
+        return !mSnapshot || mSnapshot->metadataKeys.empty();
+    }
+
+    // the backend terminates the list with an empty key
+    for (uint32_t index = 0;; ++index) {
+        uint32_t keyLength = 0;
+        bool mandatory = false;
+        mDispatch.getLayerGenericMetadataKey(mDevice, index, &keyLength, nullptr, &mandatory);
+        if (keyLength == 0) {
+            break;
+        }
+
+        std::vector<char> key(keyLength + 1, '\0');
+        mDispatch.getLayerGenericMetadataKey(mDevice, index, &keyLength, key.data(), &mandatory);
+        keys.push_back({std::string(key.data(), keyLength), mandatory});
+        ALOGI("layer generic metadata key %s%s", key.data(), mandatory ? " (mandatory)" : "");
+    }
+
+    // the client has those of the snapshot
+    if (mSnapshot) {
+        if (!std::equal(keys.begin(), keys.end(), mSnapshot->metadataKeys.begin(),
+                        mSnapshot->metadataKeys.end(), [](const auto& key, const auto& saved) {
+                            return key.name == saved.name && key.mandatory == saved.mandatory;
+                        })) {
+            ALOGE("hwc2 layer generic metadata keys differ from the snapshot");
+            return false;
+        }
+        return true;
+    }
+    mLayerGenericMetadataKeys = std::move(keys);
+    return true;
+}
+
+bool HalImpl::getBackendOverlaySupport(PlaneDump* out) {
+    if (!mDispatch.getOverlaySupport) {
+        return false;
+    }
+
+    uint32_t count = 0;
+    bool mixedColorSpaces = false;
+    if (mDispatch.getOverlaySupport(mDevice, &count, nullptr, nullptr, &mixedColorSpaces) ||
+        count == 0) {
+        ALOGW("backend overlay support unavailable");
+        return false;
+    }
+    out->formats.resize(count);
+    out->dataspaces.resize(count);
+    if (mDispatch.getOverlaySupport(mDevice, &count, out->formats.data(), out->dataspaces.data(),
+                                    &mixedColorSpaces)) {
+        ALOGW("backend overlay support unavailable");
+        return false;
+    }
+    out->formats.resize(count);
+    out->dataspaces.resize(count);
+    out->mixedColorSpaces = mixedColorSpaces;
+    return true;
+}
+
+void HalImpl::initOverlaySupport() {
+    PlaneDump planes;
+    if (!getBackendOverlaySupport(&planes)) {
+        // the plane list of the dump, once, getOverlaySupport is served from memory
+        uint32_t len = 0;
+        mDispatch.dump(mDevice, &len, nullptr);
+        std::string dump(len, '\0');
+        mDispatch.dump(mDevice, &len, dump.data());
+        dump.resize(len);
+        // without either, getOverlaySupport stays unsupported
+        if (!PlaneDump::parse(dump, &planes)) {
+            ALOGW("no overlay plane formats in the hwc2 dump");
+            return;
+        }
+    }
+    const auto& hwcFormats = planes.formats;
+    const auto& hwcDataspaces = planes.dataspaces;
+    const size_t count = hwcFormats.size();
+
+    // Split the dataspaces of each format into standard/transfer/range sets
+    // and group the formats which end up with the same sets.
+    using DataspaceSet = std::set<common::Dataspace>;
+    struct Sets {
+        DataspaceSet standards;
+        DataspaceSet transfers;
+        DataspaceSet ranges;
+    };
+    std::map<int32_t, Sets> formatSets;
+    for (size_t i = 0; i < count; ++i) {
+        auto dataspace = hwcDataspaces[i];
+        auto& sets = formatSets[hwcFormats[i]];
+        sets.standards.insert(static_cast<common::Dataspace>(
+                dataspace & static_cast<int32_t>(common::Dataspace::STANDARD_MASK)));
+        sets.transfers.insert(static_cast<common::Dataspace>(
+                dataspace & static_cast<int32_t>(common::Dataspace::TRANSFER_MASK)));
+        sets.ranges.insert(static_cast<common::Dataspace>(
+                dataspace & static_cast<int32_t>(common::Dataspace::RANGE_MASK)));
+    }
+
+    std::map<std::tuple<DataspaceSet, DataspaceSet, DataspaceSet>, std::vector<AidlPixelFormat>>
+            groups;
+    for (const auto& [format, sets] : formatSets) {
+        groups[{sets.standards, sets.transfers, sets.ranges}].push_back(
+                static_cast<AidlPixelFormat>(format));
     }
 
-    //mCaps.insert(Capability::BOOT_DISPLAY_CONFIG);
+    OverlayProperties properties;
+    for (const auto& [sets, formats] : groups) {
+        const auto& [standards, transfers, ranges] = sets;
+        properties.combinations.push_back({
+                formats,
+                {standards.begin(), standards.end()},
+                {transfers.begin(), transfers.end()},
+                {ranges.begin(), ranges.end()},
+        });
+    }
+    properties.supportMixedColorSpaces = planes.mixedColorSpaces;
+    mOverlayProperties = std::move(properties);
+    ALOGI("overlay support: %zu formats in %zu combinations", formatSets.size(), groups.size());
 }
 
 bool HalImpl::hasCapability(Capability cap) {
@@ -184,21 +573,89 @@ void HalImpl::getCapabilities(std::vector<Capability>* caps) {
 
 void HalImpl::dumpDebugInfo(std::string* output) {
     if (output == nullptr) return;
+    waitForDevice();
 
+    // straight into output, the hwc2 dump can be large
     uint32_t len = 0;
     mDispatch.dump(mDevice, &len, nullptr);
+    const size_t offset = output->size();
+    output->resize(offset + len);
+    mDispatch.dump(mDevice, &len, output->data() + offset);
+    output->resize(offset + len);
+
+    if (mSoftwareReadback) {
+        mSoftwareReadback->dump(output);
+    }
+    if (mLayerSquasher) {
+        mLayerSquasher->dump(output);
+    }
+    if (mRefreshRateController) {
+        mRefreshRateController->dump(output, systemTime(SYSTEM_TIME_MONOTONIC));
+    }
+    if (mBrightnessCoalescer) {
+        mBrightnessCoalescer->dump(output);
+    }
+    if (mSnapshot || mSnapshotWriter) {
+        output->append("\nhwc3 display snapshot:\n");
+    }
+    if (mSnapshot) {
+        ::android::base::StringAppendF(output,
+                                       "  started from %zu displays, hwc2 up %.1fms later:"
+                                       " unchanged=%u changed=%u gone=%u\n",
+                                       mSnapshot->displays.size(),
+                                       (mSnapshotDeviceReady - mSnapshotServed) / 1e6,
+                                       mSnapshotUnchanged, mSnapshotChanged, mSnapshotGone);
+    }
+    if (mSnapshotWriter) {
+        mSnapshotWriter->dump(output);
+    }
+
+#ifdef HWC3_DISPATCH_STATS
+    output->append("\nhwc3 hwc2 calls:\n");
+    for (const DispatchStats* stats : mDispatchStats) {
+        stats->dump(output);
+    }
+#endif
 
-    std::vector<char> buf(len + 1);
-    mDispatch.dump(mDevice, &len, buf.data());
-    buf.resize(len + 1);
-    buf[len] = '\0';
+    std::lock_guard<std::mutex> lock(mVirtualDisplayMutex);
+    if (!mVirtualDisplays.empty()) {
+        output->append("\nhwc3 software virtual displays:\n");
+    }
+    for (const auto& [display, vd] : mVirtualDisplays) {
+        vd->dump(output);
+    }
+}
 
-    *output = std::string(buf.begin(), buf.end());
+void HalImpl::resetDebugStats() {
+#ifdef HWC3_DISPATCH_STATS
+    for (DispatchStats* stats : mDispatchStats) {
+        stats->reset();
+    }
+#endif
 }
 
 void HalImpl::registerEventCallback(EventCallback* callback) {
+    std::lock_guard<std::mutex> lock(mDeviceMutex);
     mEventCallback = callback;
+    if (mDeviceReady) {
+        registerHwcCallbacks();
+        return;
+    }
+
+    // hwc2 gets the callbacks once it is up, the client learns of the
+    // displays from the snapshot meanwhile
+    {
+        std::lock_guard<std::mutex> displayLock(mDisplayMutex);
+        for (const auto& display : mSnapshot->displays) {
+            mAnnouncedDisplays[display.id] = false;
+        }
+    }
+    for (const auto& display : mSnapshot->displays) {
+        callback->onHotplug(display.id, true);
+    }
+}
 
+void HalImpl::registerHwcCallbacks() {
     mDispatch.registerCallback(mDevice, HWC2_CALLBACK_HOTPLUG, this,
                               reinterpret_cast<hwc2_function_pointer_t>(hook::hotplug));
     mDispatch.registerCallback(mDevice, HWC2_CALLBACK_REFRESH, this,
@@ -218,7 +675,13 @@ void HalImpl::registerEventCallback(EventCallback* callback) {
 #endif
 }
 
-void HalImpl::unregisterEventCallback() {
+void HalImpl::unregisterEventCallback(EventCallback* callback) {
+    std::lock_guard<std::mutex> lock(mDeviceMutex);
+    // the next client took over already
+    if (mEventCallback != callback) {
+        return;
+    }
+
     mDispatch.registerCallback(mDevice, HWC2_CALLBACK_HOTPLUG, this, nullptr);
     mDispatch.registerCallback(mDevice, HWC2_CALLBACK_REFRESH, this, nullptr);
     mDispatch.registerCallback(mDevice, HWC2_CALLBACK_VSYNC_2_4, this, nullptr);
@@ -235,12 +698,18 @@ void HalImpl::unregisterEventCallback() {
 }
 
 int32_t HalImpl::acceptDisplayChanges(int64_t display) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->acceptChanges();
+    }
     int32_t err = mDispatch.acceptDisplayChanges(mDevice, display);
 
     return err;
 }
 
 int32_t HalImpl::createLayer(int64_t display, int64_t* outLayer) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->createLayer(outLayer);
+    }
     hwc2_layer_t hwcLayer = 0;
     RET_IF_ERR(mDispatch.createLayer(mDevice, display, &hwcLayer));
 
@@ -249,21 +718,92 @@ int32_t HalImpl::createLayer(int64_t display, int64_t* outLayer) {
 }
 
 int32_t HalImpl::destroyLayer(int64_t display, int64_t layer) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->destroyLayer(layer);
+    }
     hwc2_layer_t hwcLayer = 0;
     a2h::translate(layer, hwcLayer);
     RET_IF_ERR(mDispatch.destroyLayer(mDevice, display, hwcLayer));
 
+    if (mSoftwareReadback) {
+        mSoftwareReadback->destroyLayer(display, layer);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->destroyLayer(display, layer);
+    }
+    if (auto controller = getRefreshRateController(display)) {
+        controller->onLayerDestroyed(display, layer);
+    }
     return HWC2_ERROR_NONE;
 }
 
+int32_t HalImpl::destroyLayers(int64_t display, const std::vector<int64_t>& layers) {
+    int32_t error = HWC2_ERROR_NONE;
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        for (int64_t layer : layers) {
+            if (int32_t err = vd->destroyLayer(layer)) {
+                error = err;
+            }
+        }
+        return error;
+    }
+
+    // hwc2 takes them one by one, what we keep about them goes at once
+    std::vector<int64_t> destroyed;
+    destroyed.reserve(layers.size());
+    for (int64_t layer : layers) {
+        hwc2_layer_t hwcLayer = 0;
+        a2h::translate(layer, hwcLayer);
+        if (int32_t err = mDispatch.destroyLayer(mDevice, display, hwcLayer)) {
+            error = err;
+            continue;
+        }
+        destroyed.push_back(layer);
+    }
+    if (destroyed.empty()) {
+        return error;
+    }
+
+    if (mSoftwareReadback) {
+        mSoftwareReadback->destroyLayers(display, destroyed);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->destroyLayers(display, destroyed);
+    }
+    if (auto controller = getRefreshRateController(display)) {
+        controller->onLayersDestroyed(display, destroyed);
+    }
+    return error;
+}
+
 int32_t HalImpl::createVirtualDisplay(uint32_t width, uint32_t height, AidlPixelFormat format,
                                       VirtualDisplay* outDisplay) {
     int32_t hwcFormat;
     a2h::translate(format, hwcFormat);
 
-    hwc2_display_t hwcDisplay = getDisplayId(HWC_DISPLAY_VIRTUAL, 0);
+    std::lock_guard<std::mutex> lock(mVirtualDisplayMutex);
+    int64_t display = allocateVirtualDisplayId();
+    if (display < 0) {
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    if (mSoftwareVirtualDisplay) {
+        if (!SoftwareVirtualDisplay::isSupportedOutputFormat(hwcFormat)) {
+            hwcFormat = HAL_PIXEL_FORMAT_RGBA_8888;
+        }
+        mVirtualDisplays[display] = std::make_shared<SoftwareVirtualDisplay>(
+                width, height, hwcFormat, SoftwareVirtualDisplay::getMaxFrameRateProperty(),
+                mVirtualDisplayPool.get());
+        outDisplay->display = display;
+        h2a::translate(hwcFormat, outDisplay->format);
+        return HWC2_ERROR_NONE;
+    }
+
+    // only a hint, hwc2 may pick another id
+    hwc2_display_t hwcDisplay = static_cast<hwc2_display_t>(display);
 
     RET_IF_ERR(mDispatch.createVirtualDisplay(mDevice, width, height, &hwcFormat, &hwcDisplay));
+    mHwcVirtualDisplays.insert(hwcDisplay);
 
     h2a::translate(hwcDisplay, outDisplay->display);
     h2a::translate(hwcFormat, outDisplay->format);
@@ -272,10 +812,44 @@ int32_t HalImpl::createVirtualDisplay(uint32_t width, uint32_t height, AidlPixel
 }
 
 int32_t HalImpl::destroyVirtualDisplay(int64_t display) {
+    if (mSoftwareReadback) {
+        mSoftwareReadback->removeDisplay(display);
+    }
+    std::shared_ptr<SoftwareVirtualDisplay> vd;
+    {
+        std::lock_guard<std::mutex> lock(mVirtualDisplayMutex);
+        if (mSoftwareVirtualDisplay) {
+            auto it = mVirtualDisplays.find(display);
+            if (it == mVirtualDisplays.end()) {
+                return HWC2_ERROR_BAD_DISPLAY;
+            }
+            vd = std::move(it->second);
+            mVirtualDisplays.erase(it);
+        } else {
+            mHwcVirtualDisplays.erase(display);
+        }
+    }
+    // the last frame finishes outside of the lock, other displays go on
+    if (vd) {
+        vd.reset();
+        return HWC2_ERROR_NONE;
+    }
     return mDispatch.destroyVirtualDisplay(mDevice, display);
 }
 
 int32_t HalImpl::getActiveConfig(int64_t display, int32_t* outConfig) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        *outConfig = snapshot->activeConfig;
+        return HWC2_ERROR_NONE;
+    }
+
+    // a lower rate picked for the content is not the client's business
+    if (auto controller = getRefreshRateController(display)) {
+        if (controller->getClientConfig(display, outConfig)) {
+            return HWC2_ERROR_NONE;
+        }
+    }
+
     hwc2_config_t hwcConfig;
     RET_IF_ERR(mDispatch.getActiveConfig(mDevice, display, &hwcConfig));
 
@@ -284,6 +858,11 @@ int32_t HalImpl::getActiveConfig(int64_t display, int32_t* outConfig) {
 }
 
 int32_t HalImpl::getColorModes(int64_t display, std::vector<ColorMode>* outModes) {
+    if (getSoftwareVirtualDisplay(display)) {
+        *outModes = {ColorMode::NATIVE};
+        return HWC2_ERROR_NONE;
+    }
+
     uint32_t count = 0;
     RET_IF_ERR(mDispatch.getColorModes(mDevice, display, &count, nullptr));
 
@@ -310,6 +889,14 @@ int32_t HalImpl::getDataspaceSaturationMatrix([[maybe_unused]] common::Dataspace
 
 int32_t HalImpl::getDisplayAttribute(int64_t display, int32_t config,
                                      DisplayAttribute attribute, int32_t* outValue) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        if (auto value = snapshot->findAttribute(config, static_cast<int32_t>(attribute))) {
+            *outValue = value->value;
+            return value->error;
+        }
+        waitForDevice();
+    }
+
     hwc2_config_t hwcConfig;
     int32_t hwcAttr;
     a2h::translate(config, hwcConfig);
@@ -332,6 +919,14 @@ int32_t HalImpl::getDisplayBrightnessSupport([[maybe_unused]] int64_t display, b
 
 int32_t HalImpl::getDisplayCapabilities([[maybe_unused]] int64_t display,
                                         std::vector<DisplayCapability>* caps) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        caps->clear();
+        for (int32_t cap : snapshot->capabilities) {
+            caps->push_back(static_cast<DisplayCapability>(cap));
+        }
+        return snapshot->capabilitiesError;
+    }
+
     if (!mDispatch.getDisplayCapabilities) {
         return HWC2_ERROR_UNSUPPORTED;
     }
@@ -348,6 +943,14 @@ int32_t HalImpl::getDisplayCapabilities([[maybe_unused]] int64_t display,
 }
 
 int32_t HalImpl::getDisplayConfigs(int64_t display, std::vector<int32_t>* configs) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        configs->clear();
+        for (const auto& config : snapshot->configs) {
+            configs->push_back(config.id);
+        }
+        return HWC2_ERROR_NONE;
+    }
+
     uint32_t count = 0;
     RET_IF_ERR(mDispatch.getDisplayConfigs(mDevice, display, &count, nullptr));
 
@@ -359,6 +962,10 @@ int32_t HalImpl::getDisplayConfigs(int64_t display, std::vector<int32_t>* config
 }
 
 int32_t HalImpl::getDisplayConnectionType(int64_t display, DisplayConnectionType* outType) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        *outType = static_cast<DisplayConnectionType>(snapshot->connectionType.value);
+        return snapshot->connectionType.error;
+    }
     if (!mDispatch.getDisplayConnectionType) {
         return HWC2_ERROR_UNSUPPORTED;
     }
@@ -371,6 +978,11 @@ int32_t HalImpl::getDisplayConnectionType(int64_t display, DisplayConnectionType
 
 int32_t HalImpl::getDisplayIdentificationData(int64_t display,
                                               DisplayIdentification *id) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        id->port = static_cast<int8_t>(snapshot->identificationPort);
+        id->data = snapshot->identification;
+        return snapshot->identificationError;
+    }
     if (!mDispatch.getDisplayIdentificationData) {
         return HWC2_ERROR_UNSUPPORTED;
     }
@@ -386,6 +998,15 @@ int32_t HalImpl::getDisplayIdentificationData(int64_t display,
 }
 
 int32_t HalImpl::getDisplayName(int64_t display, std::string* outName) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        *outName = snapshot->name;
+        return HWC2_ERROR_NONE;
+    }
+    if (getSoftwareVirtualDisplay(display)) {
+        *outName = "Virtual";
+        return HWC2_ERROR_NONE;
+    }
+
     uint32_t count = 0;
     RET_IF_ERR(mDispatch.getDisplayName(mDevice, display, &count, nullptr));
 
@@ -396,6 +1017,10 @@ int32_t HalImpl::getDisplayName(int64_t display, std::string* outName) {
 }
 
 int32_t HalImpl::getDisplayVsyncPeriod(int64_t display, int32_t* outVsyncPeriod) {
+    if (auto snapshot = getSnapshotDisplay(display)) {
+        *outVsyncPeriod = snapshot->vsyncPeriod.value;
+        return snapshot->vsyncPeriod.error;
+    }
     if (!mDispatch.getDisplayVsyncPeriod) {
         return HWC2_ERROR_UNSUPPORTED;
     }
@@ -435,6 +1060,11 @@ int32_t HalImpl::getDisplayPhysicalOrientation([[maybe_unused]] int64_t display,
 }
 
 int32_t HalImpl::getDozeSupport(int64_t display, bool& support) {
+    if (getSoftwareVirtualDisplay(display)) {
+        support = false;
+        return HWC2_ERROR_NONE;
+    }
+
     int32_t hwcSupport;
     RET_IF_ERR(mDispatch.getDozeSupport(mDevice, display, &hwcSupport));
 
@@ -460,11 +1090,20 @@ int32_t HalImpl::getHdrCapabilities(int64_t display, HdrCapabilities* caps) {
     return HWC2_ERROR_NONE;
 }
 
-int32_t HalImpl::getOverlaySupport([[maybe_unused]] OverlayProperties* caps) {
-    return HWC2_ERROR_UNSUPPORTED;
+int32_t HalImpl::getOverlaySupport(OverlayProperties* caps) {
+    if (!mOverlayProperties) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    *caps = *mOverlayProperties;
+    return HWC2_ERROR_NONE;
 }
 
 int32_t HalImpl::getMaxVirtualDisplayCount(int32_t* count) {
+    if (mSoftwareVirtualDisplay) {
+        *count = static_cast<int32_t>(mMaxVirtualDisplays);
+        return HWC2_ERROR_NONE;
+    }
+
     uint32_t hwcCount = mDispatch.getMaxVirtualDisplayCount(mDevice);
     h2a::translate(hwcCount, *count);
 
@@ -477,20 +1116,45 @@ int32_t HalImpl::getPerFrameMetadataKeys([[maybe_unused]] int64_t display,
     return HWC2_ERROR_UNSUPPORTED;
 }
 
-int32_t HalImpl::getReadbackBufferAttributes([[maybe_unused]] int64_t display,
-                                             [[maybe_unused]] ReadbackBufferAttributes* attrs) {
-    /* Drmhwc2 not support this feature */
-    return HWC2_ERROR_UNSUPPORTED;
+int32_t HalImpl::getReadbackBufferAttributes(int64_t display, ReadbackBufferAttributes* attrs) {
+    if (mDispatch.getReadbackBufferAttributes) {
+        int32_t hwcFormat;
+        int32_t hwcDataspace;
+        RET_IF_ERR(mDispatch.getReadbackBufferAttributes(mDevice, display, &hwcFormat,
+                                                         &hwcDataspace));
+        h2a::translate(hwcFormat, attrs->format);
+        h2a::translate(hwcDataspace, attrs->dataspace);
+        return HWC2_ERROR_NONE;
+    }
+
+    if (!mSoftwareReadback) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    attrs->format = common::PixelFormat::RGBA_8888;
+    attrs->dataspace = common::Dataspace::SRGB;
+    return HWC2_ERROR_NONE;
 }
 
-int32_t HalImpl::getReadbackBufferFence([[maybe_unused]] int64_t display,
-                                        [[maybe_unused]] ndk::ScopedFileDescriptor* acquireFence) {
-    /* Drmhwc2 not support this feature */
-    return HWC2_ERROR_UNSUPPORTED;
+int32_t HalImpl::getReadbackBufferFence(int64_t display, ndk::ScopedFileDescriptor* acquireFence) {
+    int32_t hwcFence = -1;
+    if (mDispatch.getReadbackBufferFence) {
+        RET_IF_ERR(mDispatch.getReadbackBufferFence(mDevice, display, &hwcFence));
+    } else if (mSoftwareReadback) {
+        RET_IF_ERR(mSoftwareReadback->getReadbackBufferFence(display, &hwcFence));
+    } else {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+
+    h2a::translate(hwcFence, *acquireFence);
+    return HWC2_ERROR_NONE;
 }
 
-int32_t HalImpl::getRenderIntents([[maybe_unused]] int64_t display, ColorMode mode,
+int32_t HalImpl::getRenderIntents(int64_t display, ColorMode mode,
                                   std::vector<RenderIntent>* intents) {
+    if (getSoftwareVirtualDisplay(display)) {
+        *intents = {RenderIntent::COLORIMETRIC};
+        return HWC2_ERROR_NONE;
+    }
     if (!mDispatch.getRenderIntents) {
         return HWC2_ERROR_UNSUPPORTED;
     }
@@ -526,10 +1190,52 @@ int32_t HalImpl::getSupportedContentTypes([[maybe_unused]] int64_t display, std:
 int32_t HalImpl::presentDisplay(int64_t display, ndk::ScopedFileDescriptor& fence,
                        std::vector<int64_t>* outLayers,
                        std::vector<ndk::ScopedFileDescriptor>* outReleaseFences) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        ::android::base::unique_fd presentFence;
+        RET_IF_ERR(vd->present(&presentFence, outLayers));
+        // the layers being read are released along with the output
+        outReleaseFences->clear();
+        for (size_t i = 0; i < outLayers->size(); ++i) {
+            outReleaseFences->emplace_back(dup(presentFence.get()));
+        }
+        fence.set(presentFence.release());
+        return HWC2_ERROR_NONE;
+    }
+
+    auto squasher = getLayerSquasher(display);
+    if (squasher && squasher->isStale(display)) {
+        // hwc2 would show the squashed layers as they were
+        return HWC2_ERROR_NOT_VALIDATED;
+    }
+
+    if (mBrightnessCoalescer) {
+        mBrightnessCoalescer->flush(display);
+    }
+
     int32_t hwcOutPresentFence = -1;
     RET_IF_ERR(mDispatch.presentDisplay(mDevice, display, &hwcOutPresentFence));
     h2a::translate(hwcOutPresentFence, fence);
 
+    if (squasher) {
+        squasher->onPresent(display, fence.get());
+    }
+
+    if (mSoftwareReadback) {
+        mSoftwareReadback->onPresent(display);
+    }
+    if (auto controller = getRefreshRateController(display)) {
+        int32_t config;
+        if (!controller->getClientConfig(display, &config)) {
+            // the client kept the config the display booted with
+            hwc2_config_t hwcConfig;
+            if (mDispatch.getActiveConfig(mDevice, display, &hwcConfig) == HWC2_ERROR_NONE) {
+                h2a::translate(hwcConfig, config);
+                setRefreshRateClientConfig(display, config);
+            }
+        }
+        controller->onPresent(display, systemTime(SYSTEM_TIME_MONOTONIC));
+    }
+
     uint32_t count = 0;
     RET_IF_ERR(mDispatch.getReleaseFences(mDevice, display, &count, nullptr, nullptr));
 
@@ -546,7 +1252,11 @@ int32_t HalImpl::presentDisplay(int64_t display, ndk::ScopedFileDescriptor& fenc
 int32_t HalImpl::setActiveConfig(int64_t display, int32_t config) {
     hwc2_config_t hwcConfig;
     a2h::translate(config, hwcConfig);
-    return mDispatch.setActiveConfig(mDevice, display, hwcConfig);
+    RET_IF_ERR(mDispatch.setActiveConfig(mDevice, display, hwcConfig));
+
+    setRefreshRateClientConfig(display, config);
+    scheduleSnapshot();
+    return HWC2_ERROR_NONE;
 }
 
 int32_t HalImpl::setActiveConfigWithConstraints(
@@ -563,6 +1273,8 @@ int32_t HalImpl::setActiveConfigWithConstraints(
     RET_IF_ERR(mDispatch.setActiveConfigWithConstraints(mDevice, display, hwcConfig, &hwcVsyncPeriodChangeConstraints, &hwcOutTimeline));
 
     h2a::translate(hwcOutTimeline, *timeline);
+    setRefreshRateClientConfig(display, config);
+    scheduleSnapshot();
     return HWC2_ERROR_NONE;
 }
 
@@ -610,6 +1322,30 @@ int32_t HalImpl::setClientTarget(int64_t display, buffer_handle_t target,
     a2h::translate(damage, hwcDamage);
     hwc_region_t region = { hwcDamage.size(), hwcDamage.data() };
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        std::vector<SwRect> swDamage;
+        for (const auto& rect : damage) {
+            swDamage.push_back({rect.left, rect.top, rect.right, rect.bottom});
+        }
+        return vd->setClientTarget(target, hwcAcquireFence, hwcDataspace, swDamage);
+    }
+    if (mSoftwareReadback) {
+        // hwc2 takes the fence, keep our own copy
+        mSoftwareReadback->setClientTarget(display, target,
+                                           hwcAcquireFence >= 0 ? dup(hwcAcquireFence) : -1,
+                                           hwcDataspace);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        if (squasher->isSquashing(display)) {
+            // hwc2 shows the squashed layers from our own client target
+            if (hwcAcquireFence >= 0) {
+                close(hwcAcquireFence);
+            }
+            return HWC2_ERROR_NONE;
+        }
+        squasher->onClientTarget(display);
+    }
+
     return mDispatch.setClientTarget(mDevice, display, target, hwcAcquireFence, hwcDataspace, region);
 }
 
@@ -623,6 +1359,10 @@ int32_t HalImpl::setColorMode(int64_t display, ColorMode mode, RenderIntent inte
     if ((hwcMode < 0) || (hwcIntent < 0))
         return HWC2_ERROR_BAD_PARAMETER;
 
+    if (getSoftwareVirtualDisplay(display)) {
+        return mode == ColorMode::NATIVE ? HWC2_ERROR_NONE : HWC2_ERROR_UNSUPPORTED;
+    }
+
     return mDispatch.setColorMode(mDevice, display, hwcMode);
 }
 
@@ -639,6 +1379,11 @@ int32_t HalImpl::setColorTransform(int64_t display, const std::vector<float>& ma
     const common::ColorTransform hint = isIdentity ? common::ColorTransform::IDENTITY
                                                    : common::ColorTransform::ARBITRARY_MATRIX;
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        vd->setColorTransform(isIdentity);
+        return HWC2_ERROR_NONE;
+    }
+
     int32_t hwcHint;
     a2h::translate(hint, hwcHint);
     return mDispatch.setColorTransform(mDevice, display, matrix.data(), hwcHint);
@@ -653,11 +1398,18 @@ int32_t HalImpl::setContentType([[maybe_unused]] int64_t display, ContentType co
     return mDispatch.setContentType(mDevice, display, type);
 }
 
-int32_t HalImpl::setDisplayBrightness([[maybe_unused]] int64_t display, [[maybe_unused]] float brightness) {
-    if (!mDispatch.setDisplayBrightness) {
+int32_t HalImpl::setDisplayBrightness(int64_t display, float brightness) {
+    if (!mBrightnessCoalescer) {
         return HWC2_ERROR_UNSUPPORTED;
     }
-    return mDispatch.setDisplayBrightness(mDevice, display, brightness);;
+    // -1 turns the backlight off
+    if (!std::isfinite(brightness) ||
+        ((brightness < 0.f || brightness > 1.f) && brightness != -1.f)) {
+        ALOGW("%s brightness %f is out of range", __func__, brightness);
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    // written along with the next present
+    return mBrightnessCoalescer->set(display, brightness, systemTime(SYSTEM_TIME_MONOTONIC));
 }
 
 int32_t HalImpl::setDisplayedContentSamplingEnabled(
@@ -674,6 +1426,19 @@ int32_t HalImpl::setLayerBlendMode(int64_t display, int64_t layer, common::Blend
 
     a2h::translate(mode, hwcMode);
     a2h::translate(layer, hwcLayer);
+
+    auto blend = mode == common::BlendMode::NONE       ? SwLayer::Blend::NONE
+                 : mode == common::BlendMode::COVERAGE ? SwLayer::Blend::COVERAGE
+                                                       : SwLayer::Blend::PREMULTIPLIED;
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerBlendMode(layer, blend);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerBlendMode(display, layer, blend);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerBlendMode(display, layer, blend);
+    }
     return mDispatch.setLayerBlendMode(mDevice, display, hwcLayer, hwcMode);
 }
 
@@ -684,6 +1449,26 @@ int32_t HalImpl::setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t
     a2h::translate(acquireFence, hwcAcquireFence);
     a2h::translate(layer, hwcLayer);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerBuffer(layer, buffer, hwcAcquireFence);
+    }
+    // the engine sends every buffer twice, first with the RK slot mask in
+    // place of the fence, which only hwc2 makes sense of
+    if (hwcAcquireFence < -1) {
+        return mDispatch.setLayerBuffer(mDevice, display, hwcLayer, buffer, hwcAcquireFence);
+    }
+    if (mSoftwareReadback) {
+        // hwc2 takes the fence, keep our own copy
+        mSoftwareReadback->setLayerBuffer(display, layer, buffer,
+                                          hwcAcquireFence >= 0 ? dup(hwcAcquireFence) : -1);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerBuffer(display, layer, buffer,
+                                 hwcAcquireFence >= 0 ? dup(hwcAcquireFence) : -1);
+    }
+    if (auto controller = getRefreshRateController(display); controller && buffer) {
+        controller->onBuffer(display, layer, systemTime(SYSTEM_TIME_MONOTONIC));
+    }
     return mDispatch.setLayerBuffer(mDevice, display, hwcLayer, buffer, hwcAcquireFence);
 }
 
@@ -694,6 +1479,17 @@ int32_t HalImpl::setLayerColor(int64_t display, int64_t layer, Color color) {
     a2h::translate(color, hwcColor);
     a2h::translate(layer, hwcLayer);
 
+    uint32_t rgba = hwcColor.r | (hwcColor.g << 8) | (hwcColor.b << 16) |
+            (static_cast<uint32_t>(hwcColor.a) << 24);
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerColor(layer, rgba);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerColor(display, layer, rgba);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerColor(display, layer, rgba);
+    }
     return mDispatch.setLayerColor(mDevice, display, hwcLayer, hwcColor);
 }
 
@@ -715,10 +1511,26 @@ int32_t HalImpl::setLayerCompositionType(int64_t display, int64_t layer, Composi
         return HWC2_ERROR_UNSUPPORTED;
     }
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerCompositionType(layer, type);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerComposition(display, layer, type);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerComposition(display, layer, type);
+        // hwc2 keeps it as client until the next validate, which the change forces
+        if (squasher->isSquashed(display, layer)) {
+            return HWC2_ERROR_NONE;
+        }
+    }
     return mDispatch.setLayerCompositionType(mDevice, display, hwcLayer, hwcType);
 }
 
 int32_t HalImpl::setLayerCursorPosition(int64_t display, int64_t layer, int32_t x, int32_t y) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->checkLayer(layer);
+    }
     hwc2_layer_t hwcLayer = 0;
     a2h::translate(layer, hwcLayer);
 
@@ -732,6 +1544,18 @@ int32_t HalImpl::setLayerDataspace(int64_t display, int64_t layer, common::Datas
     a2h::translate(dataspace, hwcDataspace);
     a2h::translate(layer, hwcLayer);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerDataspace(layer, hwcDataspace);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerDataspace(display, layer, hwcDataspace);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerDataspace(display, layer, hwcDataspace);
+    }
+    if (auto controller = getRefreshRateController(display)) {
+        controller->setLayerVideo(display, layer, LayerCadence::isVideoDataspace(hwcDataspace));
+    }
     return mDispatch.setLayerDataspace(mDevice, display, hwcLayer, hwcDataspace);
 }
 
@@ -742,6 +1566,16 @@ int32_t HalImpl::setLayerDisplayFrame(int64_t display, int64_t layer, const comm
     a2h::translate(frame, hwcFrame);
     a2h::translate(layer, hwcLayer);
 
+    SwRect swFrame = {frame.left, frame.top, frame.right, frame.bottom};
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerDisplayFrame(layer, swFrame);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerDisplayFrame(display, layer, swFrame);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerDisplayFrame(display, layer, swFrame);
+    }
     return mDispatch.setLayerDisplayFrame(mDevice, display, hwcLayer, hwcFrame);
 }
 
@@ -761,11 +1595,24 @@ int32_t HalImpl::setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha)
     hwc2_layer_t hwcLayer = 0;
     a2h::translate(layer, hwcLayer);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerPlaneAlpha(layer, alpha);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerPlaneAlpha(display, layer, alpha);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerPlaneAlpha(display, layer, alpha);
+    }
     return mDispatch.setLayerPlaneAlpha(mDevice, display, hwcLayer, alpha);
 }
 
 int32_t HalImpl::setLayerSidebandStream(int64_t display, int64_t layer,
                                         buffer_handle_t stream) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        // composed by the client, see validateDisplay
+        return vd->checkLayer(layer);
+    }
     hwc2_layer_t hwcLayer = 0;
     a2h::translate(layer, hwcLayer);
 
@@ -779,6 +1626,16 @@ int32_t HalImpl::setLayerSourceCrop(int64_t display, int64_t layer, const common
     a2h::translate(crop, hwcCrop);
     a2h::translate(layer, hwcLayer);
 
+    SwFRect swCrop = {crop.left, crop.top, crop.right, crop.bottom};
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerSourceCrop(layer, swCrop);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerSourceCrop(display, layer, swCrop);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerSourceCrop(display, layer, swCrop);
+    }
     return mDispatch.setLayerSourceCrop(mDevice, display, hwcLayer, hwcCrop);
 }
 
@@ -792,6 +1649,16 @@ int32_t HalImpl::setLayerSurfaceDamage(int64_t display, int64_t layer,
 
     a2h::translate(layer, hwcLayer);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        // damage is tracked per layer, see SoftwareVirtualDisplay::present
+        return vd->checkLayer(layer);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        // a single empty rect means the buffer was not redrawn, none means all of it was
+        bool unchanged = hwcDamage.size() == 1 && hwcDamage[0].left == 0 &&
+                hwcDamage[0].top == 0 && hwcDamage[0].right == 0 && hwcDamage[0].bottom == 0;
+        squasher->setLayerSurfaceDamage(display, layer, !unchanged);
+    }
     return mDispatch.setLayerSurfaceDamage(mDevice, display, hwcLayer, region);
 }
 
@@ -802,6 +1669,15 @@ int32_t HalImpl::setLayerTransform(int64_t display, int64_t layer, common::Trans
     a2h::translate(transform, hwcTransform);
     a2h::translate(layer, hwcLayer);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerTransform(layer, static_cast<uint32_t>(hwcTransform));
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerTransform(display, layer, static_cast<uint32_t>(hwcTransform));
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerTransform(display, layer, static_cast<uint32_t>(hwcTransform));
+    }
     return mDispatch.setLayerTransform(mDevice, display, hwcLayer, hwcTransform);
 }
 
@@ -815,6 +1691,9 @@ int32_t HalImpl::setLayerVisibleRegion(int64_t display, int64_t layer,
 
     a2h::translate(layer, hwcLayer);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->checkLayer(layer);
+    }
     return mDispatch.setLayerVisibleRegion(mDevice, display, hwcLayer, region);
 }
 
@@ -837,6 +1716,15 @@ int32_t HalImpl::setLayerZOrder(int64_t display, int64_t layer, uint32_t z) {
 
     a2h::translate(layer, hwcLayer);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setLayerZOrder(layer, z);
+    }
+    if (mSoftwareReadback) {
+        mSoftwareReadback->setLayerZOrder(display, layer, z);
+    }
+    if (auto squasher = getLayerSquasher(display)) {
+        squasher->setLayerZOrder(display, layer, z);
+    }
     return mDispatch.setLayerZOrder(mDevice, display, hwcLayer, z);
 }
 
@@ -845,6 +1733,9 @@ int32_t HalImpl::setOutputBuffer(int64_t display, buffer_handle_t buffer,
     int32_t hwcReleaseFence = -1;
     a2h::translate(releaseFence, hwcReleaseFence);
 
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->setOutputBuffer(buffer, hwcReleaseFence);
+    }
     auto err = mDispatch.setOutputBuffer(mDevice, display, buffer, hwcReleaseFence);
     // unlike in setClientTarget, releaseFence is owned by us
     if (err == HWC2_ERROR_NONE && hwcReleaseFence >= 0) {
@@ -858,19 +1749,34 @@ int32_t HalImpl::setPowerMode(int64_t display, PowerMode mode) {
     if (mode == PowerMode::ON_SUSPEND || mode == PowerMode::DOZE_SUSPEND) {
         return HWC2_ERROR_UNSUPPORTED;
     }
+    if (getSoftwareVirtualDisplay(display)) {
+        return HWC2_ERROR_NONE;
+    }
 
     int32_t hwcMode;
     a2h::translate(mode, hwcMode);
     return mDispatch.setPowerMode(mDevice, display, hwcMode);
 }
 
-int32_t HalImpl::setReadbackBuffer([[maybe_unused]] int64_t display, [[maybe_unused]] buffer_handle_t buffer,
-                                   [[maybe_unused]] const ndk::ScopedFileDescriptor& releaseFence) {
-    /* Drmhwc2 not support this feature */
-    return HWC2_ERROR_UNSUPPORTED;
+int32_t HalImpl::setReadbackBuffer(int64_t display, buffer_handle_t buffer,
+                                   const ndk::ScopedFileDescriptor& releaseFence) {
+    if (!mDispatch.setReadbackBuffer && !mSoftwareReadback) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+
+    // both paths own the fence from here on
+    int32_t hwcReleaseFence = -1;
+    a2h::translate(releaseFence, hwcReleaseFence);
+    if (mDispatch.setReadbackBuffer) {
+        return mDispatch.setReadbackBuffer(mDevice, display, buffer, hwcReleaseFence);
+    }
+    return mSoftwareReadback->setReadbackBuffer(display, buffer, hwcReleaseFence);
 }
 
 int32_t HalImpl::setVsyncEnabled(int64_t display, bool enabled) {
+    if (getSoftwareVirtualDisplay(display)) {
+        return HWC2_ERROR_NONE;
+    }
     hwc2_vsync_t hwcEnable;
     a2h::translate(enabled, hwcEnable);
     return mDispatch.setVsyncEnabled(mDevice, display, hwcEnable);
@@ -881,24 +1787,296 @@ int32_t HalImpl::setIdleTimerEnabled([[maybe_unused]] int64_t display, [[maybe_u
     return HWC2_ERROR_UNSUPPORTED;
 }
 
-int32_t getClientTargetProperty(
-                        hwc_client_target_property_t *outClientTargetProperty,
-                        DimmingStage *outDimmingStage) {
-    outClientTargetProperty->pixelFormat = HAL_PIXEL_FORMAT_RGBA_8888;
-    outClientTargetProperty->dataspace = HAL_DATASPACE_UNKNOWN;
+std::shared_ptr<SoftwareVirtualDisplay> HalImpl::getSoftwareVirtualDisplay(int64_t display) {
+    if (!mSoftwareVirtualDisplay) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mVirtualDisplayMutex);
+    auto it = mVirtualDisplays.find(display);
+    return it != mVirtualDisplays.end() ? it->second : nullptr;
+}
+
+bool HalImpl::isVirtualDisplay(int64_t display) {
+    if ((display >> DISPLAYID_MASK_LEN) == HWC_DISPLAY_VIRTUAL) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(mVirtualDisplayMutex);
+    return mHwcVirtualDisplays.count(display) > 0;
+}
+
+LayerSquasher* HalImpl::getLayerSquasher(int64_t display) {
+    // what a virtual display shows is read back by the client, nothing to save
+    return mLayerSquasher && !isVirtualDisplay(display) ? mLayerSquasher.get() : nullptr;
+}
+
+RefreshRateController* HalImpl::getRefreshRateController(int64_t display) {
+    // virtual displays have no vsync of their own
+    return mRefreshRateController && !isVirtualDisplay(display) ? mRefreshRateController.get()
+                                                                : nullptr;
+}
+
+void HalImpl::setRefreshRateClientConfig(int64_t display, int32_t config) {
+    auto controller = getRefreshRateController(display);
+    if (!controller) {
+        return;
+    }
+    hwc2_config_t hwcConfig;
+    a2h::translate(config, hwcConfig);
+    int32_t group = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    if (mDispatch.getDisplayAttribute(mDevice, display, hwcConfig, HWC2_ATTRIBUTE_CONFIG_GROUP,
+                                      &group) != HWC2_ERROR_NONE ||
+        mDispatch.getDisplayAttribute(mDevice, display, hwcConfig, HWC2_ATTRIBUTE_WIDTH,
+                                      &width) != HWC2_ERROR_NONE ||
+        mDispatch.getDisplayAttribute(mDevice, display, hwcConfig, HWC2_ATTRIBUTE_HEIGHT,
+                                      &height) != HWC2_ERROR_NONE) {
+        return;
+    }
+
+    uint32_t count = 0;
+    if (mDispatch.getDisplayConfigs(mDevice, display, &count, nullptr) != HWC2_ERROR_NONE) {
+        return;
+    }
+    std::vector<hwc2_config_t> hwcConfigs(count);
+    if (mDispatch.getDisplayConfigs(mDevice, display, &count, hwcConfigs.data()) !=
+        HWC2_ERROR_NONE) {
+        return;
+    }
+
+    // only configs hwc2 can switch to without a modeset
+    std::vector<RefreshRateController::Mode> modes;
+    for (hwc2_config_t candidate : hwcConfigs) {
+        int32_t candidateGroup = 0;
+        int32_t candidateWidth = 0;
+        int32_t candidateHeight = 0;
+        int32_t vsyncPeriod = 0;
+        if (mDispatch.getDisplayAttribute(mDevice, display, candidate,
+                                          HWC2_ATTRIBUTE_CONFIG_GROUP,
+                                          &candidateGroup) != HWC2_ERROR_NONE ||
+            mDispatch.getDisplayAttribute(mDevice, display, candidate, HWC2_ATTRIBUTE_WIDTH,
+                                          &candidateWidth) != HWC2_ERROR_NONE ||
+            mDispatch.getDisplayAttribute(mDevice, display, candidate, HWC2_ATTRIBUTE_HEIGHT,
+                                          &candidateHeight) != HWC2_ERROR_NONE ||
+            mDispatch.getDisplayAttribute(mDevice, display, candidate,
+                                          HWC2_ATTRIBUTE_VSYNC_PERIOD,
+                                          &vsyncPeriod) != HWC2_ERROR_NONE) {
+            continue;
+        }
+        if (candidateGroup == group && candidateWidth == width && candidateHeight == height &&
+            vsyncPeriod > 0) {
+            int32_t modeConfig;
+            h2a::translate(candidate, modeConfig);
+            modes.push_back({modeConfig, vsyncPeriod});
+        }
+    }
+    controller->setClientMode(display, config, modes, systemTime(SYSTEM_TIME_MONOTONIC));
+}
+
+bool HalImpl::switchRefreshRate(int64_t display, int32_t config, nsecs_t now) {
+    hwc2_config_t hwcConfig;
+    a2h::translate(config, hwcConfig);
+    hwc_vsync_period_change_constraints_t hwcConstraints = {
+            .desiredTimeNanos = now,
+            .seamlessRequired = 1,
+    };
+    hwc_vsync_period_change_timeline_t hwcTimeline;
+    if (mDispatch.setActiveConfigWithConstraints(mDevice, display, hwcConfig, &hwcConstraints,
+                                                 &hwcTimeline) != HWC2_ERROR_NONE) {
+        return false;
+    }
+
+    // the client schedules its frames on the vsync it is told about
+    if (mEventCallback) {
+        VsyncPeriodChangeTimeline timeline;
+        h2a::translate(hwcTimeline, timeline);
+        mEventCallback->onVsyncPeriodTimingChanged(display, timeline);
+    }
+    return true;
+}
+
+int32_t HalImpl::getActiveSize(int64_t display, int32_t* outWidth, int32_t* outHeight) {
+    hwc2_config_t config;
+    RET_IF_ERR(mDispatch.getActiveConfig(mDevice, display, &config));
+    RET_IF_ERR(mDispatch.getDisplayAttribute(mDevice, display, config, HWC2_ATTRIBUTE_WIDTH,
+                                             outWidth));
+    return mDispatch.getDisplayAttribute(mDevice, display, config, HWC2_ATTRIBUTE_HEIGHT,
+                                         outHeight);
+}
+
+bool HalImpl::prepareSquash(int64_t display, LayerSquasher* squasher) {
+    int32_t width = 0;
+    int32_t height = 0;
+    if (getActiveSize(display, &width, &height) != HWC2_ERROR_NONE || width <= 0 ||
+        height <= 0) {
+        return false;
+    }
+
+    LayerSquasher::Plan plan;
+    bool squashed = squasher->prepare(display, static_cast<uint32_t>(width),
+                                      static_cast<uint32_t>(height), &plan);
+    restoreCompositionTypes(display, plan.restore);
+    if (!squashed) {
+        return false;
+    }
+
+    for (int64_t layer : plan.client) {
+        hwc2_layer_t hwcLayer = 0;
+        a2h::translate(layer, hwcLayer);
+        mDispatch.setLayerCompositionType(mDevice, display, hwcLayer, HWC2_COMPOSITION_CLIENT);
+    }
+    if (plan.targetChanged) {
+        hwc_region_t damage = {0, nullptr};
+        if (mDispatch.setClientTarget(mDevice, display, plan.target, -1, plan.targetDataspace,
+                                      damage) != HWC2_ERROR_NONE) {
+            restoreCompositionTypes(display, squasher->abandon(display));
+            squasher->onClientTarget(display);
+            return false;
+        }
+    }
+    return true;
+}
+
+void HalImpl::restoreCompositionTypes(
+        int64_t display, const std::vector<std::pair<int64_t, Composition>>& types) {
+    for (const auto& [layer, type] : types) {
+        hwc2_layer_t hwcLayer = 0;
+        int32_t hwcType;
+        a2h::translate(layer, hwcLayer);
+        a2h::translate(type, hwcType);
+        mDispatch.setLayerCompositionType(mDevice, display, hwcLayer, hwcType);
+    }
+}
+
+int64_t HalImpl::allocateVirtualDisplayId() {
+    const uint32_t count = mSoftwareVirtualDisplay ? mMaxVirtualDisplays
+                                                   : (1 << DISPLAYID_MASK_LEN);
+    for (uint32_t index = 0; index < count; ++index) {
+        int64_t display = getDisplayId(HWC_DISPLAY_VIRTUAL, index);
+        if (!mVirtualDisplays.count(display) && !mHwcVirtualDisplays.count(display)) {
+            return display;
+        }
+    }
+    return -1;
+}
+
+void HalImpl::onDisplayDisconnected(int64_t display) {
+    if (mSoftwareReadback) {
+        mSoftwareReadback->removeDisplay(display);
+    }
+    if (mLayerSquasher) {
+        mLayerSquasher->removeDisplay(display);
+    }
+    if (mRefreshRateController) {
+        mRefreshRateController->removeDisplay(display);
+    }
+    if (mBrightnessCoalescer) {
+        mBrightnessCoalescer->removeDisplay(display);
+    }
+}
+
+void HalImpl::invalidateClientTargetProperty(int64_t display) {
+    std::lock_guard<std::mutex> lock(mClientTargetMutex);
+    for (auto it = mClientTargetProperties.begin(); it != mClientTargetProperties.end();) {
+        if (it->first.first == display) {
+            it = mClientTargetProperties.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int32_t HalImpl::probeClientTargetProperty(int64_t display,
+                                           hwc_client_target_property_t* outClientTargetProperty) {
+    // Candidates in order of preference. RGB565 halves the DDR bandwidth of GPU
+    // fallback but drops the alpha channel and precision of the client target,
+    // so it is opt-in.
+    static const bool kAllowRgb565 =
+            ::android::base::GetBoolProperty("vendor.hwc3.client_target.rgb565", false);
+
+    hwc2_config_t config;
+    RET_IF_ERR(mDispatch.getActiveConfig(mDevice, display, &config));
+
+    std::lock_guard<std::mutex> lock(mClientTargetMutex);
+    auto key = std::make_pair(display, config);
+    auto it = mClientTargetProperties.find(key);
+    if (it != mClientTargetProperties.end()) {
+        *outClientTargetProperty = it->second;
+        return HWC2_ERROR_NONE;
+    }
+
+    int32_t width = 0;
+    int32_t height = 0;
+    RET_IF_ERR(mDispatch.getDisplayAttribute(mDevice, display, config, HWC2_ATTRIBUTE_WIDTH,
+                                             &width));
+    RET_IF_ERR(mDispatch.getDisplayAttribute(mDevice, display, config, HWC2_ATTRIBUTE_HEIGHT,
+                                             &height));
+
+    std::vector<int32_t> candidates;
+    if (kAllowRgb565) {
+        candidates.push_back(HAL_PIXEL_FORMAT_RGB_565);
+    }
+    candidates.push_back(HAL_PIXEL_FORMAT_RGBA_8888);
+
+    // the widest gamut the display has a color mode for, UNKNOWN last as
+    // before, for backends that only check the format
+    std::vector<int32_t> dataspaces;
+    uint32_t modeCount = 0;
+    std::vector<int32_t> modes;
+    if (mDispatch.getColorModes(mDevice, display, &modeCount, nullptr) == HWC2_ERROR_NONE) {
+        modes.resize(modeCount);
+        if (mDispatch.getColorModes(mDevice, display, &modeCount, modes.data()) !=
+            HWC2_ERROR_NONE) {
+            modes.clear();
+        }
+    }
+    if (std::find(modes.begin(), modes.end(), HAL_COLOR_MODE_DISPLAY_P3) != modes.end()) {
+        dataspaces.push_back(HAL_DATASPACE_DISPLAY_P3);
+    }
+    dataspaces.push_back(HAL_DATASPACE_V0_SRGB);
+    dataspaces.push_back(HAL_DATASPACE_UNKNOWN);
+
+    hwc_client_target_property_t property = {HAL_PIXEL_FORMAT_RGBA_8888, HAL_DATASPACE_UNKNOWN};
+    bool found = false;
+    for (size_t i = 0; i < candidates.size() && !found; ++i) {
+        for (auto dataspace : dataspaces) {
+            if (mDispatch.getClientTargetSupport(mDevice, display, width, height, candidates[i],
+                                                 dataspace) == HWC2_ERROR_NONE) {
+                property = {candidates[i], static_cast<android_dataspace_t>(dataspace)};
+                found = true;
+                break;
+            }
+        }
+    }
+
+    ALOGI("display %" PRId64 " config %u %dx%d: client target format %d dataspace %#x", display,
+          config, width, height, property.pixelFormat, property.dataspace);
+    mClientTargetProperties.emplace(key, property);
+    *outClientTargetProperty = property;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t HalImpl::getClientTargetProperty(int64_t display,
+                                         hwc_client_target_property_t* outClientTargetProperty,
+                                         DimmingStage* outDimmingStage) {
     if (outDimmingStage != nullptr)
         *outDimmingStage = DimmingStage::NONE;
 
-    return HWC2_ERROR_NONE;
+    // the backend knows best, if it tells
+    if (mDispatch.getClientTargetProperty &&
+        mDispatch.getClientTargetProperty(mDevice, display, outClientTargetProperty) ==
+                HWC2_ERROR_NONE) {
+        return HWC2_ERROR_NONE;
+    }
+
+    return probeClientTargetProperty(display, outClientTargetProperty);
 }
 
-int32_t HalImpl::validateDisplay(int64_t display, std::vector<int64_t>* outChangedLayers,
-                                 std::vector<Composition>* outCompositionTypes,
-                                 uint32_t* outDisplayRequestMask,
-                                 std::vector<int64_t>* outRequestedLayers,
-                                 std::vector<int32_t>* outRequestMasks,
-                                 ClientTargetProperty* outClientTargetProperty,
-                                 DimmingStage* outDimmingStage) {
+int32_t HalImpl::validateHwcDisplay(int64_t display, std::vector<int64_t>* outChangedLayers,
+                                    std::vector<Composition>* outCompositionTypes,
+                                    uint32_t* outDisplayRequestMask,
+                                    std::vector<int64_t>* outRequestedLayers,
+                                    std::vector<int32_t>* outRequestMasks) {
     uint32_t typesCount = 0;
     uint32_t reqsCount = 0;
     auto err = mDispatch.validateDisplay(mDevice, display, &typesCount, &reqsCount);
@@ -925,8 +2103,50 @@ int32_t HalImpl::validateDisplay(int64_t display, std::vector<int64_t>* outChang
     *outDisplayRequestMask = displayReqs;
     h2a::translate(hwcRequestedLayers, *outRequestedLayers);
 
+    return HWC2_ERROR_NONE;
+}
+
+int32_t HalImpl::validateDisplay(int64_t display, std::vector<int64_t>* outChangedLayers,
+                                 std::vector<Composition>* outCompositionTypes,
+                                 uint32_t* outDisplayRequestMask,
+                                 std::vector<int64_t>* outRequestedLayers,
+                                 std::vector<int32_t>* outRequestMasks,
+                                 ClientTargetProperty* outClientTargetProperty,
+                                 DimmingStage* outDimmingStage) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        *outDisplayRequestMask = 0;
+        outRequestedLayers->clear();
+        outRequestMasks->clear();
+        auto err = vd->validate(outChangedLayers, outCompositionTypes);
+        return err == HWC2_ERROR_HAS_CHANGES ? HWC2_ERROR_NONE : err;
+    }
+
+    auto squasher = getLayerSquasher(display);
+    if (squasher) {
+        prepareSquash(display, squasher);
+    }
+    RET_IF_ERR(validateHwcDisplay(display, outChangedLayers, outCompositionTypes,
+                                  outDisplayRequestMask, outRequestedLayers, outRequestMasks));
+    if (squasher && !squasher->onValidated(display, outChangedLayers, outCompositionTypes,
+                                           outRequestedLayers, outRequestMasks)) {
+        // hwc2 needs the client target for other layers as well, give it back
+        restoreCompositionTypes(display, squasher->abandon(display));
+        RET_IF_ERR(validateHwcDisplay(display, outChangedLayers, outCompositionTypes,
+                                      outDisplayRequestMask, outRequestedLayers,
+                                      outRequestMasks));
+        squasher->onValidated(display, outChangedLayers, outCompositionTypes,
+                              outRequestedLayers, outRequestMasks);
+    }
+    if (mSoftwareReadback) {
+        // the client has to accept these, so they are what gets presented
+        for (size_t i = 0; i < outChangedLayers->size(); ++i) {
+            mSoftwareReadback->setLayerComposition(display, (*outChangedLayers)[i],
+                                                   (*outCompositionTypes)[i]);
+        }
+    }
+
     hwc_client_target_property hwcProperty;
-    if (!getClientTargetProperty(&hwcProperty, outDimmingStage))
+    if (!getClientTargetProperty(display, &hwcProperty, outDimmingStage))
         h2a::translate(hwcProperty, *outClientTargetProperty);
     // else ignore this error
 
@@ -937,6 +2157,10 @@ int HalImpl::setExpectedPresentTime(
         [[maybe_unused]] int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime) {
     if (!expectedPresentTime.has_value()) return HWC2_ERROR_NONE;
 
+    if (auto controller = getRefreshRateController(display)) {
+        controller->onExpectedPresentTime(display, expectedPresentTime->timestampNanos);
+    }
+
 #if 0
     /* Drmhwc2 not support this feature */
     if (halDisplay->getPendingExpectedPresentTime() != 0) {
@@ -949,6 +2173,37 @@ int HalImpl::setExpectedPresentTime(
     return HWC2_ERROR_NONE;
 }
 
+int32_t HalImpl::getLayerGenericMetadataKeys(std::vector<LayerGenericMetadataKey>* keys) {
+    // hwc2 has the same, or the service starts over
+    if (mServingSnapshot) {
+        *keys = mLayerGenericMetadataKeys;
+        return HWC2_ERROR_NONE;
+    }
+    if (!mDispatch.getLayerGenericMetadataKey) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+
+    *keys = mLayerGenericMetadataKeys;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t HalImpl::setLayerGenericMetadata(int64_t display, int64_t layer,
+                                         const LayerGenericMetadataKey& key,
+                                         const std::vector<uint8_t>& value) {
+    if (auto vd = getSoftwareVirtualDisplay(display)) {
+        return vd->checkLayer(layer);
+    }
+    if (!mDispatch.setLayerGenericMetadata) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    hwc2_layer_t hwcLayer = 0;
+    a2h::translate(layer, hwcLayer);
+
+    return mDispatch.setLayerGenericMetadata(mDevice, display, hwcLayer, key.name.size(),
+                                             key.name.c_str(), key.mandatory, value.size(),
+                                             value.data());
+}
+
 int32_t HalImpl::getRCDLayerSupport([[maybe_unused]] int64_t display, [[maybe_unused]] bool& outSupport) {
     /* Drmhwc2 not support this feature */
     return HWC2_ERROR_UNSUPPORTED;
@@ -16,10 +16,28 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
 #include <unordered_set>
 
 #include "include/IComposerHal.h"
+#include "include/RkHwcDeviceModule.h"
+#include "BrightnessCoalescer.h"
+#include "DispatchFn.h"
+#include "DisplaySnapshot.h"
+#include "LayerSquasher.h"
+#include "PlaneDump.h"
+#include "RefreshRateController.h"
+#include "SoftwareReadback.h"
+#include "SoftwareVirtualDisplay.h"
+#include "WorkerPool.h"
 #include <utils/String8.h>
 #include <hardware/hwcomposer2.h>
 
@@ -35,22 +53,28 @@ namespace aidl::android::hardware::graphics::composer3::impl {
 class HalImpl : public IComposerHal {
   public:
     HalImpl() = default;
-    virtual ~HalImpl() = default;
+    virtual ~HalImpl();
 
     bool initWithDevice(hwc2_device_t* device, bool requireReliablePresentFence);
+    // Answers the client from snapshot while hwc2 is opened on a thread of
+    // its own. The service aborts if that fails, the next start goes without.
+    void initWithSnapshot(DisplaySnapshot snapshot);
 
     void getCapabilities(std::vector<Capability>* caps) override;
     void dumpDebugInfo(std::string* output) override;
+    void resetDebugStats() override;
     bool hasCapability(Capability cap) override;
+    void waitForDevice() override;
 
     void registerEventCallback(EventCallback* callback) override;
-    void unregisterEventCallback() override;
+    void unregisterEventCallback(EventCallback* callback) override;
 
     int32_t acceptDisplayChanges(int64_t display) override;
     int32_t createLayer(int64_t display, int64_t* outLayer) override;
     int32_t createVirtualDisplay(uint32_t width, uint32_t height, AidlPixelFormat format,
                                  VirtualDisplay* outDisplay) override;
     int32_t destroyLayer(int64_t display, int64_t layer) override;
+    int32_t destroyLayers(int64_t display, const std::vector<int64_t>& layers) override;
     int32_t destroyVirtualDisplay(int64_t display) override;
     int32_t getActiveConfig(int64_t display, int32_t* outConfig) override;
     int32_t getColorModes(int64_t display, std::vector<ColorMode>* outModes) override;
@@ -157,8 +181,16 @@ class HalImpl : public IComposerHal {
     int32_t setExpectedPresentTime(
             int64_t display,
             const std::optional<ClockMonotonicTimestamp> expectedPresentTime) override;
+    int32_t getLayerGenericMetadataKeys(std::vector<LayerGenericMetadataKey>* keys) override;
+    int32_t setLayerGenericMetadata(int64_t display, int64_t layer,
+                                    const LayerGenericMetadataKey& key,
+                                    const std::vector<uint8_t>& value) override;
 
     EventCallback* getEventCallback() { return mEventCallback; }
+    void invalidateClientTargetProperty(int64_t display);
+    void onDisplayDisconnected(int64_t display);
+    // false if the client knows about the display from the snapshot already
+    bool onDisplayHotplug(int64_t display, bool connected);
 
 protected:
     template <typename T>
@@ -173,6 +205,23 @@ protected:
         }
     }
 
+#ifdef HWC3_DISPATCH_STATS
+    template <typename Pfn>
+    bool initDispatch(hwc2_function_descriptor_t desc, DispatchFn<Pfn>* outFn) {
+        Pfn pfn = nullptr;
+        if (!initDispatch(desc, &pfn)) {
+            return false;
+        }
+        *outFn = pfn;
+        if (std::find(mDispatchStats.begin(), mDispatchStats.end(), outFn) ==
+            mDispatchStats.end()) {
+            outFn->init(desc);
+            mDispatchStats.push_back(outFn);
+        }
+        return true;
+    }
+#endif
+
     virtual bool initDispatch() {
         if (!initDispatch(HWC2_FUNCTION_ACCEPT_DISPLAY_CHANGES, &mDispatch.acceptDisplayChanges) ||
             !initDispatch(HWC2_FUNCTION_CREATE_LAYER, &mDispatch.createLayer) ||
@@ -263,13 +312,87 @@ protected:
             ALOGE("failed to get hwcomposer2.4 functions %s(%d)", __FUNCTION__, __LINE__);
             return false;
         }
+        /* composer 2.4 optional */
+        if (!initDispatch(HWC2_FUNCTION_GET_CLIENT_TARGET_PROPERTY,
+                          &mDispatch.getClientTargetProperty)) {
+            mDispatch.getClientTargetProperty = nullptr;
+        }
+        /* composer 2.2 optional, writeback connector */
+        if (!initDispatch(HWC2_FUNCTION_SET_READBACK_BUFFER, &mDispatch.setReadbackBuffer) ||
+            !initDispatch(HWC2_FUNCTION_GET_READBACK_BUFFER_ATTRIBUTES,
+                          &mDispatch.getReadbackBufferAttributes) ||
+            !initDispatch(HWC2_FUNCTION_GET_READBACK_BUFFER_FENCE,
+                          &mDispatch.getReadbackBufferFence)) {
+            mDispatch.setReadbackBuffer = nullptr;
+            mDispatch.getReadbackBufferAttributes = nullptr;
+            mDispatch.getReadbackBufferFence = nullptr;
+        }
+        /* rockchip vendor, optional */
+        if (!initDispatch(static_cast<hwc2_function_descriptor_t>(
+                                  RK_HWC2_FUNCTION_GET_OVERLAY_SUPPORT),
+                          &mDispatch.getOverlaySupport)) {
+            mDispatch.getOverlaySupport = nullptr;
+        }
+        if (!initDispatch(HWC2_FUNCTION_GET_LAYER_GENERIC_METADATA_KEY,
+                          &mDispatch.getLayerGenericMetadataKey) ||
+            !initDispatch(HWC2_FUNCTION_SET_LAYER_GENERIC_METADATA,
+                          &mDispatch.setLayerGenericMetadata)) {
+            mDispatch.getLayerGenericMetadataKey = nullptr;
+            mDispatch.setLayerGenericMetadata = nullptr;
+        }
 
         return true;
     }
 
 
 private:
-    void initCaps();
+    // both fail if hwc2 does not agree with the snapshot the client was given
+    bool initCaps();
+    bool initLayerGenericMetadataKeys();
+    void initOverlaySupport();
+    // from RK_HWC2_FUNCTION_GET_OVERLAY_SUPPORT, if the backend has it
+    bool getBackendOverlaySupport(PlaneDump* out);
+    int32_t getClientTargetProperty(int64_t display,
+                                    hwc_client_target_property_t* outClientTargetProperty,
+                                    DimmingStage* outDimmingStage);
+    int32_t probeClientTargetProperty(int64_t display,
+                                      hwc_client_target_property_t* outClientTargetProperty);
+    std::shared_ptr<SoftwareVirtualDisplay> getSoftwareVirtualDisplay(int64_t display);
+    // created by the client or composed on the CPU
+    bool isVirtualDisplay(int64_t display);
+    // null unless static layers of the display are squashed
+    LayerSquasher* getLayerSquasher(int64_t display);
+    // null unless the refresh rate of the display is lowered for its content
+    RefreshRateController* getRefreshRateController(int64_t display);
+    // hands the configs the controller may pick from for the client's config
+    void setRefreshRateClientConfig(int64_t display, int32_t config);
+    // RefreshRateController::SwitchFn
+    bool switchRefreshRate(int64_t display, int32_t config, nsecs_t now);
+    int32_t getActiveSize(int64_t display, int32_t* outWidth, int32_t* outHeight);
+    // tells hwc2 about the squashed layers, returns true if there are any
+    bool prepareSquash(int64_t display, LayerSquasher* squasher);
+    void restoreCompositionTypes(int64_t display,
+                                 const std::vector<std::pair<int64_t, Composition>>& types);
+    int32_t validateHwcDisplay(int64_t display, std::vector<int64_t>* outChangedLayers,
+                               std::vector<Composition>* outCompositionTypes,
+                               uint32_t* outDisplayRequestMask,
+                               std::vector<int64_t>* outRequestedLayers,
+                               std::vector<int32_t>* outRequestMasks);
+    // lowest free virtual display id, -1 if all are taken
+    int64_t allocateVirtualDisplayId() REQUIRES(mVirtualDisplayMutex);
+
+    void registerHwcCallbacks();
+    // runs on mDeviceThread
+    void initDeviceForSnapshot();
+    // the display as it was before the restart, null once hwc2 is up; waits
+    // for hwc2 if the snapshot does not have the display
+    const DisplaySnapshot::Display* getSnapshotDisplay(int64_t display);
+    // tells the client about the displays that changed while the service was down
+    void checkSnapshotDisplays() REQUIRES(mDeviceMutex);
+    // DisplaySnapshotWriter::CaptureFn
+    bool captureSnapshot(DisplaySnapshot* outSnapshot);
+    bool captureDisplay(int64_t display, DisplaySnapshot::Display* outDisplay);
+    void scheduleSnapshot();
 
     hwc2_device_t *mDevice;
     EventCallback* mEventCallback;
@@ -277,84 +400,144 @@ private:
     std::unique_ptr<ExynosHWCCtx> mHwcCtx;
 #endif
     std::unordered_set<Capability> mCaps;
+    std::vector<LayerGenericMetadataKey> mLayerGenericMetadataKeys;
+    // only what the backend reports
+    std::optional<OverlayProperties> mOverlayProperties;
+    // set when readback falls back to the CPU, see SoftwareReadback
+    std::unique_ptr<SoftwareReadback> mSoftwareReadback;
+    // set when vendor.hwc3.squash.frames is, see LayerSquasher
+    std::unique_ptr<LayerSquasher> mLayerSquasher;
+    // set when vendor.hwc3.drr.enable is, see RefreshRateController
+    std::unique_ptr<RefreshRateController> mRefreshRateController;
+    // set when hwc2 can change the brightness
+    std::unique_ptr<BrightnessCoalescer> mBrightnessCoalescer;
+
+    // virtual displays are composed on the CPU, see SoftwareVirtualDisplay
+    bool mSoftwareVirtualDisplay = false;
+    std::unique_ptr<WorkerPool> mVirtualDisplayPool;
+    // vendor.hwc3.virtual.max_count
+    uint32_t mMaxVirtualDisplays = 0;
+    std::mutex mVirtualDisplayMutex;
+    std::map<int64_t, std::shared_ptr<SoftwareVirtualDisplay>> mVirtualDisplays
+            GUARDED_BY(mVirtualDisplayMutex);
+    // ids of the virtual displays created through hwc2
+    std::set<int64_t> mHwcVirtualDisplays GUARDED_BY(mVirtualDisplayMutex);
+
+    // the displays as they were before a restart, see DisplaySnapshot
+    std::unique_ptr<const DisplaySnapshot> mSnapshot;
+    // queries of the displays in mSnapshot are answered from it
+    std::atomic<bool> mServingSnapshot = false;
+    // hwc2 is up and has the callbacks, false only while started from a snapshot
+    std::atomic<bool> mDeviceReady = true;
+    std::mutex mDeviceMutex;
+    std::condition_variable mDeviceCondition;
+    std::thread mDeviceThread;
+    // what became of mSnapshot, set before mDeviceReady
+    nsecs_t mSnapshotServed = 0;
+    nsecs_t mSnapshotDeviceReady = 0;
+    uint32_t mSnapshotUnchanged = 0;
+    uint32_t mSnapshotChanged = 0;
+    uint32_t mSnapshotGone = 0;
 
+    std::mutex mDisplayMutex;
+    std::set<int64_t> mConnectedDisplays GUARDED_BY(mDisplayMutex);
+    // displays announced from the snapshot, true once hwc2 reported them too
+    std::map<int64_t, bool> mAnnouncedDisplays GUARDED_BY(mDisplayMutex);
+    // set when vendor.hwc3.snapshot.enable is
+    std::unique_ptr<DisplaySnapshotWriter> mSnapshotWriter;
+
+    // client target property per (display, config), probed through getClientTargetSupport
+    std::mutex mClientTargetMutex;
+    std::map<std::pair<int64_t, hwc2_config_t>, hwc_client_target_property_t>
+            mClientTargetProperties;
+
+#ifdef HWC3_DISPATCH_STATS
+    // the functions resolved so far, in mDispatch
+    std::vector<DispatchStats*> mDispatchStats;
+#endif
+    // timed per call when built with HWC3_DISPATCH_STATS, see DispatchFn
     struct {
-        HWC2_PFN_ACCEPT_DISPLAY_CHANGES acceptDisplayChanges;
-        HWC2_PFN_CREATE_LAYER createLayer;
-        HWC2_PFN_CREATE_VIRTUAL_DISPLAY createVirtualDisplay;
-        HWC2_PFN_DESTROY_LAYER destroyLayer;
-        HWC2_PFN_DESTROY_VIRTUAL_DISPLAY destroyVirtualDisplay;
-        HWC2_PFN_DUMP dump;
-        HWC2_PFN_GET_ACTIVE_CONFIG getActiveConfig;
-        HWC2_PFN_GET_CHANGED_COMPOSITION_TYPES getChangedCompositionTypes;
-        HWC2_PFN_GET_CLIENT_TARGET_SUPPORT getClientTargetSupport;
-        HWC2_PFN_GET_COLOR_MODES getColorModes;
-        HWC2_PFN_GET_DISPLAY_ATTRIBUTE getDisplayAttribute;
-        HWC2_PFN_GET_DISPLAY_CONFIGS getDisplayConfigs;
-        HWC2_PFN_GET_DISPLAY_NAME getDisplayName;
-        HWC2_PFN_GET_DISPLAY_REQUESTS getDisplayRequests;
-        HWC2_PFN_GET_DISPLAY_TYPE getDisplayType;
-        HWC2_PFN_GET_DOZE_SUPPORT getDozeSupport;
-        HWC2_PFN_GET_HDR_CAPABILITIES getHdrCapabilities;
-        HWC2_PFN_GET_MAX_VIRTUAL_DISPLAY_COUNT getMaxVirtualDisplayCount;
-        HWC2_PFN_GET_RELEASE_FENCES getReleaseFences;
-        HWC2_PFN_PRESENT_DISPLAY presentDisplay;
-        HWC2_PFN_REGISTER_CALLBACK registerCallback;
-        HWC2_PFN_SET_ACTIVE_CONFIG setActiveConfig;
-        HWC2_PFN_SET_CLIENT_TARGET setClientTarget;
-        HWC2_PFN_SET_COLOR_MODE setColorMode;
-        HWC2_PFN_SET_COLOR_TRANSFORM setColorTransform;
-        HWC2_PFN_SET_CURSOR_POSITION setCursorPosition;
-        HWC2_PFN_SET_LAYER_BLEND_MODE setLayerBlendMode;
-        HWC2_PFN_SET_LAYER_BUFFER setLayerBuffer;
-        HWC2_PFN_SET_LAYER_COLOR setLayerColor;
-        HWC2_PFN_SET_LAYER_COMPOSITION_TYPE setLayerCompositionType;
-        HWC2_PFN_SET_LAYER_DATASPACE setLayerDataspace;
-        HWC2_PFN_SET_LAYER_DISPLAY_FRAME setLayerDisplayFrame;
-        HWC2_PFN_SET_LAYER_PLANE_ALPHA setLayerPlaneAlpha;
-        HWC2_PFN_SET_LAYER_SIDEBAND_STREAM setLayerSidebandStream;
-        HWC2_PFN_SET_LAYER_SOURCE_CROP setLayerSourceCrop;
-        HWC2_PFN_SET_LAYER_SURFACE_DAMAGE setLayerSurfaceDamage;
-        HWC2_PFN_SET_LAYER_TRANSFORM setLayerTransform;
-        HWC2_PFN_SET_LAYER_VISIBLE_REGION setLayerVisibleRegion;
-        HWC2_PFN_SET_LAYER_Z_ORDER setLayerZOrder;
-        HWC2_PFN_SET_OUTPUT_BUFFER setOutputBuffer;
-        HWC2_PFN_SET_POWER_MODE setPowerMode;
-        HWC2_PFN_SET_VSYNC_ENABLED setVsyncEnabled;
-        HWC2_PFN_VALIDATE_DISPLAY validateDisplay;
+        DispatchFn<HWC2_PFN_ACCEPT_DISPLAY_CHANGES> acceptDisplayChanges;
+        DispatchFn<HWC2_PFN_CREATE_LAYER> createLayer;
+        DispatchFn<HWC2_PFN_CREATE_VIRTUAL_DISPLAY> createVirtualDisplay;
+        DispatchFn<HWC2_PFN_DESTROY_LAYER> destroyLayer;
+        DispatchFn<HWC2_PFN_DESTROY_VIRTUAL_DISPLAY> destroyVirtualDisplay;
+        DispatchFn<HWC2_PFN_DUMP> dump;
+        DispatchFn<HWC2_PFN_GET_ACTIVE_CONFIG> getActiveConfig;
+        DispatchFn<HWC2_PFN_GET_CHANGED_COMPOSITION_TYPES> getChangedCompositionTypes;
+        DispatchFn<HWC2_PFN_GET_CLIENT_TARGET_SUPPORT> getClientTargetSupport;
+        DispatchFn<HWC2_PFN_GET_COLOR_MODES> getColorModes;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_ATTRIBUTE> getDisplayAttribute;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_CONFIGS> getDisplayConfigs;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_NAME> getDisplayName;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_REQUESTS> getDisplayRequests;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_TYPE> getDisplayType;
+        DispatchFn<HWC2_PFN_GET_DOZE_SUPPORT> getDozeSupport;
+        DispatchFn<HWC2_PFN_GET_HDR_CAPABILITIES> getHdrCapabilities;
+        DispatchFn<HWC2_PFN_GET_MAX_VIRTUAL_DISPLAY_COUNT> getMaxVirtualDisplayCount;
+        DispatchFn<HWC2_PFN_GET_RELEASE_FENCES> getReleaseFences;
+        DispatchFn<HWC2_PFN_PRESENT_DISPLAY> presentDisplay;
+        DispatchFn<HWC2_PFN_REGISTER_CALLBACK> registerCallback;
+        DispatchFn<HWC2_PFN_SET_ACTIVE_CONFIG> setActiveConfig;
+        DispatchFn<HWC2_PFN_SET_CLIENT_TARGET> setClientTarget;
+        DispatchFn<HWC2_PFN_SET_COLOR_MODE> setColorMode;
+        DispatchFn<HWC2_PFN_SET_COLOR_TRANSFORM> setColorTransform;
+        DispatchFn<HWC2_PFN_SET_CURSOR_POSITION> setCursorPosition;
+        DispatchFn<HWC2_PFN_SET_LAYER_BLEND_MODE> setLayerBlendMode;
+        DispatchFn<HWC2_PFN_SET_LAYER_BUFFER> setLayerBuffer;
+        DispatchFn<HWC2_PFN_SET_LAYER_COLOR> setLayerColor;
+        DispatchFn<HWC2_PFN_SET_LAYER_COMPOSITION_TYPE> setLayerCompositionType;
+        DispatchFn<HWC2_PFN_SET_LAYER_DATASPACE> setLayerDataspace;
+        DispatchFn<HWC2_PFN_SET_LAYER_DISPLAY_FRAME> setLayerDisplayFrame;
+        DispatchFn<HWC2_PFN_SET_LAYER_PLANE_ALPHA> setLayerPlaneAlpha;
+        DispatchFn<HWC2_PFN_SET_LAYER_SIDEBAND_STREAM> setLayerSidebandStream;
+        DispatchFn<HWC2_PFN_SET_LAYER_SOURCE_CROP> setLayerSourceCrop;
+        DispatchFn<HWC2_PFN_SET_LAYER_SURFACE_DAMAGE> setLayerSurfaceDamage;
+        DispatchFn<HWC2_PFN_SET_LAYER_TRANSFORM> setLayerTransform;
+        DispatchFn<HWC2_PFN_SET_LAYER_VISIBLE_REGION> setLayerVisibleRegion;
+        DispatchFn<HWC2_PFN_SET_LAYER_Z_ORDER> setLayerZOrder;
+        DispatchFn<HWC2_PFN_SET_OUTPUT_BUFFER> setOutputBuffer;
+        DispatchFn<HWC2_PFN_SET_POWER_MODE> setPowerMode;
+        DispatchFn<HWC2_PFN_SET_VSYNC_ENABLED> setVsyncEnabled;
+        DispatchFn<HWC2_PFN_VALIDATE_DISPLAY> validateDisplay;
 
         /* composer 2.2 */
-        HWC2_PFN_SET_LAYER_FLOAT_COLOR setLayerFloatColor;
-        HWC2_PFN_SET_LAYER_PER_FRAME_METADATA setLayerPerFrameMetadata;
-        HWC2_PFN_GET_PER_FRAME_METADATA_KEYS getPerFrameMetadataKeys;
-        HWC2_PFN_SET_READBACK_BUFFER setReadbackBuffer;
-        HWC2_PFN_GET_READBACK_BUFFER_ATTRIBUTES getReadbackBufferAttributes;
-        HWC2_PFN_GET_READBACK_BUFFER_FENCE getReadbackBufferFence;
-        HWC2_PFN_GET_RENDER_INTENTS getRenderIntents;
-        HWC2_PFN_SET_COLOR_MODE_WITH_RENDER_INTENT setColorModeWithRenderIntent;
-        HWC2_PFN_GET_DATASPACE_SATURATION_MATRIX getDataspaceSaturationMatrix;
+        DispatchFn<HWC2_PFN_SET_LAYER_FLOAT_COLOR> setLayerFloatColor;
+        DispatchFn<HWC2_PFN_SET_LAYER_PER_FRAME_METADATA> setLayerPerFrameMetadata;
+        DispatchFn<HWC2_PFN_GET_PER_FRAME_METADATA_KEYS> getPerFrameMetadataKeys;
+        DispatchFn<HWC2_PFN_SET_READBACK_BUFFER> setReadbackBuffer;
+        DispatchFn<HWC2_PFN_GET_READBACK_BUFFER_ATTRIBUTES> getReadbackBufferAttributes;
+        DispatchFn<HWC2_PFN_GET_READBACK_BUFFER_FENCE> getReadbackBufferFence;
+        DispatchFn<HWC2_PFN_GET_RENDER_INTENTS> getRenderIntents;
+        DispatchFn<HWC2_PFN_SET_COLOR_MODE_WITH_RENDER_INTENT> setColorModeWithRenderIntent;
+        DispatchFn<HWC2_PFN_GET_DATASPACE_SATURATION_MATRIX> getDataspaceSaturationMatrix;
 
         /* composer 2.3 */
-        HWC2_PFN_GET_DISPLAY_IDENTIFICATION_DATA getDisplayIdentificationData;
-        HWC2_PFN_SET_LAYER_COLOR_TRANSFORM setLayerColorTransform;
-        HWC2_PFN_GET_DISPLAYED_CONTENT_SAMPLING_ATTRIBUTES getDisplayedContentSamplingAttributes;
-        HWC2_PFN_SET_DISPLAYED_CONTENT_SAMPLING_ENABLED setDisplayedContentSamplingEnabled;
-        HWC2_PFN_GET_DISPLAYED_CONTENT_SAMPLE getDisplayedContentSample;
-        HWC2_PFN_GET_DISPLAY_CAPABILITIES getDisplayCapabilities;
-        HWC2_PFN_SET_LAYER_PER_FRAME_METADATA_BLOBS setLayerPerFrameMetadataBlobs;
-        HWC2_PFN_GET_DISPLAY_BRIGHTNESS_SUPPORT getDisplayBrightnessSupport;
-        HWC2_PFN_SET_DISPLAY_BRIGHTNESS setDisplayBrightness;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_IDENTIFICATION_DATA> getDisplayIdentificationData;
+        DispatchFn<HWC2_PFN_SET_LAYER_COLOR_TRANSFORM> setLayerColorTransform;
+        DispatchFn<HWC2_PFN_GET_DISPLAYED_CONTENT_SAMPLING_ATTRIBUTES>
+                getDisplayedContentSamplingAttributes;
+        DispatchFn<HWC2_PFN_SET_DISPLAYED_CONTENT_SAMPLING_ENABLED>
+                setDisplayedContentSamplingEnabled;
+        DispatchFn<HWC2_PFN_GET_DISPLAYED_CONTENT_SAMPLE> getDisplayedContentSample;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_CAPABILITIES> getDisplayCapabilities;
+        DispatchFn<HWC2_PFN_SET_LAYER_PER_FRAME_METADATA_BLOBS> setLayerPerFrameMetadataBlobs;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_BRIGHTNESS_SUPPORT> getDisplayBrightnessSupport;
+        DispatchFn<HWC2_PFN_SET_DISPLAY_BRIGHTNESS> setDisplayBrightness;
 
         /* composer 2.4 */
-        HWC2_PFN_GET_DISPLAY_CONNECTION_TYPE getDisplayConnectionType;
-        HWC2_PFN_GET_DISPLAY_VSYNC_PERIOD getDisplayVsyncPeriod;
-        HWC2_PFN_SET_ACTIVE_CONFIG_WITH_CONSTRAINTS setActiveConfigWithConstraints;
-        HWC2_PFN_SET_AUTO_LOW_LATENCY_MODE setAutoLowLatencyMode;
-        HWC2_PFN_GET_SUPPORTED_CONTENT_TYPES getSupportedContentTypes;
-        HWC2_PFN_SET_CONTENT_TYPE setContentType;
-        HWC2_PFN_GET_CLIENT_TARGET_PROPERTY getClientTargetProperty;
-        HWC2_PFN_SET_LAYER_GENERIC_METADATA setLayerGenericMetadata;
-        HWC2_PFN_GET_LAYER_GENERIC_METADATA_KEY getLayerGenericMetadataKey;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_CONNECTION_TYPE> getDisplayConnectionType;
+        DispatchFn<HWC2_PFN_GET_DISPLAY_VSYNC_PERIOD> getDisplayVsyncPeriod;
+        DispatchFn<HWC2_PFN_SET_ACTIVE_CONFIG_WITH_CONSTRAINTS> setActiveConfigWithConstraints;
+        DispatchFn<HWC2_PFN_SET_AUTO_LOW_LATENCY_MODE> setAutoLowLatencyMode;
+        DispatchFn<HWC2_PFN_GET_SUPPORTED_CONTENT_TYPES> getSupportedContentTypes;
+        DispatchFn<HWC2_PFN_SET_CONTENT_TYPE> setContentType;
+        DispatchFn<HWC2_PFN_GET_CLIENT_TARGET_PROPERTY> getClientTargetProperty;
+        DispatchFn<HWC2_PFN_SET_LAYER_GENERIC_METADATA> setLayerGenericMetadata;
+        DispatchFn<HWC2_PFN_GET_LAYER_GENERIC_METADATA_KEY> getLayerGenericMetadataKey;
+
+        /* rockchip vendor */
+        DispatchFn<RK_HWC2_PFN_GET_OVERLAY_SUPPORT> getOverlaySupport;
     } mDispatch = {};
 };
 
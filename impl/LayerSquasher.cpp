@@ -0,0 +1,591 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LayerSquasher.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <hardware/gralloc.h>
+#include <hardware/hwcomposer2.h>
+#include <sync/sync.h>
+#include <system/graphics.h>
+#include <ui/GraphicBufferAllocator.h>
+#include <ui/GraphicBufferMapper.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// how long to wait for hwc2 to let go of a cache buffer before freeing it
+static constexpr int kReleaseTimeoutMs = 1000;
+
+// sets field, returns whether that changed it
+template <typename T>
+static bool assign(T& field, const T& value) {
+    if (field == value) {
+        return false;
+    }
+    field = value;
+    return true;
+}
+
+template <typename Rect>
+static bool assignRect(Rect& field, const Rect& value) {
+    if (field.left == value.left && field.top == value.top && field.right == value.right &&
+        field.bottom == value.bottom) {
+        return false;
+    }
+    field = value;
+    return true;
+}
+
+// what hwc2 reads from memory for the layer each frame
+static uint64_t getScanoutBytes(const ShadowLayer& layer, const SwRect& screen) {
+    if (layer.composition == Composition::SOLID_COLOR) {
+        return 0;
+    }
+    SwRect visible = intersectRect(layer.frame, screen);
+    if (visible.isEmpty()) {
+        return 0;
+    }
+    uint64_t bytesPerPixel = layer.bufferFormat == HAL_PIXEL_FORMAT_RGB_565 ? 2 : 4;
+    return static_cast<uint64_t>(visible.right - visible.left) * (visible.bottom - visible.top) *
+            bytesPerPixel;
+}
+
+uint32_t LayerSquasher::getStaticFramesProperty() {
+    return ::android::base::GetUintProperty<uint32_t>("vendor.hwc3.squash.frames", 0, 1000);
+}
+
+LayerSquasher::LayerSquasher(uint32_t staticFrames) : mStaticFrames(staticFrames) {}
+
+LayerSquasher::~LayerSquasher() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& [display, state] : mDisplays) {
+        freeCache(state);
+    }
+}
+
+void LayerSquasher::freeCache(Display& state) {
+    for (auto& cache : state.cache) {
+        if (!cache.handle) {
+            continue;
+        }
+        if (cache.releaseFence.ok()) {
+            sync_wait(cache.releaseFence.get(), kReleaseTimeoutMs);
+        }
+        ::android::GraphicBufferAllocator::get().free(cache.handle);
+        cache = CacheBuffer();
+    }
+    state.composed = -1;
+    state.hwcTarget = -1;
+    state.shown = -1;
+}
+
+void LayerSquasher::removeDisplay(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it != mDisplays.end()) {
+        freeCache(it->second);
+        mDisplays.erase(it);
+    }
+}
+
+void LayerSquasher::destroyLayer(int64_t display, int64_t layer) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it != mDisplays.end()) {
+        it->second.stack.layers.erase(layer);
+        it->second.ages.erase(layer);
+    }
+}
+
+void LayerSquasher::destroyLayers(int64_t display, const std::vector<int64_t>& layers) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return;
+    }
+    for (int64_t layer : layers) {
+        it->second.stack.layers.erase(layer);
+        it->second.ages.erase(layer);
+    }
+}
+
+template <typename F>
+void LayerSquasher::update(int64_t display, int64_t layer, F&& change) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto& state = mDisplays[display].stack.layers[layer];
+    if (change(state)) {
+        ++state.changeCount;
+    }
+}
+
+void LayerSquasher::setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                                   int acquireFence) {
+    ::android::base::unique_fd fence(acquireFence);
+    int32_t format = 0;
+    if (buffer) {
+        ::android::ui::PixelFormat pixelFormat;
+        if (::android::GraphicBufferMapper::get().getPixelFormatRequested(buffer,
+                                                                          &pixelFormat) ==
+            ::android::OK) {
+            format = static_cast<int32_t>(pixelFormat);
+        }
+    }
+
+    update(display, layer, [&](ShadowLayer& state) {
+        state.acquireFence = std::move(fence);
+        // a null buffer is a cached slot, the damage tells whether it was redrawn
+        if (!buffer || buffer == state.buffer) {
+            return false;
+        }
+        state.buffer = buffer;
+        state.bufferFormat = format;
+        return true;
+    });
+}
+
+void LayerSquasher::setLayerSurfaceDamage(int64_t display, int64_t layer, bool contentChanged) {
+    update(display, layer, [&](ShadowLayer&) { return contentChanged; });
+}
+
+void LayerSquasher::setLayerColor(int64_t display, int64_t layer, uint32_t rgba) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assign(state.color, rgba);
+    });
+}
+
+void LayerSquasher::setLayerComposition(int64_t display, int64_t layer, Composition type) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assign(state.composition, type);
+    });
+}
+
+void LayerSquasher::setLayerDisplayFrame(int64_t display, int64_t layer, const SwRect& frame) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assignRect(state.frame, frame);
+    });
+}
+
+void LayerSquasher::setLayerSourceCrop(int64_t display, int64_t layer, const SwFRect& crop) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assignRect(state.crop, crop);
+    });
+}
+
+void LayerSquasher::setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assign(state.alpha, alpha);
+    });
+}
+
+void LayerSquasher::setLayerBlendMode(int64_t display, int64_t layer, SwLayer::Blend blend) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assign(state.blend, blend);
+    });
+}
+
+void LayerSquasher::setLayerDataspace(int64_t display, int64_t layer, int32_t dataspace) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assign(state.dataspace, dataspace);
+    });
+}
+
+void LayerSquasher::setLayerTransform(int64_t display, int64_t layer, uint32_t transform) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assign(state.transform, transform);
+    });
+}
+
+void LayerSquasher::setLayerZOrder(int64_t display, int64_t layer, uint32_t z) {
+    update(display, layer, [&](ShadowLayer& state) {
+        return assign(state.z, z);
+    });
+}
+
+std::vector<int64_t> LayerSquasher::findRun(const Display& state, uint32_t width,
+                                            uint32_t height, uint64_t* outBytes,
+                                            int32_t* outDataspace) {
+    std::vector<std::pair<uint32_t, int64_t>> order;
+    for (const auto& [id, layer] : state.stack.layers) {
+        if (layer.composition == Composition::CLIENT) {
+            // the client target is taken
+            return {};
+        }
+        order.emplace_back(layer.z, id);
+    }
+    std::sort(order.begin(), order.end());
+
+    const SwRect screen = {0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height)};
+    std::vector<int64_t> best;
+    std::vector<int64_t> run;
+    uint64_t runBytes = 0;
+    // the cache holds a single dataspace, that of the buffers in it
+    int32_t runDataspace = HAL_DATASPACE_UNKNOWN;
+    bool runHasBuffer = false;
+    auto endRun = [&]() {
+        if (run.size() > best.size()) {
+            best = run;
+            *outBytes = runBytes;
+            *outDataspace = runDataspace;
+        }
+        run.clear();
+        runBytes = 0;
+        runDataspace = HAL_DATASPACE_UNKNOWN;
+        runHasBuffer = false;
+    };
+
+    for (const auto& [z, id] : order) {
+        const ShadowLayer& layer = state.stack.layers.at(id);
+        auto age = state.ages.find(id);
+        bool candidate = age != state.ages.end() && age->second.second >= mStaticFrames;
+        bool hasBuffer = layer.composition == Composition::DEVICE;
+        if (hasBuffer) {
+            // video is neither static nor cheap to convert
+            candidate = candidate && layer.buffer &&
+                    SoftwareCompositor::isSupportedSourceFormat(layer.bufferFormat) &&
+                    !SoftwareCompositor::isYuvFormat(layer.bufferFormat);
+        } else {
+            candidate = candidate && layer.composition == Composition::SOLID_COLOR;
+        }
+        if (!candidate) {
+            endRun();
+            continue;
+        }
+        if (hasBuffer && runHasBuffer && layer.dataspace != runDataspace) {
+            endRun();
+        }
+        if (hasBuffer && !runHasBuffer) {
+            runDataspace = layer.dataspace;
+            runHasBuffer = true;
+        }
+        run.push_back(id);
+        runBytes += getScanoutBytes(layer, screen);
+    }
+    endRun();
+    return best;
+}
+
+int LayerSquasher::findComposed(const Display& state, const std::vector<int64_t>& run,
+                                uint32_t width, uint32_t height) {
+    if (state.composed < 0 || state.composedMembers.size() != run.size()) {
+        return -1;
+    }
+    const CacheBuffer& cache = state.cache[state.composed];
+    if (cache.width != width || cache.height != height) {
+        return -1;
+    }
+    for (size_t i = 0; i < run.size(); ++i) {
+        const auto& [id, changeCount] = state.composedMembers[i];
+        if (id != run[i] || state.stack.layers.at(id).changeCount != changeCount) {
+            return -1;
+        }
+    }
+    return state.composed;
+}
+
+int LayerSquasher::compose(Display& state, const std::vector<int64_t>& run, uint32_t width,
+                           uint32_t height) {
+    // never draw into what is on screen
+    const int index = state.shown == 0 ? 1 : 0;
+    CacheBuffer& cache = state.cache[index];
+    if (cache.handle && (cache.width != width || cache.height != height)) {
+        if (cache.releaseFence.ok()) {
+            sync_wait(cache.releaseFence.get(), kReleaseTimeoutMs);
+        }
+        ::android::GraphicBufferAllocator::get().free(cache.handle);
+        cache = CacheBuffer();
+    }
+    if (!cache.handle) {
+        uint32_t stride = 0;
+        if (::android::GraphicBufferAllocator::get().allocate(
+                    width, height, HAL_PIXEL_FORMAT_RGBA_8888, 1,
+                    GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN |
+                            GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_HW_TEXTURE,
+                    &cache.handle, &stride, "hwc3-squash") != ::android::OK) {
+            LOG(ERROR) << __func__ << ": failed to allocate a " << width << "x" << height
+                       << " cache buffer";
+            cache = CacheBuffer();
+            return -1;
+        }
+        cache.width = width;
+        cache.height = height;
+    }
+    if (state.composed == index) {
+        state.composed = -1;
+    }
+
+    MappedBuffer target(cache.handle, true /* write */, cache.releaseFence.release());
+    if (!target.isValid()) {
+        return -1;
+    }
+    std::vector<SwLayer> layers;
+    std::vector<std::unique_ptr<MappedBuffer>> mappings;
+    if (!state.stack.collect(run, &layers, &mappings)) {
+        return -1;
+    }
+    // transparent where no squashed layer is, hwc2 blends it over the layers below
+    SoftwareCompositor::compose(layers, target.get(),
+                                {0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height)},
+                                0);
+
+    state.composed = index;
+    state.composedMembers.clear();
+    for (int64_t id : run) {
+        state.composedMembers.emplace_back(id, state.stack.layers.at(id).changeCount);
+    }
+    return index;
+}
+
+bool LayerSquasher::prepare(int64_t display, uint32_t width, uint32_t height, Plan* outPlan) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto& state = mDisplays[display];
+    for (const auto& [id, layer] : state.stack.layers) {
+        auto& [seen, frames] = state.ages[id];
+        if (seen != layer.changeCount) {
+            seen = layer.changeCount;
+            frames = 0;
+        } else if (frames < mStaticFrames) {
+            ++frames;
+        }
+    }
+
+    std::vector<int64_t> run;
+    uint64_t bytes = 0;
+    int32_t dataspace = HAL_DATASPACE_UNKNOWN;
+    if (state.backoff > 0) {
+        --state.backoff;
+    } else {
+        run = findRun(state, width, height, &bytes, &dataspace);
+        // one full screen plane instead of the run only pays off if the run
+        // reads as much, or if hwc2 is out of planes and would use the GPU
+        const uint64_t cacheBytes = static_cast<uint64_t>(width) * height * 4;
+        if (run.size() < 2 || (bytes < cacheBytes && !state.planePressure)) {
+            run.clear();
+        }
+    }
+
+    int target = -1;
+    bool composed = false;
+    if (!run.empty()) {
+        target = findComposed(state, run, width, height);
+        if (target < 0) {
+            nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+            target = compose(state, run, width, height);
+            mComposeTime += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+            ++mCompositions;
+            composed = true;
+        }
+        if (target < 0) {
+            run.clear();
+            state.backoff = mStaticFrames;
+        }
+    }
+
+    auto inRun = [&](int64_t id) { return std::find(run.begin(), run.end(), id) != run.end(); };
+    for (const auto& [id, changeCount] : state.members) {
+        auto it = state.stack.layers.find(id);
+        if (it != state.stack.layers.end() && !inRun(id)) {
+            outPlan->restore.emplace_back(id, it->second.composition);
+        }
+    }
+    std::vector<std::pair<int64_t, uint64_t>> members;
+    for (int64_t id : run) {
+        auto previous = std::find_if(state.members.begin(), state.members.end(),
+                                     [id](const auto& member) { return member.first == id; });
+        if (previous == state.members.end()) {
+            outPlan->client.push_back(id);
+        }
+        members.emplace_back(id, state.stack.layers.at(id).changeCount);
+    }
+    state.members = std::move(members);
+    state.memberBytes = bytes;
+
+    if (run.empty()) {
+        return false;
+    }
+    outPlan->target = state.cache[target].handle;
+    outPlan->targetDataspace = dataspace;
+    outPlan->targetChanged = composed || state.hwcTarget != target;
+    state.hwcTarget = target;
+    return true;
+}
+
+bool LayerSquasher::onValidated(int64_t display, std::vector<int64_t>* changedLayers,
+                                std::vector<Composition>* compositionTypes,
+                                std::vector<int64_t>* requestedLayers,
+                                std::vector<int32_t>* requestMasks) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return true;
+    }
+    auto& state = it->second;
+    if (state.members.empty()) {
+        state.planePressure = std::find(compositionTypes->begin(), compositionTypes->end(),
+                                        Composition::CLIENT) != compositionTypes->end();
+        return true;
+    }
+
+    auto isMember = [&](int64_t id) {
+        return std::find_if(state.members.begin(), state.members.end(),
+                            [id](const auto& member) { return member.first == id; }) !=
+                state.members.end();
+    };
+    for (size_t i = 0; i < changedLayers->size(); ++i) {
+        bool client = (*compositionTypes)[i] == Composition::CLIENT;
+        if (isMember((*changedLayers)[i]) ? !client : client) {
+            ++mRejected;
+            return false;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < changedLayers->size(); ++i) {
+        if (!isMember((*changedLayers)[i])) {
+            (*changedLayers)[kept] = (*changedLayers)[i];
+            (*compositionTypes)[kept] = (*compositionTypes)[i];
+            ++kept;
+        }
+    }
+    changedLayers->resize(kept);
+    compositionTypes->resize(kept);
+
+    kept = 0;
+    for (size_t i = 0; i < requestedLayers->size(); ++i) {
+        if (!isMember((*requestedLayers)[i])) {
+            (*requestedLayers)[kept] = (*requestedLayers)[i];
+            (*requestMasks)[kept] = (*requestMasks)[i];
+            ++kept;
+        }
+    }
+    requestedLayers->resize(kept);
+    requestMasks->resize(kept);
+    return true;
+}
+
+std::vector<std::pair<int64_t, Composition>> LayerSquasher::abandon(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::vector<std::pair<int64_t, Composition>> restore;
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return restore;
+    }
+    auto& state = it->second;
+    for (const auto& [id, changeCount] : state.members) {
+        auto layer = state.stack.layers.find(id);
+        if (layer != state.stack.layers.end()) {
+            restore.emplace_back(id, layer->second.composition);
+        }
+    }
+    state.members.clear();
+    state.memberBytes = 0;
+    state.backoff = mStaticFrames;
+    return restore;
+}
+
+bool LayerSquasher::isSquashed(int64_t display, int64_t layer) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return false;
+    }
+    const auto& members = it->second.members;
+    return std::find_if(members.begin(), members.end(), [layer](const auto& member) {
+               return member.first == layer;
+           }) != members.end();
+}
+
+bool LayerSquasher::isSquashing(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    return it != mDisplays.end() && !it->second.members.empty();
+}
+
+void LayerSquasher::onClientTarget(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it != mDisplays.end()) {
+        it->second.hwcTarget = -1;
+    }
+}
+
+bool LayerSquasher::isStale(int64_t display) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return false;
+    }
+    const auto& state = it->second;
+    for (const auto& [id, changeCount] : state.members) {
+        auto layer = state.stack.layers.find(id);
+        if (layer == state.stack.layers.end() || layer->second.changeCount != changeCount) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LayerSquasher::onPresent(int64_t display, int presentFence) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return;
+    }
+    auto& state = it->second;
+    const int current = state.members.empty() ? -1 : state.hwcTarget;
+    // the previous buffer stays on screen until this frame replaces it
+    if (state.shown >= 0 && state.shown != current) {
+        state.cache[state.shown].releaseFence.reset(presentFence >= 0 ? dup(presentFence) : -1);
+    }
+    state.shown = current;
+    if (current < 0) {
+        return;
+    }
+
+    const CacheBuffer& cache = state.cache[current];
+    ++mSquashedFrames;
+    mPlanesSaved += state.members.size() - 1;
+    mBytesSaved += static_cast<int64_t>(state.memberBytes) -
+            static_cast<int64_t>(cache.width) * cache.height * 4;
+}
+
+void LayerSquasher::dump(std::string* output) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    ::android::base::StringAppendF(output,
+                                   "\nhwc3 layer squashing: after %u frames, squashed frames=%" PRIu64
+                                   " planes saved=%" PRIu64 " bytes saved=%" PRId64
+                                   " (%.1fKB/frame) compositions=%" PRIu64
+                                   " avg=%.3fms rejected=%" PRIu64 "\n",
+                                   mStaticFrames, mSquashedFrames, mPlanesSaved, mBytesSaved,
+                                   mSquashedFrames ? mBytesSaved / 1024.0 / mSquashedFrames : 0.0,
+                                   mCompositions,
+                                   mCompositions ? mComposeTime / 1e6 / mCompositions : 0.0,
+                                   mRejected);
+    for (const auto& [display, state] : mDisplays) {
+        ::android::base::StringAppendF(output,
+                                       "  display %" PRId64 ": layers=%zu squashed=%zu%s\n",
+                                       display, state.stack.layers.size(),
+                                       state.members.size(),
+                                       state.backoff ? " (backing off)" : "");
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
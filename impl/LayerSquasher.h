@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <cutils/native_handle.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "include/IComposerHal.h"
+#include "LayerStack.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Caches layers that stopped changing. Once a run of adjacent layers has kept
+// its content and geometry for a number of frames, it is blended once on the
+// CPU into a buffer of our own. hwc2 is told those layers are client composed
+// and gets that buffer as the client target, so the run takes one plane until
+// one of its layers changes. The client never learns about it: the changed
+// types are filtered out of validate and its client target is dropped.
+class LayerSquasher {
+  public:
+    // vendor.hwc3.squash.frames, how long a layer must be unchanged, 0 disables
+    static uint32_t getStaticFramesProperty();
+
+    explicit LayerSquasher(uint32_t staticFrames);
+    ~LayerSquasher();
+
+    LayerSquasher(const LayerSquasher&) = delete;
+    LayerSquasher& operator=(const LayerSquasher&) = delete;
+
+    void removeDisplay(int64_t display);
+    void destroyLayer(int64_t display, int64_t layer);
+    void destroyLayers(int64_t display, const std::vector<int64_t>& layers);
+
+    // the state requested by the client, acquire fences are owned by the callee
+    void setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                        int acquireFence);
+    // false if the damage says the content of the buffer is the same
+    void setLayerSurfaceDamage(int64_t display, int64_t layer, bool contentChanged);
+    void setLayerColor(int64_t display, int64_t layer, uint32_t rgba);
+    void setLayerComposition(int64_t display, int64_t layer, Composition type);
+    void setLayerDisplayFrame(int64_t display, int64_t layer, const SwRect& frame);
+    void setLayerSourceCrop(int64_t display, int64_t layer, const SwFRect& crop);
+    void setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha);
+    void setLayerBlendMode(int64_t display, int64_t layer, SwLayer::Blend blend);
+    void setLayerDataspace(int64_t display, int64_t layer, int32_t dataspace);
+    void setLayerTransform(int64_t display, int64_t layer, uint32_t transform);
+    void setLayerZOrder(int64_t display, int64_t layer, uint32_t z);
+
+    // What to tell hwc2 before validating.
+    struct Plan {
+        // layers to switch to client composition
+        std::vector<int64_t> client;
+        // layers going back to the type the client asked for
+        std::vector<std::pair<int64_t, Composition>> restore;
+        buffer_handle_t target = nullptr;
+        int32_t targetDataspace = 0;
+        // target is not the client target of hwc2 yet
+        bool targetChanged = false;
+    };
+
+    // Once per validate. Returns true if a run is squashed into plan->target,
+    // plan->restore may need to be applied either way.
+    bool prepare(int64_t display, uint32_t width, uint32_t height, Plan* outPlan);
+    // Takes the squashed layers back out of the validate result. Returns false
+    // if hwc2 needs client composition for other layers too, the caller then
+    // undoes the plan with abandon() and validates again.
+    bool onValidated(int64_t display, std::vector<int64_t>* changedLayers,
+                     std::vector<Composition>* compositionTypes,
+                     std::vector<int64_t>* requestedLayers, std::vector<int32_t>* requestMasks);
+    std::vector<std::pair<int64_t, Composition>> abandon(int64_t display);
+
+    // a squashed layer, hwc2 must keep seeing it as client composed
+    bool isSquashed(int64_t display, int64_t layer);
+    // the client target of the client is not wanted while a run is squashed
+    bool isSquashing(int64_t display);
+    // the client target of the client reached hwc2
+    void onClientTarget(int64_t display);
+    // a squashed layer changed since validate
+    bool isStale(int64_t display);
+    void onPresent(int64_t display, int presentFence);
+
+    void dump(std::string* output);
+
+  private:
+    struct CacheBuffer {
+        buffer_handle_t handle = nullptr;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        // signals once hwc2 stopped scanning out of it
+        ::android::base::unique_fd releaseFence;
+    };
+
+    struct Display {
+        LayerStack stack;
+        // frames each layer has been unchanged for, and the change it last saw
+        std::unordered_map<int64_t, std::pair<uint64_t, uint32_t>> ages;
+
+        // layers hwc2 currently sees as client composed, with their change at compose
+        std::vector<std::pair<int64_t, uint64_t>> members;
+        uint64_t memberBytes = 0;
+        // what cache[composed] holds
+        std::vector<std::pair<int64_t, uint64_t>> composedMembers;
+        CacheBuffer cache[2];
+        int composed = -1;
+        // the cache buffer hwc2 has as client target, and the one on screen
+        int hwcTarget = -1;
+        int shown = -1;
+
+        // frames to wait after hwc2 rejected a plan
+        uint32_t backoff = 0;
+        // the last validate without squashing fell back to client composition
+        bool planePressure = false;
+    };
+
+    // applies a change of the layer, which returns false if nothing changed
+    template <typename F>
+    void update(int64_t display, int64_t layer, F&& change);
+    std::vector<int64_t> findRun(const Display& state, uint32_t width, uint32_t height,
+                                 uint64_t* outBytes, int32_t* outDataspace) REQUIRES(mMutex);
+    int findComposed(const Display& state, const std::vector<int64_t>& run, uint32_t width,
+                     uint32_t height) REQUIRES(mMutex);
+    int compose(Display& state, const std::vector<int64_t>& run, uint32_t width,
+                uint32_t height) REQUIRES(mMutex);
+    void freeCache(Display& state) REQUIRES(mMutex);
+
+    const uint32_t mStaticFrames;
+
+    std::mutex mMutex;
+    std::map<int64_t, Display> mDisplays GUARDED_BY(mMutex);
+
+    uint64_t mSquashedFrames GUARDED_BY(mMutex) = 0;
+    uint64_t mPlanesSaved GUARDED_BY(mMutex) = 0;
+    int64_t mBytesSaved GUARDED_BY(mMutex) = 0;
+    uint64_t mCompositions GUARDED_BY(mMutex) = 0;
+    uint64_t mRejected GUARDED_BY(mMutex) = 0;
+    nsecs_t mComposeTime GUARDED_BY(mMutex) = 0;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
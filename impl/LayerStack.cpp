@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LayerStack.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+static int dupFence(const ::android::base::unique_fd& fence) {
+    return fence.ok() ? dup(fence.get()) : -1;
+}
+
+static bool addLayer(const ShadowLayer& layer, int fence, std::vector<SwLayer>* outLayers,
+                     std::vector<std::unique_ptr<MappedBuffer>>* outMappings) {
+    SwLayer out;
+    out.color = layer.color;
+    out.crop = layer.crop;
+    out.frame = layer.frame;
+    out.transform = layer.transform;
+    out.alpha = layer.alpha;
+    out.blend = layer.blend;
+    getYuvEncoding(layer.dataspace, &out.yuvStandard, &out.yuvFullRange);
+    if (layer.composition != Composition::SOLID_COLOR) {
+        auto mapping = std::make_unique<MappedBuffer>(layer.buffer, false /* write */, fence);
+        if (!mapping->isValid()) {
+            return false;
+        }
+        out.buffer = &mapping->get();
+        outMappings->push_back(std::move(mapping));
+    }
+    outLayers->push_back(out);
+    return true;
+}
+
+void LayerStack::collect(uint32_t width, uint32_t height, std::vector<SwLayer>* outLayers,
+                         std::vector<std::unique_ptr<MappedBuffer>>* outMappings) const {
+    std::vector<const ShadowLayer*> visible;
+    const ShadowLayer* lowestClient = nullptr;
+    for (const auto& [id, layer] : layers) {
+        switch (layer.composition) {
+            case Composition::CLIENT:
+                if (!lowestClient || layer.z < lowestClient->z) {
+                    lowestClient = &layer;
+                }
+                break;
+            case Composition::SIDEBAND:
+            case Composition::DISPLAY_DECORATION:
+                // not visible to the CPU
+                break;
+            default:
+                visible.push_back(&layer);
+                break;
+        }
+    }
+    std::sort(visible.begin(), visible.end(),
+              [](const ShadowLayer* a, const ShadowLayer* b) { return a->z < b->z; });
+
+    auto add = [&](const ShadowLayer& layer, int fence) {
+        addLayer(layer, fence, outLayers, outMappings);
+    };
+
+    auto addClientTarget = [&]() {
+        ShadowLayer client;
+        client.composition = Composition::CLIENT;
+        client.buffer = clientTarget;
+        client.dataspace = clientTargetDataspace;
+        client.frame = {0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height)};
+        client.crop = {0.f, 0.f, static_cast<float>(width), static_cast<float>(height)};
+        add(client, dupFence(clientTargetFence));
+    };
+
+    bool clientAdded = !lowestClient || !clientTarget;
+    for (const ShadowLayer* layer : visible) {
+        if (!clientAdded && lowestClient->z <= layer->z) {
+            addClientTarget();
+            clientAdded = true;
+        }
+        if (layer->composition == Composition::SOLID_COLOR || layer->buffer) {
+            add(*layer, dupFence(layer->acquireFence));
+        }
+    }
+    if (!clientAdded) {
+        addClientTarget();
+    }
+}
+
+bool LayerStack::collect(const std::vector<int64_t>& ids, std::vector<SwLayer>* outLayers,
+                         std::vector<std::unique_ptr<MappedBuffer>>* outMappings) const {
+    for (int64_t id : ids) {
+        auto it = layers.find(id);
+        if (it == layers.end()) {
+            return false;
+        }
+        const ShadowLayer& layer = it->second;
+        if (layer.composition != Composition::SOLID_COLOR && !layer.buffer) {
+            return false;
+        }
+        if (!addLayer(layer, dupFence(layer.acquireFence), outLayers, outMappings)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <cutils/native_handle.h>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "include/IComposerHal.h"
+#include "BufferMapper.h"
+#include "SoftwareCompositor.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// HWC3 side copy of the state of one layer.
+struct ShadowLayer {
+    Composition composition = Composition::DEVICE;
+    buffer_handle_t buffer = nullptr;
+    ::android::base::unique_fd acquireFence;
+    // of buffer, only filled in by users that need it
+    int32_t bufferFormat = 0;
+    uint32_t color = 0;
+    SwFRect crop;
+    SwRect frame;
+    uint32_t transform = 0;
+    float alpha = 1.f;
+    SwLayer::Blend blend = SwLayer::Blend::PREMULTIPLIED;
+    int32_t dataspace = 0;
+    uint32_t z = 0;
+    // bumped by every change, including a new buffer in the same handle
+    uint64_t changeCount = 0;
+};
+
+// The layers of one display plus its client target, as committed by the
+// client, and how to turn them into SoftwareCompositor input.
+struct LayerStack {
+    std::unordered_map<int64_t, ShadowLayer> layers;
+    buffer_handle_t clientTarget = nullptr;
+    ::android::base::unique_fd clientTargetFence;
+    int32_t clientTargetDataspace = 0;
+
+    // Maps the buffers of the visible layers and fills outLayers bottom first.
+    // The client target stands in for the client layers at the lowest client
+    // z and covers width x height. outMappings keeps the buffers locked and
+    // must outlive outLayers.
+    void collect(uint32_t width, uint32_t height, std::vector<SwLayer>* outLayers,
+                 std::vector<std::unique_ptr<MappedBuffer>>* outMappings) const;
+    // Same for the given layers only, in the given order and regardless of
+    // their composition type. Returns false if a buffer could not be mapped.
+    bool collect(const std::vector<int64_t>& ids, std::vector<SwLayer>* outLayers,
+                 std::vector<std::unique_ptr<MappedBuffer>>* outMappings) const;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
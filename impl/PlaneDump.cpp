@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PlaneDump.h"
+
+#include <system/graphics.h>
+
+#include <set>
+#include <utility>
+
+#include "include/RkHwc3Types.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+namespace {
+
+struct FourccFormat {
+    std::string_view fourcc;
+    int32_t format;
+    bool yuv;
+};
+
+// drm fourcc codes are little endian, ABGR8888 is RGBA in memory
+constexpr FourccFormat kFormats[] = {
+        {"AB24", HAL_PIXEL_FORMAT_RGBA_8888, false},
+        {"XB24", HAL_PIXEL_FORMAT_RGBX_8888, false},
+        {"AR24", HAL_PIXEL_FORMAT_BGRA_8888, false},
+        {"BG24", HAL_PIXEL_FORMAT_RGB_888, false},
+        {"RG16", HAL_PIXEL_FORMAT_RGB_565, false},
+        {"AB30", HAL_PIXEL_FORMAT_RGBA_1010102, false},
+        {"NV12", RK_HAL_PIXEL_FORMAT_YCRCB_NV12, true},
+        {"NV21", HAL_PIXEL_FORMAT_YCRCB_420_SP, true},
+        {"P010", HAL_PIXEL_FORMAT_YCBCR_P010, true},
+};
+
+const FourccFormat* findFormat(std::string_view fourcc) {
+    for (const auto& format : kFormats) {
+        if (format.fourcc == fourcc) {
+            return &format;
+        }
+    }
+    return nullptr;
+}
+
+struct Plane {
+    std::set<const FourccFormat*> formats;
+    std::set<int32_t> standards;
+    std::set<int32_t> ranges;
+};
+
+void parseFormats(std::string_view line, Plane* plane) {
+    while (!line.empty()) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string_view::npos) {
+            break;
+        }
+        line.remove_prefix(start);
+        size_t end = line.find_first_of(" \t");
+        if (auto format = findFormat(line.substr(0, end))) {
+            plane->formats.insert(format);
+        }
+        line.remove_prefix(end == std::string_view::npos ? line.size() : end);
+    }
+}
+
+void parseEnums(std::string_view line, Plane* plane) {
+    auto has = [line](std::string_view name) { return line.find(name) != line.npos; };
+    if (has("BT.601")) {
+        plane->standards.insert(HAL_DATASPACE_STANDARD_BT601_625);
+        plane->standards.insert(HAL_DATASPACE_STANDARD_BT601_525);
+    }
+    if (has("BT.709")) {
+        plane->standards.insert(HAL_DATASPACE_STANDARD_BT709);
+    }
+    if (has("BT.2020")) {
+        plane->standards.insert(HAL_DATASPACE_STANDARD_BT2020);
+    }
+    if (has("limited range")) {
+        plane->ranges.insert(HAL_DATASPACE_RANGE_LIMITED);
+    }
+    if (has("full range")) {
+        plane->ranges.insert(HAL_DATASPACE_RANGE_FULL);
+    }
+}
+
+} // namespace
+
+bool PlaneDump::parse(std::string_view dump, PlaneDump* out) {
+    static constexpr std::string_view kFormatsTag = "formats:";
+    static constexpr std::string_view kEnumsTag = "enums:";
+
+    std::vector<Plane> planes;
+    while (!dump.empty()) {
+        size_t end = dump.find('\n');
+        std::string_view line = dump.substr(0, end);
+        dump.remove_prefix(end == std::string_view::npos ? dump.size() : end + 1);
+
+        if (size_t pos = line.find(kFormatsTag); pos != line.npos) {
+            planes.emplace_back();
+            parseFormats(line.substr(pos + kFormatsTag.size()), &planes.back());
+        } else if (size_t pos = line.find(kEnumsTag); pos != line.npos && !planes.empty()) {
+            parseEnums(line.substr(pos + kEnumsTag.size()), &planes.back());
+        }
+    }
+
+    std::set<std::pair<int32_t, int32_t>> pairs;
+    bool mixedColorSpaces = false;
+    for (auto& plane : planes) {
+        if (plane.standards.empty()) {
+            plane.standards.insert(HAL_DATASPACE_STANDARD_BT601_625);
+            plane.standards.insert(HAL_DATASPACE_STANDARD_BT601_525);
+        } else {
+            mixedColorSpaces = true;
+        }
+        if (plane.ranges.empty()) {
+            plane.ranges.insert(HAL_DATASPACE_RANGE_LIMITED);
+        }
+
+        for (const auto* format : plane.formats) {
+            if (!format->yuv) {
+                pairs.emplace(format->format, HAL_DATASPACE_V0_SRGB);
+                continue;
+            }
+            for (int32_t standard : plane.standards) {
+                for (int32_t range : plane.ranges) {
+                    pairs.emplace(format->format,
+                                  standard | HAL_DATASPACE_TRANSFER_SMPTE_170M | range);
+                }
+            }
+        }
+    }
+    if (pairs.empty()) {
+        return false;
+    }
+
+    out->formats.clear();
+    out->dataspaces.clear();
+    for (const auto& [format, dataspace] : pairs) {
+        out->formats.push_back(format);
+        out->dataspaces.push_back(dataspace);
+    }
+    out->mixedColorSpaces = mixedColorSpaces;
+    return true;
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// What the overlay planes scan out, read from the plane list of the hwc2
+// dump when the backend has no vendor function for it. The plane list is
+// printed the way libdrm's modetest does:
+//
+//   formats: XR24 AR24 AB24 NV12 ...
+//   ...
+//         enums: ITU-R BT.601 YCbCr=0 ITU-R BT.709 YCbCr=1 ITU-R BT.2020 YCbCr=2
+//   ...
+//         enums: YCbCr limited range=0 YCbCr full range=1
+//
+// A "formats:" line starts a plane, the color_encoding and color_range enums
+// up to the next one are its own. RGB formats scan out as sRGB, YUV formats
+// in the encodings and ranges of their plane, the kernel defaults of BT.601
+// limited range if it has none.
+struct PlaneDump {
+    // (android_pixel_format_t, android_dataspace_t) pairs, as the vendor function
+    std::vector<int32_t> formats;
+    std::vector<int32_t> dataspaces;
+    // planes have a color encoding of their own
+    bool mixedColorSpaces = false;
+
+    // false if the dump lists no plane format we know
+    static bool parse(std::string_view dump, PlaneDump* out);
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RefreshRateController.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <limits>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// how long a lower rate must be wanted before switching to it
+static constexpr nsecs_t kLowerDelay = 500'000'000;
+// no lower rate for this long after a late frame or a failed switch
+static constexpr nsecs_t kHoldTime = 2'000'000'000;
+// an animation this close to the current rate may be limited by it, and the
+// rate picked for an animation is this much above its own
+static constexpr float kRateMargin = 0.05f;
+
+static float toRate(nsecs_t vsyncPeriod) {
+    return vsyncPeriod > 0 ? 1e9f / vsyncPeriod : 0.f;
+}
+
+bool RefreshRateController::isEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.drr.enable", false);
+}
+
+nsecs_t RefreshRateController::getIdleTimeoutProperty() {
+    return ms2ns(::android::base::GetIntProperty("vendor.hwc3.drr.idle_ms", 1000, 0, 60000));
+}
+
+RefreshRateController::RefreshRateController(SwitchFn switchMode, nsecs_t idleTimeout)
+      : mSwitchMode(std::move(switchMode)), mIdleTimeout(idleTimeout) {
+    if (mIdleTimeout > 0) {
+        mIdleThread = std::thread(&RefreshRateController::idleLoop, this);
+    }
+}
+
+RefreshRateController::~RefreshRateController() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mIdleCondition.notify_one();
+    if (mIdleThread.joinable()) {
+        mIdleThread.join();
+    }
+}
+
+void RefreshRateController::setClientMode(int64_t display, int32_t config,
+                                          const std::vector<Mode>& modes, nsecs_t now) {
+    std::lock_guard<std::mutex> switchLock(mSwitchMutex);
+    std::lock_guard<std::mutex> lock(mMutex);
+    Display& state = mDisplays[display];
+    accountResidency(state, now);
+    if (state.trackedSince == 0) {
+        state.trackedSince = now;
+    }
+
+    // lowest rate first
+    state.modes = modes;
+    std::sort(state.modes.begin(), state.modes.end(),
+              [](const Mode& a, const Mode& b) { return a.vsyncPeriod > b.vsyncPeriod; });
+    const Mode* mode = findMode(state, config);
+    state.clientConfig = config;
+    state.clientPeriod = mode ? mode->vsyncPeriod : 0;
+    state.config = config;
+    state.period = state.clientPeriod;
+    state.configSince = now;
+    state.lowerSince = 0;
+    // give the client's choice a moment before going below it
+    state.holdUntil = now + kLowerDelay;
+}
+
+bool RefreshRateController::getClientConfig(int64_t display, int32_t* outConfig) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end() || it->second.clientConfig < 0) {
+        return false;
+    }
+    *outConfig = it->second.clientConfig;
+    return true;
+}
+
+void RefreshRateController::removeDisplay(int64_t display) {
+    std::lock_guard<std::mutex> switchLock(mSwitchMutex);
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDisplays.erase(display);
+}
+
+void RefreshRateController::onBuffer(int64_t display, int64_t layer, nsecs_t time) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDisplays[display].layers[layer].onBuffer(time);
+}
+
+void RefreshRateController::setLayerVideo(int64_t display, int64_t layer, bool video) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDisplays[display].layers[layer].setVideo(video);
+}
+
+void RefreshRateController::onLayerDestroyed(int64_t display, int64_t layer) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it != mDisplays.end()) {
+        it->second.layers.erase(layer);
+    }
+}
+
+void RefreshRateController::onLayersDestroyed(int64_t display,
+                                              const std::vector<int64_t>& layers) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return;
+    }
+    for (int64_t layer : layers) {
+        it->second.layers.erase(layer);
+    }
+}
+
+void RefreshRateController::onExpectedPresentTime(int64_t display, nsecs_t time) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it != mDisplays.end()) {
+        it->second.expectedPresentTime = time;
+    }
+}
+
+void RefreshRateController::onPresent(int64_t display, nsecs_t now) {
+    bool wakeIdleTimer = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mDisplays.find(display);
+        if (it == mDisplays.end() || it->second.clientConfig < 0) {
+            return;
+        }
+        Display& state = it->second;
+        // the frame is on screen by the next vsync at the latest, which at the
+        // client's rate would have been within its period of the expected time
+        if (state.expectedPresentTime > 0 && state.period > state.clientPeriod &&
+            now + state.period - state.expectedPresentTime > state.clientPeriod) {
+            state.lateFrames++;
+            state.holdUntil = now + kHoldTime;
+        }
+        state.expectedPresentTime = 0;
+        // the idle timer only needs to hear about a new deadline if it had none
+        wakeIdleTimer = state.idle || state.lastPresent == 0;
+        state.lastPresent = now;
+        state.idle = false;
+    }
+    if (wakeIdleTimer) {
+        mIdleCondition.notify_one();
+    }
+    update(display, now);
+}
+
+void RefreshRateController::onIdle(int64_t display, nsecs_t now) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mDisplays.find(display);
+        if (it == mDisplays.end() || it->second.idle) {
+            return;
+        }
+        it->second.idle = true;
+    }
+    update(display, now);
+}
+
+const RefreshRateController::Mode* RefreshRateController::findMode(const Display& state,
+                                                                   int32_t config) const {
+    for (const Mode& mode : state.modes) {
+        if (mode.config == config) {
+            return &mode;
+        }
+    }
+    return nullptr;
+}
+
+const RefreshRateController::Mode* RefreshRateController::chooseMode(Display& state,
+                                                                     nsecs_t now) {
+    const Mode* client = findMode(state, state.clientConfig);
+    if (!client) {
+        return nullptr;
+    }
+
+    // modes are lowest rate first, none above the client's
+    std::vector<const Mode*> candidates;
+    for (const Mode& mode : state.modes) {
+        if (mode.vsyncPeriod >= state.clientPeriod) {
+            candidates.push_back(&mode);
+        }
+    }
+    if (state.idle) {
+        return candidates.front();
+    }
+    if (now < state.holdUntil) {
+        return client;
+    }
+
+    DisplayCadence cadence;
+    for (const auto& [layer, layerCadence] : state.layers) {
+        float fps = 0.f;
+        LayerCadence::Type type = layerCadence.classify(now, &fps);
+        cadence.add(type, fps);
+    }
+
+    float minRate = 0.f;
+    if (cadence.animatingLayers > 0) {
+        if (cadence.animatingFps >= toRate(state.period) * (1.f - kRateMargin)) {
+            // possibly held back by the current rate, or not measured yet
+            return client;
+        }
+        minRate = cadence.animatingFps * (1.f + kRateMargin);
+    }
+    for (const Mode* mode : candidates) {
+        float rate = toRate(mode->vsyncPeriod);
+        if (rate >= minRate && fitsVideoRates(cadence, rate)) {
+            return mode;
+        }
+    }
+    return client;
+}
+
+void RefreshRateController::accountResidency(Display& state, nsecs_t now) {
+    if (state.config < 0 || now <= state.configSince) {
+        return;
+    }
+    const nsecs_t time = now - state.configSince;
+    state.residency[state.config] += time;
+    if (state.period > 0) {
+        state.vsyncs += static_cast<double>(time) / state.period;
+    }
+    state.configSince = now;
+}
+
+void RefreshRateController::update(int64_t display, nsecs_t now) {
+    std::lock_guard<std::mutex> switchLock(mSwitchMutex);
+    int32_t config;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mDisplays.find(display);
+        if (it == mDisplays.end()) {
+            return;
+        }
+        Display& state = it->second;
+        const Mode* mode = chooseMode(state, now);
+        if (!mode || mode->config == state.config) {
+            state.lowerSince = 0;
+            return;
+        }
+        // up at once, down only once it held, or right away for an idle display
+        if (mode->vsyncPeriod > state.period && !state.idle) {
+            if (state.lowerSince == 0) {
+                state.lowerSince = now;
+            }
+            if (now - state.lowerSince < kLowerDelay) {
+                return;
+            }
+        }
+        config = mode->config;
+    }
+
+    // hwc2 may take a while, buffers and presents carry on meanwhile
+    const bool switched = mSwitchMode(display, config, now);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return;
+    }
+    Display& state = it->second;
+    state.lowerSince = 0;
+    if (!switched) {
+        LOG(ERROR) << __FUNCTION__ << ": display " << display << " failed to switch to config "
+                   << config;
+        state.failedSwitches++;
+        state.holdUntil = now + kHoldTime;
+        return;
+    }
+    const Mode* mode = findMode(state, config);
+    accountResidency(state, now);
+    if (mode->vsyncPeriod > state.period) {
+        state.switchesDown++;
+    } else {
+        state.switchesUp++;
+    }
+    state.config = config;
+    state.period = mode->vsyncPeriod;
+}
+
+void RefreshRateController::idleLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mStopping) {
+        const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t next = std::numeric_limits<nsecs_t>::max();
+        std::vector<int64_t> expired;
+        for (const auto& [display, state] : mDisplays) {
+            if (state.idle || state.lastPresent == 0) {
+                continue;
+            }
+            const nsecs_t deadline = state.lastPresent + mIdleTimeout;
+            if (deadline <= now) {
+                expired.push_back(display);
+            } else {
+                next = std::min(next, deadline);
+            }
+        }
+
+        if (!expired.empty()) {
+            lock.unlock();
+            for (int64_t display : expired) {
+                onIdle(display, now);
+            }
+            lock.lock();
+        } else if (next == std::numeric_limits<nsecs_t>::max()) {
+            mIdleCondition.wait(lock);
+        } else {
+            mIdleCondition.wait_for(lock, std::chrono::nanoseconds(next - now));
+        }
+    }
+}
+
+void RefreshRateController::dump(std::string* output, nsecs_t now) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    ::android::base::StringAppendF(output, "\nhwc3 refresh rate controller: idle after %.0fms\n",
+                                   mIdleTimeout / 1e6);
+    for (auto& [display, state] : mDisplays) {
+        accountResidency(state, now);
+        const nsecs_t tracked = now - state.trackedSince;
+        ::android::base::StringAppendF(output,
+                                       "  display %" PRId64
+                                       ": client config %d (%.2fHz) running config %d (%.2fHz)%s"
+                                       " vsyncs/s=%.2f switches up=%" PRIu64 " down=%" PRIu64
+                                       " failed=%" PRIu64 " late frames=%" PRIu64 "\n",
+                                       display, state.clientConfig, toRate(state.clientPeriod),
+                                       state.config, toRate(state.period),
+                                       state.idle ? " idle" : "",
+                                       tracked > 0 ? state.vsyncs * 1e9 / tracked : 0.0,
+                                       state.switchesUp, state.switchesDown, state.failedSwitches,
+                                       state.lateFrames);
+        for (const auto& [config, time] : state.residency) {
+            const Mode* mode = findMode(state, config);
+            ::android::base::StringAppendF(output, "    config %d (%.2fHz): %.1f%%\n", config,
+                                           mode ? toRate(mode->vsyncPeriod) : 0.f,
+                                           tracked > 0 ? time * 100.0 / tracked : 0.0);
+        }
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
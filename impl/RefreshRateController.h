@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "LayerCadence.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Display side dynamic refresh rate. The client picks a config; within its
+// config group this runs the display at the lowest refresh rate that still
+// shows the content on time:
+//  - static content and idle displays get the lowest rate,
+//  - video gets the lowest whole multiple of its frame rate,
+//  - animations get the lowest rate above their measured frame rate, or the
+//    client's rate when they may be limited by the current one.
+// A frame presented later than its expected present time returns to the
+// client's rate at once. Lower rates are only taken once they held for a while.
+//
+// The controller does not read the clock or touch hwc2 except through the
+// idle timer and the switch function, so a mode table and a stream of
+// timestamps are enough to drive it.
+class RefreshRateController {
+  public:
+    struct Mode {
+        int32_t config;
+        nsecs_t vsyncPeriod;
+    };
+    // Switches the display to config seamlessly, returns false if that failed.
+    using SwitchFn = std::function<bool(int64_t display, int32_t config, nsecs_t now)>;
+
+    // vendor.hwc3.drr.enable
+    static bool isEnabled();
+    // vendor.hwc3.drr.idle_ms
+    static nsecs_t getIdleTimeoutProperty();
+
+    // The idle timer runs on its own thread if idleTimeout is positive.
+    RefreshRateController(SwitchFn switchMode, nsecs_t idleTimeout);
+    ~RefreshRateController();
+
+    // The client made config active. modes are the configs of its group, the
+    // controller stays at or below the rate of config.
+    void setClientMode(int64_t display, int32_t config, const std::vector<Mode>& modes,
+                       nsecs_t now);
+    // false if the display is not controlled
+    bool getClientConfig(int64_t display, int32_t* outConfig);
+    void removeDisplay(int64_t display);
+
+    void onBuffer(int64_t display, int64_t layer, nsecs_t time);
+    void setLayerVideo(int64_t display, int64_t layer, bool video);
+    void onLayerDestroyed(int64_t display, int64_t layer);
+    void onLayersDestroyed(int64_t display, const std::vector<int64_t>& layers);
+    void onExpectedPresentTime(int64_t display, nsecs_t time);
+    // after each present of the display, may switch its mode
+    void onPresent(int64_t display, nsecs_t now);
+    // no present for the idle timeout
+    void onIdle(int64_t display, nsecs_t now);
+
+    void dump(std::string* output, nsecs_t now);
+
+  private:
+    struct Display {
+        std::vector<Mode> modes;
+        int32_t clientConfig = -1;
+        nsecs_t clientPeriod = 0;
+        int32_t config = -1;
+        nsecs_t period = 0;
+        nsecs_t configSince = 0;
+
+        std::unordered_map<int64_t, LayerCadence> layers;
+        nsecs_t expectedPresentTime = 0;
+        nsecs_t lastPresent = 0;
+        bool idle = false;
+        // a lower rate was first wanted at, 0 if not
+        nsecs_t lowerSince = 0;
+        // no lower rate before
+        nsecs_t holdUntil = 0;
+
+        // power proxy: time spent in each config, and the vsyncs it took
+        std::map<int32_t, nsecs_t> residency;
+        double vsyncs = 0;
+        nsecs_t trackedSince = 0;
+        uint64_t switchesUp = 0;
+        uint64_t switchesDown = 0;
+        uint64_t failedSwitches = 0;
+        uint64_t lateFrames = 0;
+    };
+
+    // the config the display should run at now
+    const Mode* chooseMode(Display& state, nsecs_t now) REQUIRES(mMutex);
+    const Mode* findMode(const Display& state, int32_t config) const;
+    void accountResidency(Display& state, nsecs_t now) REQUIRES(mMutex);
+    // switches if chooseMode wants another config
+    void update(int64_t display, nsecs_t now);
+    void idleLoop();
+
+    const SwitchFn mSwitchMode;
+    const nsecs_t mIdleTimeout;
+
+    std::mutex mMutex;
+    std::map<int64_t, Display> mDisplays GUARDED_BY(mMutex);
+    // one mode switch at a time, taken before mMutex
+    std::mutex mSwitchMutex;
+
+    std::condition_variable mIdleCondition;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    std::thread mIdleThread;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
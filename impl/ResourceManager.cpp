@@ -15,6 +15,10 @@
  */
 
 #include <aidlcommonsupport/NativeHandle.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <cinttypes>
 
 #include "ResourceManager.h"
 #include "TranslateHwcAidl.h"
@@ -43,6 +47,23 @@ void ResourceManager::clear(RemoveDisplay removeDisplay) {
 
         removeDisplay(display, isVirtual, layers);
     });
+
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    mCaches.clear();
+}
+
+std::vector<IResourceManager::DisplayResources> ResourceManager::getDisplayResources() {
+    // the caches are added and removed along with the displays and layers
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    std::vector<DisplayResources> displays;
+    for (const auto& [display, caches] : mCaches) {
+        DisplayResources resources = {.display = display, .isVirtual = caches.isVirtual};
+        for (const auto& [layer, cache] : caches.layers) {
+            resources.layers.push_back(layer);
+        }
+        displays.push_back(std::move(resources));
+    }
+    return displays;
 }
 
 bool ResourceManager::hasDisplay(int64_t display) {
@@ -60,6 +81,10 @@ int32_t ResourceManager::addPhysicalDisplay(int64_t display) {
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display] = {};
+    }
     return err;
 }
 
@@ -72,6 +97,12 @@ int32_t ResourceManager::addVirtualDisplay(int64_t display, uint32_t outputBuffe
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display] = {};
+        mCaches[display].isVirtual = true;
+        mCaches[display].outputBuffer.resize(outputBufferCacheSize);
+    }
     return err;
 }
 
@@ -83,6 +114,10 @@ int32_t ResourceManager::removeDisplay(int64_t display) {
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches.erase(display);
+    }
     return err;
 }
 
@@ -95,6 +130,10 @@ int32_t ResourceManager::setDisplayClientTargetCacheSize(int64_t display,
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display].clientTarget.resize(clientTargetCacheSize);
+    }
     return err;
 }
 
@@ -131,6 +170,10 @@ int32_t ResourceManager::addLayer(int64_t display, int64_t layer, uint32_t buffe
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display].layers[layer].resize(bufferCacheSize);
+    }
     return err;
 }
 
@@ -144,6 +187,10 @@ int32_t ResourceManager::removeLayer(int64_t display, int64_t layer) {
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display].layers.erase(layer);
+    }
     return err;
 }
 
@@ -190,6 +237,10 @@ int32_t ResourceManager::getDisplayClientTarget(int64_t display, uint32_t slot,
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display].clientTarget.onBuffer(slot, fromCache, handle);
+    }
     return err;
 }
 
@@ -206,6 +257,10 @@ int32_t ResourceManager::getDisplayOutputBuffer(int64_t display, uint32_t slot,
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display].outputBuffer.onBuffer(slot, fromCache, handle);
+    }
     return err;
 }
 
@@ -226,6 +281,10 @@ int32_t ResourceManager::getLayerBuffer(int64_t display, int64_t layer, uint32_t
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (!err) {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        mCaches[display].layers[layer].onBuffer(slot, fromCache, rawHandle);
+    }
     return err;
 }
 
@@ -248,4 +307,71 @@ int32_t ResourceManager::getLayerSidebandStream(int64_t display, int64_t layer,
     return err;
 }
 
+void ResourceManager::Cache::resize(uint32_t size) {
+    slots.resize(size);
+    used = static_cast<uint32_t>(std::count(slots.begin(), slots.end(), true));
+}
+
+void ResourceManager::Cache::onBuffer(uint32_t slot, bool fromCache,
+                                      const buffer_handle_t handle) {
+    if (fromCache) {
+        hits++;
+        return;
+    }
+    imports++;
+    if (handle && slot < slots.size() && !slots[slot]) {
+        slots[slot] = true;
+        used++;
+    }
+}
+
+static void dumpCache(const char* name, size_t count, uint32_t used, size_t size, uint64_t hits,
+                      uint64_t imports, std::string* output) {
+    ::android::base::StringAppendF(output,
+                                   "    %s: %zu with %u/%zu slots used, cached=%" PRIu64
+                                   " imported=%" PRIu64 " hit rate=%.1f%%\n",
+                                   name, count, used, size, hits, imports,
+                                   hits + imports ? hits * 100.0 / (hits + imports) : 0.0);
+}
+
+void ResourceManager::dump(std::string* output) {
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    output->append("\nhwc3 buffer caches:\n");
+    for (const auto& [display, caches] : mCaches) {
+        ::android::base::StringAppendF(output, "  display %" PRId64 ":\n", display);
+        dumpCache("client target", 1, caches.clientTarget.used, caches.clientTarget.slots.size(),
+                  caches.clientTarget.hits, caches.clientTarget.imports, output);
+        if (!caches.outputBuffer.slots.empty()) {
+            dumpCache("output buffer", 1, caches.outputBuffer.used,
+                      caches.outputBuffer.slots.size(), caches.outputBuffer.hits,
+                      caches.outputBuffer.imports, output);
+        }
+        uint32_t used = 0;
+        size_t size = 0;
+        uint64_t hits = 0;
+        uint64_t imports = 0;
+        for (const auto& [layer, cache] : caches.layers) {
+            used += cache.used;
+            size += cache.slots.size();
+            hits += cache.hits;
+            imports += cache.imports;
+        }
+        dumpCache("layers", caches.layers.size(), used, size, hits, imports, output);
+    }
+}
+
+void ResourceManager::resetStats() {
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    for (auto& [display, caches] : mCaches) {
+        for (Cache* cache : {&caches.clientTarget, &caches.outputBuffer}) {
+            cache->hits = 0;
+            cache->imports = 0;
+        }
+        for (auto& [layer, cache] : caches.layers) {
+            cache.hits = 0;
+            cache.imports = 0;
+        }
+    }
+}
+
 } // namespace aidl::android::hardware::graphics::composer3::impl
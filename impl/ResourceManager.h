@@ -17,6 +17,11 @@
 #pragma once
 
 #include <composer-resources/2.2/ComposerResources.h>
+#include <utils/Mutex.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
 
 #include "include/IResourceManager.h"
 
@@ -43,6 +48,7 @@ class ResourceManager : public IResourceManager {
 
     std::unique_ptr<IBufferReleaser> createReleaser(bool isBuffer) override;
     void clear(RemoveDisplay removeDisplay) override;
+    std::vector<DisplayResources> getDisplayResources() override;
     bool hasDisplay(int64_t display) override;
     int32_t addPhysicalDisplay(int64_t display) override;
     int32_t addVirtualDisplay(int64_t display, uint32_t outputBufferCacheSize) override;
@@ -72,8 +78,31 @@ class ResourceManager : public IResourceManager {
                                    const buffer_handle_t rawHandle,
                                    buffer_handle_t& outStreamHandle,
                                    IBufferReleaser* bufReleaser) override;
+    void dump(std::string* output) override;
+    void resetStats() override;
+
   private:
+    // mirrors which slots of a ComposerResources cache hold a buffer
+    struct Cache {
+        std::vector<bool> slots;
+        uint32_t used = 0;
+        // buffers taken from a slot, and imported into one
+        uint64_t hits = 0;
+        uint64_t imports = 0;
+
+        void resize(uint32_t size);
+        void onBuffer(uint32_t slot, bool fromCache, const buffer_handle_t handle);
+    };
+    struct DisplayCaches {
+        bool isVirtual = false;
+        Cache clientTarget;
+        Cache outputBuffer;
+        std::map<int64_t, Cache> layers;
+    };
+
     std::unique_ptr<ComposerResources> mResources = ComposerResources::create();
+    std::mutex mCacheMutex;
+    std::map<int64_t, DisplayCaches> mCaches GUARDED_BY(mCacheMutex);
 };
 
 } // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,841 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SoftwareCompositor.h"
+
+#include <string.h>
+#include <system/graphics.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "include/RkHwc3Types.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+static constexpr uint32_t kOpaqueBlack = 0xff000000;
+
+// exact x / 255 for x in [0, 255 * 255]
+static inline uint32_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t premultiply(uint32_t px) {
+    uint32_t a = px >> 24;
+    uint32_t r = div255((px & 0xff) * a);
+    uint32_t g = div255(((px >> 8) & 0xff) * a);
+    uint32_t b = div255(((px >> 16) & 0xff) * a);
+    return (a << 24) | (b << 16) | (g << 8) | r;
+}
+
+static inline uint32_t swapRedBlue(uint32_t px) {
+    return (px & 0xff00ff00) | ((px & 0xff) << 16) | ((px >> 16) & 0xff);
+}
+
+static inline uint32_t clampByte(int32_t v) {
+    return static_cast<uint32_t>(std::clamp(v, 0, 255));
+}
+
+static inline uint32_t packRgba(uint32_t r, uint32_t g, uint32_t b) {
+    return kOpaqueBlack | (b << 16) | (g << 8) | r;
+}
+
+static inline uint32_t expandRgb565(uint16_t px) {
+    uint32_t r = px >> 11;
+    uint32_t g = (px >> 5) & 0x3f;
+    uint32_t b = px & 0x1f;
+    return packRgba((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+}
+
+// YUV to RGB in 6 bit fixed point, small enough for 16 bit SIMD lanes. The
+// SIMD kernels saturate where this overflows, which only happens for values
+// that get clamped anyway, so all paths agree bit for bit.
+struct YuvCoefficients {
+    int16_t yOffset;
+    int16_t y;
+    int16_t rv;
+    int16_t gu;
+    int16_t gv;
+    int16_t bu;
+};
+
+static const YuvCoefficients& getYuvCoefficients(SwLayer::YuvStandard standard,
+                                                 bool fullRange) {
+    // [standard][fullRange]
+    static constexpr YuvCoefficients kCoefficients[2][2] = {
+            {{16, 75, 102, 25, 52, 129}, {0, 64, 90, 22, 46, 113}},
+            {{16, 75, 115, 14, 34, 135}, {0, 64, 101, 12, 30, 119}},
+    };
+    return kCoefficients[standard == SwLayer::YuvStandard::BT709][fullRange];
+}
+
+static inline uint32_t yuvToRgba(int32_t y, int32_t u, int32_t v, const YuvCoefficients& k) {
+    int32_t c = (y - k.yOffset) * k.y;
+    int32_t d = u - 128;
+    int32_t e = v - 128;
+    return packRgba(clampByte((c + k.rv * e + 32) >> 6),
+                    clampByte((c - k.gu * d - k.gv * e + 32) >> 6),
+                    clampByte((c + k.bu * d + 32) >> 6));
+}
+
+static void convertRowRgb565Scalar(uint32_t* dst, const uint16_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = expandRgb565(src[i]);
+    }
+}
+
+static void convertRowNv12Scalar(uint32_t* dst, const uint8_t* y, const uint8_t* uv,
+                                 bool uvSwapped, const YuvCoefficients& k, size_t count) {
+    const int uIndex = uvSwapped ? 1 : 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* chroma = uv + (i / 2) * 2;
+        dst[i] = yuvToRgba(y[i], chroma[uIndex], chroma[1 - uIndex], k);
+    }
+}
+
+// RGB to YUV in 8 bit fixed point. Each row of coefficients sums to what
+// keeps grey neutral, and every path computes the same 32 bit sums.
+struct RgbToYuvCoefficients {
+    int16_t yOffset;
+    int16_t yr, yg, yb;
+    int16_t ur, ug, ub;
+    int16_t vr, vg, vb;
+};
+
+static const RgbToYuvCoefficients& getRgbToYuvCoefficients(SwLayer::YuvStandard standard,
+                                                           bool fullRange) {
+    // [standard][fullRange]
+    static constexpr RgbToYuvCoefficients kCoefficients[2][2] = {
+            {{16, 66, 129, 25, -38, -74, 112, 112, -94, -18},
+             {0, 77, 150, 29, -43, -85, 128, 128, -107, -21}},
+            {{16, 47, 157, 16, -26, -86, 112, 112, -102, -10},
+             {0, 54, 183, 19, -29, -99, 128, 128, -116, -12}},
+    };
+    return kCoefficients[standard == SwLayer::YuvStandard::BT709][fullRange];
+}
+
+static inline int32_t lumaBias(const RgbToYuvCoefficients& k) {
+    return 128 + (k.yOffset << 8);
+}
+
+// 128 << 8 plus rounding
+static constexpr int32_t kChromaBias = 32896;
+
+static inline uint8_t rgbDot(uint32_t px, int16_t r, int16_t g, int16_t b, int32_t bias) {
+    return static_cast<uint8_t>(clampByte((r * static_cast<int32_t>(px & 0xff) +
+                                           g * static_cast<int32_t>((px >> 8) & 0xff) +
+                                           b * static_cast<int32_t>((px >> 16) & 0xff) + bias) >>
+                                          8));
+}
+
+// rounding average of each channel, as _mm_avg_epu8 and vrhadd_u8
+static inline uint32_t averagePixel(uint32_t a, uint32_t b) {
+    return (a | b) - (((a ^ b) >> 1) & 0x7f7f7f7f);
+}
+
+static void convertRowsToNv12Scalar(uint8_t* y0, uint8_t* y1, uint8_t* uv, const uint32_t* row0,
+                                    const uint32_t* row1, bool uvSwapped,
+                                    const RgbToYuvCoefficients& k, size_t count) {
+    const int32_t bias = lumaBias(k);
+    for (size_t i = 0; i < count; ++i) {
+        y0[i] = rgbDot(row0[i], k.yr, k.yg, k.yb, bias);
+        if (y1) {
+            y1[i] = rgbDot(row1[i], k.yr, k.yg, k.yb, bias);
+        }
+    }
+
+    const int uIndex = uvSwapped ? 1 : 0;
+    for (size_t i = 0; i < count; i += 2) {
+        // an odd last column is its own neighbour
+        const size_t next = std::min(i + 1, count - 1);
+        uint32_t c = averagePixel(averagePixel(row0[i], row1[i]),
+                                  averagePixel(row0[next], row1[next]));
+        uv[i + uIndex] = rgbDot(c, k.ur, k.ug, k.ub, kChromaBias);
+        uv[i + 1 - uIndex] = rgbDot(c, k.vr, k.vg, k.vb, kChromaBias);
+    }
+}
+
+static void blendRowScalar(uint32_t* dst, const uint32_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t s = src[i];
+        uint32_t inv = 255 - (s >> 24);
+        if (inv == 0) {
+            dst[i] = s;
+            continue;
+        }
+        uint32_t d = dst[i];
+        uint32_t out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t c = ((s >> shift) & 0xff) + div255(((d >> shift) & 0xff) * inv);
+            out |= std::min<uint32_t>(c, 255) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+static void scaleRowScalar(uint32_t* px, uint8_t alpha, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t p = px[i];
+        uint32_t out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            out |= div255(((p >> shift) & 0xff) * alpha) << shift;
+        }
+        px[i] = out;
+    }
+}
+
+#if defined(__ARM_NEON)
+
+void blendRowPremultiplied(uint32_t* dst, const uint32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t*>(src + i));
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<const uint8_t*>(dst + i));
+        uint8x8_t inv = vmvn_u8(s.val[3]);
+        for (int c = 0; c < 4; ++c) {
+            uint16x8_t m = vmull_u8(d.val[c], inv);
+            uint8x8_t scaled = vrshrn_n_u16(vrsraq_n_u16(m, m, 8), 8);
+            d.val[c] = vqadd_u8(s.val[c], scaled);
+        }
+        vst4_u8(reinterpret_cast<uint8_t*>(dst + i), d);
+    }
+    blendRowScalar(dst + i, src + i, count - i);
+}
+
+void scaleRow(uint32_t* px, uint8_t alpha, size_t count) {
+    size_t i = 0;
+    uint8x8_t a = vdup_n_u8(alpha);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t p = vld4_u8(reinterpret_cast<const uint8_t*>(px + i));
+        for (int c = 0; c < 4; ++c) {
+            uint16x8_t m = vmull_u8(p.val[c], a);
+            p.val[c] = vrshrn_n_u16(vrsraq_n_u16(m, m, 8), 8);
+        }
+        vst4_u8(reinterpret_cast<uint8_t*>(px + i), p);
+    }
+    scaleRowScalar(px + i, alpha, count - i);
+}
+
+void convertRowRgb565(uint32_t* dst, const uint16_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t p = vld1q_u16(src + i);
+        uint16x8_t r = vshrq_n_u16(p, 11);
+        uint16x8_t g = vandq_u16(vshrq_n_u16(p, 5), vdupq_n_u16(0x3f));
+        uint16x8_t b = vandq_u16(p, vdupq_n_u16(0x1f));
+        uint8x8x4_t out;
+        out.val[0] = vmovn_u16(vorrq_u16(vshlq_n_u16(r, 3), vshrq_n_u16(r, 2)));
+        out.val[1] = vmovn_u16(vorrq_u16(vshlq_n_u16(g, 2), vshrq_n_u16(g, 4)));
+        out.val[2] = vmovn_u16(vorrq_u16(vshlq_n_u16(b, 3), vshrq_n_u16(b, 2)));
+        out.val[3] = vdup_n_u8(0xff);
+        vst4_u8(reinterpret_cast<uint8_t*>(dst + i), out);
+    }
+    convertRowRgb565Scalar(dst + i, src + i, count - i);
+}
+
+// 8 pixels, y and the upsampled chroma as signed 16 bit lanes
+static inline uint8x8x4_t yuvToRgbaNeon(int16x8_t y, int16x8_t d, int16x8_t e,
+                                        const YuvCoefficients& k) {
+    int16x8_t c = vmulq_n_s16(vsubq_s16(y, vdupq_n_s16(k.yOffset)), k.y);
+    int16x8_t r = vqaddq_s16(c, vmulq_n_s16(e, k.rv));
+    int16x8_t g = vqsubq_s16(vqsubq_s16(c, vmulq_n_s16(d, k.gu)), vmulq_n_s16(e, k.gv));
+    int16x8_t b = vqaddq_s16(c, vmulq_n_s16(d, k.bu));
+    uint8x8x4_t out;
+    out.val[0] = vqrshrun_n_s16(r, 6);
+    out.val[1] = vqrshrun_n_s16(g, 6);
+    out.val[2] = vqrshrun_n_s16(b, 6);
+    out.val[3] = vdup_n_u8(0xff);
+    return out;
+}
+
+void convertRowNv12(uint32_t* dst, const uint8_t* y, const uint8_t* uv, bool uvSwapped,
+                    SwLayer::YuvStandard standard, bool fullRange, size_t count) {
+    const YuvCoefficients& k = getYuvCoefficients(standard, fullRange);
+    const int16x8_t bias = vdupq_n_s16(128);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t luma = vld1q_u8(y + i);
+        uint8x8x2_t chroma = vld2_u8(uv + i);
+        uint8x8_t u = chroma.val[uvSwapped ? 1 : 0];
+        uint8x8_t v = chroma.val[uvSwapped ? 0 : 1];
+        uint8x8x2_t uu = vzip_u8(u, u);
+        uint8x8x2_t vv = vzip_u8(v, v);
+        for (int half = 0; half < 2; ++half) {
+            uint8x8_t yHalf = half ? vget_high_u8(luma) : vget_low_u8(luma);
+            int16x8_t yl = vreinterpretq_s16_u16(vmovl_u8(yHalf));
+            int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uu.val[half])), bias);
+            int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vv.val[half])), bias);
+            vst4_u8(reinterpret_cast<uint8_t*>(dst + i + half * 8), yuvToRgbaNeon(yl, d, e, k));
+        }
+    }
+    convertRowNv12Scalar(dst + i, y + i, uv + i, uvSwapped, k, count - i);
+}
+
+// luma of 8 pixels, the coefficients are all positive and the sums fit 16 bits
+static inline uint8x8_t rgbToLumaNeon(const uint8x8x4_t& px, const RgbToYuvCoefficients& k) {
+    uint16x8_t sum = vmull_u8(px.val[0], vdup_n_u8(k.yr));
+    sum = vmlal_u8(sum, px.val[1], vdup_n_u8(k.yg));
+    sum = vmlal_u8(sum, px.val[2], vdup_n_u8(k.yb));
+    return vshrn_n_u16(vaddq_u16(sum, vdupq_n_u16(lumaBias(k))), 8);
+}
+
+static inline uint16x4_t rgbDotNeon(int16x4_t r, int16x4_t g, int16x4_t b, int16_t cr,
+                                    int16_t cg, int16_t cb) {
+    int32x4_t sum = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(r, cr), g, cg), b, cb);
+    return vqshrun_n_s32(vaddq_s32(sum, vdupq_n_s32(kChromaBias)), 8);
+}
+
+void convertRowsToNv12(uint8_t* y0, uint8_t* y1, uint8_t* uv, const uint32_t* row0,
+                       const uint32_t* row1, bool uvSwapped, SwLayer::YuvStandard standard,
+                       bool fullRange, size_t count) {
+    const RgbToYuvCoefficients& k = getRgbToYuvCoefficients(standard, fullRange);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t p0 = vld4_u8(reinterpret_cast<const uint8_t*>(row0 + i));
+        uint8x8x4_t p1 = vld4_u8(reinterpret_cast<const uint8_t*>(row1 + i));
+        vst1_u8(y0 + i, rgbToLumaNeon(p0, k));
+        if (y1) {
+            vst1_u8(y1 + i, rgbToLumaNeon(p1, k));
+        }
+
+        // four 2x2 averages per channel, in the low lanes
+        int16x4_t c[3];
+        for (int ch = 0; ch < 3; ++ch) {
+            uint8x8_t v = vrhadd_u8(p0.val[ch], p1.val[ch]);
+            uint8x8x2_t pairs = vuzp_u8(v, v);
+            uint8x8_t h = vrhadd_u8(pairs.val[0], pairs.val[1]);
+            c[ch] = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(h)));
+        }
+        uint16x4_t u = rgbDotNeon(c[0], c[1], c[2], k.ur, k.ug, k.ub);
+        uint16x4_t v = rgbDotNeon(c[0], c[1], c[2], k.vr, k.vg, k.vb);
+        uint16x4x2_t zipped = uvSwapped ? vzip_u16(v, u) : vzip_u16(u, v);
+        vst1_u8(uv + i, vqmovn_u16(vcombine_u16(zipped.val[0], zipped.val[1])));
+    }
+    convertRowsToNv12Scalar(y0 + i, y1 ? y1 + i : nullptr, uv + i, row0 + i, row1 + i, uvSwapped,
+                            k, count - i);
+}
+
+#elif defined(__SSE2__)
+
+// x / 255 on 16 bit lanes holding products of two bytes
+static inline __m128i div255Epi16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+void blendRowPremultiplied(uint32_t* dst, const uint32_t* src, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v255 = _mm_set1_epi16(255);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+
+        // broadcast each pixel's alpha to its four 16 bit channel lanes
+        __m128i a = _mm_srli_epi32(s, 24);
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+        __m128i invLo = _mm_sub_epi16(v255, _mm_unpacklo_epi32(a, a));
+        __m128i invHi = _mm_sub_epi16(v255, _mm_unpackhi_epi32(a, a));
+
+        __m128i lo = div255Epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), invLo));
+        __m128i hi = div255Epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), invHi));
+        __m128i out = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+    }
+    blendRowScalar(dst + i, src + i, count - i);
+}
+
+void scaleRow(uint32_t* px, uint8_t alpha, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i a = _mm_set1_epi16(alpha);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px + i));
+        __m128i lo = div255Epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), a));
+        __m128i hi = div255Epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), a));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(px + i), _mm_packus_epi16(lo, hi));
+    }
+    scaleRowScalar(px + i, alpha, count - i);
+}
+
+// interleaves 8 r, g and b values held in 16 bit lanes into opaque RGBA_8888
+static inline void storeRgbaSse2(uint32_t* dst, __m128i r, __m128i g, __m128i b) {
+    __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+    __m128i ba = _mm_or_si128(b, _mm_set1_epi16(static_cast<int16_t>(0xff00)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4), _mm_unpackhi_epi16(rg, ba));
+}
+
+void convertRowRgb565(uint32_t* dst, const uint16_t* src, size_t count) {
+    const __m128i mask6 = _mm_set1_epi16(0x3f);
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i r = _mm_srli_epi16(p, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+        __m128i b = _mm_and_si128(p, mask5);
+        storeRgbaSse2(dst + i, _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2)),
+                      _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4)),
+                      _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2)));
+    }
+    convertRowRgb565Scalar(dst + i, src + i, count - i);
+}
+
+// (x + 32) >> 6 clamped to [0, 255], still in 16 bit lanes
+static inline __m128i descaleSse2(__m128i x) {
+    x = _mm_srai_epi16(_mm_adds_epi16(x, _mm_set1_epi16(32)), 6);
+    return _mm_min_epi16(_mm_max_epi16(x, _mm_setzero_si128()), _mm_set1_epi16(255));
+}
+
+void convertRowNv12(uint32_t* dst, const uint8_t* y, const uint8_t* uv, bool uvSwapped,
+                    SwLayer::YuvStandard standard, bool fullRange, size_t count) {
+    const YuvCoefficients& k = getYuvCoefficients(standard, fullRange);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i lowHalf = _mm_set1_epi32(0xffff);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i luma = _mm_unpacklo_epi8(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(y + i)), zero);
+        // four chroma pairs, one per 32 bit lane
+        __m128i chroma = _mm_unpacklo_epi8(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(uv + i)), zero);
+        __m128i first = _mm_and_si128(chroma, lowHalf);
+        __m128i second = _mm_srli_epi32(chroma, 16);
+        first = _mm_or_si128(first, _mm_slli_epi32(first, 16));
+        second = _mm_or_si128(second, _mm_slli_epi32(second, 16));
+        __m128i d = _mm_sub_epi16(uvSwapped ? second : first, bias);
+        __m128i e = _mm_sub_epi16(uvSwapped ? first : second, bias);
+
+        __m128i c = _mm_mullo_epi16(_mm_sub_epi16(luma, _mm_set1_epi16(k.yOffset)),
+                                    _mm_set1_epi16(k.y));
+        __m128i r = _mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(k.rv)));
+        __m128i g = _mm_subs_epi16(_mm_subs_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(k.gu))),
+                                   _mm_mullo_epi16(e, _mm_set1_epi16(k.gv)));
+        __m128i b = _mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(k.bu)));
+        storeRgbaSse2(dst + i, descaleSse2(r), descaleSse2(g), descaleSse2(b));
+    }
+    convertRowNv12Scalar(dst + i, y + i, uv + i, uvSwapped, k, count - i);
+}
+
+// Dot products of 4 pixels with [r, g, b, 0] coefficients as 32 bit lanes,
+// biased and shifted down by 8.
+static inline __m128i rgbDotSse2(__m128i px, __m128i coefficients, __m128i bias) {
+    const __m128i zero = _mm_setzero_si128();
+    // r * cr + g * cg in the even lanes, b * cb in the odd ones
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coefficients);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coefficients);
+    lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+    hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+    __m128i sum = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 0, 2, 0)),
+                                     _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 0, 2, 0)));
+    return _mm_srai_epi32(_mm_add_epi32(sum, bias), 8);
+}
+
+static inline __m128i rgbCoefficientsSse2(int16_t r, int16_t g, int16_t b) {
+    return _mm_set_epi16(0, b, g, r, 0, b, g, r);
+}
+
+// the even pixels of a and b, a first
+static inline __m128i evenPixelsSse2(__m128i a, __m128i b) {
+    return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, _MM_SHUFFLE(2, 0, 2, 0)),
+                              _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+void convertRowsToNv12(uint8_t* y0, uint8_t* y1, uint8_t* uv, const uint32_t* row0,
+                       const uint32_t* row1, bool uvSwapped, SwLayer::YuvStandard standard,
+                       bool fullRange, size_t count) {
+    const RgbToYuvCoefficients& k = getRgbToYuvCoefficients(standard, fullRange);
+    const __m128i yk = rgbCoefficientsSse2(k.yr, k.yg, k.yb);
+    const __m128i uk = rgbCoefficientsSse2(k.ur, k.ug, k.ub);
+    const __m128i vk = rgbCoefficientsSse2(k.vr, k.vg, k.vb);
+    const __m128i yBias = _mm_set1_epi32(lumaBias(k));
+    const __m128i cBias = _mm_set1_epi32(kChromaBias);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + i));
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + i + 4));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + i));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + i + 4));
+
+        __m128i luma = _mm_packs_epi32(rgbDotSse2(a0, yk, yBias), rgbDotSse2(b0, yk, yBias));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(y0 + i), _mm_packus_epi16(luma, luma));
+        if (y1) {
+            luma = _mm_packs_epi32(rgbDotSse2(a1, yk, yBias), rgbDotSse2(b1, yk, yBias));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(y1 + i), _mm_packus_epi16(luma, luma));
+        }
+
+        // average vertically, then each pixel with its right neighbour
+        __m128i a = _mm_avg_epu8(a0, a1);
+        __m128i b = _mm_avg_epu8(b0, b1);
+        a = _mm_avg_epu8(a, _mm_srli_epi64(a, 32));
+        b = _mm_avg_epu8(b, _mm_srli_epi64(b, 32));
+        __m128i c = evenPixelsSse2(a, b);
+        __m128i u = rgbDotSse2(c, uk, cBias);
+        __m128i v = rgbDotSse2(c, vk, cBias);
+        __m128i planar = uvSwapped ? _mm_packs_epi32(v, u) : _mm_packs_epi32(u, v);
+        __m128i chroma = _mm_unpacklo_epi16(planar, _mm_srli_si128(planar, 8));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(uv + i), _mm_packus_epi16(chroma, chroma));
+    }
+    convertRowsToNv12Scalar(y0 + i, y1 ? y1 + i : nullptr, uv + i, row0 + i, row1 + i, uvSwapped,
+                            k, count - i);
+}
+
+#else
+
+void blendRowPremultiplied(uint32_t* dst, const uint32_t* src, size_t count) {
+    blendRowScalar(dst, src, count);
+}
+
+void scaleRow(uint32_t* px, uint8_t alpha, size_t count) {
+    scaleRowScalar(px, alpha, count);
+}
+
+void convertRowRgb565(uint32_t* dst, const uint16_t* src, size_t count) {
+    convertRowRgb565Scalar(dst, src, count);
+}
+
+void convertRowNv12(uint32_t* dst, const uint8_t* y, const uint8_t* uv, bool uvSwapped,
+                    SwLayer::YuvStandard standard, bool fullRange, size_t count) {
+    convertRowNv12Scalar(dst, y, uv, uvSwapped, getYuvCoefficients(standard, fullRange), count);
+}
+
+void convertRowsToNv12(uint8_t* y0, uint8_t* y1, uint8_t* uv, const uint32_t* row0,
+                       const uint32_t* row1, bool uvSwapped, SwLayer::YuvStandard standard,
+                       bool fullRange, size_t count) {
+    convertRowsToNv12Scalar(y0, y1, uv, row0, row1, uvSwapped,
+                            getRgbToYuvCoefficients(standard, fullRange), count);
+}
+
+#endif
+
+SwRect unionRect(const SwRect& a, const SwRect& b) {
+    if (a.isEmpty()) return b;
+    if (b.isEmpty()) return a;
+    return {std::min(a.left, b.left), std::min(a.top, b.top), std::max(a.right, b.right),
+            std::max(a.bottom, b.bottom)};
+}
+
+SwRect intersectRect(const SwRect& a, const SwRect& b) {
+    return {std::max(a.left, b.left), std::max(a.top, b.top), std::min(a.right, b.right),
+            std::min(a.bottom, b.bottom)};
+}
+
+SwRect alignToChroma(const SwRect& rect, uint32_t width, uint32_t height) {
+    if (rect.isEmpty()) {
+        return rect;
+    }
+    return {rect.left & ~1, rect.top & ~1,
+            std::min((rect.right + 1) & ~1, static_cast<int32_t>(width)),
+            std::min((rect.bottom + 1) & ~1, static_cast<int32_t>(height))};
+}
+
+bool getYuvEncoding(int32_t dataspace, SwLayer::YuvStandard* outStandard, bool* outFullRange) {
+    *outStandard = SwLayer::YuvStandard::BT601;
+    *outFullRange = false;
+    // legacy values, from before the standard and range fields
+    switch (dataspace) {
+        case HAL_DATASPACE_JFIF:
+            *outFullRange = true;
+            return true;
+        case HAL_DATASPACE_BT601_625:
+        case HAL_DATASPACE_BT601_525:
+            return true;
+        case HAL_DATASPACE_BT709:
+            *outStandard = SwLayer::YuvStandard::BT709;
+            return true;
+        default:
+            break;
+    }
+
+    *outFullRange = (dataspace & HAL_DATASPACE_RANGE_MASK) == HAL_DATASPACE_RANGE_FULL;
+    switch (dataspace & HAL_DATASPACE_STANDARD_MASK) {
+        case HAL_DATASPACE_STANDARD_BT709:
+            *outStandard = SwLayer::YuvStandard::BT709;
+            return true;
+        case HAL_DATASPACE_STANDARD_BT601_625:
+        case HAL_DATASPACE_STANDARD_BT601_625_UNADJUSTED:
+        case HAL_DATASPACE_STANDARD_BT601_525:
+        case HAL_DATASPACE_STANDARD_BT601_525_UNADJUSTED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool SoftwareCompositor::isSupportedSourceFormat(int32_t format) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return true;
+        default:
+            return isYuvFormat(format);
+    }
+}
+
+bool SoftwareCompositor::isSupportedTargetFormat(int32_t format) {
+    return format == HAL_PIXEL_FORMAT_RGBA_8888 || format == HAL_PIXEL_FORMAT_RGBX_8888;
+}
+
+bool SoftwareCompositor::isYuvFormat(int32_t format) {
+    return format == HAL_PIXEL_FORMAT_YCBCR_420_888 || format == HAL_PIXEL_FORMAT_YCRCB_420_SP ||
+            format == RK_HAL_PIXEL_FORMAT_YCRCB_NV12;
+}
+
+void SoftwareCompositor::compose(const std::vector<SwLayer>& layers, const SwBuffer& target) {
+    compose(layers, target,
+            {0, 0, static_cast<int32_t>(target.width), static_cast<int32_t>(target.height)});
+}
+
+void SoftwareCompositor::compose(const std::vector<SwLayer>& layers, const SwBuffer& target,
+                                 const SwRect& clip) {
+    compose(layers, target, clip, kOpaqueBlack);
+}
+
+void SoftwareCompositor::compose(const std::vector<SwLayer>& layers, const SwBuffer& target,
+                                 const SwRect& clip, uint32_t background) {
+    if (!isSupportedTargetFormat(target.format)) {
+        return;
+    }
+
+    SwRect bounds = intersectRect(
+            clip, {0, 0, static_cast<int32_t>(target.width), static_cast<int32_t>(target.height)});
+    if (bounds.isEmpty()) {
+        return;
+    }
+
+    for (int32_t y = bounds.top; y < bounds.bottom; ++y) {
+        auto* row = reinterpret_cast<uint32_t*>(target.data + y * target.stride);
+        std::fill(row + bounds.left, row + bounds.right, background);
+    }
+
+    std::vector<uint32_t> line;
+    for (const auto& layer : layers) {
+        if (layer.buffer && !isSupportedSourceFormat(layer.buffer->format)) {
+            continue;
+        }
+        composeLayer(layer, target, bounds, line);
+    }
+}
+
+bool SoftwareCompositor::isSupportedYuvTarget(const SwBuffer& target) {
+    return isYuvFormat(target.format) && target.chromaStep == 2 &&
+            (target.cb + 1 == target.cr || target.cr + 1 == target.cb);
+}
+
+void SoftwareCompositor::convertToYuv(const SwBuffer& src, const SwBuffer& target,
+                                      const SwRect& clip, SwLayer::YuvStandard standard,
+                                      bool fullRange) {
+    if (!isSupportedTargetFormat(src.format) || !isSupportedYuvTarget(target)) {
+        return;
+    }
+
+    const int32_t width = std::min(src.width, target.width);
+    const int32_t height = std::min(src.height, target.height);
+    SwRect bounds = intersectRect(alignToChroma(clip, width, height), {0, 0, width, height});
+    if (bounds.isEmpty()) {
+        return;
+    }
+
+    const bool swapped = target.cr + 1 == target.cb;
+    uint8_t* chroma = swapped ? target.cr : target.cb;
+    const size_t count = bounds.right - bounds.left;
+    for (int32_t y = bounds.top; y < bounds.bottom; y += 2) {
+        const bool pair = y + 1 < height;
+        auto* row0 = reinterpret_cast<const uint32_t*>(src.data + y * src.stride) + bounds.left;
+        auto* row1 = pair ? reinterpret_cast<const uint32_t*>(src.data + (y + 1) * src.stride) +
+                        bounds.left
+                          : row0;
+        uint8_t* y0 = target.data + y * target.stride + bounds.left;
+        convertRowsToNv12(y0, pair ? y0 + target.stride : nullptr,
+                          chroma + (y / 2) * target.chromaStride + bounds.left, row0, row1,
+                          swapped, standard, fullRange, count);
+    }
+}
+
+void SoftwareCompositor::composeLayer(const SwLayer& layer, const SwBuffer& target,
+                                      const SwRect& clip, std::vector<uint32_t>& line) {
+    SwRect bounds = intersectRect(layer.frame, clip);
+    if (bounds.isEmpty()) {
+        return;
+    }
+
+    auto alpha = static_cast<uint8_t>(std::lround(std::clamp(layer.alpha, 0.f, 1.f) * 255.f));
+    if (alpha == 0) {
+        return;
+    }
+    const bool opaque = layer.blend == SwLayer::Blend::NONE && alpha == 255;
+    const size_t count = bounds.right - bounds.left;
+    line.resize(count);
+
+    for (int32_t y = bounds.top; y < bounds.bottom; ++y) {
+        auto* row = reinterpret_cast<uint32_t*>(target.data + y * target.stride) + bounds.left;
+        if (opaque) {
+            fetchRow(layer, y, bounds.left, bounds.right, row);
+            continue;
+        }
+        fetchRow(layer, y, bounds.left, bounds.right, line.data());
+        if (alpha != 255) {
+            scaleRow(line.data(), alpha, count);
+        }
+        blendRowPremultiplied(row, line.data(), count);
+    }
+}
+
+// source pixel as non-premultiplied RGBA_8888
+static inline uint32_t loadPixel(const SwBuffer& src, const SwLayer& layer, int32_t x,
+                                 int32_t y) {
+    switch (src.format) {
+        case HAL_PIXEL_FORMAT_RGB_565: {
+            uint16_t px;
+            memcpy(&px, src.data + y * src.stride + x * 2, sizeof(px));
+            return expandRgb565(px);
+        }
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888: {
+            uint32_t px;
+            memcpy(&px, src.data + y * src.stride + x * 4, sizeof(px));
+            return src.format == HAL_PIXEL_FORMAT_BGRA_8888 ? swapRedBlue(px) : px;
+        }
+        default: {
+            size_t chroma = (y / 2) * src.chromaStride + (x / 2) * src.chromaStep;
+            return yuvToRgba(src.data[y * src.stride + x], src.cb[chroma], src.cr[chroma],
+                             getYuvCoefficients(layer.yuvStandard, layer.yuvFullRange));
+        }
+    }
+}
+
+static bool hasAlphaChannel(int32_t format) {
+    return format == HAL_PIXEL_FORMAT_RGBA_8888 || format == HAL_PIXEL_FORMAT_BGRA_8888;
+}
+
+// Turns loaded pixels into what blendRowPremultiplied expects.
+static void finishRow(const SwLayer& layer, uint32_t* px, size_t count) {
+    if (!hasAlphaChannel(layer.buffer->format) || layer.blend == SwLayer::Blend::NONE) {
+        for (size_t i = 0; i < count; ++i) {
+            px[i] |= kOpaqueBlack;
+        }
+    } else if (layer.blend == SwLayer::Blend::COVERAGE) {
+        for (size_t i = 0; i < count; ++i) {
+            px[i] = premultiply(px[i]);
+        }
+    }
+}
+
+// Rows of layers drawn 1:1 without a transform, the common case for
+// UI and video that is already scaled. Returns false if not applicable.
+bool SoftwareCompositor::fetchRowUnscaled(const SwLayer& layer, int32_t y, int32_t left,
+                                          int32_t right, uint32_t* out) {
+    const SwBuffer& src = *layer.buffer;
+    const int32_t width = layer.frame.right - layer.frame.left;
+    const int32_t height = layer.frame.bottom - layer.frame.top;
+    if (layer.transform != 0 || layer.crop.left != std::floor(layer.crop.left) ||
+        layer.crop.top != std::floor(layer.crop.top) ||
+        layer.crop.right - layer.crop.left != width ||
+        layer.crop.bottom - layer.crop.top != height) {
+        return false;
+    }
+
+    const int32_t sx = static_cast<int32_t>(layer.crop.left) + left - layer.frame.left;
+    const int32_t sy = static_cast<int32_t>(layer.crop.top) + y - layer.frame.top;
+    const size_t count = right - left;
+    if (sx < 0 || sy < 0 || sx + count > src.width || sy >= static_cast<int32_t>(src.height)) {
+        return false;
+    }
+
+    const uint8_t* row = src.data + sy * src.stride;
+    switch (src.format) {
+        case HAL_PIXEL_FORMAT_RGB_565:
+            convertRowRgb565(out, reinterpret_cast<const uint16_t*>(row) + sx, count);
+            return true;
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            memcpy(out, row + sx * 4, count * 4);
+            if (src.format == HAL_PIXEL_FORMAT_BGRA_8888) {
+                for (size_t i = 0; i < count; ++i) {
+                    out[i] = swapRedBlue(out[i]);
+                }
+            }
+            finishRow(layer, out, count);
+            return true;
+        default:
+            break;
+    }
+
+    // semi-planar 4:2:0 starting on a chroma sample
+    const bool swapped = src.cr + 1 == src.cb;
+    if (src.chromaStep != 2 || (!swapped && src.cb + 1 != src.cr) || (sx & 1)) {
+        return false;
+    }
+    const uint8_t* uv = (swapped ? src.cr : src.cb) + (sy / 2) * src.chromaStride + sx;
+    convertRowNv12(out, row + sx, uv, swapped, layer.yuvStandard, layer.yuvFullRange, count);
+    return true;
+}
+
+// Produces premultiplied pixels of the layer for target pixels [left, right) of row y.
+void SoftwareCompositor::fetchRow(const SwLayer& layer, int32_t y, int32_t left, int32_t right,
+                                  uint32_t* out) {
+    if (!layer.buffer) {
+        uint32_t color = layer.color;
+        color = layer.blend == SwLayer::Blend::NONE ? color | kOpaqueBlack : premultiply(color);
+        std::fill(out, out + (right - left), color);
+        return;
+    }
+
+    if (fetchRowUnscaled(layer, y, left, right, out)) {
+        return;
+    }
+
+    const SwBuffer& src = *layer.buffer;
+    const float frameWidth = layer.frame.right - layer.frame.left;
+    const float frameHeight = layer.frame.bottom - layer.frame.top;
+    const float cropWidth = layer.crop.right - layer.crop.left;
+    const float cropHeight = layer.crop.bottom - layer.crop.top;
+    const bool rot90 = layer.transform & HAL_TRANSFORM_ROT_90;
+    const bool flipH = layer.transform & HAL_TRANSFORM_FLIP_H;
+    const bool flipV = layer.transform & HAL_TRANSFORM_FLIP_V;
+    const float v = (y - layer.frame.top + 0.5f) / frameHeight;
+
+    for (int32_t x = left; x < right; ++x) {
+        // undo the rotation, then the flips
+        float u = (x - layer.frame.left + 0.5f) / frameWidth;
+        float su = rot90 ? v : u;
+        float sv = rot90 ? 1.f - u : v;
+        if (flipH) su = 1.f - su;
+        if (flipV) sv = 1.f - sv;
+
+        auto sx = static_cast<int32_t>(layer.crop.left + su * cropWidth);
+        auto sy = static_cast<int32_t>(layer.crop.top + sv * cropHeight);
+        sx = std::clamp(sx, 0, static_cast<int32_t>(src.width) - 1);
+        sy = std::clamp(sy, 0, static_cast<int32_t>(src.height) - 1);
+        out[x - left] = loadPixel(src, layer, sx, sy);
+    }
+    finishRow(layer, out, right - left);
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
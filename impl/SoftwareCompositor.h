@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// CPU reference composition. It only depends on plain memory so it can be
+// exercised on a host; mapping gralloc buffers is left to the caller.
+
+// A mapped buffer, format is an android_pixel_format_t. For YUV formats data
+// and stride describe the luma plane.
+struct SwBuffer {
+    uint8_t* data = nullptr;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // in bytes
+    uint32_t stride = 0;
+    int32_t format = 0;
+
+    // chroma planes of YUV 4:2:0 formats, chromaStep is 2 for semi-planar
+    uint8_t* cb = nullptr;
+    uint8_t* cr = nullptr;
+    uint32_t chromaStride = 0;
+    uint32_t chromaStep = 0;
+};
+
+struct SwRect {
+    int32_t left = 0;
+    int32_t top = 0;
+    int32_t right = 0;
+    int32_t bottom = 0;
+
+    bool isEmpty() const { return left >= right || top >= bottom; }
+};
+
+// smallest rect containing both, an empty rect is ignored
+SwRect unionRect(const SwRect& a, const SwRect& b);
+SwRect intersectRect(const SwRect& a, const SwRect& b);
+// grows rect to whole 2x2 chroma samples, without leaving width x height
+SwRect alignToChroma(const SwRect& rect, uint32_t width, uint32_t height);
+
+struct SwFRect {
+    float left = 0.f;
+    float top = 0.f;
+    float right = 0.f;
+    float bottom = 0.f;
+};
+
+struct SwLayer {
+    enum class Blend { NONE, PREMULTIPLIED, COVERAGE };
+    enum class YuvStandard { BT601, BT709 };
+
+    // nullptr for a solid color layer
+    const SwBuffer* buffer = nullptr;
+    // non-premultiplied RGBA_8888, used when there is no buffer
+    uint32_t color = 0;
+    SwFRect crop;
+    SwRect frame;
+    // HAL_TRANSFORM_* bits
+    uint32_t transform = 0;
+    float alpha = 1.f;
+    Blend blend = Blend::PREMULTIPLIED;
+    // only used for YUV buffers
+    YuvStandard yuvStandard = YuvStandard::BT601;
+    bool yuvFullRange = false;
+};
+
+// Matrix and range named by an android_dataspace_t. Returns false, leaving
+// BT601 in outStandard, if it names no matrix.
+bool getYuvEncoding(int32_t dataspace, SwLayer::YuvStandard* outStandard, bool* outFullRange);
+
+class SoftwareCompositor {
+  public:
+    static bool isSupportedSourceFormat(int32_t format);
+    static bool isSupportedTargetFormat(int32_t format);
+    static bool isYuvFormat(int32_t format);
+    // semi-planar 4:2:0, the layout convertToYuv writes
+    static bool isSupportedYuvTarget(const SwBuffer& target);
+
+    // Composes the layers, bottom first, into the target. What no layer
+    // covers is opaque black. Layers in unsupported formats are skipped.
+    static void compose(const std::vector<SwLayer>& layers, const SwBuffer& target);
+    // Same, but only touches the target pixels inside clip. Disjoint clips
+    // can be composed concurrently.
+    static void compose(const std::vector<SwLayer>& layers, const SwBuffer& target,
+                        const SwRect& clip);
+    // Same, over a premultiplied RGBA_8888 background instead of black.
+    static void compose(const std::vector<SwLayer>& layers, const SwBuffer& target,
+                        const SwRect& clip, uint32_t background);
+    // Converts the clip of an RGBA_8888 or RGBX_8888 buffer into a buffer that
+    // isSupportedYuvTarget. The clip should be aligned to chroma samples.
+    static void convertToYuv(const SwBuffer& src, const SwBuffer& target, const SwRect& clip,
+                             SwLayer::YuvStandard standard, bool fullRange);
+
+  private:
+    static void composeLayer(const SwLayer& layer, const SwBuffer& target, const SwRect& clip,
+                             std::vector<uint32_t>& line);
+    static void fetchRow(const SwLayer& layer, int32_t y, int32_t left, int32_t right,
+                         uint32_t* out);
+    static bool fetchRowUnscaled(const SwLayer& layer, int32_t y, int32_t left, int32_t right,
+                                 uint32_t* out);
+};
+
+// Row kernels, exposed for benchmarking. Pixels are premultiplied RGBA_8888.
+// dst = src + dst * (1 - src.a)
+void blendRowPremultiplied(uint32_t* dst, const uint32_t* src, size_t count);
+// px = px * alpha / 255
+void scaleRow(uint32_t* px, uint8_t alpha, size_t count);
+// opaque RGBA_8888 from RGB_565
+void convertRowRgb565(uint32_t* dst, const uint16_t* src, size_t count);
+// opaque RGBA_8888 from a luma row and its interleaved chroma row, starting on
+// an even pixel. uvSwapped is set for CrCb ordering.
+void convertRowNv12(uint32_t* dst, const uint8_t* y, const uint8_t* uv, bool uvSwapped,
+                    SwLayer::YuvStandard standard, bool fullRange, size_t count);
+// luma of two opaque RGBA_8888 rows and their interleaved, 2x2 averaged chroma.
+// y1 is nullptr for the last row of an odd height, row1 then repeats row0.
+void convertRowsToNv12(uint8_t* y0, uint8_t* y1, uint8_t* uv, const uint32_t* row0,
+                       const uint32_t* row1, bool uvSwapped, SwLayer::YuvStandard standard,
+                       bool fullRange, size_t count);
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
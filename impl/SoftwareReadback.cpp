@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SoftwareReadback.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <hardware/hwcomposer2.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+SoftwareReadback::SoftwareReadback() {
+    mTimeline = SyncTimeline::create();
+    if (mTimeline) {
+        mThread = std::thread([this]() {
+            pthread_setname_np(pthread_self(), "hwc3Readback");
+            composeLoop();
+        });
+    }
+}
+
+SoftwareReadback::~SoftwareReadback() {
+    if (mThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mComposeCondition.notify_one();
+        mThread.join();
+    }
+}
+
+bool SoftwareReadback::isEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.readback.software", false);
+}
+
+std::unique_lock<std::mutex> SoftwareReadback::lockIdle(int64_t display) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mIdleCondition.wait(lock, [this, display]() {
+        auto it = mDisplays.find(display);
+        return it == mDisplays.end() || !it->second.composing;
+    });
+    return lock;
+}
+
+ShadowLayer& SoftwareReadback::getLayer(int64_t display, int64_t layer) {
+    return mDisplays[display].stack.layers[layer];
+}
+
+void SoftwareReadback::removeDisplay(int64_t display) {
+    auto lock = lockIdle(display);
+    mDisplays.erase(display);
+}
+
+void SoftwareReadback::destroyLayer(int64_t display, int64_t layer) {
+    auto lock = lockIdle(display);
+    auto it = mDisplays.find(display);
+    if (it != mDisplays.end()) {
+        it->second.stack.layers.erase(layer);
+    }
+}
+
+void SoftwareReadback::destroyLayers(int64_t display, const std::vector<int64_t>& layers) {
+    auto lock = lockIdle(display);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end()) {
+        return;
+    }
+    for (int64_t layer : layers) {
+        it->second.stack.layers.erase(layer);
+    }
+}
+
+void SoftwareReadback::setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                                      int acquireFence) {
+    auto lock = lockIdle(display);
+    auto& state = getLayer(display, layer);
+    // a null buffer only updates the fence, as for a cached slot
+    if (buffer) {
+        state.buffer = buffer;
+    }
+    state.acquireFence.reset(acquireFence);
+}
+
+void SoftwareReadback::setLayerColor(int64_t display, int64_t layer, uint32_t rgba) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).color = rgba;
+}
+
+void SoftwareReadback::setLayerComposition(int64_t display, int64_t layer, Composition type) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).composition = type;
+}
+
+void SoftwareReadback::setLayerDisplayFrame(int64_t display, int64_t layer,
+                                            const SwRect& frame) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).frame = frame;
+}
+
+void SoftwareReadback::setLayerSourceCrop(int64_t display, int64_t layer, const SwFRect& crop) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).crop = crop;
+}
+
+void SoftwareReadback::setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).alpha = alpha;
+}
+
+void SoftwareReadback::setLayerBlendMode(int64_t display, int64_t layer, SwLayer::Blend blend) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).blend = blend;
+}
+
+void SoftwareReadback::setLayerDataspace(int64_t display, int64_t layer, int32_t dataspace) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).dataspace = dataspace;
+}
+
+void SoftwareReadback::setLayerTransform(int64_t display, int64_t layer, uint32_t transform) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).transform = transform;
+}
+
+void SoftwareReadback::setLayerZOrder(int64_t display, int64_t layer, uint32_t z) {
+    auto lock = lockIdle(display);
+    getLayer(display, layer).z = z;
+}
+
+void SoftwareReadback::setClientTarget(int64_t display, buffer_handle_t target,
+                                       int acquireFence, int32_t dataspace) {
+    auto lock = lockIdle(display);
+    auto& stack = mDisplays[display].stack;
+    if (target) {
+        stack.clientTarget = target;
+    }
+    stack.clientTargetFence.reset(acquireFence);
+    stack.clientTargetDataspace = dataspace;
+}
+
+int32_t SoftwareReadback::setReadbackBuffer(int64_t display, buffer_handle_t buffer,
+                                            int releaseFence) {
+    ::android::base::unique_fd fence(releaseFence);
+    if (!buffer) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+
+    auto lock = lockIdle(display);
+    auto& state = mDisplays[display];
+    state.readbackBuffer = buffer;
+    state.readbackReleaseFence = std::move(fence);
+    state.readbackDone = false;
+    state.readbackFailed = false;
+    state.readbackFence.reset();
+    return HWC2_ERROR_NONE;
+}
+
+void SoftwareReadback::onPresent(int64_t display) {
+    auto lock = lockIdle(display);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end() || !it->second.readbackBuffer) {
+        return;
+    }
+
+    auto& state = it->second;
+    state.readbackDone = true;
+    if (mTimeline) {
+        ::android::base::unique_fd fence =
+                mTimeline->createFence("hwc3Readback", mTimelinePoint + 1);
+        if (fence.ok()) {
+            ++mTimelinePoint;
+            state.readbackFence = std::move(fence);
+            state.composing = true;
+            mQueue.push_back(display);
+            mComposeCondition.notify_one();
+            return;
+        }
+    }
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    const bool composed = compose(state);
+    onComposed(state, composed, systemTime(SYSTEM_TIME_MONOTONIC) - start);
+}
+
+void SoftwareReadback::onComposed(Display& state, bool composed, nsecs_t elapsed) {
+    state.readbackFailed = !composed;
+    // the buffer is filled once per setReadbackBuffer
+    state.readbackBuffer = nullptr;
+
+    ++mFrames;
+    mTotalTime += elapsed;
+    mMaxTime = std::max(mMaxTime, elapsed);
+}
+
+void SoftwareReadback::composeLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        mComposeCondition.wait(lock, [this]() { return !mQueue.empty() || mStopping; });
+        if (mQueue.empty()) {
+            return;
+        }
+        // not removed before it is idle again
+        auto& state = mDisplays[mQueue.front()];
+        mQueue.pop_front();
+        lock.unlock();
+
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        const bool composed = compose(state);
+        const nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+        lock.lock();
+        onComposed(state, composed, elapsed);
+        // the fence signals regardless, a failure shows in the next fence query
+        mTimeline->advance();
+        state.composing = false;
+        mIdleCondition.notify_all();
+    }
+}
+
+int32_t SoftwareReadback::getReadbackBufferFence(int64_t display, int32_t* outFence) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mDisplays.find(display);
+    if (it == mDisplays.end() || !it->second.readbackDone || it->second.readbackFailed) {
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    const auto& fence = it->second.readbackFence;
+    *outFence = fence.ok() ? dup(fence.get()) : -1;
+    return HWC2_ERROR_NONE;
+}
+
+bool SoftwareReadback::compose(Display& state) {
+    MappedBuffer target(state.readbackBuffer, true /* write */,
+                        state.readbackReleaseFence.release());
+    if (!target.isValid() || !SoftwareCompositor::isSupportedTargetFormat(target.get().format)) {
+        LOG(ERROR) << __func__ << ": readback buffer is not writable";
+        return false;
+    }
+
+    std::vector<SwLayer> layers;
+    std::vector<std::unique_ptr<MappedBuffer>> mappings;
+    state.stack.collect(target.get().width, target.get().height, &layers, &mappings);
+    SoftwareCompositor::compose(layers, target.get());
+    return true;
+}
+
+void SoftwareReadback::dump(std::string* output) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    ::android::base::StringAppendF(output,
+                                   "\nhwc3 software readback: %s frames=%" PRIu64
+                                   " avg=%.3fms max=%.3fms\n",
+                                   mTimeline ? "async" : "sync", mFrames,
+                                   mFrames ? mTotalTime / 1e6 / mFrames : 0.0,
+                                   mMaxTime / 1e6);
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <cutils/native_handle.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "include/IComposerHal.h"
+#include "LayerStack.h"
+#include "SyncTimeline.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Readback for backends without a writeback connector. Keeps a shadow copy of
+// the layer state sent to hwc2 and, on present, blends the committed stack into
+// the readback buffer on the CPU. That runs on a thread of its own and signals
+// a sw_sync readback fence when done, calls that change the state of the
+// display wait for it. Without sw_sync it runs in present.
+class SoftwareReadback {
+  public:
+    SoftwareReadback();
+    ~SoftwareReadback();
+
+    SoftwareReadback(const SoftwareReadback&) = delete;
+    SoftwareReadback& operator=(const SoftwareReadback&) = delete;
+
+    // vendor.hwc3.readback.software
+    static bool isEnabled();
+
+    void removeDisplay(int64_t display);
+    void destroyLayer(int64_t display, int64_t layer);
+    void destroyLayers(int64_t display, const std::vector<int64_t>& layers);
+
+    // acquire fences are owned by the callee
+    void setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                        int acquireFence);
+    void setLayerColor(int64_t display, int64_t layer, uint32_t rgba);
+    void setLayerComposition(int64_t display, int64_t layer, Composition type);
+    void setLayerDisplayFrame(int64_t display, int64_t layer, const SwRect& frame);
+    void setLayerSourceCrop(int64_t display, int64_t layer, const SwFRect& crop);
+    void setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha);
+    void setLayerBlendMode(int64_t display, int64_t layer, SwLayer::Blend blend);
+    void setLayerDataspace(int64_t display, int64_t layer, int32_t dataspace);
+    void setLayerTransform(int64_t display, int64_t layer, uint32_t transform);
+    void setLayerZOrder(int64_t display, int64_t layer, uint32_t z);
+    void setClientTarget(int64_t display, buffer_handle_t target, int acquireFence,
+                         int32_t dataspace);
+
+    // releaseFence is owned by the callee, the buffer is not written before it signals
+    int32_t setReadbackBuffer(int64_t display, buffer_handle_t buffer, int releaseFence);
+    // composes the stack just presented if a readback buffer is set
+    void onPresent(int64_t display);
+    // signals once the content is written, -1 if it already is
+    int32_t getReadbackBufferFence(int64_t display, int32_t* outFence);
+
+    void dump(std::string* output);
+
+  private:
+    struct Display {
+        LayerStack stack;
+        buffer_handle_t readbackBuffer = nullptr;
+        ::android::base::unique_fd readbackReleaseFence;
+        // set once onPresent produced the content for the current readback buffer
+        bool readbackDone = false;
+        bool readbackFailed = false;
+        ::android::base::unique_fd readbackFence;
+        // the readback thread reads the display meanwhile, without mMutex
+        bool composing = false;
+    };
+
+    // waits for the compose of the display in flight
+    std::unique_lock<std::mutex> lockIdle(int64_t display);
+    ShadowLayer& getLayer(int64_t display, int64_t layer) REQUIRES(mMutex);
+    bool compose(Display& state);
+    void onComposed(Display& state, bool composed, nsecs_t elapsed) REQUIRES(mMutex);
+    void composeLoop();
+
+    std::mutex mMutex;
+    std::map<int64_t, Display> mDisplays GUARDED_BY(mMutex);
+
+    std::unique_ptr<SyncTimeline> mTimeline;
+    uint32_t mTimelinePoint GUARDED_BY(mMutex) = 0;
+    std::deque<int64_t> mQueue GUARDED_BY(mMutex);
+    std::condition_variable mComposeCondition;
+    std::condition_variable mIdleCondition;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    std::thread mThread;
+
+    uint64_t mFrames GUARDED_BY(mMutex) = 0;
+    nsecs_t mTotalTime GUARDED_BY(mMutex) = 0;
+    nsecs_t mMaxTime GUARDED_BY(mMutex) = 0;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,535 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SoftwareVirtualDisplay.h"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <hardware/hwcomposer2.h>
+#include <pthread.h>
+#include <string.h>
+#include <system/graphics.h>
+#include <ui/GraphicBufferMapper.h>
+
+#include <algorithm>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// how many frames back an output buffer may be and still get a partial update
+static constexpr size_t kDamageHistory = 4;
+// below this many pixels a frame is composed on the calling thread
+static constexpr int64_t kParallelMinPixels = 512 * 1024;
+static constexpr int32_t kMinBandRows = 64;
+
+static void copyRect(const SwBuffer& src, const SwBuffer& target, const SwRect& rect) {
+    const size_t bytes = (rect.right - rect.left) * 4;
+    for (int32_t y = rect.top; y < rect.bottom; ++y) {
+        memcpy(target.data + y * target.stride + rect.left * 4,
+               src.data + y * src.stride + rect.left * 4, bytes);
+    }
+}
+
+SoftwareVirtualDisplay::SoftwareVirtualDisplay(uint32_t width, uint32_t height, int32_t format,
+                                               float maxFrameRate, WorkerPool* pool)
+      : mWidth(width),
+        mHeight(height),
+        mFormat(format),
+        mFrameInterval(maxFrameRate > 0.f ? static_cast<nsecs_t>(1e9 / maxFrameRate) : 0),
+        mPool(pool) {
+    mTimeline = SyncTimeline::create();
+    if (mTimeline) {
+        mThread = std::thread([this]() {
+            pthread_setname_np(pthread_self(), "hwc3VirtualDisplay");
+            frameLoop();
+        });
+    }
+}
+
+SoftwareVirtualDisplay::~SoftwareVirtualDisplay() {
+    if (mThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mFrameCondition.notify_one();
+        mThread.join();
+    }
+}
+
+bool SoftwareVirtualDisplay::isEnabled() {
+    return ::android::base::GetBoolProperty("vendor.hwc3.virtual.software", false);
+}
+
+float SoftwareVirtualDisplay::getMaxFrameRateProperty() {
+    return static_cast<float>(::android::base::GetIntProperty("vendor.hwc3.virtual.max_fps", 0));
+}
+
+bool SoftwareVirtualDisplay::isSupportedOutputFormat(int32_t format) {
+    return SoftwareCompositor::isSupportedTargetFormat(format) ||
+            SoftwareCompositor::isYuvFormat(format);
+}
+
+int32_t SoftwareVirtualDisplay::createLayer(int64_t* outLayer) {
+    auto lock = lockIdle();
+    *outLayer = mNextLayer++;
+    mStack.layers[*outLayer];
+    return HWC2_ERROR_NONE;
+}
+
+int32_t SoftwareVirtualDisplay::destroyLayer(int64_t layer) {
+    auto lock = lockIdle();
+    mChanges.erase(layer);
+    return mStack.layers.erase(layer) ? HWC2_ERROR_NONE : HWC2_ERROR_BAD_LAYER;
+}
+
+int32_t SoftwareVirtualDisplay::checkLayer(int64_t layer) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStack.layers.count(layer) ? HWC2_ERROR_NONE : HWC2_ERROR_BAD_LAYER;
+}
+
+template <typename F>
+int32_t SoftwareVirtualDisplay::updateLayer(int64_t layer, F&& update) {
+    auto lock = lockIdle();
+    auto it = mStack.layers.find(layer);
+    if (it == mStack.layers.end()) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    update(it->second);
+    ++it->second.changeCount;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t SoftwareVirtualDisplay::setLayerBuffer(int64_t layer, buffer_handle_t buffer,
+                                               int acquireFence) {
+    ::android::base::unique_fd fence(acquireFence);
+    int32_t format = 0;
+    if (buffer) {
+        ::android::ui::PixelFormat pixelFormat;
+        if (::android::GraphicBufferMapper::get().getPixelFormatRequested(buffer,
+                                                                          &pixelFormat) ==
+            ::android::OK) {
+            format = static_cast<int32_t>(pixelFormat);
+        }
+    }
+
+    return updateLayer(layer, [&](ShadowLayer& state) {
+        // a null buffer only updates the fence, as for a cached slot
+        if (buffer) {
+            state.buffer = buffer;
+            state.bufferFormat = format;
+        }
+        state.acquireFence = std::move(fence);
+    });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerBlendMode(int64_t layer, SwLayer::Blend blend) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.blend = blend; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerColor(int64_t layer, uint32_t rgba) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.color = rgba; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerCompositionType(int64_t layer, Composition type) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.composition = type; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerDataspace(int64_t layer, int32_t dataspace) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.dataspace = dataspace; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerDisplayFrame(int64_t layer, const SwRect& frame) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.frame = frame; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerPlaneAlpha(int64_t layer, float alpha) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.alpha = alpha; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerSourceCrop(int64_t layer, const SwFRect& crop) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.crop = crop; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerTransform(int64_t layer, uint32_t transform) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.transform = transform; });
+}
+
+int32_t SoftwareVirtualDisplay::setLayerZOrder(int64_t layer, uint32_t z) {
+    return updateLayer(layer, [&](ShadowLayer& state) { state.z = z; });
+}
+
+void SoftwareVirtualDisplay::setColorTransform(bool identity) {
+    auto lock = lockIdle();
+    mColorTransformIdentity = identity;
+}
+
+int32_t SoftwareVirtualDisplay::setClientTarget(buffer_handle_t target, int acquireFence,
+                                                int32_t dataspace,
+                                                const std::vector<SwRect>& damage) {
+    auto lock = lockIdle();
+    if (target) {
+        mStack.clientTarget = target;
+    }
+    mStack.clientTargetFence.reset(acquireFence);
+    mStack.clientTargetDataspace = dataspace;
+
+    // no damage means the whole target may have changed
+    SwRect full = {0, 0, static_cast<int32_t>(mWidth), static_cast<int32_t>(mHeight)};
+    SwRect region;
+    for (const auto& rect : damage) {
+        region = unionRect(region, rect);
+    }
+    mClientTargetDamage = unionRect(mClientTargetDamage, damage.empty() ? full : region);
+    mClientTargetChanged = true;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t SoftwareVirtualDisplay::setOutputBuffer(buffer_handle_t buffer, int releaseFence) {
+    auto lock = lockIdle();
+    mOutputBuffer = buffer;
+    mOutputReleaseFence.reset(releaseFence);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t SoftwareVirtualDisplay::validate(std::vector<int64_t>* outChangedLayers,
+                                         std::vector<Composition>* outCompositionTypes) {
+    auto lock = lockIdle();
+    mChanges.clear();
+    for (const auto& [id, layer] : mStack.layers) {
+        Composition type = layer.composition;
+        if (type == Composition::CLIENT) {
+            continue;
+        }
+        if (!mColorTransformIdentity) {
+            type = Composition::CLIENT;
+        } else if (type == Composition::SIDEBAND || type == Composition::DISPLAY_DECORATION) {
+            type = Composition::CLIENT;
+        } else if (type != Composition::SOLID_COLOR &&
+                   (!layer.buffer ||
+                    !SoftwareCompositor::isSupportedSourceFormat(layer.bufferFormat))) {
+            type = Composition::CLIENT;
+        }
+        if (type != layer.composition) {
+            mChanges[id] = type;
+        }
+    }
+
+    outChangedLayers->clear();
+    outCompositionTypes->clear();
+    for (const auto& [id, type] : mChanges) {
+        outChangedLayers->push_back(id);
+        outCompositionTypes->push_back(type);
+    }
+    return mChanges.empty() ? HWC2_ERROR_NONE : HWC2_ERROR_HAS_CHANGES;
+}
+
+int32_t SoftwareVirtualDisplay::acceptChanges() {
+    auto lock = lockIdle();
+    for (const auto& [id, type] : mChanges) {
+        auto it = mStack.layers.find(id);
+        if (it != mStack.layers.end()) {
+            it->second.composition = type;
+            ++it->second.changeCount;
+        }
+    }
+    mChanges.clear();
+    return HWC2_ERROR_NONE;
+}
+
+// Region of this frame that differs from the previous one.
+SwRect SoftwareVirtualDisplay::collectDamage() {
+    SwRect damage;
+    bool hasClientLayers = false;
+    for (const auto& [id, layer] : mStack.layers) {
+        hasClientLayers |= layer.composition == Composition::CLIENT;
+        auto it = mPresented.find(id);
+        if (it == mPresented.end()) {
+            damage = unionRect(damage, layer.frame);
+        } else if (it->second.changeCount != layer.changeCount) {
+            damage = unionRect(damage, unionRect(it->second.frame, layer.frame));
+        }
+    }
+    for (const auto& [id, presented] : mPresented) {
+        if (!mStack.layers.count(id)) {
+            damage = unionRect(damage, presented.frame);
+        }
+    }
+    if (hasClientLayers && mClientTargetChanged) {
+        damage = unionRect(damage, mClientTargetDamage);
+    }
+
+    mPresented.clear();
+    for (const auto& [id, layer] : mStack.layers) {
+        mPresented[id] = {layer.changeCount, layer.frame};
+    }
+    mClientTargetChanged = false;
+    mClientTargetDamage = {};
+    return intersectRect(damage, {0, 0, static_cast<int32_t>(mWidth),
+                                  static_cast<int32_t>(mHeight)});
+}
+
+// Damage of the frames the output buffer missed, or all of it.
+SwRect SoftwareVirtualDisplay::getOutputClip() {
+    SwRect clip = {0, 0, static_cast<int32_t>(mWidth), static_cast<int32_t>(mHeight)};
+    auto it = mOutputFrames.find(mOutputBuffer);
+    if (it == mOutputFrames.end()) {
+        return clip;
+    }
+
+    uint64_t missed = mFrameCount - it->second;
+    if (missed > mDamageHistory.size()) {
+        return clip;
+    }
+    SwRect region;
+    for (size_t i = 0; i < missed; ++i) {
+        region = unionRect(region, mDamageHistory[mDamageHistory.size() - 1 - i]);
+    }
+    return region.isEmpty() ? SwRect{} : intersectRect(region, clip);
+}
+
+void SoftwareVirtualDisplay::forEachBand(const SwRect& clip,
+                                         const std::function<void(const SwRect&)>& fn) {
+    const int32_t rows = clip.bottom - clip.top;
+    const int64_t pixels = static_cast<int64_t>(rows) * (clip.right - clip.left);
+    if (!mPool || pixels < kParallelMinPixels) {
+        fn(clip);
+        return;
+    }
+
+    const size_t bands = std::clamp<size_t>(rows / kMinBandRows, 1, mPool->size() + 1);
+    // even boundaries keep each chroma row in one band
+    auto edge = [&](size_t band) {
+        return band == bands ? clip.bottom
+                             : clip.top + (static_cast<int32_t>(rows * band / bands) & ~1);
+    };
+    bool split = mPool->tryRun(bands, [&](size_t band) {
+        SwRect part = clip;
+        part.top = edge(band);
+        part.bottom = edge(band + 1);
+        fn(part);
+    });
+    if (!split) {
+        // another display has the pool, rather than waiting for it
+        fn(clip);
+    }
+}
+
+// Encoders tag their buffers; untagged ones get what they conventionally
+// expect for the resolution.
+void SoftwareVirtualDisplay::getOutputEncoding(buffer_handle_t buffer,
+                                               SwLayer::YuvStandard* outStandard,
+                                               bool* outFullRange) {
+    ::android::ui::Dataspace dataspace = ::android::ui::Dataspace::UNKNOWN;
+    ::android::GraphicBufferMapper::get().getDataspace(buffer, &dataspace);
+    if (!getYuvEncoding(static_cast<int32_t>(dataspace), outStandard, outFullRange)) {
+        *outStandard = mHeight >= 720 ? SwLayer::YuvStandard::BT709 : SwLayer::YuvStandard::BT601;
+    }
+}
+
+// Composes the frame into mFrame, unless nothing changed. Returns false if
+// there was nothing to compose.
+bool SoftwareVirtualDisplay::composeFrame() {
+    SwRect damage = collectDamage();
+    if (!mFrameValid) {
+        mFrame.resize(static_cast<size_t>(mWidth) * mHeight);
+        damage = {0, 0, static_cast<int32_t>(mWidth), static_cast<int32_t>(mHeight)};
+    }
+    if (damage.isEmpty()) {
+        return false;
+    }
+    // YUV outputs are converted in whole chroma samples
+    damage = alignToChroma(damage, mWidth, mHeight);
+
+    std::vector<SwLayer> layers;
+    std::vector<std::unique_ptr<MappedBuffer>> mappings;
+    mStack.collect(mWidth, mHeight, &layers, &mappings);
+    const SwBuffer frame = getFrameBuffer();
+    forEachBand(damage,
+                [&](const SwRect& band) { SoftwareCompositor::compose(layers, frame, band); });
+    mFrameValid = true;
+
+    mDamageHistory.push_back(damage);
+    if (mDamageHistory.size() > kDamageHistory) {
+        mDamageHistory.pop_front();
+    }
+    ++mFrameCount;
+    // forget buffers that can no longer be updated partially
+    for (auto it = mOutputFrames.begin(); it != mOutputFrames.end();) {
+        it = mFrameCount - it->second > kDamageHistory ? mOutputFrames.erase(it) : ++it;
+    }
+
+    if (damage.right - damage.left < static_cast<int32_t>(mWidth) ||
+        damage.bottom - damage.top < static_cast<int32_t>(mHeight)) {
+        ++mPartialFrames;
+    }
+    mComposedPixels +=
+            static_cast<uint64_t>(damage.right - damage.left) * (damage.bottom - damage.top);
+    return true;
+}
+
+SwBuffer SoftwareVirtualDisplay::getFrameBuffer() {
+    return {reinterpret_cast<uint8_t*>(mFrame.data()), mWidth, mHeight, mWidth * 4,
+            HAL_PIXEL_FORMAT_RGBA_8888};
+}
+
+// Frames arriving faster than the target rate are dropped. The deadline
+// advances by whole intervals so a 30 fps target holds on a 60 Hz source.
+bool SoftwareVirtualDisplay::isThrottled(nsecs_t now) {
+    // tolerates vsync jitter
+    static constexpr nsecs_t kSlack = 2'000'000;
+    if (mFrameInterval <= 0 || !mFrameValid) {
+        return false;
+    }
+    return now < mNextFrameTime - kSlack;
+}
+
+int32_t SoftwareVirtualDisplay::present(::android::base::unique_fd* outPresentFence,
+                                        std::vector<int64_t>* outReadLayers) {
+    auto lock = lockIdle();
+    outPresentFence->reset();
+    outReadLayers->clear();
+    if (!mOutputBuffer) {
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+    if (!mTimeline) {
+        return presentFrame();
+    }
+
+    ::android::base::unique_fd fence =
+            mTimeline->createFence("hwc3VirtualDisplay", mTimelinePoint + 1);
+    if (!fence.ok()) {
+        return presentFrame();
+    }
+    ++mTimelinePoint;
+    for (const auto& [id, layer] : mStack.layers) {
+        if (layer.buffer && (layer.composition == Composition::DEVICE ||
+                             layer.composition == Composition::CURSOR)) {
+            outReadLayers->push_back(id);
+        }
+    }
+    *outPresentFence = std::move(fence);
+    mFramePending = true;
+    mFrameCondition.notify_one();
+    return HWC2_ERROR_NONE;
+}
+
+void SoftwareVirtualDisplay::frameLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        mFrameCondition.wait(lock, [this]() { return mFramePending || mStopping; });
+        if (!mFramePending) {
+            return;
+        }
+        // errors cannot be returned anymore, the fence signals regardless
+        if (presentFrame() != HWC2_ERROR_NONE) {
+            ++mFailedFrames;
+        }
+        mTimeline->advance();
+        mFramePending = false;
+        mIdleCondition.notify_all();
+    }
+}
+
+std::unique_lock<std::mutex> SoftwareVirtualDisplay::lockIdle() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mIdleCondition.wait(lock, [this]() { return !mFramePending; });
+    return lock;
+}
+
+int32_t SoftwareVirtualDisplay::presentFrame() {
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (isThrottled(start)) {
+        // layer changes carry over into the next composed frame
+        ++mThrottledFrames;
+    } else if (composeFrame()) {
+        ++mProducedFrames;
+        if (mFrameInterval > 0) {
+            mNextFrameTime = start - mNextFrameTime > mFrameInterval
+                    ? start + mFrameInterval
+                    : mNextFrameTime + mFrameInterval;
+        }
+    } else {
+        ++mUnchangedFrames;
+    }
+
+    SwRect clip = getOutputClip();
+    if (clip.isEmpty()) {
+        // the buffer already holds the frame, its release fence can go as is
+        mOutputFrames[mOutputBuffer] = mFrameCount;
+        mOutputReleaseFence.reset();
+        mTotalTime += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        return HWC2_ERROR_NONE;
+    }
+
+    MappedBuffer output(mOutputBuffer, true /* write */, mOutputReleaseFence.release());
+    if (!output.isValid() || !isSupportedOutputFormat(output.get().format)) {
+        LOG(ERROR) << __func__ << ": output buffer is not writable";
+        mOutputFrames.erase(mOutputBuffer);
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+
+    SwBuffer target = output.get();
+    target.width = std::min(target.width, mWidth);
+    target.height = std::min(target.height, mHeight);
+
+    const bool yuv = SoftwareCompositor::isYuvFormat(target.format);
+    SwLayer::YuvStandard standard = SwLayer::YuvStandard::BT601;
+    bool fullRange = false;
+    if (yuv) {
+        if (!SoftwareCompositor::isSupportedYuvTarget(target)) {
+            LOG(ERROR) << __func__ << ": output buffer is not semi-planar";
+            mOutputFrames.erase(mOutputBuffer);
+            return HWC2_ERROR_NO_RESOURCES;
+        }
+        clip = alignToChroma(clip, mWidth, mHeight);
+        getOutputEncoding(mOutputBuffer, &standard, &fullRange);
+    }
+
+    const SwBuffer frame = getFrameBuffer();
+    forEachBand(clip, [&](const SwRect& band) {
+        if (yuv) {
+            SoftwareCompositor::convertToYuv(frame, target, band, standard, fullRange);
+        } else {
+            copyRect(frame, target, band);
+        }
+    });
+    mOutputFrames[mOutputBuffer] = mFrameCount;
+
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    mTotalTime += elapsed;
+    mMaxTime = std::max(mMaxTime, elapsed);
+    return HWC2_ERROR_NONE;
+}
+
+void SoftwareVirtualDisplay::dump(std::string* output) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    uint64_t presented = mProducedFrames + mThrottledFrames + mUnchangedFrames;
+    ::android::base::StringAppendF(output,
+                                   "  %ux%u format=%d layers=%zu %s maxFps=%.1f presented=%" PRIu64
+                                   " produced=%" PRIu64 " partial=%" PRIu64 " throttled=%" PRIu64
+                                   " unchanged=%" PRIu64 " failed=%" PRIu64
+                                   " avg=%.3fms max=%.3fms avgPixels=%" PRIu64 "\n",
+                                   mWidth, mHeight, mFormat, mStack.layers.size(),
+                                   mTimeline ? "async" : "sync",
+                                   mFrameInterval > 0 ? 1e9 / mFrameInterval : 0.0, presented,
+                                   mProducedFrames, mPartialFrames, mThrottledFrames,
+                                   mUnchangedFrames, mFailedFrames, presented ? mTotalTime / 1e6 / presented : 0.0,
+                                   mMaxTime / 1e6,
+                                   mProducedFrames ? mComposedPixels / mProducedFrames : 0);
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
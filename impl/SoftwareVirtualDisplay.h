@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cutils/native_handle.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "LayerStack.h"
+#include "SyncTimeline.h"
+#include "WorkerPool.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// A virtual display composed by HWC3 on the CPU, for backends that cannot
+// write back. Only the pixels that changed since the output buffer was last
+// written are recomposed, large areas are split across a WorkerPool.
+// Frames are composed on a thread of their own and signal a sw_sync present
+// fence when done, so displays do not hold each other up. Calls that change
+// the display state wait for the frame in flight. Without sw_sync frames are
+// composed in present and no fences are returned.
+//
+// The latest frame is kept in RGBA_8888 and output buffers are brought up to
+// date from it, converting to NV12 for YUV outputs. Frames beyond the target
+// rate and frames where nothing changed are not composed at all.
+class SoftwareVirtualDisplay {
+  public:
+    // maxFrameRate of 0 composes every frame
+    SoftwareVirtualDisplay(uint32_t width, uint32_t height, int32_t format, float maxFrameRate,
+                           WorkerPool* pool);
+    ~SoftwareVirtualDisplay();
+
+    // vendor.hwc3.virtual.software
+    static bool isEnabled();
+    // vendor.hwc3.virtual.max_fps
+    static float getMaxFrameRateProperty();
+    static bool isSupportedOutputFormat(int32_t format);
+
+    int32_t getFormat() const { return mFormat; }
+
+    int32_t createLayer(int64_t* outLayer);
+    int32_t destroyLayer(int64_t layer);
+    // for layer state that does not affect the output
+    int32_t checkLayer(int64_t layer);
+
+    // fences are owned by the callee
+    int32_t setLayerBuffer(int64_t layer, buffer_handle_t buffer, int acquireFence);
+    int32_t setLayerBlendMode(int64_t layer, SwLayer::Blend blend);
+    int32_t setLayerColor(int64_t layer, uint32_t rgba);
+    int32_t setLayerCompositionType(int64_t layer, Composition type);
+    int32_t setLayerDataspace(int64_t layer, int32_t dataspace);
+    int32_t setLayerDisplayFrame(int64_t layer, const SwRect& frame);
+    int32_t setLayerPlaneAlpha(int64_t layer, float alpha);
+    int32_t setLayerSourceCrop(int64_t layer, const SwFRect& crop);
+    int32_t setLayerTransform(int64_t layer, uint32_t transform);
+    int32_t setLayerZOrder(int64_t layer, uint32_t z);
+
+    void setColorTransform(bool identity);
+    int32_t setClientTarget(buffer_handle_t target, int acquireFence, int32_t dataspace,
+                            const std::vector<SwRect>& damage);
+    int32_t setOutputBuffer(buffer_handle_t buffer, int releaseFence);
+
+    int32_t validate(std::vector<int64_t>* outChangedLayers,
+                     std::vector<Composition>* outCompositionTypes);
+    int32_t acceptChanges();
+    // outReadLayers are the layers whose buffers the frame reads, they are
+    // released with the present fence.
+    int32_t present(::android::base::unique_fd* outPresentFence,
+                    std::vector<int64_t>* outReadLayers);
+
+    void dump(std::string* output);
+
+  private:
+    struct PresentedLayer {
+        uint64_t changeCount;
+        SwRect frame;
+    };
+
+    template <typename F>
+    int32_t updateLayer(int64_t layer, F&& update);
+    std::unique_lock<std::mutex> lockIdle();
+    void frameLoop();
+    int32_t presentFrame() REQUIRES(mMutex);
+    SwRect collectDamage() REQUIRES(mMutex);
+    bool composeFrame() REQUIRES(mMutex);
+    SwBuffer getFrameBuffer() REQUIRES(mMutex);
+    bool isThrottled(nsecs_t now) REQUIRES(mMutex);
+    SwRect getOutputClip() REQUIRES(mMutex);
+    // runs fn on bands of clip that start on even rows, in parallel if worth it
+    void forEachBand(const SwRect& clip, const std::function<void(const SwRect&)>& fn);
+    void getOutputEncoding(buffer_handle_t buffer, SwLayer::YuvStandard* outStandard,
+                           bool* outFullRange);
+
+    const uint32_t mWidth;
+    const uint32_t mHeight;
+    const int32_t mFormat;
+    const nsecs_t mFrameInterval;
+    WorkerPool* const mPool;
+
+    std::unique_ptr<SyncTimeline> mTimeline;
+    std::thread mThread;
+
+    std::mutex mMutex;
+    std::condition_variable mFrameCondition;
+    std::condition_variable mIdleCondition;
+    bool mFramePending GUARDED_BY(mMutex) = false;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    uint32_t mTimelinePoint GUARDED_BY(mMutex) = 0;
+
+    LayerStack mStack GUARDED_BY(mMutex);
+    int64_t mNextLayer GUARDED_BY(mMutex) = 1;
+    bool mColorTransformIdentity GUARDED_BY(mMutex) = true;
+    std::unordered_map<int64_t, Composition> mChanges GUARDED_BY(mMutex);
+
+    bool mClientTargetChanged GUARDED_BY(mMutex) = false;
+    SwRect mClientTargetDamage GUARDED_BY(mMutex);
+
+    buffer_handle_t mOutputBuffer GUARDED_BY(mMutex) = nullptr;
+    ::android::base::unique_fd mOutputReleaseFence GUARDED_BY(mMutex);
+
+    // what went into the last frame, to find what changed since
+    std::unordered_map<int64_t, PresentedLayer> mPresented GUARDED_BY(mMutex);
+    // the latest composed frame
+    std::vector<uint32_t> mFrame GUARDED_BY(mMutex);
+    bool mFrameValid GUARDED_BY(mMutex) = false;
+    nsecs_t mNextFrameTime GUARDED_BY(mMutex) = 0;
+    // damage of the most recent frames, newest last
+    std::deque<SwRect> mDamageHistory GUARDED_BY(mMutex);
+    // the frame each output buffer holds
+    std::unordered_map<buffer_handle_t, uint64_t> mOutputFrames GUARDED_BY(mMutex);
+    uint64_t mFrameCount GUARDED_BY(mMutex) = 0;
+
+    uint64_t mProducedFrames GUARDED_BY(mMutex) = 0;
+    uint64_t mPartialFrames GUARDED_BY(mMutex) = 0;
+    uint64_t mThrottledFrames GUARDED_BY(mMutex) = 0;
+    uint64_t mUnchangedFrames GUARDED_BY(mMutex) = 0;
+    uint64_t mFailedFrames GUARDED_BY(mMutex) = 0;
+    uint64_t mComposedPixels GUARDED_BY(mMutex) = 0;
+    nsecs_t mTotalTime GUARDED_BY(mMutex) = 0;
+    nsecs_t mMaxTime GUARDED_BY(mMutex) = 0;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
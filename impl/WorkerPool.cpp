@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WorkerPool.h"
+
+#include <pthread.h>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+WorkerPool::WorkerPool(size_t threads, const std::string& name) {
+    for (size_t i = 0; i < threads; ++i) {
+        mThreads.emplace_back([this, i, name]() {
+            std::string threadName = name + std::to_string(i);
+            pthread_setname_np(pthread_self(), threadName.c_str());
+            workerLoop();
+        });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mWorkCondition.notify_all();
+    for (auto& thread : mThreads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)>& job) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1 || mThreads.empty()) {
+        for (size_t i = 0; i < count; ++i) {
+            job(i);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> runLock(mRunMutex);
+    runLocked(count, job);
+}
+
+bool WorkerPool::tryRun(size_t count, const std::function<void(size_t)>& job) {
+    if (count <= 1 || mThreads.empty()) {
+        run(count, job);
+        return true;
+    }
+
+    std::unique_lock<std::mutex> runLock(mRunMutex, std::try_to_lock);
+    if (!runLock.owns_lock()) {
+        return false;
+    }
+    runLocked(count, job);
+    return true;
+}
+
+void WorkerPool::runLocked(size_t count, const std::function<void(size_t)>& job) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mJob = &job;
+    mNextJob = 0;
+    mJobCount = count;
+    ++mBatch;
+    mWorkCondition.notify_all();
+
+    drain(lock);
+    mDoneCondition.wait(lock, [this]() { return mNextJob >= mJobCount && mRunning == 0; });
+    mJob = nullptr;
+}
+
+void WorkerPool::drain(std::unique_lock<std::mutex>& lock) {
+    while (mNextJob < mJobCount) {
+        size_t index = mNextJob++;
+        const auto* job = mJob;
+        ++mRunning;
+        lock.unlock();
+        (*job)(index);
+        lock.lock();
+        --mRunning;
+    }
+    if (mRunning == 0) {
+        mDoneCondition.notify_all();
+    }
+}
+
+void WorkerPool::workerLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    uint64_t seenBatch = 0;
+    while (true) {
+        mWorkCondition.wait(lock, [&]() { return mStopping || mBatch != seenBatch; });
+        if (mStopping) {
+            return;
+        }
+        seenBatch = mBatch;
+        drain(lock);
+    }
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+// Fixed set of threads to split CPU composition across. The calling thread
+// takes part in the work, so a pool of N threads runs N + 1 jobs at once.
+class WorkerPool {
+  public:
+    WorkerPool(size_t threads, const std::string& name);
+    ~WorkerPool();
+
+    size_t size() const { return mThreads.size(); }
+
+    // Runs job(0) .. job(count - 1) and returns once all of them are done.
+    void run(size_t count, const std::function<void(size_t)>& job);
+    // Same, but returns false without running anything if another batch is
+    // in progress, for callers that would rather do the work themselves.
+    bool tryRun(size_t count, const std::function<void(size_t)>& job);
+
+  private:
+    void runLocked(size_t count, const std::function<void(size_t)>& job);
+    void workerLoop();
+    // runs jobs of the current batch until none is left
+    void drain(std::unique_lock<std::mutex>& lock);
+
+    std::vector<std::thread> mThreads;
+
+    // one batch at a time
+    std::mutex mRunMutex;
+
+    std::mutex mMutex;
+    std::condition_variable mWorkCondition;
+    std::condition_variable mDoneCondition;
+    const std::function<void(size_t)>* mJob = nullptr;
+    size_t mNextJob = 0;
+    size_t mJobCount = 0;
+    size_t mRunning = 0;
+    uint64_t mBatch = 0;
+    bool mStopping = false;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -78,6 +78,8 @@
 #include <aidl/android/hardware/graphics/composer3/ZOrder.h>
 #include <cutils/native_handle.h>
 
+#include "RkHwc3Types.h"
+
 // avoid naming conflict
 using AidlPixelFormat = aidl::android::hardware::graphics::common::PixelFormat;
 using AidlNativeHandle = aidl::android::hardware::common::NativeHandle;
@@ -93,7 +95,13 @@ class IComposerHal {
 
     virtual void getCapabilities(std::vector<Capability>* caps) = 0;
     virtual void dumpDebugInfo(std::string* output) = 0;
+    // starts the statistics in dumpDebugInfo over
+    virtual void resetDebugStats() = 0;
     virtual bool hasCapability(Capability cap) = 0;
+    // Blocks until hwc2 is up. Only a HAL started from a display snapshot
+    // returns before that, and until then only answers the capabilities, the
+    // layer generic metadata keys and the display queries the snapshot holds.
+    virtual void waitForDevice() = 0;
 
     class EventCallback {
       public:
@@ -107,13 +115,16 @@ class IComposerHal {
         virtual void onSeamlessPossible(int64_t display) = 0;
     };
     virtual void registerEventCallback(EventCallback* callback) = 0;
-    virtual void unregisterEventCallback() = 0;
+    // does nothing if another callback was registered since
+    virtual void unregisterEventCallback(EventCallback* callback) = 0;
 
     virtual int32_t acceptDisplayChanges(int64_t display) = 0;
     virtual int32_t createLayer(int64_t display, int64_t* outLayer) = 0;
     virtual int32_t createVirtualDisplay(uint32_t width, uint32_t height, AidlPixelFormat format,
                                          VirtualDisplay* outDisplay) = 0;
     virtual int32_t destroyLayer(int64_t display, int64_t layer) = 0;
+    // all of them even if some fail, returns the last error
+    virtual int32_t destroyLayers(int64_t display, const std::vector<int64_t>& layers) = 0;
     virtual int32_t destroyVirtualDisplay(int64_t display) = 0;
     virtual int32_t getActiveConfig(int64_t display, int32_t* outConfig) = 0;
     virtual int32_t getColorModes(int64_t display, std::vector<ColorMode>* outModes) = 0;
@@ -227,6 +238,10 @@ class IComposerHal {
     virtual int32_t setLayerBlockingRegion(
             int64_t display, int64_t layer,
             const std::vector<std::optional<common::Rect>>& blockingRegion) = 0;
+    virtual int32_t getLayerGenericMetadataKeys(std::vector<LayerGenericMetadataKey>* keys) = 0;
+    virtual int32_t setLayerGenericMetadata(int64_t display, int64_t layer,
+                                            const LayerGenericMetadataKey& key,
+                                            const std::vector<uint8_t>& value) = 0;
 };
 
 } // namespace aidl::android::hardware::graphics::composer3::detail
@@ -38,6 +38,13 @@ public:
     virtual std::unique_ptr<IBufferReleaser> createReleaser(bool isBuffer) = 0;
 
     virtual void clear(RemoveDisplay removeDisplay) = 0;
+    struct DisplayResources {
+        int64_t display;
+        bool isVirtual;
+        std::vector<int64_t> layers;
+    };
+    // what clear() would pass to removeDisplay, without removing anything
+    virtual std::vector<DisplayResources> getDisplayResources() = 0;
     virtual bool hasDisplay(int64_t display) = 0;
     virtual int32_t addPhysicalDisplay(int64_t display) = 0;
     virtual int32_t addVirtualDisplay(int64_t display, uint32_t outputBufferCacheSize) = 0;
@@ -70,6 +77,9 @@ public:
                                            const buffer_handle_t rawHandle,
                                            buffer_handle_t& outStreamHandle,
                                            IBufferReleaser* bufReleaser) = 0;
+    // occupancy and hit rate of the buffer slot caches
+    virtual void dump(std::string* output) = 0;
+    virtual void resetStats() = 0;
 };
 
 } // namespace aidl::android::hardware::graphics::composer3::impl
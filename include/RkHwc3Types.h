@@ -16,6 +16,10 @@
 #ifndef RK_HWC3_TYPES_H_
 #define RK_HWC3_TYPES_H_
 
+#include <stdint.h>
+
+#include <string>
+
 enum class HwcMountOrientation {
     ROT_0 = 0,
     ROT_90,
@@ -23,4 +27,12 @@ enum class HwcMountOrientation {
     ROT_270,
 };
 
+struct LayerGenericMetadataKey {
+    std::string name;
+    bool mandatory;
+};
+
+// NV12 as allocated by the Rockchip gralloc (HAL_PIXEL_FORMAT_YCrCb_NV12)
+#define RK_HAL_PIXEL_FORMAT_YCRCB_NV12 0x15
+
 #endif  // RK_HWC3_TYPES_H_
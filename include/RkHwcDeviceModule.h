@@ -16,6 +16,24 @@
 #ifndef RK_HWC_DEVICE_MODULE_H_
 #define RK_HWC_DEVICE_MODULE_H_
 
+#include <hardware/hwcomposer2.h>
 
+/*
+ * Vendor hwc2 functions, shared between hwc3 and the Rockchip hwc2 backend.
+ * Descriptors start well above the AOSP range so they never collide.
+ */
+enum {
+    RK_HWC2_FUNCTION_GET_OVERLAY_SUPPORT = 0x10000,
+};
+
+/*
+ * Lists the (pixel format, dataspace) pairs the overlay planes can scan out.
+ * Called with null arrays to get the number of pairs in outNumElements.
+ * outSupportMixedColorSpaces tells whether planes of different color spaces
+ * can be shown in the same frame.
+ */
+typedef int32_t /*hwc2_error_t*/ (*RK_HWC2_PFN_GET_OVERLAY_SUPPORT)(
+        hwc2_device_t* device, uint32_t* outNumElements, int32_t* /*android_pixel_format_t*/ outFormats,
+        int32_t* /*android_dataspace_t*/ outDataspaces, bool* outSupportMixedColorSpaces);
 
 #endif  // RK_HWC_DEVICE_MODULE_H_
\ No newline at end of file
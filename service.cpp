@@ -21,15 +21,22 @@
 #include <sched.h>
 
 #include "Composer.h"
+#include "Startup.h"
 
 using aidl::android::hardware::graphics::composer3::impl::Composer;
 using aidl::android::hardware::graphics::composer3::impl::IComposerHal;
+using aidl::android::hardware::graphics::composer3::impl::getMlockProperty;
+using aidl::android::hardware::graphics::composer3::impl::getPrefaultBudgetProperty;
+using aidl::android::hardware::graphics::composer3::impl::prefaultMemory;
+using aidl::android::hardware::graphics::composer3::impl::setStartupTime;
+using aidl::android::hardware::graphics::composer3::impl::warmUpCommandEngine;
 
 using android::base::InitLogging;
 using android::base::StderrLogger;
 using android::sp;
 
 int main(int /*argc*/, char* argv[]) {
+    setStartupTime(systemTime(SYSTEM_TIME_MONOTONIC));
     InitLogging(argv, android::base::LogdLogger(android::base::SYSTEM));
     LOG(INFO) << "hwc3 starting up";
 
@@ -42,15 +49,11 @@ int main(int /*argc*/, char* argv[]) {
 
     std::unique_ptr<IComposerHal> halImpl = IComposerHal::create();
     CHECK(halImpl != nullptr);
+    warmUpCommandEngine(halImpl.get());
 
     std::shared_ptr<Composer> composer = ndk::SharedRefBase::make<Composer>(std::move(halImpl));
     CHECK(composer != nullptr);
 
-    const std::string instance = std::string() + Composer::descriptor + "/default";
-    binder_status_t status =
-            AServiceManager_addService(composer->asBinder().get(), instance.c_str());
-    CHECK(status == STATUS_OK);
-
     // Thread pool for vendor libbinder for internal vendor services
     android::ProcessState::self()->setThreadPoolMaxThreadCount(2);
     android::ProcessState::self()->startThreadPool();
@@ -62,6 +65,17 @@ int main(int /*argc*/, char* argv[]) {
     ABinderProcess_setThreadPoolMaxThreadCount(5);
     ABinderProcess_startThreadPool();
 #endif
+
+    // before the client can reach us, with the binder threads up
+    if (size_t budget = getPrefaultBudgetProperty()) {
+        prefaultMemory(budget, getMlockProperty());
+    }
+
+    const std::string instance = std::string() + Composer::descriptor + "/default";
+    binder_status_t status =
+            AServiceManager_addService(composer->asBinder().get(), instance.c_str());
+    CHECK(status == STATUS_OK);
+
     ABinderProcess_joinThreadPool();
 
     return EXIT_FAILURE;  // should not reach